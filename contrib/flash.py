@@ -15,6 +15,9 @@ import os, sys
 import urllib.request
 # to flash using DFU-util
 import subprocess
+# to flash many devices in parallel
+import concurrent.futures
+import time
 
 # SIMtrace 2 device information
 class Device(NamedTuple):
@@ -40,17 +43,42 @@ def print_help():
 	print("to flash a specific firmware, provide the name as argument")
 	print("the possible firmwares are: trace, cardem")
 	print("to list all devices connected to USB, provide the argument \"list\"")
+	print("the devices are flashed in parallel; to limit how many at once, provide the argument \"-j <number>\"")
 
 # the firmware to flash
 to_flash = None
+# how many devices to flash at once (None: all)
+jobs = None
 
-# parse command line argument
-if len(sys.argv) == 2:
-  to_flash = sys.argv[1]
-if to_flash not in ["list", "trace", "cardem"] and len(sys.argv) > 1:
+# parse command line arguments
+args = sys.argv[1:]
+if len(args) >= 2 and args[-2] == "-j" and args[-1].isdigit() and int(args[-1]) > 0:
+	jobs = int(args[-1])
+	args = args[:-2]
+if len(args) == 1:
+  to_flash = args[0]
+if to_flash not in ["list", "trace", "cardem"] and len(args) > 0:
 	print_help()
 	exit(0)
 
+# firmware images already downloaded, by URL
+downloads = {}
+def download(url):
+	if url not in downloads:
+		dl_path, header = urllib.request.urlretrieve(url)
+		dl_file = open(dl_path, "rb")
+		downloads[url] = (dl_path, dl_file.read())
+		dl_file.close()
+	return downloads[url]
+
+# devices to flash: (definition, USB path, image path)
+to_update = []
+
+def flash(definition, usb_path, dl_path):
+	start = time.monotonic()
+	dfu_result = subprocess.run(["dfu-util", "--device", hex(definition.usb_vendor_id) + ":" + hex(definition.usb_product_id), "--path", usb_path, "--cfg", "1", "--alt", "1", "--reset", "--download", dl_path], stdout=subprocess.PIPE, stderr=subprocess.STDOUT)
+	return (dfu_result, time.monotonic() - start)
+
 # get all USB devices
 devices = []
 devices_nb = 0
@@ -124,24 +152,20 @@ for usb_device in usb_devices:
 	if firmware == "dfu" and to_flash is None:
 		print("device is currently in DFU mode. you need to specify which firmware to flash")
 		continue
-	to_flash = to_flash or firmware
-	if to_flash not in definition.url.keys():
+	device_to_flash = to_flash or firmware
+	if device_to_flash not in definition.url.keys():
 		print("no firmware image available for " + firmware + " firmware")
 		continue
 	# download firmware
 	try:
-		dl_path, header = urllib.request.urlretrieve(definition.url[to_flash])
+		dl_path, dl_data = download(definition.url[device_to_flash])
 	except:
-		print("could not download firmware " + definition.url[to_flash])
+		print("could not download firmware " + definition.url[device_to_flash])
 		continue
-	dl_file = open(dl_path, "rb")
-	dl_data = dl_file.read()
-	dl_file.close()
 	# compare versions
 	dl_version = re.search(b'firmware \d+\.\d+\.\d+\.\d+-[0-9a-fA-F]{4}', dl_data)
 	if dl_version is None:
 		print("could not get version from downloaded firmware image")
-		os.remove(dl_path)
 		continue
 	dl_version = dl_version.group(0).decode("utf-8").split(" ")[1]
 	print("latest firmware version: " + dl_version)
@@ -150,15 +174,25 @@ for usb_device in usb_devices:
 	dl_newer = (versions[0] < dl_versions[0] or (versions[0] == dl_versions[0] and versions[1] < dl_versions[1]) or (versions[0] == dl_versions[0] and versions[1] == dl_versions[1] and versions[2] < dl_versions[2]) or (versions[0] == dl_versions[0] and versions[1] == dl_versions[1] and versions[2] == dl_versions[2] and versions[3] < dl_versions[3]))
 	if not dl_newer:
 		print("no need to flash latest version")
-		os.remove(dl_path)
 		continue
 	print("flashing latest version")
-	dfu_result = subprocess.run(["dfu-util", "--device", hex(definition.usb_vendor_id) + ":" + hex(definition.usb_product_id), "--path", usb_path, "--cfg", "1", "--alt", "1", "--reset", "--download", dl_path])
+	to_update.append((definition, usb_path, dl_path))
+
+# flash all devices at once
+start = time.monotonic()
+with concurrent.futures.ThreadPoolExecutor(max_workers=jobs or max(len(to_update), 1)) as executor:
+	futures = {executor.submit(flash, *update): update for update in to_update}
+	for future in concurrent.futures.as_completed(futures):
+		definition, usb_path, dl_path = futures[future]
+		dfu_result, duration = future.result()
+		if 0 != dfu_result.returncode:
+			print(dfu_result.stdout.decode("utf-8", "replace"))
+			print(definition.name + " at USB path " + usb_path + ": flashing firmware using dfu-util failed. ensure dfu-util is installed and you have the permissions to access this USB device")
+			continue
+		print(definition.name + " at USB path " + usb_path + ": flashed in " + "%.1f" % duration + " s")
+		updated_nb += 1
+for dl_path, dl_data in downloads.values():
 	os.remove(dl_path)
-	if 0 != dfu_result.returncode:
-		print("flashing firmware using dfu-util failed. ensure dfu-util is installed and you have the permissions to access this USB device")
-		continue
-	updated_nb += 1
 
 print(str(devices_nb)+ " SIMtrace 2 device(s) found")
-print(str(updated_nb)+ " SIMtrace 2 device(s) updated")
+print(str(updated_nb)+ " SIMtrace 2 device(s) updated" + (" in " + "%.1f" % (time.monotonic() - start) + " s" if to_update else ""))
@@ -79,6 +79,14 @@ cd $TOPDIR/firmware/test
 make clean
 make
 ./card_emu_test
+./iso7816_pps_test
+make clean
+
+echo
+echo "=============== FIRMWARE SITL ==========="
+cd $TOPDIR/firmware/sitl
+make clean
+make
 make clean
 
 echo
@@ -71,6 +71,21 @@ local CEMU_STATUS_F_CLK_ACTIVE  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_
 local CEMU_STATUS_F_RCEMU_ACTIVE  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_RCEMU_ACTIVE", "CEMU_ACTIVE", base.HEX_DEC, NULL, 0x00000004)
 local CEMU_STATUS_F_CARD_INSERT  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_CARD_INSERT", "CARD_INSERT", base.HEX_DEC, NULL, 0x00000008)
 local CEMU_STATUS_F_RESET_ACTIVE  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_RESET_ACTIVE", "RESET_ACTIVE", base.HEX_DEC, NULL, 0x00000010)
+local CEMU_STATUS_F_CLK_MEASURED  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_CLK_MEASURED", "CLK_MEASURED", base.HEX_DEC, NULL, 0x00000020)
+local hf_cemu_status_clk_hz = ProtoField.uint32("usb_simtrace.CEMU_STATUS.clk_hz", "CLK frequency (Hz)", base.DEC)
+local hf_cemu_status_clk_stops = ProtoField.uint32("usb_simtrace.CEMU_STATUS.clk_stops", "CLK stops", base.DEC)
+local CEMU_STATUS_F_VCC_MEASURED  = ProtoField.uint32("usb_simtrace.CEMU_STATUS.F_VCC_MEASURED", "VCC_MEASURED", base.HEX_DEC, NULL, 0x00000040)
+local vcc_class_types = {
+    [0x00] = "none",
+    [0x01] = "A (5V)",
+    [0x02] = "B (3V)",
+    [0x03] = "C (1.8V)",
+}
+local hf_cemu_status_vcc_min = ProtoField.uint16("usb_simtrace.CEMU_STATUS.vcc_min_mv", "VCC min (mV)", base.DEC)
+local hf_cemu_status_vcc_max = ProtoField.uint16("usb_simtrace.CEMU_STATUS.vcc_max_mv", "VCC max (mV)", base.DEC)
+local hf_cemu_status_vcc_avg = ProtoField.uint16("usb_simtrace.CEMU_STATUS.vcc_avg_mv", "VCC avg (mV)", base.DEC)
+local hf_cemu_status_vcc_class = ProtoField.uint8("usb_simtrace.CEMU_STATUS.vcc_class", "VCC class", base.DEC, vcc_class_types)
+local hf_cemu_status_vcc_glitches = ProtoField.uint32("usb_simtrace.CEMU_STATUS.vcc_glitches", "VCC glitches", base.DEC)
 
 local CEMU_CONFIG_PRES_POL_PRES_H  = ProtoField.uint32("usb_simtrace.CEMU_CONFIG.PRES_POL_PRES_H", "PRESENCE_HIGH", base.HEX_DEC, NULL, 0x00000001)
 local CEMU_CONFIG_PRES_POL_VALID  = ProtoField.uint32("usb_simtrace.CEMU_CONFIG.PRES_POL_VALID", "PRESENCE_VALID", base.HEX_DEC, NULL, 0x00000002)
@@ -89,15 +104,31 @@ local modem_sim_select_types = {
 }
 local hf_modem_sim_select = ProtoField.uint8("usb_simtrace.modem.sim_select", "SIM card selection", base.DEC, modem_sim_select_types, 0xff)
 
+local hf_modem_sts_supported = ProtoField.uint8("usb_simtrace.modem.status.supported", "supported", base.HEX)
+local hf_modem_sts_status = ProtoField.uint8("usb_simtrace.modem.status.status", "status", base.HEX)
+local hf_modem_sts_changed = ProtoField.uint8("usb_simtrace.modem.status.changed", "changed", base.HEX)
+local ST_MDM_STS_BIT_WWAN_LED = ProtoField.uint8("usb_simtrace.modem.status.WWAN_LED", "WWAN_LED", base.HEX, NULL, 0x01)
+local ST_MDM_STS_BIT_CARD_INSERTED = ProtoField.uint8("usb_simtrace.modem.status.CARD_INSERTED", "CARD_INSERTED", base.HEX, NULL, 0x02)
+local hf_modem_sts_timestamp = ProtoField.uint32("usb_simtrace.modem.status.timestamp_ms", "timestamp (ms)", base.DEC)
+local hf_modem_sts_led_edge = ProtoField.uint32("usb_simtrace.modem.status.wwan_led_edge_ms", "WWAN LED edge (ms)", base.DEC)
+local hf_modem_sts_card_edge = ProtoField.uint32("usb_simtrace.modem.status.card_inserted_edge_ms", "card inserted edge (ms)", base.DEC)
+local hf_modem_sts_led_edges = ProtoField.uint32("usb_simtrace.modem.status.wwan_led_edges", "WWAN LED edges", base.DEC)
+
 usb_simtrace_protocol.fields = {
   msgtype, seqnr, slotnr, reserved, payloadlen, payload,
   pb_and_rx, pb_and_tx, final, tpdu_hdr, rxtxdatalen, rxtxdata,
   CEMU_STATUS_F_VCC_PRESENT, CEMU_STATUS_F_CLK_ACTIVE, CEMU_STATUS_F_RCEMU_ACTIVE, CEMU_STATUS_F_CARD_INSERT, CEMU_STATUS_F_RESET_ACTIVE,
+  CEMU_STATUS_F_CLK_MEASURED, hf_cemu_status_clk_hz, hf_cemu_status_clk_stops,
+  CEMU_STATUS_F_VCC_MEASURED, hf_cemu_status_vcc_min, hf_cemu_status_vcc_max, hf_cemu_status_vcc_avg,
+  hf_cemu_status_vcc_class, hf_cemu_status_vcc_glitches,
   CEMU_CONFIG_PRES_POL_PRES_H, CEMU_CONFIG_PRES_POL_VALID,
   modem_reset_status, modem_reset_len,
   hf_pts_len, hf_pts_req, hf_pts_resp,
   hf_cemu_cfg_features, hf_cemu_cfg_slot_mux_nr, hf_cemu_cfg_presence_polarity,
   hf_cemu_cardinsert, hf_modem_sim_select,
+  hf_modem_sts_supported, hf_modem_sts_status, hf_modem_sts_changed,
+  ST_MDM_STS_BIT_WWAN_LED, ST_MDM_STS_BIT_CARD_INSERTED,
+  hf_modem_sts_timestamp, hf_modem_sts_led_edge, hf_modem_sts_card_edge, hf_modem_sts_led_edges,
 }
 
 local is_hdr = Field.new("usb_simtrace.tpdu_hdr")
@@ -175,6 +206,20 @@ function dissect_status(payload_data,pinfo,tree)
   headerSubtree:add(CEMU_STATUS_F_RCEMU_ACTIVE, cmd32)
   headerSubtree:add(CEMU_STATUS_F_CARD_INSERT, cmd32)
   headerSubtree:add(CEMU_STATUS_F_RESET_ACTIVE, cmd32)
+  headerSubtree:add(CEMU_STATUS_F_CLK_MEASURED, cmd32)
+  headerSubtree:add(CEMU_STATUS_F_VCC_MEASURED, cmd32)
+  -- appended by newer firmware
+  if payload_data:len() >= 21 then
+    headerSubtree:add_le(hf_cemu_status_clk_hz, payload_data(13,4))
+    headerSubtree:add_le(hf_cemu_status_clk_stops, payload_data(17,4))
+  end
+  if payload_data:len() >= 32 then
+    headerSubtree:add_le(hf_cemu_status_vcc_min, payload_data(21,2))
+    headerSubtree:add_le(hf_cemu_status_vcc_max, payload_data(23,2))
+    headerSubtree:add_le(hf_cemu_status_vcc_avg, payload_data(25,2))
+    headerSubtree:add(hf_cemu_status_vcc_class, payload_data(27,1))
+    headerSubtree:add_le(hf_cemu_status_vcc_glitches, payload_data(28,4))
+  end
 
   pinfo.cols.info:append(" VCC:" .. payload_data(0,1):bitfield(7, 1) .. " CLK:" .. payload_data(0,1):bitfield(6, 1) .. " RESET:" .. payload_data(0,1):bitfield(3, 1))
 end
@@ -238,6 +283,25 @@ function dissect_modem_sim_sel(payload_data, pinfo, tree)
   pinfo.cols.info:append(" " .. modem_sim_select_types[sim_select]);
 end
 
+function dissect_modem_status(payload_data, pinfo, tree)
+  -- the request has no payload
+  if payload_data:len() < 3 then return end
+
+  local subtree = tree:add(usb_simtrace_protocol, payload_data, "Modem Status")
+  subtree:add(hf_modem_sts_supported, payload_data(0,1));
+  local statusSubtree = subtree:add(hf_modem_sts_status, payload_data(1,1));
+  statusSubtree:add(ST_MDM_STS_BIT_WWAN_LED, payload_data(1,1));
+  statusSubtree:add(ST_MDM_STS_BIT_CARD_INSERTED, payload_data(1,1));
+  subtree:add(hf_modem_sts_changed, payload_data(2,1));
+  -- firmware reporting the changes
+  if payload_data:len() >= 19 then
+    subtree:add_le(hf_modem_sts_timestamp, payload_data(3,4));
+    subtree:add_le(hf_modem_sts_led_edge, payload_data(7,4));
+    subtree:add_le(hf_modem_sts_card_edge, payload_data(11,4));
+    subtree:add_le(hf_modem_sts_led_edges, payload_data(15,4));
+  end
+end
+
 function dissect_cemu_cardinsert(payload_data, pinfo, tree)
   local subtree = tree:add(usb_simtrace_protocol, payload_data, "Card Insert")
   local cins_type = payload_data(0,1):le_uint()
@@ -279,6 +343,8 @@ function usb_simtrace_protocol.dissector(buffer, pinfo, tree)
     return dissect_modem_reset(payload_data(),pinfo,subtree)
   elseif(command == 0x0202) then
     return dissect_modem_sim_sel(payload_data(),pinfo,subtree)
+  elseif(command == 0x0203) then
+    return dissect_modem_status(payload_data(),pinfo,subtree)
   else
     subtree:add(payload, payload_data)
   end
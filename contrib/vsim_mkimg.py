@@ -0,0 +1,80 @@
+#!/usr/bin/env python3
+# encoding: utf-8
+
+# generate a file-system image for the virtual SIM of simtrace2-cardem-pcsc (--vsim-image)
+# from a JSON description of the following form:
+#
+# {
+#   "atr": "3b9f96801fc78031a073be21136743200718000001a5",
+#   "files": [
+#     { "path": "2f00", "type": "linfix", "rec_len": 38, "records": ["61..", "61.."] },
+#     { "path": "7f20", "type": "df" },
+#     { "path": "7f20/6f07", "type": "transparent", "data": "082926020000000010" },
+#     { "path": "7fff", "type": "adf", "aid": "a0000000871002ffffffff8907090000" },
+#     { "path": "7fff/6fad", "type": "transparent", "sfi": 3, "data": "00000002" },
+#     { "path": "7fff/6f13", "type": "cyclic", "rec_len": 3, "records": ["010101", "020202"] }
+#   ]
+# }
+#
+# the format of the image is described in host/include/osmocom/simtrace2/vsim.h
+
+import json
+import struct
+import sys
+
+MAGIC = b"ST2VSIM1"
+NO_PARENT = 0xffff
+FTYPES = {"df": 1, "adf": 2, "transparent": 3, "linfix": 4, "cyclic": 5}
+
+HDR_FMT = "<8sHB33sI"
+FILE_FMT = "<HHBBBB16sII"
+
+def print_help():
+	print("usage: vsim_mkimg.py DESCRIPTION.json IMAGE")
+
+if len(sys.argv) != 3:
+	print_help()
+	exit(1)
+
+with open(sys.argv[1]) as f:
+	desc = json.load(f)
+
+# the MF is always file 0
+files = [{"path": "", "type": "df", "fid": 0x3f00, "parent": NO_PARENT}]
+index = {"": 0}
+for f in desc["files"]:
+	path = f["path"].lower()
+	if path.startswith("3f00/"):
+		path = path[5:]
+	parent_path, _, fid = path.rpartition("/")
+	if parent_path not in index:
+		print("parent DF of %s must be listed before it" % f["path"])
+		exit(1)
+	entry = dict(f, fid=int(fid, 16), parent=index[parent_path])
+	index[path] = len(files)
+	files.append(entry)
+
+body = b""
+body_offset = struct.calcsize(HDR_FMT) + len(files) * struct.calcsize(FILE_FMT)
+table = b""
+for f in files:
+	ftype = FTYPES[f["type"]]
+	rec_len = f.get("rec_len", 0)
+	if "records" in f:
+		data = b"".join(bytes.fromhex(r).ljust(rec_len, b"\xff") for r in f["records"])
+	else:
+		data = bytes.fromhex(f.get("data", ""))
+		if "size" in f:
+			data = data.ljust(f["size"], b"\xff")
+	aid = bytes.fromhex(f.get("aid", ""))
+	table += struct.pack(FILE_FMT, f["fid"], f["parent"], ftype, f.get("sfi", 0), rec_len,
+			     len(aid), aid, body_offset + len(body), len(data))
+	body += data
+
+atr = bytes.fromhex(desc["atr"])
+hdr = struct.pack(HDR_FMT, MAGIC, len(files), len(atr), atr, 0)
+
+with open(sys.argv[2], "wb") as f:
+	f.write(hdr + table + body)
+
+print("wrote %u files (%u bytes) to %s" % (len(files), len(hdr + table + body), sys.argv[2]))
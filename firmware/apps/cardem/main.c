@@ -21,6 +21,7 @@
 #include "simtrace.h"
 #include "utils.h"
 #include "main_common.h"
+#include "boot_time.h"
 #include <osmocom/core/timer.h>
 
 /*------------------------------------------------------------------------------
@@ -59,6 +60,7 @@ static const conf_func config_func_ptrs[] = {
 		.init = CCID_init,
 		.exit = CCID_exit,
 		.run = CCID_run,
+		.usart0_irq = CCID_usart0_irq,
 	},
 #endif
 #ifdef HAVE_CARDEM
@@ -137,6 +139,40 @@ static void check_exec_dbg_cmd(void)
 	board_exec_dbg_cmd(ch);
 }
 
+/*------------------------------------------------------------------------------
+ *        Deferred initialization
+ *------------------------------------------------------------------------------*/
+
+/* Before the USB pull-up is enabled, the start-up only does what the USB
+ * enumeration depends on.  The rest is done one step at a time: while the host
+ * enumerates the device, and after the selected configuration is initialized,
+ * so that the reader doesn't wait for the console. */
+static unsigned int boot_step = 1;
+
+static void boot_deferred_step(void)
+{
+	if (boot_step < ARRAY_SIZE(config_func_ptrs)) {
+		/* array slot 0 is empty, usb configs start at 1 */
+		if (config_func_ptrs[boot_step].configure)
+			config_func_ptrs[boot_step].configure();
+	} else if (boot_step == ARRAY_SIZE(config_func_ptrs)) {
+		print_banner();
+	} else if (boot_step == ARRAY_SIZE(config_func_ptrs) + 1 && boot_time_get(BOOT_P_READY) >= 0) {
+		boot_time_mark(BOOT_P_DEFERRED);
+		boot_time_print();
+	} else {
+		return;
+	}
+	boot_step++;
+}
+
+/* the static initialization of all configurations precedes the init of one */
+static void boot_configure_all(void)
+{
+	while (boot_step < ARRAY_SIZE(config_func_ptrs))
+		boot_deferred_step();
+}
+
 /*------------------------------------------------------------------------------
  *        Main
  *------------------------------------------------------------------------------*/
@@ -147,6 +183,8 @@ extern int main(void)
 	enum confNum last_simtrace_config = simtrace_config;
 	unsigned int i = 0;
 
+	boot_time_mark(BOOT_P_MAIN);
+
 	led_init();
 	led_blink(LED_RED, BLINK_ALWAYS_ON);
 	led_blink(LED_GREEN, BLINK_ALWAYS_ON);
@@ -157,15 +195,16 @@ extern int main(void)
 
 	PIO_InitializeInterrupts(10);
 
-	print_banner();
 	board_main_top();
+	boot_time_mark(BOOT_P_BOARD);
 
-	TRACE_INFO("USB init...\n\r");
 	SIMtrace_USB_Initialize();
+	boot_time_mark(BOOT_P_USB_INIT);
 
 	while (USBD_GetState() < USBD_STATE_CONFIGURED) {
 		WDT_Restart(WDT);
 		check_exec_dbg_cmd();
+		boot_deferred_step();
 #if 0
 		if (i >= MAX_USB_ITER * 3) {
 			TRACE_ERROR("Resetting board (USB could "
@@ -177,17 +216,14 @@ extern int main(void)
 		i++;
 	}
 
-	TRACE_INFO("calling configure of all configurations...\n\r");
-	for (i = 1; i < ARRAY_SIZE(config_func_ptrs); i++) {
-		if (config_func_ptrs[i].configure)
-			config_func_ptrs[i].configure();
-	}
+	boot_time_mark(BOOT_P_USB_CONFIGURED);
 
-	TRACE_INFO("calling init of config %u...\n\r", simtrace_config);
+	boot_configure_all();
 	if (config_func_ptrs[simtrace_config].init) {
 		config_func_ptrs[simtrace_config].init();
 	}
 	last_simtrace_config = simtrace_config;
+	boot_time_mark(BOOT_P_READY);
 
 	TRACE_INFO("entering main loop...\n\r");
 	while (1) {
@@ -198,6 +234,7 @@ extern int main(void)
 		putchar('\b');
 #endif
 		check_exec_dbg_cmd();
+		boot_deferred_step();
 		osmo_timers_prepare();
 		osmo_timers_update();
 
@@ -33,6 +33,7 @@
 #endif
 
 unsigned int g_unique_id[4];
+extern volatile uint32_t jiffies;
 /* remember if the watchdog has been configured in the main loop so we can kick it in the ISR */
 static bool watchdog_configured = false;
 
@@ -60,10 +61,34 @@ static const Pin pinsLeds[] = { PINS_LEDS } ;
 #define IFLASH_END ((uint8_t *)IFLASH_ADDR + BOARD_DFU_BOOT_SIZE)
 #endif
 
+/* The flash blocks are written from the main loop, while the next one is
+ * received.  The image is verified once, at manifestation, with the CRC which
+ * the crcstub checks at boot. */
+static struct {
+	/* blocks received, not written yet */
+	struct {
+		uint32_t addr;
+		const uint8_t *data;
+		unsigned int len;
+	} blocks[DFU_NUM_BUFS];
+	volatile unsigned int head;
+	volatile unsigned int num;
+	/* end of the data downloaded to the flash */
+	uint32_t end;
+	/* the partition has been unlocked */
+	bool unlocked;
+	/* the manifestation has been requested, and its result (>0 if in progress) */
+	volatile bool manifest;
+	volatile int manifest_rc;
+	/* time of the first block */
+	uint32_t start;
+} g_flash;
+
 /* incoming call-back: Host has transferred 'len' bytes (stored at
  * 'data'), which we shall write to 'offset' into the partition
  * associated with 'altif'.  Guaranted to be less than
- * BOARD_DFU_PAGE_SIZE */
+ * BOARD_DFU_PAGE_SIZE.  Flash blocks are only queued, 'data' remaining
+ * valid until they are written */
 int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 			 uint8_t *data, unsigned int len)
 {
@@ -77,15 +102,7 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 		WDT_Restart(WDT);
 	}
 
-#if TRACE_LEVEL >= TRACE_LEVEL_INFO
-	TRACE_INFO("dnload(altif=%u, offset=%u, len=%u)\n\r", altif, offset, len);
-#else
-	printf("DL off=%u\n\r", offset);
-#endif
-
-#ifdef PINS_LEDS
-	PIO_Clear(&pinsLeds[LED_NUM_RED]);
-#endif
+	TRACE_DEBUG("dnload(altif=%u, offset=%u, len=%u)\n\r", altif, offset, len);
 
 	switch (altif) {
 	case ALTIF_RAM:
@@ -111,25 +128,24 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 			rc = DFU_RET_STALL;
 			break;
 		}
-		rc = FLASHD_Unlock(addr, addr + len, 0, 0);
-		if (rc != 0) {
-			TRACE_ERROR("DFU download flash unlock failed\n\r");
-			rc =  DFU_RET_STALL;
-			break;
+		if (offset == 0) {
+			printf("DFU download...\n\r");
+			g_flash.unlocked = false;
+			g_flash.manifest = false;
+			g_flash.start = jiffies;
 		}
-		rc = FLASHD_Write(addr, data, len);
-		if (rc != 0) {
-			TRACE_ERROR("DFU download flash erase failed\n\r");
+		/* a block failed to be written (the status tells why) */
+		if (g_dfu->status != DFU_STATUS_OK || g_flash.num >= DFU_NUM_BUFS) {
+			g_dfu->state = DFU_STATE_dfuERROR;
 			rc = DFU_RET_STALL;
 			break;
 		}
-		for (i = 0; i < len; i++) {
-			if (((uint8_t*)addr)[i]!=data[i]) {
-				TRACE_ERROR("DFU download flash data written not correct\n\r");
-				rc = DFU_RET_STALL;
-				break;
-			}
-		}
+		i = (g_flash.head + g_flash.num) % DFU_NUM_BUFS;
+		g_flash.blocks[i].addr = addr;
+		g_flash.blocks[i].data = data;
+		g_flash.blocks[i].len = len;
+		g_flash.num++;
+		g_flash.end = addr + len;
 		rc = DFU_RET_ZLP;
 		break;
 	default:
@@ -138,11 +154,118 @@ int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 		break;
 	}
 
+	return rc;
+}
+
+unsigned int USBDFU_dnload_pending(void)
+{
+	return g_flash.num;
+}
+
+int USBDFU_handle_manifest(uint8_t altif)
+{
+	if (altif != ALTIF_FLASH)
+		return 0;
+
+	if (!g_flash.manifest) {
+		g_flash.manifest_rc = 1;
+		g_flash.manifest = true;
+	}
+	return g_flash.manifest_rc;
+}
+
+/* same as the crcstub, and misc/crctool */
+static uint32_t crc32(const uint8_t *data, uint32_t len)
+{
+	uint32_t crc = 0xffffffff;
+	uint32_t i;
+	unsigned int j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= (int8_t)data[i];
+		for (j = 0; j < 8; j++)
+			crc = (crc & 1) ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+		if ((i & 0xfff) == 0)
+			WDT_Restart(WDT);
+	}
+
+	return ~crc;
+}
+
+/* check the image with the CRC from its crcstub table (see crcstub.c), which
+ * misc/crctool computes over the image after the crcstub part */
+static int flash_verify(void)
+{
+	const uint32_t *table = (const uint32_t *)FLASH_ADDR(0);
+	uint32_t crc, start = table[3], len = table[4];
+
+	if (start != FLASH_ADDR(512) || len > g_flash.end - start) {
+		printf("DFU image without CRC, not verified\n\r");
+		return 0;
+	}
+
+	crc = crc32((const uint8_t *)start, len);
+	if (crc != table[2]) {
+		TRACE_ERROR("DFU image CRC 0x%08lx, expected 0x%08lx\n\r", crc, table[2]);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* write the queued blocks, and verify the image once all are written */
+static void flash_work(void)
+{
+	unsigned long flags;
+	uint32_t addr, len;
+	int rc;
+
+	if (g_flash.num) {
+		addr = g_flash.blocks[g_flash.head].addr;
+		len = g_flash.blocks[g_flash.head].len;
+		rc = 0;
+		/* the whole partition at once, on the first block */
+		if (!g_flash.unlocked) {
+			rc = FLASHD_Unlock(addr, (uint32_t)IFLASH_END, 0, 0);
+			if (rc != 0) {
+				TRACE_ERROR("DFU download flash unlock failed\n\r");
+				g_dfu->status = DFU_STATUS_errWRITE;
+			}
+			g_flash.unlocked = true;
+		}
+		if (rc == 0) {
 #ifdef PINS_LEDS
-	PIO_Set(&pinsLeds[LED_NUM_RED]);
+			PIO_Clear(&pinsLeds[LED_NUM_RED]);
+#endif
+			rc = FLASHD_Write(addr, g_flash.blocks[g_flash.head].data, len);
+#ifdef PINS_LEDS
+			PIO_Set(&pinsLeds[LED_NUM_RED]);
 #endif
+			if (rc != 0) {
+				TRACE_ERROR("DFU download flash write failed at 0x%08lx\n\r", addr);
+				g_dfu->status = DFU_STATUS_errPROG;
+			}
+		}
+		/* the buffer may now be reused */
+		local_irq_save(flags);
+		g_flash.head = (g_flash.head + 1) % DFU_NUM_BUFS;
+		g_flash.num--;
+		local_irq_restore(flags);
+		return;
+	}
 
-	return rc;
+	if (g_flash.manifest && g_flash.manifest_rc > 0) {
+		if (g_dfu->status != DFU_STATUS_OK) {
+			rc = -1;
+		} else {
+			rc = flash_verify();
+			if (rc < 0)
+				g_dfu->status = DFU_STATUS_errVERIFY;
+		}
+		printf("DFU download of %lu bytes %s in %lu ms\n\r", g_flash.end - FLASH_ADDR(0),
+		       rc < 0 ? "failed" : "done", jiffies - g_flash.start);
+		g_flash.manifest_rc = rc;
+	}
 }
 
 /* incoming call-back: Host has requested to read back 'req_len' bytes
@@ -367,6 +490,7 @@ extern int main(void)
 		putchar(rotor[i++ % ARRAY_SIZE(rotor)]);
 #endif
 		check_exec_dbg_cmd();
+		flash_work();
 #if 0
 		osmo_timers_prepare();
 		osmo_timers_update();
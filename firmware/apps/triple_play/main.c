@@ -56,6 +56,7 @@ static const conf_func config_func_ptrs[] = {
 		.init = CCID_init,
 		.exit = CCID_exit,
 		.run = CCID_run,
+		.usart0_irq = CCID_usart0_irq,
 	},
 #endif
 #ifdef HAVE_CARDEM
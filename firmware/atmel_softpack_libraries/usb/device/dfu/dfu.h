@@ -111,6 +111,12 @@ extern int USBDFU_handle_dnload(uint8_t altif, unsigned int offset,
 extern int USBDFU_handle_upload(uint8_t altif, unsigned int offset,
 				uint8_t *data, unsigned int req_len);
 extern int USBDFU_OverrideEnterDFU(void);
+/* number of downloaded blocks the application didn't write yet, when it doesn't
+ * write them synchronously in USBDFU_handle_dnload() */
+extern unsigned int USBDFU_dnload_pending(void);
+/* manifestation of the downloaded firmware: 0 when done, >0 while in progress,
+ * <0 on error (e.g. the verification failed) */
+extern int USBDFU_handle_manifest(uint8_t altif);
 
 /* function to be called at end of EP0 handler during runtime */
 void USBDFU_Runtime_RequestHandler(const USBGenericRequest *request);
@@ -127,6 +133,14 @@ void USBDFU_SwitchToApp(void);
 /* USBD tells us to switch from to DFU mode */
 void USBDFU_SwitchToDFU(void);
 
+/* buffers for the downloaded blocks, for the application to write one while the
+ * next is received */
+#define DFU_NUM_BUFS	2
+/* poll timeout while waiting for a buffer, about the time to write a flash page */
+#ifndef DFU_POLL_TIMEOUT_BUSY_MS
+#define DFU_POLL_TIMEOUT_BUSY_MS	5
+#endif
+
 /* Return values to be used by USBDFU_handle_{dn,up}load */
 #define DFU_RET_NOTHING	0
 #define DFU_RET_ZLP	1
@@ -47,13 +47,34 @@ __dfudata struct dfudata _g_dfu = {
 /** variable to structure containing DFU state */
 struct dfudata *g_dfu = &_g_dfu;
 
+/* default for applications writing the downloaded data synchronously */
+WEAK unsigned int USBDFU_dnload_pending(void)
+{
+	return 0;
+}
+
+/* default for applications with nothing to do at manifestation */
+WEAK int USBDFU_handle_manifest(uint8_t altif)
+{
+	return 0;
+}
+
 WEAK void dfu_drv_updstatus(void)
 {
 	TRACE_INFO("DFU: updstatus()\n\r");
 
-	/* we transition immediately from MANIFEST_SYNC to MANIFEST,
-	 * as the flash-writing is not asynchronous in this
-	 * implementation */
+	/* the next block is received in the other buffer, which the
+	 * application may still be writing */
+	if (g_dfu->state == DFU_STATE_dfuDNLOAD_SYNC ||
+	    g_dfu->state == DFU_STATE_dfuDNBUSY) {
+		if (USBDFU_dnload_pending() >= DFU_NUM_BUFS)
+			g_dfu->state = DFU_STATE_dfuDNBUSY;
+		else
+			g_dfu->state = DFU_STATE_dfuDNLOAD_IDLE;
+	}
+
+	/* the manifestation (writing the last blocks, and verifying the
+	 * image) goes on in the background, see the dfuMANIFEST state */
 	if (g_dfu->state == DFU_STATE_dfuMANIFEST_SYNC)
 		g_dfu->state = DFU_STATE_dfuMANIFEST;
 }
@@ -63,6 +84,8 @@ static __dfufunc void handle_getstatus(void)
 	/* has to be static as USBD_Write is async ? */
 	static struct dfu_status dstat;
 	static const uint8_t poll_timeout_10ms[] = { 10, 0, 0 };
+	/* the time to write a flash page */
+	static const uint8_t poll_timeout_busy[] = { DFU_POLL_TIMEOUT_BUSY_MS, 0, 0 };
 
 	dfu_drv_updstatus();
 
@@ -70,7 +93,10 @@ static __dfufunc void handle_getstatus(void)
 	dstat.bStatus = g_dfu->status;
 	dstat.bState = g_dfu->state;
 	dstat.iString = 0;
-	memcpy(&dstat.bwPollTimeout, poll_timeout_10ms, sizeof(dstat.bwPollTimeout));
+	if (g_dfu->state == DFU_STATE_dfuDNBUSY)
+		memcpy(&dstat.bwPollTimeout, poll_timeout_busy, sizeof(dstat.bwPollTimeout));
+	else
+		memcpy(&dstat.bwPollTimeout, poll_timeout_10ms, sizeof(dstat.bwPollTimeout));
 
 	TRACE_DEBUG("handle_getstatus(%u, %u)\n\r", dstat.bStatus, dstat.bState);
 
@@ -98,7 +124,12 @@ static void TerminateCtrlInWithNull(void *pArg,
                (void *)  0);
 }
 
-static uint8_t dfu_buf[BOARD_DFU_PAGE_SIZE];
+/* The downloaded blocks are received alternately in one of the buffers, so the
+ * application can write a block while the next one is received.  It must be
+ * done with a block (see USBDFU_dnload_pending()) before its buffer is used
+ * again. */
+static uint8_t dfu_buf[DFU_NUM_BUFS][BOARD_DFU_PAGE_SIZE];
+static uint8_t dfu_buf_idx;
 
 /* download of a single page has completed */
 static void dnload_cb(void *arg, unsigned char status, unsigned long int transferred,
@@ -114,11 +145,14 @@ static void dnload_cb(void *arg, unsigned char status, unsigned long int transfe
 		return;
 	}
 
-	rc = USBDFU_handle_dnload(if_altsettings[0], g_dfu->total_bytes, dfu_buf, transferred);
+	rc = USBDFU_handle_dnload(if_altsettings[0], g_dfu->total_bytes, dfu_buf[dfu_buf_idx],
+				  transferred);
 	switch (rc) {
 	case DFU_RET_ZLP:
 		g_dfu->total_bytes += transferred;
-		g_dfu->state = DFU_STATE_dfuDNLOAD_IDLE;
+		dfu_buf_idx = (dfu_buf_idx + 1) % DFU_NUM_BUFS;
+		/* left on the next GETSTATUS, once the next buffer is free */
+		g_dfu->state = DFU_STATE_dfuDNLOAD_SYNC;
 		TerminateCtrlInWithNull(0,0,0,0);
 		break;
 	case DFU_RET_STALL:
@@ -149,8 +183,10 @@ static int handle_dnload(uint16_t val, uint16_t len, int first)
 		return DFU_RET_STALL;
 	}
 
-	if (first)
+	if (first) {
 		g_dfu->total_bytes = 0;
+		dfu_buf_idx = 0;
+	}
 
 	if (len == 0) {
 		TRACE_DEBUG("zero-size write -> MANIFEST_SYNC\n\r");
@@ -159,7 +195,7 @@ static int handle_dnload(uint16_t val, uint16_t len, int first)
 	}
 
 	/* else: actually read data */
-	rc = USBD_Read(0, dfu_buf, len, &dnload_cb, 0);
+	rc = USBD_Read(0, dfu_buf[dfu_buf_idx], len, &dnload_cb, 0);
 	if (rc == USBD_STATUS_SUCCESS)
 		return DFU_RET_NOTHING;
 	else
@@ -197,13 +233,13 @@ static int handle_upload(uint16_t val, uint16_t len, int first)
 		return DFU_RET_STALL;
 	}
 
-	rc = USBDFU_handle_upload(if_altsettings[0], g_dfu->total_bytes, dfu_buf, len);
+	rc = USBDFU_handle_upload(if_altsettings[0], g_dfu->total_bytes, dfu_buf[0], len);
 	if (rc < 0) {
 		TRACE_ERROR("application handle_upload() returned %d\n\r", rc);
 		return DFU_RET_STALL;
 	}
 
-	if (USBD_Write(0, dfu_buf, rc, &upload_cb, 0) == USBD_STATUS_SUCCESS)
+	if (USBD_Write(0, dfu_buf[0], rc, &upload_cb, 0) == USBD_STATUS_SUCCESS)
 		return rc;
 
 	return DFU_RET_STALL;
@@ -363,8 +399,15 @@ void USBDFU_DFU_RequestHandler(const USBGenericRequest *request)
 			 * the global variable 'past_manifest'.
 			 */
 			//g_dfu->state = DFU_STATE_dfuMANIFEST_WAIT_RST;
-			g_dfu->state = DFU_STATE_dfuIDLE;
-			g_dfu->past_manifest = 1;
+			rc = USBDFU_handle_manifest(if_altsettings[0]);
+			if (rc < 0) {
+				g_dfu->state = DFU_STATE_dfuERROR;
+				if (g_dfu->status == DFU_STATUS_OK)
+					g_dfu->status = DFU_STATUS_errVERIFY;
+			} else if (rc == 0) {
+				g_dfu->state = DFU_STATE_dfuIDLE;
+				g_dfu->past_manifest = 1;
+			}
 			handle_getstatus();
 			break;
 		case USB_REQ_DFU_GETSTATE:
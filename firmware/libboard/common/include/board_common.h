@@ -112,7 +112,9 @@
 
 #define BOARD_DFU_BOOT_SIZE	(16 * 1024)
 #define BOARD_DFU_RAM_SIZE	(2 * 1024)
-#define BOARD_DFU_PAGE_SIZE	512
+/* DFU wTransferSize: whole flash pages, so that no block has to be merged with
+ * the content of a page; two blocks are buffered in RAM */
+#define BOARD_DFU_PAGE_SIZE	(8 * IFLASH_PAGE_SIZE)
 /** number of DFU interfaces (used to flash specific partitions) */
 #define BOARD_DFU_NUM_IF	3
 
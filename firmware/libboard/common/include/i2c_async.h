@@ -0,0 +1,37 @@
+/* Asynchronous I2C transfers, bit-banged from a timer interrupt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include "board.h"
+
+/* SCL half period of the asynchronous transfers */
+#ifndef I2C_ASYNC_HALF_PERIOD_US
+#define I2C_ASYNC_HALF_PERIOD_US	10
+#endif
+
+/* transfers which can be queued */
+#ifndef I2C_ASYNC_QUEUE_LEN
+#define I2C_ASYNC_QUEUE_LEN	8
+#endif
+
+/* completion of an asynchronous transfer: rc is the byte read, 0 after a write,
+ * or -1 if the slave didn't acknowledge */
+typedef void (*i2c_cb_t)(int rc, void *data);
+
+void i2c_async_init(const Pin *sda, const Pin *scl, const Pin *sda_in);
+int i2c_async_write(uint8_t slave, uint8_t addr, uint8_t byte, uint8_t wait_ms,
+		    i2c_cb_t cb, void *data);
+int i2c_async_read(uint8_t slave, uint8_t addr, i2c_cb_t cb, void *data);
+unsigned int i2c_async_pending(void);
+void i2c_async_flush(void);
@@ -0,0 +1,30 @@
+/* debounced status of the modems (WWAN LED, card inserted), with the time of
+ * their edges
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct st_modem_status;
+
+#define MODEM_STATUS_NUM	2
+
+/* a change of an input is taken once it is stable for this time */
+#ifndef MODEM_STATUS_DEBOUNCE_MS
+#define MODEM_STATUS_DEBOUNCE_MS	20
+#endif
+
+void modem_status_input(unsigned int modem, uint8_t bit, bool active, uint32_t now_ms);
+bool modem_status_poll(unsigned int modem, uint32_t now_ms);
+void modem_status_get(unsigned int modem, struct st_modem_status *sts, uint32_t now_ms);
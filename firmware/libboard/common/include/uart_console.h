@@ -31,10 +31,29 @@
 #define _UART_CONSOLE_
 #include <stdint.h>
 
+/* size of the transmit buffer, a power of 2 */
+#ifndef CONSOLE_TX_BUF_SIZE
+#define CONSOLE_TX_BUF_SIZE 1024
+#endif
+
+struct uart_console_stats {
+	/* bytes dropped because the transmit buffer was full */
+	uint32_t dropped;
+	/* times bytes started being dropped */
+	uint32_t overflows;
+	/* highest number of bytes in the transmit buffer */
+	uint32_t max_queued;
+	/* transfers of the PDC */
+	uint32_t transfers;
+};
+
 extern void UART_Configure( uint32_t dwBaudrate, uint32_t dwMasterClock ) ;
 extern void UART_Exit( void ) ;
 extern void UART_PutChar( uint8_t uc ) ;
 extern void UART_PutChar_Sync( uint8_t uc ) ;
+extern void UART_PutBuffer( const uint8_t *data, uint32_t len ) ;
+extern void UART_GetStats( struct uart_console_stats *st ) ;
+extern void UART_PrintStats( void ) ;
 extern uint32_t UART_GetChar( void ) ;
 extern uint32_t UART_IsRxReady( void ) ;
 
@@ -0,0 +1,344 @@
+/* Asynchronous I2C transfers, bit-banged from a timer interrupt
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+
+#ifdef HAVE_I2C_ASYNC
+
+#include "utils.h"
+#include "i2c_async.h"
+#include <stdbool.h>
+#include <string.h>
+
+/* SDA and SCL are not connected to a TWI peripheral, so the transfers are
+ * bit-banged from the interrupt of a timer, one SCL half period per interrupt.
+ * The main loop (and with it the servicing of the card UART) is not stalled
+ * for the duration of a transfer, or the write cycle time of an EEPROM.
+ * The board sets up the pins, and passes them to i2c_async_init(). */
+
+/* TC0 channels 0..2 are used for the ETU timers and the frequency counter */
+#define I2C_TC		(&TC1->TC_CHANNEL[0])
+#define I2C_TC_ID	ID_TC3
+#define I2C_TC_IRQ	TC3_IRQn
+/* timer clock 1 is MCK/2 */
+#define I2C_TC_CLOCKS_PER_MS	(BOARD_MCK / 2 / 1000)
+
+/* byte of a transfer, as sent on the bus */
+#define I2C_OP_START	0x01
+#define I2C_OP_STOP	0x02
+#define I2C_OP_READ	0x04
+
+enum i2c_async_state {
+	I2C_S_IDLE,
+	I2C_S_START,
+	I2C_S_BITS,
+	I2C_S_STOP,
+	I2C_S_WAIT,
+};
+
+struct i2c_xfer {
+	uint8_t slave;
+	uint8_t addr;
+	uint8_t byte;
+	bool read;
+	/* time to wait after a write, before the bus is used again */
+	uint8_t wait_ms;
+	i2c_cb_t cb;
+	void *data;
+};
+
+static struct {
+	struct i2c_xfer queue[I2C_ASYNC_QUEUE_LEN];
+	volatile uint8_t head;
+	volatile uint8_t len;
+	volatile enum i2c_async_state state;
+	/* step within the state */
+	uint8_t step;
+	/* bytes of the transfer in progress, and the one on the bus */
+	struct {
+		uint8_t byte;
+		uint8_t flags;
+	} ops[4];
+	uint8_t num_ops;
+	uint8_t op;
+	/* bit on the bus (8: acknowledge), and the bits received */
+	uint8_t bit;
+	uint16_t rx;
+	int rc;
+	uint8_t wait_ms;
+	/* SDA and SCL, as outputs (open drain), and SDA as input */
+	const Pin *sda;
+	const Pin *scl;
+	const Pin *sda_in;
+} g_i2c;
+
+static void tc_set_period_us(uint32_t us)
+{
+	I2C_TC->TC_RC = us * I2C_TC_CLOCKS_PER_MS / 1000;
+	I2C_TC->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+}
+
+/* set up the bytes of the transfer at the head of the queue */
+static void xfer_begin(void)
+{
+	const struct i2c_xfer *x = &g_i2c.queue[g_i2c.head];
+
+	g_i2c.ops[0].byte = x->slave << 1;
+	g_i2c.ops[0].flags = I2C_OP_START;
+	g_i2c.ops[1].byte = x->addr;
+	g_i2c.ops[1].flags = 0;
+	if (x->read) {
+		/* dummy write of the address, then re-start with read */
+		g_i2c.ops[2].byte = (x->slave << 1) | 1;
+		g_i2c.ops[2].flags = I2C_OP_START;
+		g_i2c.ops[3].byte = 0xff;
+		g_i2c.ops[3].flags = I2C_OP_READ | I2C_OP_STOP;
+		g_i2c.num_ops = 4;
+	} else {
+		g_i2c.ops[2].byte = x->byte;
+		g_i2c.ops[2].flags = I2C_OP_STOP;
+		g_i2c.num_ops = 3;
+	}
+	g_i2c.op = 0;
+	g_i2c.rc = 0;
+	g_i2c.wait_ms = x->read ? 0 : x->wait_ms;
+	g_i2c.state = I2C_S_START;
+	g_i2c.step = 0;
+}
+
+/* complete the transfer at the head of the queue, and begin the next one */
+static void xfer_end(void)
+{
+	struct i2c_xfer *x = &g_i2c.queue[g_i2c.head];
+	i2c_cb_t cb = x->cb;
+	void *data = x->data;
+
+	g_i2c.head = (g_i2c.head + 1) % I2C_ASYNC_QUEUE_LEN;
+	g_i2c.len--;
+
+	/* the callback may submit the next transfer, which begins below */
+	if (cb)
+		cb(g_i2c.rc, data);
+
+	if (g_i2c.len) {
+		xfer_begin();
+	} else {
+		g_i2c.state = I2C_S_IDLE;
+		I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+	}
+}
+
+/* the byte just transferred has been acknowledged (or read): what follows */
+static void op_end(void)
+{
+	uint8_t flags = g_i2c.ops[g_i2c.op].flags;
+
+	if (flags & I2C_OP_READ) {
+		g_i2c.rc = g_i2c.rx >> 1;
+	} else if (g_i2c.rx & 1) {
+		/* NACK */
+		g_i2c.rc = -1;
+		g_i2c.wait_ms = 0;
+		g_i2c.state = I2C_S_STOP;
+		g_i2c.step = 0;
+		return;
+	}
+
+	if (flags & I2C_OP_STOP) {
+		g_i2c.state = I2C_S_STOP;
+	} else if (g_i2c.ops[++g_i2c.op].flags & I2C_OP_START) {
+		g_i2c.state = I2C_S_START;
+	} else {
+		g_i2c.state = I2C_S_BITS;
+		g_i2c.bit = 0;
+		g_i2c.rx = 0;
+	}
+	g_i2c.step = 0;
+}
+
+/* one SCL half period of the transfer in progress */
+static void i2c_async_step(void)
+{
+	uint8_t byte;
+
+	switch (g_i2c.state) {
+	case I2C_S_START:
+		/* SCL is low, unless the bus was idle */
+		switch (g_i2c.step++) {
+		case 0:
+			PIO_Set(g_i2c.sda);
+			break;
+		case 1:
+			PIO_Set(g_i2c.scl);
+			break;
+		case 2:
+			PIO_Clear(g_i2c.sda);
+			g_i2c.state = I2C_S_BITS;
+			g_i2c.step = 0;
+			g_i2c.bit = 0;
+			g_i2c.rx = 0;
+			break;
+		}
+		break;
+	case I2C_S_BITS:
+		if (g_i2c.step == 0) {
+			/* sample the previous bit at the end of its SCL high period */
+			if (g_i2c.bit > 0)
+				g_i2c.rx = (g_i2c.rx << 1) | (PIO_Get(g_i2c.sda_in) ? 1 : 0);
+			PIO_Clear(g_i2c.scl);
+			if (g_i2c.bit == 9) {
+				op_end();
+				break;
+			}
+			/* the acknowledge bit, and the bits read, are released */
+			byte = g_i2c.ops[g_i2c.op].byte;
+			if (g_i2c.bit == 8 || (g_i2c.ops[g_i2c.op].flags & I2C_OP_READ) ||
+			    (byte & (0x80 >> g_i2c.bit)))
+				PIO_Set(g_i2c.sda);
+			else
+				PIO_Clear(g_i2c.sda);
+			g_i2c.step = 1;
+		} else {
+			PIO_Set(g_i2c.scl);
+			g_i2c.bit++;
+			g_i2c.step = 0;
+		}
+		break;
+	case I2C_S_STOP:
+		/* SCL is low */
+		switch (g_i2c.step++) {
+		case 0:
+			PIO_Clear(g_i2c.sda);
+			break;
+		case 1:
+			PIO_Set(g_i2c.scl);
+			break;
+		case 2:
+			PIO_Set(g_i2c.sda);
+			if (g_i2c.wait_ms) {
+				g_i2c.state = I2C_S_WAIT;
+				tc_set_period_us(1000);
+			} else {
+				xfer_end();
+			}
+			break;
+		}
+		break;
+	case I2C_S_WAIT:
+		if (--g_i2c.wait_ms == 0) {
+			tc_set_period_us(I2C_ASYNC_HALF_PERIOD_US);
+			xfer_end();
+		}
+		break;
+	default:
+		I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+		break;
+	}
+}
+
+void TC3_IrqHandler(void)
+{
+	if (I2C_TC->TC_SR & TC_SR_CPCS)
+		i2c_async_step();
+}
+
+/*! Set up the timer for the asynchronous transfers.
+ *  \param[in] sda SDA as open-drain output, already configured
+ *  \param[in] scl SCL as open-drain output, already configured
+ *  \param[in] sda_in SDA as input, for reading the bits */
+void i2c_async_init(const Pin *sda, const Pin *scl, const Pin *sda_in)
+{
+	memset(&g_i2c, 0, sizeof(g_i2c));
+	g_i2c.sda = sda;
+	g_i2c.scl = scl;
+	g_i2c.sda_in = sda_in;
+
+	PMC_EnablePeripheral(I2C_TC_ID);
+	I2C_TC->TC_CCR = TC_CCR_CLKDIS;
+	I2C_TC->TC_CMR = TC_CMR_TCCLKS_TIMER_CLOCK1 | TC_CMR_WAVE | TC_CMR_WAVSEL_UP_RC;
+	I2C_TC->TC_RC = I2C_ASYNC_HALF_PERIOD_US * I2C_TC_CLOCKS_PER_MS / 1000;
+	I2C_TC->TC_IER = TC_IER_CPCS;
+	/* below the card UART and USB: a late SCL edge does no harm */
+	NVIC_SetPriority(I2C_TC_IRQ, 15);
+	NVIC_EnableIRQ(I2C_TC_IRQ);
+}
+
+static int i2c_async_submit(const struct i2c_xfer *x)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if (g_i2c.len >= I2C_ASYNC_QUEUE_LEN) {
+		local_irq_restore(flags);
+		return -1;
+	}
+	g_i2c.queue[(g_i2c.head + g_i2c.len) % I2C_ASYNC_QUEUE_LEN] = *x;
+	if (g_i2c.len++ == 0 && g_i2c.state == I2C_S_IDLE) {
+		/* the timer is stopped: begin at once */
+		xfer_begin();
+		tc_set_period_us(I2C_ASYNC_HALF_PERIOD_US);
+	}
+	local_irq_restore(flags);
+
+	return 0;
+}
+
+/*! Queue the write of a byte to a register of a slave.
+ *  \param[in] wait_ms time the slave needs after the write (e.g. tWR of an EEPROM)
+ *  \param[in] cb called from interrupt context once done, with 0 or -1 on NACK
+ *  \returns 0 on success; -1 if the queue is full */
+int i2c_async_write(uint8_t slave, uint8_t addr, uint8_t byte, uint8_t wait_ms,
+		    i2c_cb_t cb, void *data)
+{
+	const struct i2c_xfer x = {
+		.slave = slave,
+		.addr = addr,
+		.byte = byte,
+		.read = false,
+		.wait_ms = wait_ms,
+		.cb = cb,
+		.data = data,
+	};
+
+	return i2c_async_submit(&x);
+}
+
+/*! Queue the read of a byte from a register of a slave.
+ *  \param[in] cb called from interrupt context once done, with the byte or -1 on NACK
+ *  \returns 0 on success; -1 if the queue is full */
+int i2c_async_read(uint8_t slave, uint8_t addr, i2c_cb_t cb, void *data)
+{
+	const struct i2c_xfer x = {
+		.slave = slave,
+		.addr = addr,
+		.read = true,
+		.cb = cb,
+		.data = data,
+	};
+
+	return i2c_async_submit(&x);
+}
+
+/* number of transfers queued, including the one in progress */
+unsigned int i2c_async_pending(void)
+{
+	return g_i2c.len;
+}
+
+/* wait for the queued transfers to complete */
+void i2c_async_flush(void)
+{
+	while (g_i2c.len)
+		WDT_Restart(WDT);
+}
+
+#endif /* HAVE_I2C_ASYNC */
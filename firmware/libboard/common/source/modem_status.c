@@ -0,0 +1,132 @@
+/* debounced status of the modems (WWAN LED, card inserted), with the time of
+ * their edges
+ *
+ * The board code passes the level of its inputs whenever it may have changed,
+ * from an interrupt or a timer.  The main loop polls for the changes which
+ * were stable for MODEM_STATUS_DEBOUNCE_MS, and reports them to the host.  The
+ * time of an edge is the one of the input, not the one of the poll.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "simtrace_prot.h"
+#include "modem_status.h"
+
+/* ST_MDM_STS_BIT_WWAN_LED and ST_MDM_STS_BIT_CARD_INSERTED */
+#define NUM_BITS	2
+
+struct modem_status {
+	/* inputs passed at least once, i.e. supported by the board */
+	uint8_t known;
+	/* last level of the inputs, and since when */
+	uint8_t raw;
+	uint32_t raw_ms[NUM_BITS];
+	/* debounced status, and the time of its last edges */
+	uint8_t status;
+	uint32_t edge_ms[NUM_BITS];
+	/* bits changed since the last report */
+	uint8_t changed;
+	uint32_t led_edges;
+};
+
+static struct modem_status g_mdm[MODEM_STATUS_NUM];
+
+static unsigned int bit_idx(uint8_t bit)
+{
+	return bit == ST_MDM_STS_BIT_WWAN_LED ? 0 : 1;
+}
+
+/*! Pass the level of an input.  May be called from an interrupt.
+ *  \param[in] modem number of the modem
+ *  \param[in] bit ST_MDM_STS_BIT_WWAN_LED or ST_MDM_STS_BIT_CARD_INSERTED
+ *  \param[in] active level of the input
+ *  \param[in] now_ms current time in ms */
+void modem_status_input(unsigned int modem, uint8_t bit, bool active, uint32_t now_ms)
+{
+	struct modem_status *m;
+	unsigned int i = bit_idx(bit);
+
+	if (modem >= MODEM_STATUS_NUM)
+		return;
+	m = &g_mdm[modem];
+
+	if (!(m->known & bit)) {
+		/* initial level: not a change */
+		m->known |= bit;
+		if (active) {
+			m->raw |= bit;
+			m->status |= bit;
+		}
+		m->raw_ms[i] = now_ms;
+		m->edge_ms[i] = now_ms;
+		return;
+	}
+
+	if (!!(m->raw & bit) == active)
+		return;
+	m->raw ^= bit;
+	m->raw_ms[i] = now_ms;
+}
+
+/*! Take the changes which were stable long enough.  To be called with the
+ *  interrupts disabled.
+ *  \param[in] now_ms current time in ms
+ *  \returns whether the status changed since the last modem_status_get() */
+bool modem_status_poll(unsigned int modem, uint32_t now_ms)
+{
+	struct modem_status *m;
+	unsigned int i;
+
+	if (modem >= MODEM_STATUS_NUM)
+		return false;
+	m = &g_mdm[modem];
+
+	for (i = 0; i < NUM_BITS; i++) {
+		uint8_t bit = 1 << i;
+
+		if (!((m->raw ^ m->status) & bit))
+			continue;
+		if (now_ms - m->raw_ms[i] < MODEM_STATUS_DEBOUNCE_MS)
+			continue;
+		m->status ^= bit;
+		m->changed |= bit;
+		m->edge_ms[i] = m->raw_ms[i];
+		if (bit == ST_MDM_STS_BIT_WWAN_LED)
+			m->led_edges++;
+	}
+
+	return m->changed != 0;
+}
+
+/*! Get the status of a modem, and the bits changed since the last call.  To be
+ *  called with the interrupts disabled.
+ *  \param[out] sts status to report
+ *  \param[in] now_ms current time in ms */
+void modem_status_get(unsigned int modem, struct st_modem_status *sts, uint32_t now_ms)
+{
+	struct modem_status *m;
+
+	memset(sts, 0, sizeof(*sts));
+	if (modem >= MODEM_STATUS_NUM)
+		return;
+	m = &g_mdm[modem];
+
+	sts->supported_mask = m->known;
+	sts->status_mask = m->status;
+	sts->changed_mask = m->changed;
+	sts->timestamp_ms = now_ms;
+	sts->wwan_led_edge_ms = m->edge_ms[bit_idx(ST_MDM_STS_BIT_WWAN_LED)];
+	sts->card_inserted_edge_ms = m->edge_ms[bit_idx(ST_MDM_STS_BIT_CARD_INSERTED)];
+	sts->wwan_led_edges = m->led_edges;
+	m->changed = 0;
+}
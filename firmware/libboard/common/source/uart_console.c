@@ -43,21 +43,115 @@
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 
-#include "ringbuffer.h"
+#include "utils.h"
 
 /*----------------------------------------------------------------------------
  *        Definitions
  *----------------------------------------------------------------------------*/
 
+/* the indexes run freely and are taken modulo the size, which must be a power
+ * of 2.  A transfer of the PDC is at most the whole buffer */
+#if (CONSOLE_TX_BUF_SIZE & (CONSOLE_TX_BUF_SIZE - 1)) || CONSOLE_TX_BUF_SIZE > 32768
+#error "CONSOLE_TX_BUF_SIZE must be a power of 2, up to 32768"
+#endif
+
 /*----------------------------------------------------------------------------
  *        Variables
  *----------------------------------------------------------------------------*/
 
 /** Is Console Initialized. */
 static uint8_t _ucIsConsoleInitialized=0;
-/** Ring buffer to queue data to be sent */
-static ringbuf uart_tx_buffer;
+
+/** Ring buffer of the data to be sent, which the PDC reads from */
+static struct {
+	uint8_t buf[CONSOLE_TX_BUF_SIZE];
+	/* next byte to write, and first byte not yet sent */
+	volatile uint32_t head;
+	volatile uint32_t tail;
+	/* bytes from the tail handed to the PDC; 0 if it is idle */
+	volatile uint32_t in_flight;
+	/* the last byte written was dropped */
+	bool dropping;
+	struct uart_console_stats stats;
+} g_tx;
+
+/*----------------------------------------------------------------------------
+ *        Transmission
+ *----------------------------------------------------------------------------*/
+
+/* hand the queued data to the PDC: the span up to the end of the buffer, and
+ * the one from its start if the data wraps around.  Called with the interrupts
+ * disabled, while the PDC is idle */
+static void tx_start(Uart *uart)
+{
+	uint32_t len = g_tx.head - g_tx.tail;
+	uint32_t pos = g_tx.tail % CONSOLE_TX_BUF_SIZE;
+	uint32_t first = CONSOLE_TX_BUF_SIZE - pos;
+
+	if (!len) {
+		uart->UART_IDR = UART_IDR_TXBUFE;
+		return;
+	}
+
+	if (first > len)
+		first = len;
+	/* the PDC would start with the next span if it was written while the
+	 * counter is 0 */
+	uart->UART_PTCR = UART_PTCR_TXTDIS;
+	uart->UART_TPR = (uint32_t) &g_tx.buf[pos];
+	uart->UART_TCR = first;
+	uart->UART_TNPR = (uint32_t) &g_tx.buf[0];
+	uart->UART_TNCR = len - first;
+	uart->UART_PTCR = UART_PTCR_TXTEN;
+	g_tx.in_flight = len;
+	g_tx.stats.transfers++;
+	uart->UART_IER = UART_IER_TXBUFE;
+}
+
+/* the PDC sent the data it was handed.  Called with the interrupts disabled */
+static void tx_done(void)
+{
+	g_tx.tail += g_tx.in_flight;
+	g_tx.in_flight = 0;
+}
+
+/* write into the ring buffer as much as fits, and start the PDC if it is idle.
+ * Never waits: what doesn't fit is dropped, and counted */
+static void tx_queue(const uint8_t *data, uint32_t len)
+{
+	Uart *uart = CONSOLE_UART;
+	unsigned long flags;
+	uint32_t used, room, pos, first;
+
+	local_irq_save(flags);
+	used = g_tx.head - g_tx.tail;
+	room = CONSOLE_TX_BUF_SIZE - used;
+	if (len > room) {
+		if (!g_tx.dropping)
+			g_tx.stats.overflows++;
+		g_tx.dropping = true;
+		g_tx.stats.dropped += len - room;
+		len = room;
+	} else
+		g_tx.dropping = false;
+
+	pos = g_tx.head % CONSOLE_TX_BUF_SIZE;
+	first = CONSOLE_TX_BUF_SIZE - pos;
+	if (first > len)
+		first = len;
+	memcpy(&g_tx.buf[pos], data, first);
+	memcpy(&g_tx.buf[0], data + first, len - first);
+	g_tx.head += len;
+
+	used += len;
+	if (used > g_tx.stats.max_queued)
+		g_tx.stats.max_queued = used;
+	if (!g_tx.in_flight)
+		tx_start(uart);
+	local_irq_restore(flags);
+}
 
 /**
  * \brief Configures an USART peripheral with the specified parameters.
@@ -96,10 +190,11 @@ extern void UART_Configure( uint32_t baudrate, uint32_t masterClock)
 	pUart->UART_PTCR = UART_PTCR_RXTDIS | UART_PTCR_TXTDIS;
 
 	/* Reset transmit ring buffer */
-	rbuf_reset(&uart_tx_buffer);
+	memset(&g_tx, 0, sizeof(g_tx));
 
-	/* Enable TX interrupts */
-	pUart->UART_IER = UART_IER_TXRDY;
+	/* The PDC sends the data, and interrupts once it is done */
+	pUart->UART_IDR = 0xffffffff;
+	pUart->UART_PTCR = UART_PTCR_TXTEN;
 	NVIC_SetPriority(CONSOLE_IRQ, 15); /* lowest priority */
 	NVIC_EnableIRQ(CONSOLE_IRQ);
 	
@@ -120,7 +215,8 @@ void UART_Exit(void)
 	}
 
 	Uart *pUart = CONSOLE_UART;
-	pUart->UART_IDR = UART_IDR_TXRDY;
+	pUart->UART_IDR = 0xffffffff;
+	pUart->UART_PTCR = UART_PTCR_TXTDIS;
 	pUart->UART_CR = UART_CR_RSTRX | UART_CR_RSTTX | UART_CR_RXDIS | UART_CR_TXDIS | UART_CR_RSTSTA;
 	PMC->PMC_PCDR0 = 1 << CONSOLE_ID;
 	NVIC_DisableIRQ(CONSOLE_IRQ);
@@ -130,49 +226,63 @@ void UART_Exit(void)
 void CONSOLE_ISR(void)
 {
 	Uart *uart = CONSOLE_UART;
-	if (uart->UART_SR & UART_SR_TXRDY) {
-		if (!rbuf_is_empty(&uart_tx_buffer)) {
-			uart->UART_THR = rbuf_read(&uart_tx_buffer);
-		} else {
-			uart->UART_IDR = UART_IER_TXRDY;
-		}
+	unsigned long flags;
+
+	/* interrupts of a higher priority may queue data meanwhile */
+	local_irq_save(flags);
+	if (g_tx.in_flight && (uart->UART_SR & UART_SR_TXBUFE)) {
+		tx_done();
+		tx_start(uart);
 	}
+	local_irq_restore(flags);
 }
 
 /**
  * \brief Outputs a character on the UART line.
  *
- * \note This function is asynchronous (i.e. uses a buffer and interrupt to complete the transfer).
+ * \note This function is asynchronous (i.e. uses a buffer and the PDC to complete the transfer).
+ * It never waits: the character is dropped if the buffer is full.
  * \param c  Character to send.
  */
 void UART_PutChar( uint8_t uc )
 {
-	Uart *pUart = CONSOLE_UART ;
-
 	/* Initialize console is not already done */
 	if ( !_ucIsConsoleInitialized )
 	{
 		UART_Configure(CONSOLE_BAUDRATE, BOARD_MCK);
 	}
 
-	if (!rbuf_is_full(&uart_tx_buffer)) {
-		rbuf_write(&uart_tx_buffer, uc);
-		if (!(pUart->UART_IMR & UART_IMR_TXRDY)) {
-			pUart->UART_IER = UART_IER_TXRDY;
-			CONSOLE_ISR();
-		}
+	tx_queue(&uc, 1);
+}
+
+/**
+ * \brief Outputs a buffer on the UART line.
+ *
+ * \note This function is asynchronous, like UART_PutChar(): what doesn't fit into the buffer is dropped.
+ * \param data  Data to send.
+ * \param len  Length of the data.
+ */
+void UART_PutBuffer( const uint8_t *data, uint32_t len )
+{
+	if ( !_ucIsConsoleInitialized )
+	{
+		UART_Configure(CONSOLE_BAUDRATE, BOARD_MCK);
 	}
+
+	tx_queue(data, len);
 }
 
 /**
  * \brief Outputs a character on the UART line.
  *
  * \note This function is synchronous (i.e. uses polling and blocks until the transfer is complete).
+ * The data queued before is sent first.
  * \param c  Character to send.
  */
 void UART_PutChar_Sync( uint8_t uc )
 {
 	Uart *pUart = CONSOLE_UART ;
+	unsigned long flags;
 
 	/* Initialize console is not already done */
 	if ( !_ucIsConsoleInitialized )
@@ -180,10 +290,44 @@ void UART_PutChar_Sync( uint8_t uc )
 		UART_Configure(CONSOLE_BAUDRATE, BOARD_MCK);
 	}
 
+	local_irq_save(flags);
+	/* Wait for the PDC to send the queued data */
+	while (g_tx.in_flight) {
+		while (!(pUart->UART_SR & UART_SR_TXBUFE));
+		tx_done();
+		tx_start(pUart);
+	}
 	while (!(pUart->UART_SR & UART_SR_TXRDY)); /* Wait for transfer buffer to be empty */
 	pUart->UART_THR = uc; /* Send data to UART peripheral */
 	while (!(pUart->UART_SR & UART_SR_TXRDY)); /* Wait for transfer buffer to transferred to shift register */
 	while (!(pUart->UART_SR & UART_SR_TXEMPTY)); /* Wait for transfer shift register to be empty (i.e. transfer is complete) */
+	local_irq_restore(flags);
+}
+
+/**
+ * \brief Get the statistics of the transmission.
+ *
+ * \param st  Statistics since the console was configured.
+ */
+void UART_GetStats( struct uart_console_stats *st )
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	*st = g_tx.stats;
+	local_irq_restore(flags);
+}
+
+/**
+ * \brief Print the statistics of the transmission on the console.
+ */
+void UART_PrintStats( void )
+{
+	struct uart_console_stats st;
+
+	UART_GetStats(&st);
+	printf("console: %lu transfers, %lu/%u bytes max queued, %lu overflows, %lu bytes dropped\n\r",
+	       st.transfers, st.max_queued, CONSOLE_TX_BUF_SIZE, st.overflows, st.dropped);
 }
 
 /**
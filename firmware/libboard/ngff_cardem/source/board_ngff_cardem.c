@@ -41,6 +41,7 @@ void board_exec_dbg_cmd(int ch)
 		printf("\t1\tGenerate 1ms reset pulse on WWAN1\n\r");
 		printf("\t!\tSwitch Channel A from physical -> remote\n\r");
 		printf("\tt\t(pseudo)talloc report\n\r");
+		printf("\tc\tconsole statistics\n\r");
 		break;
 	case 'R':
 		printf("Asking NVIC to reset us\n\r");
@@ -73,6 +74,9 @@ void board_exec_dbg_cmd(int ch)
 	case 't':
 		talloc_report(NULL, stdout);
 		break;
+	case 'c':
+		UART_PrintStats();
+		break;
 	default:
 		printf("Unknown command '%c'\n\r", ch);
 		break;
@@ -16,8 +16,12 @@
  * PIN_WWAN1 and/or PIN_WWAN2 defines in its board.h file.
  */
 #include "board.h"
+#include "simtrace_prot.h"
+#include "modem_status.h"
 #include "wwan_led.h"
 
+extern volatile uint32_t jiffies;
+
 #ifdef PIN_WWAN1
 static const Pin pin_wwan1 = PIN_WWAN1;
 
@@ -25,9 +29,10 @@ static void wwan1_irqhandler(const Pin *pPin)
 {
 	int active = wwan_led_active(0);
 
-	TRACE_INFO("0: WWAN LED %u\r\n", active);
+	TRACE_DEBUG("0: WWAN LED %u\r\n", active);
 
-	/* TODO: notify host via USB */
+	/* debounced and reported to the host from the main loop */
+	modem_status_input(0, ST_MDM_STS_BIT_WWAN_LED, active, jiffies);
 }
 #endif
 
@@ -37,9 +42,9 @@ static const Pin pin_wwan2 = PIN_WWAN2;
 static void wwan2_irqhandler(const Pin *pPin)
 {
 	int active = wwan_led_active(1);
-	TRACE_INFO("1: WWAN LED %u\r\n", active);
+	TRACE_DEBUG("1: WWAN LED %u\r\n", active);
 
-	/* TODO: notify host via USB */
+	modem_status_input(1, ST_MDM_STS_BIT_WWAN_LED, active, jiffies);
 }
 #endif
 
@@ -75,6 +80,7 @@ int wwan_led_init(void)
 #ifdef PIN_WWAN1
 	PIO_Configure(&pin_wwan1, 1);
 	PIO_ConfigureIt(&pin_wwan1, wwan1_irqhandler);
+	modem_status_input(0, ST_MDM_STS_BIT_WWAN_LED, wwan_led_active(0), jiffies);
 	PIO_EnableIt(&pin_wwan1);
 	num_leds++;
 #endif
@@ -82,6 +88,7 @@ int wwan_led_init(void)
 #ifdef PIN_WWAN2
 	PIO_Configure(&pin_wwan2, 1);
 	PIO_ConfigureIt(&pin_wwan2, wwan2_irqhandler);
+	modem_status_input(1, ST_MDM_STS_BIT_WWAN_LED, wwan_led_active(1), jiffies);
 	PIO_EnableIt(&pin_wwan2);
 	num_leds++;
 #endif
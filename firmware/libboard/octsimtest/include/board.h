@@ -99,9 +99,13 @@
 /* we have a resistive voltage divider of 47 + 30 kOhms to also detect 5V supply power */
 #define VCC_UV_THRESH_1V8	(1500000*47)/(47+30)
 #define VCC_UV_THRESH_3V	(2500000*47)/(47+30)
+#define VCC_UV_THRESH_5V	(4000000*47)/(47+30)
 
 #define HAVE_SLOT_MUX
 
+/* I2C transfers bit-banged from TC3, see i2c_async.c */
+#define HAVE_I2C_ASYNC
+
 #define HAVE_BOARD_CARDINSERT
 struct cardem_inst;
 void board_set_card_insert(struct cardem_inst *ci, bool card_insert);
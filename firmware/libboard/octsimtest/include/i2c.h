@@ -13,6 +13,8 @@
 #pragma once
 
 #include <stdbool.h>
+#include <stdint.h>
+#include "i2c_async.h"
 
 void i2c_pin_init(void);
 
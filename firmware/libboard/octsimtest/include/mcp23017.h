@@ -12,12 +12,15 @@
  */
 #pragma once
 
+#include "i2c.h"
+
 #define MCP23017_ADDRESS 0x20
 
 int mcp23017_init(uint8_t slave, uint8_t iodira, uint8_t iodirb);
 int mcp23017_test(uint8_t slave);
 int mcp23017_toggle(uint8_t slave);
 int mcp23017_set_output_a(uint8_t slave, uint8_t val);
+int mcp23017_set_output_a_async(uint8_t slave, uint8_t val, i2c_cb_t cb, void *data);
 int mcp23017_set_output_b(uint8_t slave, uint8_t val);
 //int mcp23017_write_byte(uint8_t slave, uint8_t addr, uint8_t byte);
 //int mcp23017_read_byte(uint8_t slave, uint8_t addr);
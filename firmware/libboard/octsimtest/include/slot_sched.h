@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* number of SIM slots behind the 1:8 mux */
+#define SLOT_SCHED_NUM_SLOTS	8
+
+/* time a slot keeps the UART, before the next slot gets it between two transactions */
+#ifndef SLOT_SCHED_SLICE_MS
+#define SLOT_SCHED_SLICE_MS	100
+#endif
+
+/* time without transaction, after which a slot gives the UART to the next one
+ * before its time slice is used up */
+#ifndef SLOT_SCHED_IDLE_MS
+#define SLOT_SCHED_IDLE_MS	20
+#endif
+
+/* time a slot without VCC or clock keeps the UART, to see the reader power it up */
+#ifndef SLOT_SCHED_SETTLE_MS
+#define SLOT_SCHED_SETTLE_MS	10
+#endif
+
+/* what the reader of the connected slot is doing */
+enum slot_sched_activity {
+	/* no VCC, or the clock is stopped: may be left after SLOT_SCHED_SETTLE_MS */
+	SLOT_SCHED_A_OFF,
+	/* VCC on and RST asserted: the ATR follows once it is released, so the
+	 * slot keeps the UART for its time slice */
+	SLOT_SCHED_A_RESET,
+	/* between two transactions: may be left after SLOT_SCHED_IDLE_MS without
+	 * transaction, or at the end of the time slice */
+	SLOT_SCHED_A_IDLE,
+	/* ATR, PPS or a transaction in progress: the slot is never left */
+	SLOT_SCHED_A_BUSY,
+};
+
+enum slot_sched_activity slot_sched_classify(bool vcc, bool rst, bool clk_stopped, bool idle);
+void slot_sched_init(uint8_t cur, uint32_t now);
+void slot_sched_set_mask(uint8_t mask);
+uint8_t slot_sched_get_mask(void);
+int slot_sched_poll(enum slot_sched_activity act, uint32_t now);
+void slot_sched_switched(uint8_t slot, uint32_t now);
+void slot_sched_get_stats(uint8_t slot, uint32_t now, uint32_t *connected_ms, uint32_t *connections);
@@ -23,9 +23,56 @@
 #include "i2c.h"
 #include "mcp23017.h"
 #include "mux.h"
+#include "slot_sched.h"
 
 static bool mcp2317_present = false;
 
+/* The card insert signals are written to the MCP23017 without waiting for the
+ * I2C transfer, so the card UART keeps being serviced.  While a write is in
+ * progress, only the latest value is kept to be written next. */
+static struct {
+	volatile bool busy;
+	/* value to write once the write in progress is done; -1 if none */
+	volatile int next;
+	uint32_t errors;
+} g_card_insert = { .next = -1 };
+
+static void card_insert_written(int rc, void *data);
+
+/* called with interrupts disabled, or from the I2C interrupt */
+static void card_insert_write(uint8_t val)
+{
+	/* at most one write is queued by us, so the queue can't be full */
+	g_card_insert.busy = mcp23017_set_output_a_async(MCP23017_ADDRESS, val,
+							 card_insert_written, NULL) == 0;
+}
+
+static void card_insert_written(int rc, void *data)
+{
+	int next = g_card_insert.next;
+
+	if (rc < 0)
+		g_card_insert.errors++;
+
+	if (next >= 0) {
+		g_card_insert.next = -1;
+		card_insert_write(next);
+	} else
+		g_card_insert.busy = false;
+}
+
+static void set_card_insert(uint8_t val)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	if (g_card_insert.busy)
+		g_card_insert.next = val;
+	else
+		card_insert_write(val);
+	local_irq_restore(flags);
+}
+
 void board_exec_dbg_cmd(int ch)
 {
 	switch (ch) {
@@ -36,6 +83,7 @@ void board_exec_dbg_cmd(int ch)
 		printf("\tm\trun mcp23017 test\n\r");
 		printf("\ti\tset card insert via I2C\n\r");
 		printf("\tI\tdisable card insert\n\r");
+		printf("\tc\tprint card insert write errors\n\r");
 		break;
 	case '0': mux_set_slot(0); break;
 	case '1': mux_set_slot(1); break;
@@ -55,11 +103,14 @@ void board_exec_dbg_cmd(int ch)
 		break;
 	case 'i':
 		printf("Setting card insert (slot=%u)\r\n", mux_get_slot());
-		mcp23017_set_output_a(MCP23017_ADDRESS, (1 << mux_get_slot()));
+		set_card_insert(1 << mux_get_slot());
 		break;
 	case 'I':
 		printf("Releasing card insert (slot=%u)\r\n", mux_get_slot());
-		mcp23017_set_output_a(MCP23017_ADDRESS, 0);
+		set_card_insert(0);
+		break;
+	case 'c':
+		printf("Card insert write errors: %lu\r\n", g_card_insert.errors);
 		break;
 	default:
 		printf("Unknown command '%c'\n\r", ch);
@@ -108,11 +159,12 @@ void board_set_card_insert(struct cardem_inst *ci, bool card_insert)
 
 	if (mcp2317_present) {
 		if (card_insert) {
-			/* we must enable card-presence of the active slot and disable it on all others */
-			mcp23017_set_output_a(MCP23017_ADDRESS, (1 << s));
+			/* we must enable card-presence of the active slot, and of the slots it
+			 * is time-multiplexed with, and disable it on all others */
+			set_card_insert((1 << s) | slot_sched_get_mask());
 		} else {
 			/* we disable all card insert signals */
-			mcp23017_set_output_a(MCP23017_ADDRESS, 0);
+			set_card_insert(0);
 		}
 	} else {
 		TRACE_WARNING("No MCP23017 present; cannot set CARD_INSERT\r\n");
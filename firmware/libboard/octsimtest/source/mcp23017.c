@@ -131,6 +131,12 @@ int mcp23017_set_output_a(uint8_t slave, uint8_t val)
 	return mcp23017_write_byte(slave, MCP23017_OLATA, val);
 }
 
+/* same as mcp23017_set_output_a(), without waiting for the I2C transfer */
+int mcp23017_set_output_a_async(uint8_t slave, uint8_t val, i2c_cb_t cb, void *data)
+{
+	return i2c_async_write(slave, MCP23017_OLATA, val, 0, cb, data);
+}
+
 int mcp23017_set_output_b(uint8_t slave, uint8_t val)
 {
 	return mcp23017_write_byte(slave, MCP23017_OLATB, val);
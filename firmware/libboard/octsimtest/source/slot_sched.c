@@ -0,0 +1,152 @@
+/* sysmoOCTSIMTEST time-multiplexed scheduling of the slots behind the mux
+ *
+ * The card emulation UART is connected to one of the eight slots at a time.
+ * The scheduler decides when to move on to the next slot of the mask: never
+ * within a transaction or an ATR, and only once the slot used up its time
+ * slice, or has been idle for a while.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <stdbool.h>
+#include <string.h>
+#include "slot_sched.h"
+
+static struct {
+	/* bit-mask of the slots to cycle through, 0 if not scheduling */
+	uint8_t mask;
+	/* slot connected to the UART, and since when */
+	uint8_t cur;
+	uint32_t since;
+	/* last time the connected slot was seen within a transaction */
+	uint32_t busy;
+	struct {
+		/* time connected to the UART, without the current connection */
+		uint32_t connected_ms;
+		uint32_t connections;
+	} stats[SLOT_SCHED_NUM_SLOTS];
+} g_sched;
+
+/* what the reader of the connected slot is doing, from its lines and the state
+ * of the card handle.  A reader may stop the clock between two transactions;
+ * the slot can then be left like one without VCC */
+enum slot_sched_activity slot_sched_classify(bool vcc, bool rst, bool clk_stopped, bool idle)
+{
+	if (!vcc)
+		return SLOT_SCHED_A_OFF;
+	if (rst)
+		return SLOT_SCHED_A_RESET;
+	if (!idle)
+		return SLOT_SCHED_A_BUSY;
+	if (clk_stopped)
+		return SLOT_SCHED_A_OFF;
+	return SLOT_SCHED_A_IDLE;
+}
+
+/* initialize the scheduler, with slot cur being connected */
+void slot_sched_init(uint8_t cur, uint32_t now)
+{
+	memset(&g_sched, 0, sizeof(g_sched));
+	g_sched.cur = cur;
+	g_sched.since = g_sched.busy = now;
+	g_sched.stats[cur].connections = 1;
+}
+
+/* set the slots to cycle through, 0 to stay with the current one */
+void slot_sched_set_mask(uint8_t mask)
+{
+	g_sched.mask = mask;
+}
+
+uint8_t slot_sched_get_mask(void)
+{
+	return g_sched.mask;
+}
+
+/* next slot of the mask after the current one, in round robin */
+static int next_slot(void)
+{
+	unsigned int i;
+	uint8_t s;
+
+	for (i = 1; i <= SLOT_SCHED_NUM_SLOTS; i++) {
+		s = (g_sched.cur + i) % SLOT_SCHED_NUM_SLOTS;
+		if (g_sched.mask & (1 << s))
+			return s;
+	}
+	return -1;
+}
+
+/*! Decide whether to move on to another slot.
+ *  \param[in] act what the reader of the connected slot is doing
+ *  \param[in] now current time in ms
+ *  \returns slot to connect next; -1 to stay with the connected one */
+int slot_sched_poll(enum slot_sched_activity act, uint32_t now)
+{
+	bool stay;
+	int next;
+
+	if (act == SLOT_SCHED_A_BUSY)
+		g_sched.busy = now;
+
+	if (!g_sched.mask)
+		return -1;
+
+	switch (act) {
+	case SLOT_SCHED_A_BUSY:
+		return -1;
+	case SLOT_SCHED_A_OFF:
+		stay = now - g_sched.since < SLOT_SCHED_SETTLE_MS;
+		break;
+	case SLOT_SCHED_A_IDLE:
+		stay = now - g_sched.since < SLOT_SCHED_SLICE_MS &&
+		       now - g_sched.busy < SLOT_SCHED_IDLE_MS;
+		break;
+	default:
+		stay = now - g_sched.since < SLOT_SCHED_SLICE_MS;
+		break;
+	}
+
+	/* a slot removed from the mask is left at the next opportunity */
+	if ((g_sched.mask & (1 << g_sched.cur)) && stay)
+		return -1;
+
+	next = next_slot();
+	if (next == g_sched.cur)
+		return -1;
+	return next;
+}
+
+/* the UART has been connected to another slot */
+void slot_sched_switched(uint8_t slot, uint32_t now)
+{
+	if (slot >= SLOT_SCHED_NUM_SLOTS || slot == g_sched.cur)
+		return;
+
+	g_sched.stats[g_sched.cur].connected_ms += now - g_sched.since;
+	g_sched.cur = slot;
+	g_sched.since = g_sched.busy = now;
+	g_sched.stats[slot].connections++;
+}
+
+/* time the slot was connected to the UART, and how often */
+void slot_sched_get_stats(uint8_t slot, uint32_t now, uint32_t *connected_ms, uint32_t *connections)
+{
+	if (slot >= SLOT_SCHED_NUM_SLOTS) {
+		*connected_ms = *connections = 0;
+		return;
+	}
+
+	*connected_ms = g_sched.stats[slot].connected_ms;
+	if (slot == g_sched.cur)
+		*connected_ms += now - g_sched.since;
+	*connections = g_sched.stats[slot].connections;
+}
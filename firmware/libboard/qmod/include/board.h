@@ -108,6 +108,9 @@
 
 #define CARDEMU_SECOND_UART
 
+/* I2C transfers bit-banged from TC3, see i2c_async.c */
+#define HAVE_I2C_ASYNC
+
 #define DETECT_VCC_BY_ADC
 #define VCC_UV_THRESH_1V8	1500000
 #define VCC_UV_THRESH_3V	2500000
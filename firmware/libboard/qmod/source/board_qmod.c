@@ -67,62 +67,135 @@ const unsigned char __eeprom_bin[256] = {
 	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0xA0, 0x56, 0x23, 0x71, 0x04, 0x00, /* 0xf0 - 0xff */
 };
 
-static int write_hub_eeprom(void)
+/* The hub EEPROM is written (and read back) by the I2C interrupt, one byte after
+ * the other, while the main loop keeps running.  A timer reports the outcome. */
+static struct {
+	/* bytes to write; NULL to erase */
+	const unsigned char *bin;
+	/* the wait before the first byte is over */
+	bool started;
+	/* byte being written, or read back */
+	volatile unsigned int idx;
+	volatile bool verifying;
+	volatile bool done;
+	/* -1 if writing failed at byte idx */
+	volatile int rc;
+	uint8_t read[256];
+	struct osmo_timer_list timer;
+} g_hub_eeprom = { .done = true };
+
+static void hub_eeprom_i2c_cb(int rc, void *data);
+
+/* called from the I2C interrupt, or with no transfer of ours queued */
+static void hub_eeprom_next(void)
 {
-	int i;
+	unsigned int i = g_hub_eeprom.idx;
+	int rc;
 
-	/* wait */
-	mdelay(100);
-
-	TRACE_INFO("Writing EEPROM...\n\r");
-	/* write the EEPROM once */
-	for (i = 0; i < ARRAY_SIZE(__eeprom_bin); i++) {
-		int rc = eeprom_write_byte(0x50, i, __eeprom_bin[i]);
-		if (rc < 0) {
-			TRACE_ERROR("Writing EEPROM failed at byte %u: 0x%02x\n\r",
-				i, __eeprom_bin[i]);
-			return 1;
-		}
+	if (g_hub_eeprom.verifying)
+		rc = i2c_async_read(0x50, i, hub_eeprom_i2c_cb, NULL);
+	else
+		/* tWR = 5 ms for AT24C02 */
+		rc = i2c_async_write(0x50, i, g_hub_eeprom.bin ? g_hub_eeprom.bin[i] : 0xff, 5,
+				     hub_eeprom_i2c_cb, NULL);
+	if (rc < 0) {
+		g_hub_eeprom.rc = -1;
+		g_hub_eeprom.done = true;
+	}
+}
+
+static void hub_eeprom_i2c_cb(int rc, void *data)
+{
+	if (g_hub_eeprom.verifying) {
+		g_hub_eeprom.read[g_hub_eeprom.idx] = rc;
+	} else if (rc < 0) {
+		g_hub_eeprom.rc = -1;
+		g_hub_eeprom.done = true;
+		return;
+	}
+
+	if (++g_hub_eeprom.idx < ARRAY_SIZE(g_hub_eeprom.read)) {
+		hub_eeprom_next();
+	} else if (!g_hub_eeprom.verifying && g_hub_eeprom.bin) {
+		/* then pursue re-reading it again */
+		g_hub_eeprom.verifying = true;
+		g_hub_eeprom.idx = 0;
+		hub_eeprom_next();
+	} else {
+		g_hub_eeprom.done = true;
+	}
+}
+
+static void hub_eeprom_tmr_cb(void *data)
+{
+	const char *what = g_hub_eeprom.bin ? "Writing" : "Erasing";
+	unsigned int i;
+
+	if (!g_hub_eeprom.started) {
+		g_hub_eeprom.started = true;
+		TRACE_INFO("%s EEPROM...\n\r", what);
+		hub_eeprom_next();
+	}
+
+	if (!g_hub_eeprom.done) {
+		osmo_timer_schedule(&g_hub_eeprom.timer, 0, 100*1000);
+		return;
+	}
+
+	if (g_hub_eeprom.rc < 0) {
+		TRACE_ERROR("%s EEPROM failed at byte %u: 0x%02x\n\r", what, g_hub_eeprom.idx,
+			    g_hub_eeprom.bin ? g_hub_eeprom.bin[g_hub_eeprom.idx] : 0xff);
+		return;
+	}
+
+	if (!g_hub_eeprom.bin) {
+		TRACE_INFO("EEPROM erased\n\r");
+		return;
 	}
 
-	/* then pursue re-reading it again and again */
-	TRACE_INFO("Verifying EEPROM...\n\r");
-	for (i = 0; i < ARRAY_SIZE(__eeprom_bin); i++) {
-		int byte = eeprom_read_byte(0x50, i);
-		TRACE_DEBUG("0x%02x: %02x\n\r", i, byte);
-		if (byte != __eeprom_bin[i])
+	for (i = 0; i < ARRAY_SIZE(g_hub_eeprom.read); i++) {
+		TRACE_DEBUG("0x%02x: %02x\n\r", i, g_hub_eeprom.read[i]);
+		if (g_hub_eeprom.read[i] != g_hub_eeprom.bin[i])
 			TRACE_ERROR("Byte %u is wrong, expected 0x%02x, found 0x%02x\n\r",
-					i, __eeprom_bin[i], byte);
+					i, g_hub_eeprom.bin[i], g_hub_eeprom.read[i]);
 	}
 	TRACE_INFO("EEPROM written\n\r");
 
 	/* FIXME: Release PIN_PRTPWR_OVERRIDE after we know the hub is
 	 * again powering us up */
-
-	return 0;
 }
 
-static int erase_hub_eeprom(void)
+/* write the hub EEPROM with bin, or erase it if NULL, without waiting for it */
+static int start_hub_eeprom(const unsigned char *bin)
 {
-	int i;
+	if (!g_hub_eeprom.done) {
+		TRACE_ERROR("EEPROM access already in progress\n\r");
+		return 1;
+	}
+
+	g_hub_eeprom.bin = bin;
+	g_hub_eeprom.started = false;
+	g_hub_eeprom.idx = 0;
+	g_hub_eeprom.verifying = false;
+	g_hub_eeprom.rc = 0;
+	g_hub_eeprom.done = false;
 
 	/* wait */
-	mdelay(100);
-
-	TRACE_INFO("Erasing EEPROM...\n\r");
-	/* write the EEPROM once */
-	for (i = 0; i < 256; i++) {
-		int rc = eeprom_write_byte(0x50, i, 0xff);
-		if (rc < 0) {
-			TRACE_ERROR("Erasing EEPROM failed at byte %u: 0x%02x\n\r",
-				i, __eeprom_bin[i]);
-			return 1;
-		}
-	}
-	TRACE_INFO("EEPROM erased\n\r");
+	g_hub_eeprom.timer.cb = hub_eeprom_tmr_cb;
+	osmo_timer_schedule(&g_hub_eeprom.timer, 0, 100*1000);
 
 	return 0;
 }
+
+static int write_hub_eeprom(void)
+{
+	return start_hub_eeprom(__eeprom_bin);
+}
+
+static int erase_hub_eeprom(void)
+{
+	return start_hub_eeprom(NULL);
+}
 #endif /* ALLOW_PEER_ERASE */
 
 static void board_exec_dbg_cmd_st12only(int ch)
@@ -227,6 +300,7 @@ void board_exec_dbg_cmd(int ch)
 		printf("\t!\tSwitch Channel A from physical -> remote\n\r");
 		printf("\t@\tSwitch Channel B from physical -> remote\n\r");
 		printf("\tt\t(pseudo)talloc report\n\r");
+		printf("\tc\tconsole statistics\n\r");
 		break;
 	case 'R':
 		printf("Asking NVIC to reset us\n\r");
@@ -292,6 +366,9 @@ void board_exec_dbg_cmd(int ch)
 	case 't':
 		talloc_report(NULL, stdout);
 		break;
+	case 'c':
+		UART_PrintStats();
+		break;
 	default:
 		if (!qmod_sam3_is_12())
 			printf("Unknown command '%c'\n\r", ch);
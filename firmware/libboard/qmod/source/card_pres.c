@@ -15,11 +15,17 @@
 #include <osmocom/core/timer.h>
 #include "board.h"
 #include "utils.h"
+#include "simtrace_prot.h"
+#include "modem_status.h"
 #include "card_pres.h"
 
 #define NUM_CARDPRES	2
 
-#define TIMER_INTERVAL_MS	500
+/* the changes are debounced by modem_status, this gives the precision of the
+ * time of their edges */
+#define TIMER_INTERVAL_MS	50
+
+extern volatile uint32_t jiffies;
 
 static const Pin pin_cardpres[NUM_CARDPRES] = { PIN_DET_USIM1_PRES, PIN_DET_USIM2_PRES };
 static int last_state[NUM_CARDPRES] = { -1, -1 };
@@ -50,9 +56,9 @@ static void cardpres_tmr_cb(void *data)
 		int state = is_card_present(i);
 		if (state != last_state[i]) {
 			TRACE_INFO("%u: Card Detect Status %d -> %d\r\n", i, last_state[i], state);
-			/* FIXME: report to USB host */
 			last_state[i] = state;
 		}
+		modem_status_input(i, ST_MDM_STS_BIT_CARD_INSERTED, state, jiffies);
 	}
 
 	osmo_timer_schedule(&cardpres_timer, 0, TIMER_INTERVAL_MS*1000);
@@ -11,6 +11,8 @@
  * GNU General Public License for more details.
  */
 #include "board.h"
+#include "utils.h"
+#include "i2c.h"
 #include <stdbool.h>
 
 /* Low-Level I2C Routines */
@@ -35,6 +37,7 @@ void i2c_pin_init(void)
 {
 	PIO_Configure(&pin_scl, PIO_LISTSIZE(pin_scl));
 	PIO_Configure(&pin_sda, PIO_LISTSIZE(pin_sda));
+	i2c_async_init(&pin_sda, &pin_scl, &pin_sda_in);
 }
 
 static void set_scl(void)
@@ -81,6 +84,10 @@ static bool i2c_started = false;
 
 static void i2c_start_cond(void)
 {
+	/* the bus may still be in use by queued transfers */
+	if (!i2c_started)
+		i2c_async_flush();
+
 	if (i2c_started) {
 		set_sda();
 		set_scl();
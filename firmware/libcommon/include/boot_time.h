@@ -0,0 +1,44 @@
+/* time stamps of the start-up phases of the firmware
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+
+/* time from reset to BOOT_P_READY the start-up is benchmarked against; most of
+ * it is the host enumerating the device */
+#ifndef BOOT_TIME_TARGET_MS
+#define BOOT_TIME_TARGET_MS	300
+#endif
+
+/* phases of the start-up, in the order they are normally reached */
+enum boot_phase {
+	/* main() entered, after the low level init */
+	BOOT_P_MAIN,
+	/* board_main_top() done */
+	BOOT_P_BOARD,
+	/* USB pull-up enabled: the host can enumerate the device */
+	BOOT_P_USB_INIT,
+	/* the host selected a configuration */
+	BOOT_P_USB_CONFIGURED,
+	/* the selected configuration is initialized: the card emulation can
+	 * answer the reset of the reader with the ATR */
+	BOOT_P_READY,
+	/* the nonessential initialization deferred until enumeration is done */
+	BOOT_P_DEFERRED,
+	_NUM_BOOT_P
+};
+
+void boot_time_start(uint32_t now);
+void boot_time_mark(enum boot_phase phase);
+int boot_time_get(enum boot_phase phase);
+void boot_time_print(void);
@@ -19,6 +19,8 @@
 #include <stdint.h>
 
 struct card_handle;
+struct clk_ctr_state;
+struct vcc_adc_state;
 struct msgb;
 
 enum card_io {
@@ -48,12 +50,23 @@ int card_emu_tx_byte(struct card_handle *ch);
 /* hardware driver informs us that a card I/O signal has changed */
 void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active);
 
+/* hardware driver informs us about a new measurement of the CLK frequency */
+void card_emu_clk_measured(struct card_handle *ch, const struct clk_ctr_state *clk);
+
+/* hardware driver informs us about a new window of VCC measurements */
+void card_emu_vcc_measured(struct card_handle *ch, const struct vcc_adc_state *vcc);
+
 /* User sets a new ATR to be returned during next card reset */
 int card_emu_set_atr(struct card_handle *ch, const uint8_t *atr, uint8_t len);
 
 struct llist_head *card_emu_get_uart_tx_queue(struct card_handle *ch);
 void card_emu_have_new_uart_tx(struct card_handle *ch);
 void card_emu_report_status(struct card_handle *ch, bool report_on_irq);
+void card_emu_report_stats(struct card_handle *ch, uint32_t connected_ms, uint32_t connections);
+
+/* sharing the UART between the card handles of several slots */
+bool card_emu_ch_idle(const struct card_handle *ch);
+void card_emu_resume(struct card_handle *ch);
 
 void card_emu_wtime_half_expired(void *ch);
 void card_emu_wtime_expired(void *ch);
@@ -62,6 +75,7 @@ void card_emu_wtime_expired(void *ch);
 #define ENABLE_TX		0x01
 #define ENABLE_RX		0x02
 #define ENABLE_TX_TIMER_ONLY	0x03
+#define ENABLE_RX_TIMER		0x04
 
 int card_emu_uart_update_fidi(uint8_t uart_chan, unsigned int fidi);
 void card_emu_uart_update_wt(uint8_t uart_chan, uint32_t wt);
@@ -77,5 +91,7 @@ bool card_emu_ch_ready(const struct card_handle *ch);
 struct cardemu_usb_msg_config;
 int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
 			unsigned int scfg_len);
+bool card_emu_feature_enabled(const struct card_handle *ch, uint32_t feature);
 
+struct msgb *usb_buf_alloc_st(uint8_t ep, uint8_t msg_class, uint8_t msg_type);
 void usb_buf_upd_len_and_submit(struct msgb *msg);
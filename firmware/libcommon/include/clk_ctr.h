@@ -0,0 +1,57 @@
+/* measurement of the SIM clock frequency, in the background
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* TC clock inputs the CLK of a slot can be connected to */
+#define CLK_CTR_TCLK0		0	/* PA4 */
+#define CLK_CTR_TCLK2		2	/* PA29 */
+
+/* time during which the clock cycles are counted.  The inputs are measured in
+ * turn, each one every CLK_CTR_GATE_MS times the number of inputs */
+#ifndef CLK_CTR_GATE_MS
+#define CLK_CTR_GATE_MS		10
+#endif
+
+/* last measurement of an input */
+struct clk_ctr_state {
+	/* frequency in Hz, 0 if the clock is stopped */
+	uint32_t hz;
+	/* how often the clock stopped since the input was added */
+	uint32_t stops;
+	/* at least one gate time was measured since the input was (re)started */
+	bool valid;
+};
+
+void clk_ctr_init(void);
+void clk_ctr_exit(void);
+int clk_ctr_add(uint8_t tclk);
+void clk_ctr_restart(uint8_t tclk);
+void clk_ctr_poll(void);
+bool clk_ctr_get(uint8_t tclk, struct clk_ctr_state *st);
+
+/* whether the clock changed enough since it was last reported to the host: it
+ * stopped, restarted, or its frequency changed by more than 1/1024 */
+static inline bool clk_ctr_changed(const struct clk_ctr_state *st, const struct clk_ctr_state *reported)
+{
+	uint32_t diff;
+
+	if (st->valid != reported->valid || st->stops != reported->stops)
+		return true;
+	if (!st->hz != !reported->hz)
+		return true;
+	diff = st->hz > reported->hz ? st->hz - reported->hz : reported->hz - st->hz;
+	return diff > reported->hz / 1024;
+}
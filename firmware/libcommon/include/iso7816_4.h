@@ -41,12 +41,15 @@
  *  -# ISO7816_Init
  *  -# ISO7816_IccPowerOff
  *  -# ISO7816_XfrBlockTPDU_T0
+ *  -# ISO7816_XfrBlockTPDU_T0_Start / ISO7816_XfrBlockTPDU_T0_Done
  *  -# ISO7816_Escape
  *  -# ISO7816_RestartClock
  *  -# ISO7816_StopClock
  *  -# ISO7816_toAPDU
  *  -# ISO7816_Datablock_ATR
  *  -# ISO7816_SetDataRateandClockFrequency
+ *  -# ISO7816_SetFiDi
+ *  -# ISO7816_PPS
  *  -# ISO7816_StatusReset
  *  -# ISO7816_cold_reset
  *  -# ISO7816_warm_reset
@@ -63,9 +66,17 @@
 /** Size max of Answer To Reset */
 #define ATR_SIZE_MAX            55
 
+/** Highest ICC clock we generate, f(max) of the default Fi (Table 7 of ISO 7816-3) */
+#define ISO7816_MAX_CLOCK_KHZ   5000
+
 /** NULL byte to restart byte procedure */
 #define ISO_NULL_VAL            0x60
 
+/** Errors of the T=0 engine, in addition to the error bits of US_CSR */
+#define ISO7816_T0_ERR_PROC_BYTE  (1u << 29)
+#define ISO7816_T0_ERR_ABORTED    (1u << 30)
+#define ISO7816_T0_ERR_BUSY       (1u << 31)
+
 /*------------------------------------------------------------------------------
  *         Exported functions
  *----------------------------------------------------------------------------*/
@@ -79,12 +90,21 @@ extern uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
 					                    uint8_t *pMessage,
 					                    uint16_t wLength,
 					                    uint16_t *retlen);
+extern uint32_t ISO7816_XfrBlockTPDU_T0_Start(const uint8_t *pAPDU,
+					               uint8_t *pMessage,
+					               uint16_t wLength);
+extern bool ISO7816_XfrBlockTPDU_T0_Done( uint32_t *status, uint16_t *retlen );
+extern void ISO7816_XfrBlockTPDU_T0_Abort( void );
+extern void ISO7816_SetWaitingTime( uint32_t wt );
+extern void ISO7816_IrqHandler( void );
 extern void ISO7816_Escape( void );
 extern void ISO7816_RestartClock(void);
 extern void ISO7816_StopClock( void );
 extern void ISO7816_toAPDU( void );
 extern uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength );
-extern void ISO7816_SetDataRateandClockFrequency( uint32_t dwClockFrequency, uint32_t dwDataRate );
+extern void ISO7816_SetDataRateandClockFrequency( uint32_t *pClockFrequency, uint32_t *pDataRate );
+extern int ISO7816_SetFiDi( uint8_t fidi );
+extern int ISO7816_PPS( uint8_t t, uint8_t fidi );
 extern uint8_t ISO7816_StatusReset( void );
 extern void ISO7816_cold_reset( void );
 extern void ISO7816_warm_reset( void );
@@ -1,4 +1,4 @@
-/* ISO7816-3 Fi/Di tables + computation
+/* ISO7816-3 Fi/Di tables + computation, ATR, PPS and T=1 EDC
  *
  * (C) 2010-2015 by Harald Welte <laforge@gnumonks.org>
  *
@@ -15,6 +15,7 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 /* Table 7 of ISO 7816-3:2006 */
 extern const uint16_t iso7816_3_fi_table[16];
@@ -22,5 +23,50 @@ extern const uint16_t iso7816_3_fi_table[16];
 /* Table 8 from ISO 7816-3:2006 */
 extern const uint8_t iso7816_3_di_table[16];
 
+/* Table 7 of ISO 7816-3:2006, f(max) in kHz */
+extern const uint16_t iso7816_3_fmax_table[16];
+
 /* compute the F/D ratio based on F_index and D_index values */
 int iso7816_3_compute_fd_ratio(uint8_t f_index, uint8_t d_index);
+
+/* default Fi/Di, as used until a PPS exchange selects others */
+#define ISO7816_3_DEFAULT_FIDI	0x11
+/* default waiting time integer of T=0 */
+#define ISO7816_3_DEFAULT_WI	10
+/* default information field size (IFSC and IFSD) of T=1 */
+#define ISO7816_3_DEFAULT_IFS	32
+/* default character and block waiting time integers of T=1 */
+#define ISO7816_3_DEFAULT_CWI	13
+#define ISO7816_3_DEFAULT_BWI	4
+
+/* global, T=0 and T=1 interface bytes of an ATR */
+struct iso7816_3_atr_params {
+	/* TA1: Fi/Di supported by the card */
+	uint8_t fidi;
+	/* TC1: extra guard time */
+	uint8_t n;
+	/* TC2: waiting time integer */
+	uint8_t wi;
+	/* first protocol offered (TD1), 0 if absent */
+	uint8_t t;
+	/* bit-mask of all protocols offered (1 << T) */
+	uint16_t protocols;
+	/* first TA for T=1: information field size of the card */
+	uint8_t ifsc;
+	/* first TB for T=1: character and block waiting time integers */
+	uint8_t cwi;
+	uint8_t bwi;
+	/* first TC for T=1: CRC instead of LRC as error detection code */
+	bool crc;
+	/* TA2 present: the card is in specific mode and does not accept PPS */
+	bool specific;
+	/* TA2 bit 5: the parameters of the specific mode are implicit, not TA1 */
+	bool implicit;
+};
+
+int iso7816_3_atr_parse(const uint8_t *atr, unsigned int len, struct iso7816_3_atr_params *p);
+uint8_t iso7816_3_select_fidi(uint8_t ta1);
+unsigned int iso7816_3_pps_len(uint8_t pps0);
+unsigned int iso7816_3_pps_request(uint8_t *req, uint8_t t, uint8_t fidi);
+int iso7816_3_pps_check(const uint8_t *req, const uint8_t *resp, unsigned int resp_len);
+unsigned int iso7816_3_t1_edc(uint8_t *edc, const uint8_t *blk, unsigned int len, bool crc);
@@ -115,6 +115,7 @@ extern void mode_cardemu_run(void);
 extern void MITM_run( void );
 
 /*  IRQ functions   */
+extern void CCID_usart0_irq(void);
 extern void Sniffer_usart0_irq(void);
 extern void Sniffer_usart1_irq(void);
 extern void mode_cardemu_usart0_irq(void);
@@ -128,4 +129,7 @@ void TC0_Counter_Reset( void );
 bool mode_cardemu_get_presence_pol(uint8_t instance);
 void mode_cardemu_set_presence_pol(uint8_t instance, bool high);
 
+/* slots behind the mux */
+int mode_cardemu_select_slot(uint8_t slot);
+
 #endif  /*  SIMTRACE_H  */
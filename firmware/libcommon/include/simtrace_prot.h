@@ -84,6 +84,10 @@ enum simtrace_msg_type_sniff {
 	SIMTRACE_MSGT_SNIFF_PPS,
 	/* TPDU data */
 	SIMTRACE_MSGT_SNIFF_TPDU,
+	/* T=1 block data */
+	SIMTRACE_MSGT_SNIFF_BLOCK,
+	/* CLK frequency measured, changed or stopped */
+	SIMTRACE_MSGT_SNIFF_CLK,
 };
 
 /* common message header */
@@ -131,6 +135,14 @@ enum simtrace_capability_generic {
 	SIMTRACE_CAP_ASSERT_CARD_DET,
 	/* Can toggle the hardware reset of an attached modem */
 	SIMTRACE_CAP_ASSERT_MODEM_RST,
+	/* Board info is followed by struct simtrace_board_perf */
+	SIMTRACE_CAP_PERF_INFO,
+	/* Reassembles messages from the host which span several USB buffers,
+	 * up to simtrace_board_perf.max_out_msg_len */
+	SIMTRACE_CAP_OUT_MSG_REASSEMBLY,
+	/* Board info is followed by struct simtrace_board_boot_time, after the
+	 * struct simtrace_board_perf */
+	SIMTRACE_CAP_BOOT_TIME,
 };
 
 /* vendor-specific capabilities of sysmocom devices */
@@ -171,7 +183,41 @@ struct simtrace_board_info {
 	/* number of bytes of vendor capability bit-mask */
 	uint8_t cap_vendor_bytes;
 	uint8_t data[0];
-	/* cap_generic + cap_vendor */
+	/* cap_generic + cap_vendor, bit n of a mask being bit (n % 8) of byte (n / 8),
+	 * followed by struct simtrace_board_perf if SIMTRACE_CAP_PERF_INFO is set,
+	 * and struct simtrace_board_boot_time if SIMTRACE_CAP_BOOT_TIME is set */
+} __attribute__ ((packed));
+
+/* SIMTRACE_CMD_BD_BOARD_INFO: how the firmware handles the messages, so that the
+ * host can choose the sizes of the ones it sends */
+struct simtrace_board_perf {
+	/* largest message accepted from the host */
+	uint16_t max_out_msg_len;
+	/* largest message sent to the host */
+	uint16_t max_in_msg_len;
+	/* receive buffers kept posted on each OUT endpoint */
+	uint8_t num_out_bufs;
+	/* buffers for messages larger than a regular one */
+	uint8_t num_large_bufs;
+} __attribute__ ((packed));
+
+/* SIMTRACE_CMD_BD_BOARD_INFO: ms since the reset at which the firmware reached
+ * each phase of its start-up; 0xffff if not reached (yet) */
+struct simtrace_board_boot_time {
+	/* main() entered */
+	uint16_t main;
+	/* board initialized */
+	uint16_t board;
+	/* USB pull-up enabled */
+	uint16_t usb_init;
+	/* configuration selected by the host */
+	uint16_t usb_configured;
+	/* configuration initialized, ready to answer the reader */
+	uint16_t ready;
+	/* deferred nonessential initialization done */
+	uint16_t deferred;
+	/* benchmark target for ready */
+	uint16_t ready_target;
 } __attribute__ ((packed));
 
 /***********************************************************************
@@ -186,6 +232,8 @@ struct simtrace_board_info {
 #define CEMU_DATA_F_PB_AND_TX	0x00000004
 /* incdicates a PB is present and we should continue with RX */
 #define CEMU_DATA_F_PB_AND_RX	0x00000008
+/* indicates the data is the information field of T=1 I-blocks */
+#define CEMU_DATA_F_T1		0x00000010
 
 /* CEMU_USB_MSGT_DT_CARDINSERT */
 struct cardemu_usb_msg_cardinsert {
@@ -220,6 +268,16 @@ struct cardemu_usb_msg_rx_data {
 #define CEMU_STATUS_F_RCEMU_ACTIVE	0x00000004
 #define CEMU_STATUS_F_CARD_INSERT	0x00000008
 #define CEMU_STATUS_F_RESET_ACTIVE	0x00000010
+/* clk_hz and clk_stops are valid */
+#define CEMU_STATUS_F_CLK_MEASURED	0x00000020
+/* vcc_*_mv, vcc_class and vcc_glitches are valid */
+#define CEMU_STATUS_F_VCC_MEASURED	0x00000040
+
+/* class of VCC, as in ISO7816-3 Section 5.1.3 */
+#define CEMU_VCC_CLASS_NONE	0
+#define CEMU_VCC_CLASS_A	1	/* 5V */
+#define CEMU_VCC_CLASS_B	2	/* 3V */
+#define CEMU_VCC_CLASS_C	3	/* 1.8V */
 
 /* CEMU_USB_MSGT_DO_STATUS */
 struct cardemu_usb_msg_status {
@@ -237,6 +295,18 @@ struct cardemu_usb_msg_status {
 	};
 	uint8_t wi;		/* <! Waiting Integer as defined in ISO7816-3 Section 10.2 */
 	uint32_t waiting_time;	/* <! Waiting Time in etu as defined in ISO7816-3 Section 8.1 */
+	/* measured CLK frequency in Hz, 0 while stopped; not sent by older firmware */
+	uint32_t clk_hz;
+	/* how often the CLK was stopped */
+	uint32_t clk_stops;
+	/* VCC at the ADC over the last window, in mV; not sent by older firmware */
+	uint16_t vcc_min_mv;
+	uint16_t vcc_max_mv;
+	uint16_t vcc_avg_mv;
+	/* CEMU_VCC_CLASS_* */
+	uint8_t vcc_class;
+	/* how often VCC dropped below 90% of its level, without being switched off */
+	uint32_t vcc_glitches;
 } __attribute__ ((packed));
 
 /* CEMU_USB_MSGT_DO_PTS */
@@ -260,6 +330,9 @@ struct cardemu_usb_msg_error {
 
 /* enable/disable the generation of DO_STATUS on IRQ endpoint */
 #define CEMU_FEAT_F_STATUS_IRQ	0x00000001
+/* enable/disable the generation of BD_MODEM_STATUS on IRQ endpoint, on a
+ * change of the modem status */
+#define CEMU_FEAT_F_MODEM_STATUS_IRQ	0x00000002
 
 #define CEMU_CONFIG_PRES_POL_PRES_L 0x00
 #define CEMU_CONFIG_PRES_POL_PRES_H 0x01
@@ -276,6 +349,23 @@ struct cardemu_usb_msg_config {
 	 * When sim is present, set sim_present gpio to low -> 0x02
 	 */
 	uint8_t pres_pol;
+	/* bit-mask of the slots behind the mux to cycle through, time-multiplexed
+	 * between their transactions; 0 to stay with slot_mux_nr */
+	uint8_t slot_sched_mask;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_BD_CEMU_STATS, for the slot of the message header */
+struct cardemu_usb_msg_stats {
+	/* bytes received from / transmitted to the reader */
+	uint32_t rx_bytes;
+	uint32_t tx_bytes;
+	/* commands of the reader: TPDU headers (T=0), or chains of I-blocks (T=1) */
+	uint32_t commands;
+	/* PPS requests of the reader */
+	uint32_t pps;
+	/* time in ms the slot was connected to the UART, and how often */
+	uint32_t connected_ms;
+	uint32_t connections;
 } __attribute__ ((packed));
 
 /***********************************************************************
@@ -306,6 +396,16 @@ struct st_modem_status {
 	uint8_t status_mask;
 	/* bit-field of changed status bits */
 	uint8_t changed_mask;
+	/* only with firmware reporting the changes: */
+	/* time of the report, in ms since the start of the firmware */
+	uint32_t timestamp_ms;
+	/* time of the last edge of ST_MDM_STS_BIT_WWAN_LED and _CARD_INSERTED, in ms
+	 * since the start of the firmware */
+	uint32_t wwan_led_edge_ms;
+	uint32_t card_inserted_edge_ms;
+	/* edges of the WWAN LED since the start, also counting the ones between
+	 * two reports */
+	uint32_t wwan_led_edges;
 } __attribute__((packed));
 
 /***********************************************************************
@@ -318,7 +418,8 @@ struct st_modem_status {
 #define SNIFF_CHANGE_FLAG_RESET_ASSERT (1<<2)
 #define SNIFF_CHANGE_FLAG_RESET_DEASSERT (1<<3)
 #define SNIFF_CHANGE_FLAG_TIMEOUT_WT (1<<4)
-/* SIMTRACE_MSGT_SNIFF_ATR, SIMTRACE_MSGT_SNIFF_PPS, SIMTRACE_MSGT_SNIFF_TPDU flags */
+/* SIMTRACE_MSGT_SNIFF_ATR, SIMTRACE_MSGT_SNIFF_PPS, SIMTRACE_MSGT_SNIFF_TPDU,
+ * SIMTRACE_MSGT_SNIFF_BLOCK flags */
 #define SNIFF_DATA_FLAG_ERROR_INCOMPLETE (1<<5)
 #define SNIFF_DATA_FLAG_ERROR_MALFORMED (1<<6)
 #define SNIFF_DATA_FLAG_ERROR_CHECKSUM (1<<7)
@@ -338,7 +439,16 @@ struct sniff_fidi {
 	uint8_t fidi;
 } __attribute__ ((packed));
 
-/* SIMTRACE_MSGT_SNIFF_ATR, SIMTRACE_MSGT_SNIFF_PPS, SIMTRACE_MSGT_SNIFF_TPDU */
+/* SIMTRACE_MSGT_SNIFF_CLK */
+struct sniff_clk {
+	/* measured CLK frequency in Hz, 0 while stopped */
+	uint32_t hz;
+	/* how often the CLK was stopped */
+	uint32_t stops;
+} __attribute__ ((packed));
+
+/* SIMTRACE_MSGT_SNIFF_ATR, SIMTRACE_MSGT_SNIFF_PPS, SIMTRACE_MSGT_SNIFF_TPDU,
+ * SIMTRACE_MSGT_SNIFF_BLOCK (complete block: NAD, PCB, LEN, INF and EDC) */
 struct sniff_data {
 	/* data flags */
 	uint32_t flags;
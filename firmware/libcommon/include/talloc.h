@@ -18,6 +18,15 @@
 
 /* minimalistic emulation of core talloc API functions used by msgb.c */
 
+/* TODO: this number should dynamically scale. We need at least one per IN/IRQ endpoint,
+ * as well as at least 3 for every OUT endpoint.  Plus some more depending on the application */
+#define NUM_RCTX_SMALL 20
+/* a few larger buffers for messages which don't fit into one USB buffer,
+ * like the ones with the data of extended-length APDUs */
+#ifndef NUM_RCTX_LARGE
+#define NUM_RCTX_LARGE 4
+#endif
+
 #define __TALLOC_STRING_LINE1__(s)    #s
 #define __TALLOC_STRING_LINE2__(s)   __TALLOC_STRING_LINE1__(s)
 #define __TALLOC_STRING_LINE3__  __TALLOC_STRING_LINE2__(__LINE__)
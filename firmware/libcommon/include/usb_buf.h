@@ -15,23 +15,71 @@
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
 
+/* number of receive buffers kept posted on each OUT endpoint.  Only one of
+ * them can be armed in the USB driver at a time, but as soon as it completes,
+ * the next one is armed from the completion interrupt.  Together with the two
+ * ping-pong banks of the UDP, the host is thus only NAKed once all buffers
+ * are waiting to be processed by the main loop. */
+#ifndef USB_OUT_NUM_BUFS
+#define USB_OUT_NUM_BUFS	2
+#endif
+
+/* size of the regular USB buffers, see usb_buf_alloc() */
+#define USB_ALLOC_SIZE		280
+/* messages from the host up to this size fit into one read of an OUT endpoint,
+ * which is a multiple of the (full speed) packet size */
+#define USB_OUT_READ_SIZE	(USB_ALLOC_SIZE - USB_ALLOC_SIZE % 64)
+
+/* size of the USB buffers for messages which don't fit into a regular one,
+ * see usb_buf_alloc_size() */
+#define USB_ALLOC_SIZE_LARGE	1024
+
+/* buffers of the pool which the data queues of the IN endpoints leave free, for
+ * status messages and the receive buffers of the OUT endpoints */
+#ifndef USB_BUF_RESERVE
+#define USB_BUF_RESERVE		4
+#endif
+
+/* status messages queued per IN endpoint.  They supersede each other, so only
+ * the latest ones are kept */
+#define USB_MAX_QLEN_PRIO	4
+
+/* flags of a USB buffer, kept in cb[USB_BUF_CB_FLAGS] of its msgb */
+#define USB_BUF_CB_FLAGS	0
+/* status message, never evicted in favour of data, see usb_buf_set_prio() */
+#define USB_BUF_F_PRIO		(1 << 0)
+
 /* buffered USB endpoint (with queue of msgb) */
 struct usb_buffered_ep {
 	/* endpoint number */
 	uint8_t ep;
 	/* OUT endpoint (1) or IN/IRQ (0)? */
 	uint8_t out_from_host;
-	/* currently any transfer in progress? */
+	/* number of transfers in progress, i.e. handed to the USB driver */
 	volatile uint32_t in_progress;
+	/* OUT: the posted buffer armed in the USB driver, if any */
+	struct msgb * volatile out_armed;
+	/* OUT: posted receive buffers waiting to be armed */
+	struct llist_head out_posted;
+	/* OUT: current length of out_posted */
+	unsigned int out_posted_len;
 	/* Tx queue (IN) / Rx queue (OUT) */
 	struct llist_head queue;
 	/* current length of queue */
 	unsigned int queue_len;
+	/* IN: carries status messages only (interrupt endpoint) */
+	uint8_t status_only;
+	/* IN: data messages evicted from the queue since boot */
+	uint32_t num_evicted;
 };
 
 struct msgb *usb_buf_alloc(uint8_t ep);
+struct msgb *usb_buf_alloc_size(uint8_t ep, uint16_t size);
 void usb_buf_free(struct msgb *msg);
+void usb_buf_set_prio(struct msgb *msg);
 int usb_buf_submit(struct msgb *msg);
+int usb_buf_evict(void);
+unsigned int usb_buf_num_free(void);
 struct llist_head *usb_get_queue(uint8_t ep);
 int usb_drain_queue(uint8_t ep);
 
@@ -40,3 +88,5 @@ struct usb_buffered_ep *usb_get_buf_ep(uint8_t ep);
 
 int usb_refill_to_host(uint8_t ep);
 int usb_refill_from_host(uint8_t ep);
+
+int usb_send_board_info(uint8_t ep, const char *sw_name, uint16_t max_out_msg_len);
@@ -0,0 +1,83 @@
+/* decimation of the VCC samples of the ADC
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* samples per buffer of the PDC, of all channels.  A conversion takes about
+ * 20 us, so a buffer is filled in about 1.3 ms */
+#ifndef VCC_ADC_BUF_SAMPLES
+#define VCC_ADC_BUF_SAMPLES	64
+#endif
+
+/* the min/max/avg are taken over this time, or until the next event */
+#ifndef VCC_ADC_WINDOW_MS
+#define VCC_ADC_WINDOW_MS	100
+#endif
+
+/* thresholds of the voltage at the ADC input, in uV */
+struct vcc_adc_thresh {
+	/* VCC is considered active */
+	uint32_t on_uv;
+	/* lower limit of the class C (1.8V), B (3V) and A (5V); 0 for a class
+	 * which can't be measured */
+	uint32_t class_c_uv;
+	uint32_t class_b_uv;
+	uint32_t class_a_uv;
+};
+
+/* measurement of a window, as passed to card_emu */
+struct vcc_adc_state {
+	/* voltage at the ADC input during the window, in uV */
+	uint32_t min_uv;
+	uint32_t max_uv;
+	uint32_t avg_uv;
+	/* CEMU_VCC_CLASS_* */
+	uint8_t vcc_class;
+	/* VCC dropped below 90% of its level during the window, while staying active */
+	uint32_t glitches;
+	/* at least one window was measured since the channel was (re)started */
+	bool valid;
+};
+
+/* one ADC channel measuring VCC */
+struct vcc_adc_chan {
+	uint8_t adc_ch;
+	const struct vcc_adc_thresh *thresh;
+
+	/* state after the last buffer */
+	bool active;
+	uint8_t vcc_class;
+	uint32_t avg_uv;
+
+	/* private */
+	uint8_t skip;
+	uint8_t class_pending;
+	bool in_dip;
+	bool dip_pending;
+	uint32_t level_uv;
+	uint16_t min, max;
+	uint32_t sum, num;
+	uint32_t glitches;
+	uint32_t window_start;
+	struct vcc_adc_state st;
+	bool new;
+};
+
+void vcc_adc_chan_init(struct vcc_adc_chan *c, uint8_t adc_ch, const struct vcc_adc_thresh *thresh,
+		       uint32_t now_ms);
+void vcc_adc_chan_restart(struct vcc_adc_chan *c, uint32_t now_ms);
+void vcc_adc_process(struct vcc_adc_chan *chans, unsigned int num_chans,
+		     const uint16_t *samples, unsigned int num, uint32_t now_ms);
+bool vcc_adc_get(struct vcc_adc_chan *c, struct vcc_adc_state *st);
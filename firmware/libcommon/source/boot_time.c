@@ -0,0 +1,72 @@
+/* time stamps of the start-up phases of the firmware
+ *
+ * Each phase is marked once, the first time it is reached, in ms since the
+ * reset.  They are printed on the console and reported to the host in the
+ * board information.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "utils.h"
+#include "boot_time.h"
+
+extern volatile uint32_t jiffies;
+
+static struct {
+	/* jiffies at the reset: 0, as the SysTick is started by the low level init */
+	uint32_t start;
+	/* bit-mask of the phases reached */
+	uint32_t reached;
+	uint32_t ms[_NUM_BOOT_P];
+} g_boot;
+
+static const char *phase_names[_NUM_BOOT_P] = {
+	[BOOT_P_MAIN]		= "main",
+	[BOOT_P_BOARD]		= "board",
+	[BOOT_P_USB_INIT]	= "usb_init",
+	[BOOT_P_USB_CONFIGURED]	= "usb_configured",
+	[BOOT_P_READY]		= "ready",
+	[BOOT_P_DEFERRED]	= "deferred",
+};
+
+/* set the time of the reset, if the jiffies don't start with it */
+void boot_time_start(uint32_t now)
+{
+	g_boot.start = now;
+}
+
+void boot_time_mark(enum boot_phase phase)
+{
+	if (phase >= _NUM_BOOT_P || (g_boot.reached & (1 << phase)))
+		return;
+	g_boot.ms[phase] = jiffies - g_boot.start;
+	g_boot.reached |= 1 << phase;
+}
+
+/* ms since the reset at which the phase was reached; -1 if not reached (yet) */
+int boot_time_get(enum boot_phase phase)
+{
+	if (phase >= _NUM_BOOT_P || !(g_boot.reached & (1 << phase)))
+		return -1;
+	return g_boot.ms[phase];
+}
+
+void boot_time_print(void)
+{
+	unsigned int i;
+
+	printf("Boot time:");
+	for (i = 0; i < _NUM_BOOT_P; i++) {
+		if (g_boot.reached & (1 << i))
+			printf(" %s=%lu", phase_names[i], g_boot.ms[i]);
+	}
+	printf(" ms (target ready=%u ms)\n\r", BOOT_TIME_TARGET_MS);
+}
@@ -27,20 +27,27 @@
 #include "simtrace.h"
 #include "simtrace_prot.h"
 #include "usb_buf.h"
+#include "clk_ctr.h"
+#include "vcc_adc.h"
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
 
 #ifdef HAVE_SLOT_MUX
 #include "mux.h"
+#include "slot_sched.h"
 #endif
 
+#ifdef HAVE_SLOT_MUX
+/* one card handle for each slot behind the mux, sharing the UART */
+#define NUM_SLOTS		8
+#else
 #define NUM_SLOTS		2
+#endif
 
 /* bit-mask of supported CEMU_FEAT_F_ flags */
-#define SUPPORTED_FEATURES	(CEMU_FEAT_F_STATUS_IRQ)
+#define SUPPORTED_FEATURES	(CEMU_FEAT_F_STATUS_IRQ | CEMU_FEAT_F_MODEM_STATUS_IRQ)
 
 #define	ISO7816_3_INIT_WTIME	9600
-#define ISO7816_3_DEFAULT_WI	10
 #define ISO7816_3_ATR_LEN_MAX	(1+32)	/* TS plus 32 chars */
 
 #define ISO7816_3_PB_NULL	0x60
@@ -140,6 +147,45 @@ const struct value_string tpdu_state_names[] = {
 #define	_P2	3
 #define	_P3	4
 
+/* T=1 block state machine states */
+enum t1_state {
+	T1_S_WAIT_NAD,		/* waiting for the start of a block from reader */
+	T1_S_IN_BLOCK,		/* receiving a block from reader */
+	T1_S_WAIT_HOST,		/* waiting for the response from the USB host */
+	T1_S_TX,		/* transmitting a block to reader */
+};
+
+const struct value_string t1_state_names[] = {
+	{ T1_S_WAIT_NAD,	"WAIT_NAD" },
+	{ T1_S_IN_BLOCK,	"IN_BLOCK" },
+	{ T1_S_WAIT_HOST,	"WAIT_HOST" },
+	{ T1_S_TX,		"TX" },
+	{ 0, NULL }
+};
+
+/* T=1 block field byte index */
+#define _NAD	0
+#define _PCB	1
+#define _LEN	2
+#define _INF	3
+
+/* T=1 prologue plus the largest information field and EDC */
+#define T1_BLOCK_MAX		(3+254+2)
+
+/* T=1 protocol control byte (ISO 7816-3 Section 11.3.2) */
+#define T1_PCB_I_NS		0x40
+#define T1_PCB_I_MORE		0x20
+#define T1_PCB_R		0x80
+#define T1_PCB_R_NR		0x10
+#define T1_PCB_R_ERR_EDC	0x01
+#define T1_PCB_R_ERR_OTHER	0x02
+#define T1_PCB_S		0xc0
+#define T1_PCB_S_RESP		0x20
+#define T1_PCB_S_RESYNCH	0x00
+#define T1_PCB_S_IFS		0x01
+#define T1_PCB_S_ABORT		0x02
+#define T1_PCB_S_WTX		0x03
+
 struct card_handle {
 	unsigned int num;
 
@@ -153,6 +199,15 @@ struct card_handle {
 	bool in_reset;	/*< if card is in reset (true = RST low/asserted, false = RST high/ released) */
 	bool clocked;	/*< if clock is active ( true = active, false = inactive) */
 
+	/* CLK measured by the hardware driver, and as last reported to the host */
+	struct clk_ctr_state clk;
+	struct clk_ctr_state clk_reported;
+
+	/* last window of VCC measured by the hardware driver, and the glitches
+	 * since the card handle was initialized */
+	struct vcc_adc_state vcc;
+	uint32_t vcc_glitches;
+
 	/* All below variables with _index suffix are indexes from 0..15 into Tables 7 + 8
 	 * of ISO7816-3. */
 
@@ -176,6 +231,12 @@ struct card_handle {
 	 *  \note this depends on Fi, Di, and WI if T=0 is used */
 	uint32_t waiting_time;	/* in etu */
 
+	/*! Protocol in use: T=0 or T=1.
+	 *  \note the first one offered in the ATR, unless another is selected by PPS */
+	uint8_t t;
+	/*! bit-mask of protocols offered in the ATR (1 << T) */
+	uint16_t protocols;
+
 	uint8_t uart_chan;	/* UART channel */
 
 	uint8_t in_ep;		/* USB IN EP */
@@ -203,6 +264,41 @@ struct card_handle {
 		uint8_t hdr[5];		/* CLA INS P1 P2 P3 */
 	} tpdu;
 
+	/* T=1 blocks (ISO 7816-3 Section 11) */
+	struct {
+		enum t1_state state;
+		/* parameters from the ATR: IFSC, CWI, BWI and EDC */
+		uint8_t ifsc;
+		uint8_t cwi;
+		uint8_t bwi;
+		bool crc;
+		/* information field size of the reader, set by S(IFS request) */
+		uint8_t ifsd;
+		/* character and block waiting time, in etu */
+		uint32_t cwt;
+		uint32_t bwt;
+		/* N(S) of the next I-block to send */
+		uint8_t ns;
+		/* N(S) of the next I-block expected from the reader */
+		uint8_t nr;
+		/* NAD to use in blocks sent to the reader */
+		uint8_t nad;
+		/* an S(WTX request) has been sent, and awaits its response */
+		bool wtx_pending;
+		/* block being received from the reader */
+		uint8_t rx[T1_BLOCK_MAX];
+		uint16_t rx_len;
+		/* last I-block sent, kept for retransmission */
+		uint8_t blk[T1_BLOCK_MAX];
+		uint16_t blk_len;
+		/* R- or S-block to send */
+		uint8_t ctl[3+1+2];
+		/* block being transmitted: blk or ctl */
+		const uint8_t *tx;
+		uint16_t tx_len;
+		uint16_t tx_idx;
+	} t1;
+
 	struct msgb *uart_rx_msg;	/* UART RX -> USB TX */
 	struct msgb *uart_tx_msg;	/* USB RX -> UART TX */
 
@@ -211,6 +307,7 @@ struct card_handle {
 	struct {
 		uint32_t tx_bytes;
 		uint32_t rx_bytes;
+		uint32_t commands;
 		uint32_t pps;
 	} stats;
 };
@@ -228,6 +325,27 @@ bool card_emu_ch_ready(const struct card_handle *ch)
 	}
 }
 
+/* if the card emu is not activated, or between two transactions, so that the UART
+ * may serve another slot without the reader noticing */
+bool card_emu_ch_idle(const struct card_handle *ch)
+{
+	if (ch->uart_tx_msg || !llist_empty(&ch->uart_tx_queue))
+		return false;
+
+	switch (ch->state) {
+	case ISO_S_WAIT_POWER:
+	case ISO_S_WAIT_CLK:
+	case ISO_S_WAIT_RST:
+		return true;
+	case ISO_S_WAIT_TPDU:
+		if (ch->t == 1)
+			return ch->t1.state == T1_S_WAIT_NAD;
+		return ch->tpdu.state == TPDU_S_WAIT_CLA;
+	default:
+		return false;
+	}
+}
+
 /* reset all the 'dynamic' state of the card handle to the initial/default values */
 static void card_handle_reset(struct card_handle *ch)
 {
@@ -268,6 +386,7 @@ struct llist_head *card_emu_get_uart_tx_queue(struct card_handle *ch)
 
 static void set_tpdu_state(struct card_handle *ch, enum tpdu_state new_ts);
 static void set_pts_state(struct card_handle *ch, enum pts_state new_ptss);
+static void t1_init(struct card_handle *ch);
 
 /* update simtrace header msg_len and submit USB buffer */
 void usb_buf_upd_len_and_submit(struct msgb *msg)
@@ -288,25 +407,12 @@ struct msgb *usb_buf_alloc_st(uint8_t ep, uint8_t msg_class, uint8_t msg_type)
 	while (!msg) {
 		msg = usb_buf_alloc(ep); // try to allocate some memory
 		if (!msg) { // allocation failed, we might be out of memory
-			struct usb_buffered_ep *bep = usb_get_buf_ep(ep);
-			if (!bep) {
-				TRACE_ERROR("ep %u: %s queue does not exist\n\r",
+			/* drop the oldest queued data, but keep the status messages */
+			if (usb_buf_evict() < 0) {
+				TRACE_ERROR("ep %u: %s EOMEM (no data queued)\n\r",
 				            ep, __func__);
 				return NULL;
 			}
-			if (llist_empty(&bep->queue)) {
-				TRACE_ERROR("ep %u: %s EOMEM (queue already empty)\n\r",
-				            ep, __func__);
-				return NULL;
-			}
-			msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
-			if (!msg) {
-				TRACE_ERROR("ep %u: %s no msg in non-empty queue\n\r",
-				            ep, __func__);
-				return NULL;
-			}
-			usb_buf_free(msg);
-			msg = NULL;
 			TRACE_DEBUG("ep %u: %s queue msg dropped\n\r",
 			            ep, __func__);
 		}
@@ -322,6 +428,22 @@ struct msgb *usb_buf_alloc_st(uint8_t ep, uint8_t msg_class, uint8_t msg_type)
 	return msg;
 }
 
+/* Allocate USB buffer for a message of the card handle */
+static struct msgb *ch_alloc_st(struct card_handle *ch, uint8_t ep, uint8_t msg_type)
+{
+	struct msgb *msg = usb_buf_alloc_st(ep, SIMTRACE_MSGC_CARDEM, msg_type);
+#ifdef HAVE_SLOT_MUX
+	struct simtrace_msg_hdr *sh;
+
+	/* the slots behind the mux share the USB endpoints */
+	if (msg) {
+		sh = (struct simtrace_msg_hdr *) msg->l1h;
+		sh->slot_nr = ch->num;
+	}
+#endif
+	return msg;
+}
+
 /* Update cardemu_usb_msg_rx_data length + submit buffer */
 static void flush_rx_buffer(struct card_handle *ch)
 {
@@ -385,7 +507,7 @@ static void flush_pts(struct card_handle *ch)
 	struct msgb *msg;
 	struct cardemu_usb_msg_pts_info *ptsi;
 
-	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DO_CEMU_PTS);
+	msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_DO_CEMU_PTS);
 	if (!msg)
 		return;
 
@@ -424,11 +546,20 @@ static void emu_update_fidi(struct card_handle *ch)
 static void emu_update_wt(struct card_handle *ch)
 {
 	uint8_t d = 1;
+	uint16_t f = iso7816_3_fi_table[ch->F_index];
 
 	if (ch->D_index >= 1 && ch->D_index <= 9)
 		d = iso7816_3_di_table[ch->D_index];
+	if (f == 0)
+		f = 372;
 
 	ch->waiting_time = ch->wi * 960 * d;
+
+	/* T=1 (ISO 7816-3 Section 11.4.3): CWT = (11 + 2^CWI) etu, and
+	 * BWT = 11 etu + 2^BWI x 960 x Fd / f [seconds], which is
+	 * 11 + 2^BWI x 960 x 372 x D / F [etu] */
+	ch->t1.cwt = 11 + (1 << ch->t1.cwi);
+	ch->t1.bwt = 11 + ((960 * 372 * d / f) << ch->t1.bwi);
 }
 
 /* Update the ISO 7816-3 TPDU receiver state */
@@ -484,6 +615,11 @@ static void card_set_state(struct card_handle *ch,
 		card_emu_uart_interrupt(ch->uart_chan);
 		break;
 	case ISO_S_WAIT_TPDU:
+		if (ch->t == 1) {
+			/* start the block protocol, waiting for the first block */
+			t1_init(ch);
+			break;
+		}
 		/* enable the receiver, disable transmitter */
 		set_tpdu_state(ch, TPDU_S_WAIT_CLA);
 		card_emu_uart_enable(ch->uart_chan, ENABLE_RX);
@@ -520,36 +656,18 @@ static int tx_byte_atr(struct card_handle *ch)
 		card_emu_uart_tx(ch->uart_chan, byte);
 		return 1;
 	} else { /* The ATR has been completely transmitted */
-		/* search for TC2 to updated WI */
-		ch->wi = ISO7816_3_DEFAULT_WI;
-		if (ch->atr.len >= 2 && ch->atr.atr[1] & 0xf0) { /* Y1 has some data */
-			uint8_t atr_td1 = 2;
-			if (ch->atr.atr[1] & 0x10) { /* TA1 is present */
-				atr_td1++;
-			}
-			if (ch->atr.atr[1] & 0x20) { /* TB1 is present */
-				atr_td1++;
-			}
-			if (ch->atr.atr[1] & 0x40) { /* TC1 is present */
-				atr_td1++;
-			}
-			if (ch->atr.atr[1] & 0x80) { /* TD1 is present */
-				if (ch->atr.len > atr_td1 && ch->atr.atr[atr_td1] & 0xf0) { /* Y2 has some data */
-					uint8_t atr_tc2 = atr_td1+1;
-					if (ch->atr.atr[atr_td1] & 0x10) { /* TA2 is present */
-						atr_tc2++;
-					}
-					if (ch->atr.atr[atr_td1] & 0x20) { /* TB2 is present */
-						atr_tc2++;
-					}
-					if (ch->atr.atr[atr_td1] & 0x40) { /* TC2 is present */
-						if (ch->atr.len > atr_tc2 && ch->atr.atr[atr_tc2]) { /* TC2 encodes WI */
-							ch->wi = ch->atr.atr[atr_tc2]; /* set WI */
-						}
-					}
-				}
-			}
-		}
+		struct iso7816_3_atr_params atr;
+
+		/* use WI, the protocol and the T=1 parameters the ATR indicates,
+		 * or the defaults if it is malformed */
+		iso7816_3_atr_parse(ch->atr.atr, ch->atr.len, &atr);
+		ch->wi = atr.wi;
+		ch->t = atr.t;
+		ch->protocols = atr.protocols;
+		ch->t1.ifsc = atr.ifsc;
+		ch->t1.cwi = atr.cwi;
+		ch->t1.bwi = atr.bwi;
+		ch->t1.crc = atr.crc;
 		/* update the waiting time now that WI is known (see emu_update_wt) */
 		emu_update_wt(ch);
 		/* go to next state */
@@ -646,6 +764,15 @@ process_byte_pts(struct card_handle *ch, uint8_t byte)
 			set_pts_state(ch, PTS_S_WAIT_REQ_PTSS);
 			return ISO_S_WAIT_TPDU;
 		}
+		/* only T=0 and T=1 are implemented, and only if offered in the ATR.
+		 * Otherwise don't respond, so that the reader resets the card */
+		if ((ch->pts.req[_PTS0] & 0x0f) > 1 ||
+		    !(ch->protocols & (1 << (ch->pts.req[_PTS0] & 0x0f)))) {
+			TRACE_ERROR("%u: PTS for unsupported protocol T=%u\r\n",
+				    ch->num, ch->pts.req[_PTS0] & 0x0f);
+			set_pts_state(ch, PTS_S_WAIT_REQ_PTSS);
+			return ISO_S_WAIT_TPDU;
+		}
 		/* FIXME: check if proposal matches capabilities in ATR */
 		memcpy(ch->pts.resp, ch->pts.req, sizeof(ch->pts.resp));
 		break;
@@ -715,6 +842,8 @@ static int tx_byte_pts(struct card_handle *ch)
 	switch (ch->pts.state) {
 	case PTS_S_WAIT_RESP_PCK:
 		card_emu_uart_wait_tx_idle(ch->uart_chan);
+		/* switch to the protocol selected by PPS0 */
+		ch->t = ch->pts.resp[_PTS0] & 0x0f;
 		/* update baud rate generator with F/D */
 		emu_update_fidi(ch);
 		/* the waiting time is expressed in etu and scales with D, so it has
@@ -763,8 +892,7 @@ static void add_tpdu_byte(struct card_handle *ch, uint8_t byte)
 
 	/* ensure we have a buffer */
 	if (!ch->uart_rx_msg) {
-		msg = ch->uart_rx_msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM,
-							 SIMTRACE_MSGT_DO_CEMU_RX_DATA);
+		msg = ch->uart_rx_msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_DO_CEMU_RX_DATA);
 		if (!ch->uart_rx_msg) {
 			TRACE_ERROR("%u: Received UART byte but ENOMEM\r\n",
 				    ch->num);
@@ -884,8 +1012,7 @@ static void send_tpdu_header(struct card_handle *ch)
 	}
 	TRACE_DEBUG("%u: allocating new buffer\r\n", ch->num);
 	/* ensure we have a new buffer */
-	ch->uart_rx_msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM,
-					   SIMTRACE_MSGT_DO_CEMU_RX_DATA);
+	ch->uart_rx_msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_DO_CEMU_RX_DATA);
 	if (!ch->uart_rx_msg) {
 		TRACE_ERROR("%u: %s: ENOMEM\r\n", ch->num, __func__);
 		return;
@@ -895,6 +1022,7 @@ static void send_tpdu_header(struct card_handle *ch)
 
 	/* initialize header */
 	rd->flags = CEMU_DATA_F_TPDU_HDR;
+	ch->stats.commands++;
 
 	/* copy TPDU header to data field */
 	cur = msgb_put(msg, sizeof(ch->tpdu.hdr));
@@ -1011,6 +1139,315 @@ static int tx_byte_tpdu(struct card_handle *ch)
 	return 1;
 }
 
+/**********************************************************************
+ * T=1 block handling
+ **********************************************************************/
+
+static void set_t1_state(struct card_handle *ch, enum t1_state new_ts)
+{
+	TRACE_DEBUG("%u: 7816 T=1 state %s -> %s\r\n", ch->num,
+		    get_value_string(t1_state_names, ch->t1.state),
+		    get_value_string(t1_state_names, new_ts));
+	ch->t1.state = new_ts;
+
+	switch (new_ts) {
+	case T1_S_WAIT_NAD:
+		/* switch back to receiving mode, keeping the timer interrupt
+		 * for the character waiting time */
+		card_emu_uart_enable(ch->uart_chan, ENABLE_RX_TIMER);
+		/* disable waiting time since we don't expect any data */
+		card_emu_uart_update_wt(ch->uart_chan, 0);
+		ch->t1.rx_len = 0;
+		break;
+	case T1_S_IN_BLOCK:
+		/* the next character has to follow within CWT */
+		card_emu_uart_update_wt(ch->uart_chan, ch->t1.cwt);
+		break;
+	case T1_S_WAIT_HOST:
+		/* enable the transmitter, so that we can ask for more time by
+		 * an S(WTX request) once half of BWT is reached */
+		card_emu_uart_enable(ch->uart_chan, ENABLE_TX);
+		card_emu_uart_update_wt(ch->uart_chan, ch->t1.bwt);
+		break;
+	case T1_S_TX:
+		/* transmit the block, from the TX IRQ */
+		card_emu_uart_update_wt(ch->uart_chan, 0);
+		card_emu_uart_enable(ch->uart_chan, ENABLE_TX);
+		break;
+	}
+}
+
+/* (re)start the block protocol after ATR or PPS */
+static void t1_init(struct card_handle *ch)
+{
+	ch->t1.ifsd = ISO7816_3_DEFAULT_IFS;
+	ch->t1.ns = 0;
+	ch->t1.nr = 0;
+	ch->t1.nad = 0;
+	ch->t1.wtx_pending = false;
+	ch->t1.blk_len = 0;
+	set_t1_state(ch, T1_S_WAIT_NAD);
+}
+
+/* complete prologue and EDC of a block, returning its total length */
+static uint16_t t1_fill_block(struct card_handle *ch, uint8_t *blk, uint8_t pcb, uint8_t len)
+{
+	blk[_NAD] = ch->t1.nad;
+	blk[_PCB] = pcb;
+	blk[_LEN] = len;
+	return _INF + len + iso7816_3_t1_edc(blk + _INF + len, blk, _INF + len, ch->t1.crc);
+}
+
+static void t1_tx_block(struct card_handle *ch, const uint8_t *blk, uint16_t len)
+{
+	TRACE_DEBUG("%u: T=1 TX block PCB=%02x LEN=%u\r\n", ch->num, blk[_PCB], blk[_LEN]);
+	ch->t1.tx = blk;
+	ch->t1.tx_len = len;
+	ch->t1.tx_idx = 0;
+	set_t1_state(ch, T1_S_TX);
+}
+
+/* send an R-block or S-block with up to one byte of information field */
+static void t1_tx_ctl(struct card_handle *ch, uint8_t pcb, const uint8_t *inf, uint8_t inf_len)
+{
+	if (inf_len)
+		ch->t1.ctl[_INF] = inf[0];
+	t1_tx_block(ch, ch->t1.ctl, t1_fill_block(ch, ch->t1.ctl, pcb, inf_len));
+}
+
+/* acknowledge a chained I-block, or report an invalid block */
+static void t1_tx_r(struct card_handle *ch, uint8_t err)
+{
+	t1_tx_ctl(ch, T1_PCB_R | (ch->t1.nr ? T1_PCB_R_NR : 0) | err, NULL, 0);
+}
+
+/* number of bytes from the USB host pending for transmission to the reader,
+ * and if they are the end of the response */
+static unsigned int t1_tx_pending(struct card_handle *ch, bool *final)
+{
+	struct cardemu_usb_msg_tx_data *td;
+	struct msgb *msg;
+	unsigned int len = 0;
+
+	*final = false;
+	if (ch->uart_tx_msg) {
+		td = (struct cardemu_usb_msg_tx_data *) ch->uart_tx_msg->l2h;
+		len += msgb_length(ch->uart_tx_msg);
+		*final = td->flags & CEMU_DATA_F_FINAL;
+	}
+	llist_for_each_entry(msg, &ch->uart_tx_queue, list) {
+		if (*final)
+			break;
+		td = (struct cardemu_usb_msg_tx_data *) (msg->head + sizeof(struct simtrace_msg_hdr));
+		len += msgb_length(msg) - sizeof(struct simtrace_msg_hdr) - sizeof(*td);
+		*final = td->flags & CEMU_DATA_F_FINAL;
+	}
+
+	return len;
+}
+
+/* send the next I-block of the response from the USB host, once it is
+ * available up to IFSD or up to its end.  Returns if a block is sent */
+static bool t1_tx_iblock(struct card_handle *ch)
+{
+	struct cardemu_usb_msg_tx_data *td;
+	struct msgb *msg;
+	unsigned int pending, len, cpy, off = 0;
+	bool final;
+	uint8_t pcb;
+
+	pending = t1_tx_pending(ch, &final);
+	if (!final && pending <= ch->t1.ifsd)
+		return false;
+	len = OSMO_MIN(pending, ch->t1.ifsd);
+
+	while (off < len) {
+		if (!ch->uart_tx_msg) {
+			msg = msgb_dequeue(&ch->uart_tx_queue);
+			msg->l1h = msg->head;
+			msg->l2h = msg->l1h + sizeof(struct simtrace_msg_hdr);
+			msgb_pull(msg, sizeof(struct simtrace_msg_hdr) + sizeof(*td));
+			ch->uart_tx_msg = msg;
+		}
+		msg = ch->uart_tx_msg;
+		cpy = OSMO_MIN(msgb_length(msg), len - off);
+		memcpy(&ch->t1.blk[_INF + off], msgb_data(msg), cpy);
+		msgb_pull(msg, cpy);
+		off += cpy;
+		if (msgb_length(msg) == 0) {
+			usb_buf_free(msg);
+			ch->uart_tx_msg = NULL;
+		}
+	}
+
+	pcb = ch->t1.ns ? T1_PCB_I_NS : 0;
+	if (pending > len)
+		pcb |= T1_PCB_I_MORE;
+	ch->t1.ns ^= 1;
+	ch->t1.blk_len = t1_fill_block(ch, ch->t1.blk, pcb, len);
+	t1_tx_block(ch, ch->t1.blk, ch->t1.blk_len);
+
+	return true;
+}
+
+/* send the information field of an I-block from the reader to the USB host */
+static void t1_rx_inf(struct card_handle *ch, const uint8_t *inf, uint8_t len, bool more)
+{
+	struct cardemu_usb_msg_rx_data *rd;
+	struct msgb *msg;
+
+	msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_DO_CEMU_RX_DATA);
+	if (!msg) {
+		TRACE_ERROR("%u: %s: ENOMEM\r\n", ch->num, __func__);
+		return;
+	}
+	rd = (struct cardemu_usb_msg_rx_data *) msgb_put(msg, sizeof(*rd));
+	rd->flags = CEMU_DATA_F_T1;
+	if (!more) {
+		rd->flags |= CEMU_DATA_F_FINAL;
+		ch->stats.commands++;
+	}
+	rd->data_len = len;
+	memcpy(msgb_put(msg, len), inf, len);
+
+	usb_buf_upd_len_and_submit(msg);
+}
+
+/* process a completely received block from the reader */
+static void t1_process_block(struct card_handle *ch)
+{
+	const uint8_t *blk = ch->t1.rx;
+	uint8_t pcb = blk[_PCB], len = blk[_LEN];
+	uint8_t edc[2], inf;
+	unsigned int edc_len;
+
+	edc_len = iso7816_3_t1_edc(edc, blk, _INF + len, ch->t1.crc);
+	if (memcmp(edc, blk + _INF + len, edc_len)) {
+		TRACE_ERROR("%u: T=1 block with EDC error\r\n", ch->num);
+		t1_tx_r(ch, T1_PCB_R_ERR_EDC);
+		return;
+	}
+	/* answer with source and destination address swapped */
+	ch->t1.nad = ((blk[_NAD] & 0x07) << 4) | ((blk[_NAD] >> 4) & 0x07);
+
+	if (!(pcb & T1_PCB_R)) {
+		/* I-block */
+		if (!!(pcb & T1_PCB_I_NS) != ch->t1.nr) {
+			TRACE_ERROR("%u: T=1 I-block with unexpected N(S)\r\n", ch->num);
+			t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+			return;
+		}
+		ch->t1.nr ^= 1;
+		/* a new command: the last response has been received */
+		ch->t1.blk_len = 0;
+		t1_rx_inf(ch, blk + _INF, len, pcb & T1_PCB_I_MORE);
+		if (pcb & T1_PCB_I_MORE)
+			t1_tx_r(ch, 0);
+		else
+			set_t1_state(ch, T1_S_WAIT_HOST);
+	} else if ((pcb & T1_PCB_S) == T1_PCB_R) {
+		/* R-block: the reader asks for the next or the last I-block */
+		if (ch->t1.blk_len && !!(pcb & T1_PCB_R_NR) != ch->t1.ns)
+			t1_tx_block(ch, ch->t1.blk, ch->t1.blk_len);
+		else if (ch->t1.blk_len && (ch->t1.blk[_PCB] & T1_PCB_I_MORE)) {
+			/* the chained I-block was received */
+			ch->t1.blk_len = 0;
+			if (!t1_tx_iblock(ch))
+				set_t1_state(ch, T1_S_WAIT_HOST);
+		} else
+			t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+	} else {
+		/* S-block */
+		switch (pcb) {
+		case T1_PCB_S | T1_PCB_S_RESYNCH:
+			ch->t1.ns = ch->t1.nr = 0;
+			ch->t1.ifsd = ISO7816_3_DEFAULT_IFS;
+			ch->t1.blk_len = 0;
+			t1_tx_ctl(ch, pcb | T1_PCB_S_RESP, NULL, 0);
+			break;
+		case T1_PCB_S | T1_PCB_S_IFS:
+			inf = blk[_INF];
+			if (len != 1 || inf < 1 || inf > 254) {
+				t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+				break;
+			}
+			ch->t1.ifsd = inf;
+			t1_tx_ctl(ch, pcb | T1_PCB_S_RESP, &inf, 1);
+			break;
+		case T1_PCB_S | T1_PCB_S_ABORT:
+			ch->t1.blk_len = 0;
+			t1_tx_ctl(ch, pcb | T1_PCB_S_RESP, NULL, 0);
+			break;
+		case T1_PCB_S | T1_PCB_S_RESP | T1_PCB_S_WTX:
+			if (!ch->t1.wtx_pending || len != 1) {
+				t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+				break;
+			}
+			ch->t1.wtx_pending = false;
+			/* send the response if it arrived meanwhile, else wait
+			 * for it during the granted multiple of BWT */
+			if (!t1_tx_iblock(ch)) {
+				set_t1_state(ch, T1_S_WAIT_HOST);
+				if (blk[_INF] > 1)
+					card_emu_uart_update_wt(ch->uart_chan, ch->t1.bwt * blk[_INF]);
+			}
+			break;
+		default:
+			TRACE_ERROR("%u: T=1 unsupported S-block %02x\r\n", ch->num, pcb);
+			t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+			break;
+		}
+	}
+}
+
+static enum iso7816_3_card_state
+process_byte_t1(struct card_handle *ch, uint8_t byte)
+{
+	uint8_t *blk = ch->t1.rx;
+
+	switch (ch->t1.state) {
+	case T1_S_WAIT_NAD:
+	case T1_S_IN_BLOCK:
+		if (ch->t1.state == T1_S_WAIT_NAD)
+			set_t1_state(ch, T1_S_IN_BLOCK);
+		else
+			card_emu_uart_reset_wt(ch->uart_chan);
+		blk[ch->t1.rx_len++] = byte;
+		if (ch->t1.rx_len == _LEN + 1 && (byte > ch->t1.ifsc || byte == 0xff)) {
+			TRACE_ERROR("%u: T=1 block with LEN %u > IFSC\r\n", ch->num, byte);
+			t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+			break;
+		}
+		if (ch->t1.rx_len > _LEN &&
+		    ch->t1.rx_len == _INF + blk[_LEN] + (ch->t1.crc ? 2 : 1))
+			t1_process_block(ch);
+		break;
+	default:
+		TRACE_ERROR("%u: process_byte_t1() in invalid T=1 state %s\r\n", ch->num,
+			    get_value_string(t1_state_names, ch->t1.state));
+		break;
+	}
+
+	/* ensure we stay in TPDU ISO state */
+	return ISO_S_IN_TPDU;
+}
+
+/* tx a single byte of the current T=1 block to the reader */
+static int tx_byte_t1(struct card_handle *ch)
+{
+	if (ch->t1.state != T1_S_TX)
+		return 0;
+
+	if (ch->t1.tx_idx < ch->t1.tx_len) {
+		card_emu_uart_tx(ch->uart_chan, ch->t1.tx[ch->t1.tx_idx++]);
+		return 1;
+	}
+
+	/* the block has been transmitted, wait for the answer of the reader */
+	set_t1_state(ch, T1_S_WAIT_NAD);
+	return 0;
+}
+
 /**********************************************************************
  * Public API
  **********************************************************************/
@@ -1033,7 +1470,10 @@ void card_emu_process_rx_byte(struct card_handle *ch, uint8_t byte)
 		}
 		/* fall-through */
 	case ISO_S_IN_TPDU:
-		new_state = process_byte_tpdu(ch, byte);
+		if (ch->t == 1)
+			new_state = process_byte_t1(ch, byte);
+		else
+			new_state = process_byte_tpdu(ch, byte);
 		break;
 	case ISO_S_IN_PTS:
 		new_state = process_byte_pts(ch, byte);
@@ -1062,7 +1502,10 @@ int card_emu_tx_byte(struct card_handle *ch)
 		rc = tx_byte_pts(ch);
 		break;
 	case ISO_S_IN_TPDU:
-		rc = tx_byte_tpdu(ch);
+		if (ch->t == 1)
+			rc = tx_byte_t1(ch);
+		else
+			rc = tx_byte_tpdu(ch);
 		break;
 	default:
 		break;
@@ -1078,8 +1521,18 @@ int card_emu_tx_byte(struct card_handle *ch)
 
 void card_emu_have_new_uart_tx(struct card_handle *ch)
 {
+	unsigned long x;
+
 	switch (ch->state) {
 	case ISO_S_IN_TPDU:
+		if (ch->t == 1) {
+			/* the UART IRQ may send an S(WTX request) meanwhile */
+			local_irq_save(x);
+			if (ch->t1.state == T1_S_WAIT_HOST)
+				t1_tx_iblock(ch);
+			local_irq_restore(x);
+			break;
+		}
 		switch (ch->tpdu.state) {
 		case TPDU_S_WAIT_TX:
 		case TPDU_S_WAIT_PB:
@@ -1102,7 +1555,7 @@ void card_emu_report_status(struct card_handle *ch, bool report_on_irq)
 	if (report_on_irq)
 		ep = ch->irq_ep;
 
-	msg = usb_buf_alloc_st(ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATUS);
+	msg = ch_alloc_st(ch, ep, SIMTRACE_MSGT_BD_CEMU_STATUS);
 	if (!msg)
 		return;
 
@@ -1115,14 +1568,27 @@ void card_emu_report_status(struct card_handle *ch, bool report_on_irq)
 	if (ch->in_reset)
 		sts->flags |= CEMU_STATUS_F_RESET_ACTIVE;
 #ifdef DETECT_VCC_BY_ADC
-	sts->voltage_mv = card_emu_get_vcc(ch->num);
+	sts->voltage_mv = card_emu_get_vcc(ch->uart_chan);
 #endif
 	/* FIXME: card insert */
 	sts->F_index = ch->F_index;
 	sts->D_index = ch->D_index;
 	sts->wi = ch->wi;
 	sts->waiting_time = ch->waiting_time;
-
+	if (ch->clk.valid)
+		sts->flags |= CEMU_STATUS_F_CLK_MEASURED;
+	sts->clk_hz = ch->clk.hz;
+	sts->clk_stops = ch->clk.stops;
+	ch->clk_reported = ch->clk;
+	if (ch->vcc.valid)
+		sts->flags |= CEMU_STATUS_F_VCC_MEASURED;
+	sts->vcc_min_mv = ch->vcc.min_uv / 1000;
+	sts->vcc_max_mv = ch->vcc.max_uv / 1000;
+	sts->vcc_avg_mv = ch->vcc.avg_uv / 1000;
+	sts->vcc_class = ch->vcc.vcc_class;
+	sts->vcc_glitches = ch->vcc_glitches;
+
+	usb_buf_set_prio(msg);
 	usb_buf_upd_len_and_submit(msg);
 }
 
@@ -1132,7 +1598,7 @@ static void card_emu_report_config(struct card_handle *ch)
 	struct cardemu_usb_msg_config *cfg;
 	uint8_t ep = ch->in_ep;
 
-	msg = usb_buf_alloc_st(ch->in_ep, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
+	msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_BD_CEMU_CONFIG);
 	if (!msg)
 		return;
 
@@ -1140,14 +1606,58 @@ static void card_emu_report_config(struct card_handle *ch)
 	cfg->features = ch->features;
 #ifdef HAVE_SLOT_MUX
 	cfg->slot_mux_nr = mux_get_slot();
+	cfg->slot_sched_mask = slot_sched_get_mask();
 #else
 	cfg->slot_mux_nr = 0;
+	cfg->slot_sched_mask = 0;
 #endif
-	cfg->pres_pol = mode_cardemu_get_presence_pol(ch->num) | CEMU_CONFIG_PRES_POL_VALID;
+	cfg->pres_pol = mode_cardemu_get_presence_pol(ch->uart_chan) | CEMU_CONFIG_PRES_POL_VALID;
 
 	usb_buf_upd_len_and_submit(msg);
 }
 
+void card_emu_report_stats(struct card_handle *ch, uint32_t connected_ms, uint32_t connections)
+{
+	struct msgb *msg;
+	struct cardemu_usb_msg_stats *sts;
+
+	msg = ch_alloc_st(ch, ch->in_ep, SIMTRACE_MSGT_BD_CEMU_STATS);
+	if (!msg)
+		return;
+
+	sts = (struct cardemu_usb_msg_stats *) msgb_put(msg, sizeof(*sts));
+	sts->rx_bytes = ch->stats.rx_bytes;
+	sts->tx_bytes = ch->stats.tx_bytes;
+	sts->commands = ch->stats.commands;
+	sts->pps = ch->stats.pps;
+	sts->connected_ms = connected_ms;
+	sts->connections = connections;
+
+	usb_buf_upd_len_and_submit(msg);
+}
+
+/* the UART is connected to the card handle again, after having served other
+ * slots: restore its transmission parameters */
+void card_emu_resume(struct card_handle *ch)
+{
+	emu_update_fidi(ch);
+
+	switch (ch->state) {
+	case ISO_S_WAIT_TPDU:
+		card_emu_uart_update_wt(ch->uart_chan, 0);
+		if (ch->t == 1)
+			card_emu_uart_enable(ch->uart_chan, ENABLE_RX_TIMER);
+		else
+			card_emu_uart_enable(ch->uart_chan, ENABLE_RX);
+		break;
+	default:
+		/* only left without power, or in reset */
+		card_emu_uart_update_wt(ch->uart_chan, 0);
+		card_emu_uart_enable(ch->uart_chan, 0);
+		break;
+	}
+}
+
 /* hardware driver informs us that a card I/O signal has changed */
 void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 {
@@ -1163,7 +1673,7 @@ void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 		} else if (active == 1 && ch->vcc_active == 0) {
 #ifdef DETECT_VCC_BY_ADC
 			TRACE_INFO("%u: VCC activated (%d mV)\r\n", ch->num,
-				   card_emu_get_vcc(ch->num));
+				   card_emu_get_vcc(ch->uart_chan));
 #else
 			TRACE_INFO("%u: VCC activated\r\n", ch->num);
 #endif
@@ -1222,6 +1732,35 @@ void card_emu_io_statechg(struct card_handle *ch, enum card_io io, int active)
 		card_emu_report_status(ch, true);
 }
 
+/* hardware driver informs us about a new measurement of the CLK frequency */
+void card_emu_clk_measured(struct card_handle *ch, const struct clk_ctr_state *clk)
+{
+	if (clk->valid && clk->stops != ch->clk.stops)
+		TRACE_INFO("%u: CLK stopped\r\n", ch->num);
+	ch->clk = *clk;
+
+	/* notify the host about a stopped, restarted or changed clock */
+	if ((ch->features & CEMU_FEAT_F_STATUS_IRQ) && clk_ctr_changed(&ch->clk, &ch->clk_reported))
+		card_emu_report_status(ch, true);
+}
+
+/* hardware driver informs us about a new measurement of VCC */
+void card_emu_vcc_measured(struct card_handle *ch, const struct vcc_adc_state *vcc)
+{
+	bool event = vcc->glitches || vcc->vcc_class != ch->vcc.vcc_class;
+
+	if (vcc->glitches)
+		TRACE_INFO("%u: VCC glitch (%u mV min)\r\n", ch->num, (unsigned int) (vcc->min_uv / 1000));
+	if (vcc->vcc_class != ch->vcc.vcc_class)
+		TRACE_INFO("%u: VCC class %u\r\n", ch->num, vcc->vcc_class);
+	ch->vcc = *vcc;
+	ch->vcc_glitches += vcc->glitches;
+
+	/* notify the host about a new class or a glitch */
+	if ((ch->features & CEMU_FEAT_F_STATUS_IRQ) && event)
+		card_emu_report_status(ch, true);
+}
+
 /* User sets a new ATR to be returned during next card reset */
 int card_emu_set_atr(struct card_handle *ch, const uint8_t *atr, uint8_t len)
 {
@@ -1252,6 +1791,16 @@ void card_emu_wtime_half_expired(void *handle)
 	/* transmit NULL procedure byte well before waiting time expires */
 	switch (ch->state) {
 	case ISO_S_IN_TPDU:
+		if (ch->t == 1) {
+			/* T=1 has no NULL byte, but lets the card ask for another BWT */
+			if (ch->t1.state == T1_S_WAIT_HOST) {
+				const uint8_t mult = 1;
+
+				ch->t1.wtx_pending = true;
+				t1_tx_ctl(ch, T1_PCB_S | T1_PCB_S_WTX, &mult, 1);
+			}
+			break;
+		}
 		switch (ch->tpdu.state) {
 		case TPDU_S_WAIT_PB:
 		case TPDU_S_WAIT_TX:
@@ -1279,6 +1828,14 @@ void card_emu_wtime_expired(void *handle)
 		/* ISO 7816-3 6.2.1 time tc has passed, we can now send the ATR */
 		card_set_state(ch, ISO_S_IN_ATR);
 		break;
+	case ISO_S_IN_TPDU:
+		if (ch->t == 1 && ch->t1.state == T1_S_IN_BLOCK) {
+			/* CWT exceeded: the block is invalid (ISO 7816-3 Section 11.6.3) */
+			TRACE_ERROR("%u: T=1 CWT expired\r\n", ch->num);
+			t1_tx_r(ch, T1_PCB_R_ERR_OTHER);
+			break;
+		}
+		/* fall-through */
 	default:
 		TRACE_ERROR("%u: wtime_exp\r\n", ch->num);
 		break;
@@ -1305,6 +1862,12 @@ static const uint8_t default_atr[] = { 0x3B, 0x80, 0x80, 0x81 , 0x1F, 0xC7, 0x59
 
 static struct card_handle card_handles[NUM_SLOTS];
 
+/* whether the host enabled an optional feature (CEMU_FEAT_F_*) */
+bool card_emu_feature_enabled(const struct card_handle *ch, uint32_t feature)
+{
+	return (ch->features & feature) == feature;
+}
+
 int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_config *scfg,
 			unsigned int scfg_len)
 {
@@ -1312,16 +1875,25 @@ int card_emu_set_config(struct card_handle *ch, const struct cardemu_usb_msg_con
 		ch->features = (scfg->features & SUPPORTED_FEATURES);
 
 #ifdef HAVE_SLOT_MUX
-	if (scfg_len >= sizeof(uint32_t)+sizeof(uint8_t)) {
-		mux_set_slot(scfg->slot_mux_nr);
+	/* while slots are scheduled, the scheduler connects them: only a config
+	 * setting the schedule as well may select the slot */
+	if (scfg_len >= sizeof(uint32_t)+sizeof(uint8_t) &&
+	    (!slot_sched_get_mask() ||
+	     scfg_len >= sizeof(uint32_t)+sizeof(uint8_t)+sizeof(uint8_t)+sizeof(uint8_t))) {
+		mode_cardemu_select_slot(scfg->slot_mux_nr);
 	}
 #endif
 
 	if (scfg_len >= sizeof(uint32_t)+sizeof(uint8_t)+sizeof(uint8_t)) {
 		if (scfg->pres_pol & CEMU_CONFIG_PRES_POL_VALID)
-			mode_cardemu_set_presence_pol(ch->num, scfg->pres_pol & CEMU_CONFIG_PRES_POL_PRES_H);
+			mode_cardemu_set_presence_pol(ch->uart_chan, scfg->pres_pol & CEMU_CONFIG_PRES_POL_PRES_H);
 	}
 
+#ifdef HAVE_SLOT_MUX
+	if (scfg_len >= sizeof(uint32_t)+sizeof(uint8_t)+sizeof(uint8_t)+sizeof(uint8_t))
+		slot_sched_set_mask(scfg->slot_sched_mask);
+#endif
+
 	/* send back a report of our current configuration */
 	card_emu_report_config(ch);
 
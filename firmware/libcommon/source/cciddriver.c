@@ -53,6 +53,9 @@
 #include <USBDescriptors.h>
 //#include <usb/device/dfu/dfu.h>
 #include <cciddriverdescriptors.h>
+#include "iso7816_fidi.h"
+
+#include <string.h>
 
 // FIXME: Remove DFU related stuff 
 /* no DFU bootloader is being used */
@@ -101,6 +104,17 @@ typedef struct {
 	/// Bit 4 = Slot 2 current state
 	/// Bit 5 = Slot 2 changed status
 	unsigned char          SlotStatus;
+	/// A command has been received and waits to be dispatched
+	volatile unsigned char bCommandPending;
+	/// A TPDU is being exchanged with the card
+	unsigned char          bXfrBusy;
+	/// The response is being sent to the host
+	volatile unsigned char bResponseBusy;
+	/// TPDU being exchanged, as the command buffer receives the next command
+	unsigned char          abXfrCommand[ABDATA_SIZE];
+	/// ATR of the card, and its length
+	unsigned char          abAtr[ATR_SIZE_MAX];
+	unsigned char          bAtrLength;
 
 } CCIDDriver;
 
@@ -159,38 +173,72 @@ static void RDRtoPCSlotStatus( void )
 }
 
 //------------------------------------------------------------------------------
-/// Response Pipe, Bulk-IN Messages
-/// Answer to PC_to_RDR_IccPowerOn
+/// Reset the card and read its ATR, then select the transmission parameters:
+/// by a PPS exchange unless the card is in specific mode, and on failure of
+/// the PPS by starting over with the default parameters.
+/// \param fidi Fi/Di to select, or 0 for the fastest the card supports
+/// \return 0 on success, status of US_CSR otherwise
 //------------------------------------------------------------------------------
-static void RDRtoPCDatablock_ATR( void )
+static uint32_t CCIDActivate( uint8_t fidi )
 {
-	unsigned char i;
-	unsigned char Atr[ATR_SIZE_MAX];
-	unsigned char length;
-	uint32_t status; 
+	struct iso7816_3_atr_params atr;
+	uint32_t status;
+	int rc;
 
-	TRACE_DEBUG(".");
-
-	status = ISO7816_Datablock_ATR( Atr, &length );
-	ISO7816_Decode_ATR( Atr );
+	ISO7816_SetFiDi( ISO7816_3_DEFAULT_FIDI );
+	ISO7816_SetWaitingTime( 960 * ISO7816_3_DEFAULT_WI );
+	ISO7816_warm_reset();
 
-	if (status == 0) {
-		TRACE_DEBUG("Timeout occured while reading ATR");
-// FIXME: react properly to timeout..
-//        return;
+	status = ISO7816_Datablock_ATR( ccidDriver.abAtr, &ccidDriver.bAtrLength );
+	if (status != 0) {
+		return status;
+	}
+	if (iso7816_3_atr_parse( ccidDriver.abAtr, ccidDriver.bAtrLength, &atr ) < 0) {
+		TRACE_WARNING("Invalid ATR, using default parameters\n\r");
+		fidi = ISO7816_3_DEFAULT_FIDI;
+	}
+	else if (atr.specific) {
+		// No PPS in specific mode: the parameters of TA1 apply, unless implicit
+		fidi = atr.implicit ? ISO7816_3_DEFAULT_FIDI : atr.fidi;
+	}
+	else if (fidi == 0) {
+		fidi = iso7816_3_select_fidi( atr.fidi );
 	}
 
-// FIXME: More tests? Is bProtocol = Atr[3] ?
-	if( length > 5 ) {
-		ccidDriver.ProtocolDataStructure[1] = Atr[3]&0x0F; // TD(1)
-		ccidDriver.bProtocol = Atr[3]&0x0F;           // TD(1)
-		TRACE_INFO("Protocol data structure: 0x%x\n\r",
-					    ccidDriver.ProtocolDataStructure[1]);
+	if (atr.specific) {
+		if (ISO7816_SetFiDi( fidi ) < 0) {
+			TRACE_WARNING("Fi/Di 0x%02X of specific mode not supported\n\r", fidi);
+			fidi = ISO7816_3_DEFAULT_FIDI;
+			ISO7816_SetFiDi( fidi );
+		}
+	}
+	else if (fidi != ISO7816_3_DEFAULT_FIDI) {
+		rc = ISO7816_PPS( atr.t, fidi );
+		if (rc < 0) {
+			// The card may not even listen anymore: reset it again
+			TRACE_WARNING("PPS for Fi/Di 0x%02X failed\n\r", fidi);
+			fidi = ISO7816_3_DEFAULT_FIDI;
+			ISO7816_SetFiDi( fidi );
+			ISO7816_warm_reset();
+			status = ISO7816_Datablock_ATR( ccidDriver.abAtr, &ccidDriver.bAtrLength );
+			if (status != 0) {
+				return status;
+			}
+		}
+		else {
+			fidi = rc;
+		}
 	}
 
+	// WT = WI x 960 x Fi / f, which is WI x 960 x Di in etu
+	ISO7816_SetWaitingTime( 960 * atr.wi * iso7816_3_di_table[fidi & 0x0F] );
+
 	// S_ccid_protocol_t0
-	// bmFindexDindex
-	ccidDriver.ProtocolDataStructure[0] = Atr[2];     // TA(1)
+	// bmFindexDindex: as in use after the PPS
+	ccidDriver.ProtocolDataStructure[0] = fidi;
+	ccidDriver.ProtocolDataStructure[1] = atr.t;
+	ccidDriver.bProtocol = atr.t;
+	TRACE_INFO("Protocol T=%u, Fi/Di 0x%02X\n\r", atr.t, fidi);
 
 	// bmTCCKST0
 	// For T=0 ,B0 - 0b, B7-2 - 000000b
@@ -199,12 +247,12 @@ static void RDRtoPCDatablock_ATR( void )
 	// bGuardTimeT0
 	// Extra Guardtime between two characters. Add 0 to 254 etu to the normal 
 	// guardtime of 12etu. FFh is the same as 00h.
-	ccidDriver.ProtocolDataStructure[2] = Atr[4];     // TC(1)
+	ccidDriver.ProtocolDataStructure[2] = atr.n;      // TC(1)
 	// AT91C_BASE_US0->US_TTGR = 0;  // TC1
 
 	// bWaitingIntegerT0
 	// WI for T=0 used to define WWT
-	ccidDriver.ProtocolDataStructure[3] = Atr[7];     // TC(2)
+	ccidDriver.ProtocolDataStructure[3] = atr.wi;     // TC(2)
 
 	// bClockStop
 	// ICC Clock Stop Support
@@ -214,16 +262,43 @@ static void RDRtoPCDatablock_ATR( void )
 	// 03 = Stop with Clock either High or Low
 	ccidDriver.ProtocolDataStructure[4] = 0x00;       // 0 to 3
 
+	return 0;
+}
+
+//------------------------------------------------------------------------------
+/// Response Pipe, Bulk-IN Messages
+/// Answer to PC_to_RDR_IccPowerOn
+//------------------------------------------------------------------------------
+static void RDRtoPCDatablock_ATR( void )
+{
+	unsigned char i;
+	uint32_t status; 
+
+	TRACE_DEBUG(".");
+
+	status = CCIDActivate( 0 );
+
 	// Header fields settings
 	ccidDriver.sCcidMessage.bMessageType = RDR_TO_PC_DATABLOCK;
-	ccidDriver.sCcidMessage.wLength      = length;  // Size of ATR
-	ccidDriver.sCcidMessage.bSizeToSend += length;  // Size of ATR
 	// bChainParameter: 00 the response APDU begins and ends in this command
 	ccidDriver.sCcidMessage.bSpecific    = 0;
 
-	for( i=0; i<length; i++ ) {
+	if (status != 0) {
+		TRACE_DEBUG("Timeout occured while reading ATR");
+		ccidDriver.sCcidMessage.wLength = 0;
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED | ICC_BS_PRESENT_NOTACTIVATED;
+		ccidDriver.sCcidMessage.bError = ICC_MUTE;
+		return;
+	}
 
-		ccidDriver.sCcidMessage.abData[i]  = Atr[i];
+	ISO7816_Decode_ATR( ccidDriver.abAtr );
+
+	ccidDriver.sCcidMessage.wLength      = ccidDriver.bAtrLength;  // Size of ATR
+	ccidDriver.sCcidMessage.bSizeToSend += ccidDriver.bAtrLength;  // Size of ATR
+
+	for( i=0; i<ccidDriver.bAtrLength; i++ ) {
+
+		ccidDriver.sCcidMessage.abData[i]  = ccidDriver.abAtr[i];
 	}
 
 	// Set the slot to an active status
@@ -342,9 +417,17 @@ static void RDRtoPCDataRateAndClockFrequency( unsigned int dwClockFrequency,
 
 	ccidDriver.sCcidMessage.bSpecific = 0;  // bRFU
 
+	ccidDriver.sCcidMessage.bSizeToSend += ccidDriver.sCcidMessage.wLength;
+
 	ccidDriver.sCcidMessage.abData[0] = dwClockFrequency;
-	
+	ccidDriver.sCcidMessage.abData[1] = dwClockFrequency >> 8;
+	ccidDriver.sCcidMessage.abData[2] = dwClockFrequency >> 16;
+	ccidDriver.sCcidMessage.abData[3] = dwClockFrequency >> 24;
+
 	ccidDriver.sCcidMessage.abData[4] = dwDataRate;
+	ccidDriver.sCcidMessage.abData[5] = dwDataRate >> 8;
+	ccidDriver.sCcidMessage.abData[6] = dwDataRate >> 16;
+	ccidDriver.sCcidMessage.abData[7] = dwDataRate >> 24;
 }
 
 //------------------------------------------------------------------------------
@@ -418,14 +501,46 @@ static void PCtoRDRGetSlotStatus( void )
 	RDRtoPCSlotStatus();
 }
 
+//------------------------------------------------------------------------------
+/// Response Pipe, Bulk-IN Messages
+/// Answer to PC_to_RDR_XfrBlock, once the TPDU has been exchanged with the card
+//------------------------------------------------------------------------------
+static void RDRtoPCXfrBlockDone( uint32_t ret, uint16_t msglen )
+{
+	if (ret != 0) {
+		TRACE_ERROR("APDU could not be sent: (US_CSR = 0x%x)", ret);
+		msglen = 0;
+	}
+
+	ccidDriver.sCcidMessage.wLength = msglen;
+	TRACE_DEBUG("USB: 0x%X, 0x%X, 0x%X, 0x%X, 0x%X\n\r", ccidDriver.sCcidMessage.abData[0], 
+					                                                ccidDriver.sCcidMessage.abData[1], 
+					                                                ccidDriver.sCcidMessage.abData[2], 
+					                                                ccidDriver.sCcidMessage.abData[3],
+					                                                ccidDriver.sCcidMessage.abData[4] );
+	RDRtoPCDatablock();
+
+	if (ret == ISO7816_T0_ERR_ABORTED) {
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED;
+		ccidDriver.sCcidMessage.bError = CMD_ABORTED;
+	} else if (ret == US_CSR_TIMEOUT) {
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED;
+		ccidDriver.sCcidMessage.bError = ICC_MUTE;
+	} else if (ret != 0) {
+		ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED;
+		ccidDriver.sCcidMessage.bError = (ret & US_CSR_OVRE) ? XFR_OVERRUN : XFR_PARITY_ERROR;
+	}
+}
+
 //------------------------------------------------------------------------------
 /// Command Pipe, Bulk-OUT Messages
 /// If the command header is valid, an APDU command is received and can be read
-/// by the application
+/// by the application.
+/// \return 1 if the response is to be sent now, 0 if it is sent once the TPDU
+/// has been exchanged with the card
 //------------------------------------------------------------------------------
-static void PCtoRDRXfrBlock( void )
+static unsigned char PCtoRDRXfrBlock( void )
 {
-	uint16_t msglen = 0;
 	uint32_t ret;
 
 	TRACE_DEBUG("PCtoRDRXfrBlock\n\r");
@@ -451,15 +566,19 @@ static void PCtoRDRXfrBlock( void )
 				if (ccidDriver.ProtocolDataStructure[1] == PROTOCOL_TO) {
 					TRACE_DEBUG("APDU cmd: %x %x %x ..", ccidDriver.sCcidCommand.APDU[0], ccidDriver.sCcidCommand.APDU[1],ccidDriver.sCcidCommand.APDU[2] );
 
-					// Send commande APDU
-					ret = ISO7816_XfrBlockTPDU_T0( ccidDriver.sCcidCommand.APDU ,
+					// Send commande APDU, the response is sent from
+					// CCID_SmartCardRequest() once the card has answered
+					memcpy(ccidDriver.abXfrCommand, ccidDriver.sCcidCommand.APDU,
+					       ccidDriver.sCcidCommand.wLength);
+					ret = ISO7816_XfrBlockTPDU_T0_Start( ccidDriver.abXfrCommand,
 					                        ccidDriver.sCcidMessage.abData,
-					                        ccidDriver.sCcidCommand.wLength,
-					                        &msglen );
-					if (ret != 0) {
-					    TRACE_ERROR("APDU could not be sent: (US_CSR = 0x%x)", ret);
-					    return;
+					                        ccidDriver.sCcidCommand.wLength );
+					if (ret == 0) {
+					    ccidDriver.bXfrBusy = 1;
+					    return 0;
 					}
+					RDRtoPCXfrBlockDone(ret, 0);
+					return 1;
 				}
 				else {
 					if (ccidDriver.ProtocolDataStructure[1] == PROTOCOL_T1) {
@@ -481,14 +600,9 @@ static void PCtoRDRXfrBlock( void )
 
 	}
 
-	ccidDriver.sCcidMessage.wLength = msglen;
-	TRACE_DEBUG("USB: 0x%X, 0x%X, 0x%X, 0x%X, 0x%X\n\r", ccidDriver.sCcidMessage.abData[0], 
-					                                                ccidDriver.sCcidMessage.abData[1], 
-					                                                ccidDriver.sCcidMessage.abData[2], 
-					                                                ccidDriver.sCcidMessage.abData[3],
-					                                                ccidDriver.sCcidMessage.abData[4] );
-	 RDRtoPCDatablock();
-
+	ccidDriver.sCcidMessage.wLength = 0;
+	RDRtoPCDatablock();
+	return 1;
 }
 
 //------------------------------------------------------------------------------
@@ -534,12 +648,31 @@ static void PCtoRDRResetParameters( void )
 //------------------------------------------------------------------------------
 static void PCtoRDRSetParameters( void )
 {
+	uint8_t fidi = ccidDriver.sCcidCommand.APDU[0];     // bmFindexDindex
+
 	TRACE_DEBUG(".");
 
 	ccidDriver.SlotStatus = ccidDriver.sCcidCommand.bSlot;
 	ccidDriver.sCcidMessage.bStatus = ccidDriver.SlotStatus;
 	// Not all feature supported
 
+	// Other Fi/Di than the ones in use take another PPS exchange, and thus
+	// the card to be reset
+	if (fidi != ccidDriver.ProtocolDataStructure[0]) {
+		if (iso7816_3_compute_fd_ratio( fidi >> 4, fidi & 0x0F ) < 0) {
+			RDRtoPCParameters();
+			ccidDriver.sCcidMessage.bStatus |= ICC_CS_FAILED;
+			ccidDriver.sCcidMessage.bError = 10;    // offset of bmFindexDindex
+			return;
+		}
+		if (CCIDActivate( fidi ) != 0) {
+			RDRtoPCParameters();
+			ccidDriver.sCcidMessage.bStatus = ICC_CS_FAILED | ICC_BS_PRESENT_NOTACTIVATED;
+			ccidDriver.sCcidMessage.bError = ICC_MUTE;
+			return;
+		}
+	}
+
 	RDRtoPCParameters();
 }
 
@@ -653,8 +786,8 @@ static void PCtoRDRAbort( void )
 //------------------------------------------------------------------------------
 static void PCtoRDRSetDataRateAndClockFrequency( void )
 {
-	unsigned int dwClockFrequency;
-	unsigned int dwDataRate;
+	uint32_t dwClockFrequency;
+	uint32_t dwDataRate;
 
 	TRACE_DEBUG(".");
 
@@ -668,7 +801,14 @@ static void PCtoRDRSetDataRateAndClockFrequency( void )
 			   + (ccidDriver.sCcidCommand.APDU[6]<<16)
 			   + (ccidDriver.sCcidCommand.APDU[7]<<24);
 
-	ISO7816_SetDataRateandClockFrequency( dwClockFrequency, dwDataRate );
+	// Not beyond f(max) of the Fi in use
+	if (dwClockFrequency > iso7816_3_fmax_table[ccidDriver.ProtocolDataStructure[0] >> 4]) {
+		dwClockFrequency = iso7816_3_fmax_table[ccidDriver.ProtocolDataStructure[0] >> 4];
+	}
+
+	// The F/D ratio is given by Fi/Di: the data rate follows the clock
+	dwDataRate = 0;
+	ISO7816_SetDataRateandClockFrequency( &dwClockFrequency, &dwDataRate );
 
 	RDRtoPCDataRateAndClockFrequency( dwClockFrequency, dwDataRate );
 
@@ -698,14 +838,21 @@ static void vCCIDCommandNotSupported( void )
 //------------------------------------------------------------------------------
 /// Sent CCID response on USB
 //------------------------------------------------------------------------------
+static void vCCIDResponseSent( void *pArg, uint8_t status, uint32_t transferred, uint32_t remaining )
+{
+	ccidDriver.bResponseBusy = 0;
+}
+
 static void vCCIDSendResponse( void )
 {
 	unsigned char bStatus;
 	TRACE_DEBUG(".");
 
+	ccidDriver.bResponseBusy = 1;
 	do {
 		bStatus = CCID_Write((void*)&ccidDriver.sCcidMessage,
-					          ccidDriver.sCcidMessage.bSizeToSend, 0, 0 );
+					          ccidDriver.sCcidMessage.bSizeToSend,
+					          (TransferCallback) &vCCIDResponseSent, 0 );
 	} while (bStatus != USBD_STATUS_SUCCESS);
 
 	TRACE_DEBUG("bStatus: 0x%x\n\r", bStatus);
@@ -715,14 +862,10 @@ static void vCCIDSendResponse( void )
 //------------------------------------------------------------------------------
 ///  Description: CCID Command dispatcher
 //------------------------------------------------------------------------------
-static void CCIDCommandDispatcher( void *pArg, uint8_t status, uint32_t transferred, uint32_t remaining )
+static void CCIDCommandDispatcher( void )
 {
 	unsigned char MessageToSend = 0;
 
-	if (status != USBD_STATUS_SUCCESS) {
-		TRACE_ERROR("USB error: %d", status);
-		return;
-	}
 	TRACE_DEBUG("Command: 0x%X 0x%x 0x%X 0x%X 0x%X 0x%X 0x%X\n\r\n\r",
 				   (unsigned int)ccidDriver.sCcidCommand.bMessageType,
 				   (unsigned int)ccidDriver.sCcidCommand.wLength,
@@ -767,8 +910,7 @@ static void CCIDCommandDispatcher( void *pArg, uint8_t status, uint32_t transfer
 			break;
 
 		case PC_TO_RDR_XFRBLOCK:
-			PCtoRDRXfrBlock();
-			MessageToSend = 1;
+			MessageToSend = PCtoRDRXfrBlock();
 			break;
 
 		case PC_TO_RDR_GETPARAMETERS:
@@ -847,6 +989,20 @@ static void CCIDCommandDispatcher( void *pArg, uint8_t status, uint32_t transfer
 }
 
 
+//------------------------------------------------------------------------------
+///  Description: Bulk-OUT completion, the command is dispatched from the main
+///  loop by CCID_SmartCardRequest(), so that the exchange with the card does
+///  not block the USB interrupt
+//------------------------------------------------------------------------------
+static void CCIDCommandReceived( void *pArg, uint8_t status, uint32_t transferred, uint32_t remaining )
+{
+	if (status != USBD_STATUS_SUCCESS) {
+		TRACE_ERROR("USB error: %d", status);
+		return;
+	}
+	ccidDriver.bCommandPending = 1;
+}
+
 //------------------------------------------------------------------------------
 /// SETUP request handler for a CCID device
 /// \param pRequest Pointer to a USBGenericRequest instance
@@ -863,6 +1019,8 @@ static void CCID_RequestHandler(const USBGenericRequest *pRequest)
 
 			case CCIDGenericRequest_ABORT:
 				TRACE_DEBUG("CCIDGenericRequest_ABORT\n\r");
+				if (ccidDriver.bXfrBusy)
+					ISO7816_XfrBlockTPDU_T0_Abort();
 				break;
 
 			case CCIDGenericRequest_GET_CLOCK_FREQUENCIES:
@@ -920,17 +1078,32 @@ void USBDCallbacks_RequestReceived(const USBGenericRequest *request)
 //------------------------------------------------------------------------------
 void CCID_SmartCardRequest( void )
 {
-	unsigned char bStatus;
+	uint32_t ret;
+	uint16_t msglen;
+
 	TRACE_DEBUG("CCID_req\n\r");
 
-	do {
+	// Answer the TPDU once the card is done with it
+	if (ccidDriver.bXfrBusy && ISO7816_XfrBlockTPDU_T0_Done(&ret, &msglen)) {
+		ccidDriver.bXfrBusy = 0;
+		RDRtoPCXfrBlockDone(ret, msglen);
+		vCCIDSendResponse();
+	}
+
+	// The next command may already have been received during the exchange,
+	// it is dispatched once the response to the previous one is out
+	if (ccidDriver.bCommandPending && !ccidDriver.bXfrBusy && !ccidDriver.bResponseBusy) {
+		ccidDriver.bCommandPending = 0;
+		CCIDCommandDispatcher();
+	}
 
-		bStatus = CCID_Read( (void*)&ccidDriver.sCcidCommand,
-					         sizeof(S_ccid_bulk_out_header),
-					         (TransferCallback)&CCIDCommandDispatcher,
-					         (void*)0 );
+	// Receive the next command (USBD_Read() does nothing while a read is pending)
+	if (!ccidDriver.bCommandPending) {
+		CCID_Read( (void*)&ccidDriver.sCcidCommand,
+			   sizeof(S_ccid_bulk_out_header),
+			   (TransferCallback)&CCIDCommandReceived,
+			   (void*)0 );
 	}
-	while (0);
 }
 
 
@@ -0,0 +1,228 @@
+/* measurement of the SIM clock frequency, in the background
+ *
+ * Channel 1 of the TC block 0 counts the cycles of the CLK of a slot, which is
+ * connected to TCLK0 or TCLK2 like for the ETU timers.  The count is compared
+ * with the MCK cycles counted by the SysTick during the same gate time.  Several
+ * inputs are measured in turn, one gate time each.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>
+
+#include "board.h"
+#include "utils.h"
+#include "clk_ctr.h"
+
+extern volatile uint32_t jiffies;
+
+/* channel 0 and 2 of TC block 0 are the ETU timers, TC block 1 runs the I2C */
+#define CTR_TC		(&TC0->TC_CHANNEL[1])
+
+#define GATE_MCK	(CLK_CTR_GATE_MS * (BOARD_MCK / 1000))
+
+struct clk_ctr_input {
+	uint8_t tclk;
+	struct clk_ctr_state st;
+	/* a gate time was measured since the last clk_ctr_get() */
+	bool new;
+};
+
+static struct {
+	struct clk_ctr_input in[2];
+	unsigned int num;
+	/* input being measured, and since when in MCK cycles */
+	unsigned int cur;
+	uint32_t start;
+	/* overflows of the 16 bit counter since the start */
+	volatile uint32_t ovf;
+} g_ctr;
+
+void TC1_IrqHandler(void)
+{
+	if (CTR_TC->TC_SR & TC_SR_COVFS)
+		g_ctr.ovf++;
+}
+
+/* MCK cycles since the SysTick was started, modulo 2^32.  Called with the
+ * interrupts disabled */
+static uint32_t mck_now(void)
+{
+	uint32_t ms = jiffies;
+	uint32_t val = SysTick->VAL;
+
+	if (SCB->ICSR & SCB_ICSR_PENDSTSET_Msk) {
+		/* the SysTick wrapped, jiffies is not yet incremented */
+		ms++;
+		val = SysTick->VAL;
+	}
+	return ms * (SysTick->LOAD + 1) + SysTick->LOAD - val;
+}
+
+/* CLK cycles counted since the start of the gate time.  Called with the
+ * interrupts disabled */
+static uint32_t ctr_clocks(void)
+{
+	uint32_t cv = CTR_TC->TC_CV;
+	uint32_t ovf = g_ctr.ovf;
+
+	if (NVIC_GetPendingIRQ(TC1_IRQn)) {
+		/* the counter overflowed, but the interrupt didn't count it yet */
+		cv = CTR_TC->TC_CV;
+		ovf++;
+	}
+	return (ovf << 16) | cv;
+}
+
+/* start the gate time of an input.  Called with the interrupts disabled */
+static void ctr_start(unsigned int i)
+{
+	CTR_TC->TC_CCR = TC_CCR_CLKDIS;
+	if (g_ctr.in[i].tclk == CLK_CTR_TCLK0)
+		CTR_TC->TC_CMR = TC_CMR_TCCLKS_XC0;
+	else
+		CTR_TC->TC_CMR = TC_CMR_TCCLKS_XC2;
+	/* drop an overflow of the previous gate time */
+	CTR_TC->TC_SR;
+	NVIC_ClearPendingIRQ(TC1_IRQn);
+	g_ctr.ovf = 0;
+
+	CTR_TC->TC_CCR = TC_CCR_CLKEN | TC_CCR_SWTRG;
+	g_ctr.cur = i;
+	g_ctr.start = mck_now();
+}
+
+static struct clk_ctr_input *get_input(uint8_t tclk)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_ctr.num; i++) {
+		if (g_ctr.in[i].tclk == tclk)
+			return &g_ctr.in[i];
+	}
+	return NULL;
+}
+
+/* called if a configuration measuring the clock is activated */
+void clk_ctr_init(void)
+{
+	memset(&g_ctr, 0, sizeof(g_ctr));
+
+	PMC_EnablePeripheral(ID_TC1);
+	TC0->TC_BMR &= ~(TC_BMR_TC0XC0S_Msk | TC_BMR_TC2XC2S_Msk);
+	TC0->TC_BMR |= TC_BMR_TC0XC0S_TCLK0 | TC_BMR_TC2XC2S_TCLK2;
+
+	CTR_TC->TC_CCR = TC_CCR_CLKDIS;
+	CTR_TC->TC_IDR = 0xffffffff;
+	CTR_TC->TC_IER = TC_IER_COVFS;
+	NVIC_SetPriority(TC1_IRQn, 15);
+	NVIC_EnableIRQ(TC1_IRQn);
+}
+
+void clk_ctr_exit(void)
+{
+	NVIC_DisableIRQ(TC1_IRQn);
+	CTR_TC->TC_CCR = TC_CCR_CLKDIS;
+	CTR_TC->TC_IDR = 0xffffffff;
+	g_ctr.num = 0;
+}
+
+/*! Measure the clock on another input.
+ *  \param[in] tclk CLK_CTR_TCLK0 or CLK_CTR_TCLK2
+ *  \returns 0 on success; negative on error */
+int clk_ctr_add(uint8_t tclk)
+{
+	unsigned long flags;
+
+	if (tclk != CLK_CTR_TCLK0 && tclk != CLK_CTR_TCLK2)
+		return -1;
+	if (get_input(tclk))
+		return 0;
+	if (g_ctr.num >= ARRAY_SIZE(g_ctr.in))
+		return -1;
+
+	local_irq_save(flags);
+	memset(&g_ctr.in[g_ctr.num], 0, sizeof(g_ctr.in[0]));
+	g_ctr.in[g_ctr.num].tclk = tclk;
+	if (g_ctr.num++ == 0)
+		ctr_start(0);
+	local_irq_restore(flags);
+
+	return 0;
+}
+
+/* another clock is connected to the input (slot mux): forget the measurement,
+ * and don't count the cycles of the previous clock */
+void clk_ctr_restart(uint8_t tclk)
+{
+	struct clk_ctr_input *in = get_input(tclk);
+	unsigned long flags;
+
+	if (!in)
+		return;
+
+	local_irq_save(flags);
+	in->st.hz = 0;
+	in->st.valid = false;
+	in->new = false;
+	if (in == &g_ctr.in[g_ctr.cur])
+		ctr_start(g_ctr.cur);
+	local_irq_restore(flags);
+}
+
+/* called from the main loop: end the gate time once it is over, and start the
+ * one of the next input */
+void clk_ctr_poll(void)
+{
+	struct clk_ctr_input *in;
+	uint32_t now, elapsed, clocks;
+	unsigned long flags;
+
+	if (!g_ctr.num)
+		return;
+
+	local_irq_save(flags);
+	now = mck_now();
+	elapsed = now - g_ctr.start;
+	if (elapsed < GATE_MCK) {
+		local_irq_restore(flags);
+		return;
+	}
+	clocks = ctr_clocks();
+	in = &g_ctr.in[g_ctr.cur];
+	ctr_start((g_ctr.cur + 1) % g_ctr.num);
+	local_irq_restore(flags);
+
+	if (in->st.valid && in->st.hz && !clocks)
+		in->st.stops++;
+	in->st.hz = (uint64_t) clocks * BOARD_MCK / elapsed;
+	in->st.valid = true;
+	in->new = true;
+}
+
+/*! Get the last measurement of an input.
+ *  \param[in] tclk input, as passed to clk_ctr_add()
+ *  \param[out] st last measurement
+ *  \returns whether a gate time was measured since the last call */
+bool clk_ctr_get(uint8_t tclk, struct clk_ctr_state *st)
+{
+	struct clk_ctr_input *in = get_input(tclk);
+	bool new;
+
+	if (!in) {
+		memset(st, 0, sizeof(*st));
+		return false;
+	}
+
+	*st = in->st;
+	new = in->new;
+	in->new = false;
+	return new;
+}
@@ -11,6 +11,7 @@
  * GNU General Public License for more details.
  */
 #include <stdio.h>
+#include <string.h>
 #include "uart_console.h"
 
 int fputc(int c, FILE *stream)
@@ -21,8 +22,7 @@ int fputc(int c, FILE *stream)
 
 int fputs(const char *s, FILE *stream)
 {
-	while (*s != '\0')
-		fputc(*s++, stream);
+	UART_PutBuffer((const uint8_t *) s, strlen(s));
 	return 0;
 }
 
@@ -11,12 +11,17 @@
  * GNU General Public License for more details.
  */
 #include "board.h"
+#include "boot_time.h"
 #include "llist_irqsafe.h"
+#include "simtrace_prot.h"
+#include "talloc.h"
 #include "usb_buf.h"
 #include "utils.h"
+#include "USBD_HAL.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/utils.h>
 #include <errno.h>
 
 /***********************************************************************
@@ -104,6 +109,8 @@ int usb_refill_to_host(uint8_t ep)
 	return 1;
 }
 
+static void usb_arm_next_read(struct usb_buffered_ep *bep);
+
 /* call-back after (successful?) read transfer of a buffer on OUT EP */
 static void usb_read_cb(uint8_t *arg, uint8_t status, uint32_t transferred,
 			uint32_t remaining)
@@ -114,7 +121,8 @@ static void usb_read_cb(uint8_t *arg, uint8_t status, uint32_t transferred,
 	TRACE_DEBUG("%s (EP=%u, len=%lu, q=%p)\r\n", __func__,
 			bep->ep, transferred, &bep->queue);
 
-	bep->in_progress = 0;
+	bep->in_progress--;
+	bep->out_armed = NULL;
 
 	if (status != USBD_STATUS_SUCCESS) {
 		TRACE_ERROR("%s error, status=%d\r\n", __func__, status);
@@ -123,15 +131,63 @@ static void usb_read_cb(uint8_t *arg, uint8_t status, uint32_t transferred,
 	}
 	msgb_put(msg, transferred);
 	llist_add_tail_irqsafe(&msg->list, &bep->queue);
+
+	/* don't wait for the main loop: arm the next posted buffer right away,
+	 * so the host isn't NAKed while the main loop processes this one */
+	usb_arm_next_read(bep);
+}
+
+/* hand the next posted receive buffer (if any) to the USB driver.  Called
+ * from the main loop as well as from the read completion interrupt */
+static void usb_arm_next_read(struct usb_buffered_ep *bep)
+{
+	struct msgb *msg;
+	unsigned long x;
+	uint32_t len;
+	uint16_t ep_size;
+	int rc;
+
+	local_irq_save(x);
+	if (bep->out_armed || llist_empty(&bep->out_posted)) {
+		local_irq_restore(x);
+		return;
+	}
+	msg = llist_entry(bep->out_posted.next, struct msgb, list);
+	llist_del(&msg->list);
+	bep->out_posted_len--;
+	bep->out_armed = msg;
+	bep->in_progress++;
+	local_irq_restore(x);
+
+	/* only read whole packets: the part of a packet which doesn't fit into the
+	 * buffer would be lost, instead of being received into the next buffer */
+	len = msgb_tailroom(msg);
+	ep_size = USBD_GetEndpointSize(bep->ep);
+	if (ep_size && len > ep_size)
+		len -= len % ep_size;
+
+	rc = USBD_Read(bep->ep, msg->head, len,
+			(TransferCallback) &usb_read_cb, msg);
+	if (rc != USBD_STATUS_SUCCESS) {
+		TRACE_ERROR("%s error %d\r\n", __func__, rc);
+		/* keep it posted, we retry on the next refill */
+		local_irq_save(x);
+		llist_add(&msg->list, &bep->out_posted);
+		bep->out_posted_len++;
+		bep->out_armed = NULL;
+		bep->in_progress--;
+		local_irq_restore(x);
+	}
 }
 
-/* refill the read queue for data received from host PC on OUT EP, if needed */
+/* refill the posted receive buffers for data from host PC on OUT EP, if needed */
 int usb_refill_from_host(uint8_t ep)
 {
 	struct usb_buffered_ep *bep = usb_get_buf_ep(ep);
 	struct msgb *msg;
 	unsigned long x;
-	int rc;
+	uint32_t num;
+	int ret = 0;
 
 #if 0
 	if (!bep->out_from_host) {
@@ -140,28 +196,35 @@ int usb_refill_from_host(uint8_t ep)
 	}
 #endif
 
-	if (bep->in_progress)
-		return 0;
-
-	TRACE_DEBUG("%s (EP=0x%02x)\r\n", __func__, bep->ep);
+	while (1) {
+		/* the read completion moves a buffer from posted to armed */
+		local_irq_save(x);
+		num = bep->out_posted_len + bep->in_progress;
+		local_irq_restore(x);
+		if (num >= USB_OUT_NUM_BUFS)
+			break;
 
-	msg = usb_buf_alloc(bep->ep);
-	if (!msg)
-		return -ENOMEM;
-	msg->dst = bep;
-	msg->l1h = msg->head;
+		TRACE_DEBUG("%s (EP=0x%02x)\r\n", __func__, bep->ep);
 
-	bep->in_progress = 1;
+		msg = usb_buf_alloc(bep->ep);
+		if (!msg) {
+			if (!ret)
+				ret = -ENOMEM;
+			break;
+		}
+		msg->dst = bep;
+		msg->l1h = msg->head;
 
-	rc = USBD_Read(ep, msg->head, msgb_tailroom(msg),
-			(TransferCallback) &usb_read_cb, msg);
-	if (rc != USBD_STATUS_SUCCESS) {
-		TRACE_ERROR("%s error %d\r\n", __func__, rc);
-		usb_buf_free(msg);
-		bep->in_progress = 0;
+		local_irq_save(x);
+		llist_add_tail(&msg->list, &bep->out_posted);
+		bep->out_posted_len++;
+		local_irq_restore(x);
+		ret++;
 	}
 
-	return 1;
+	usb_arm_next_read(bep);
+
+	return ret;
 }
 
 /* drain any buffers from the queue of the endpoint and release their memory */
@@ -172,6 +235,24 @@ int usb_drain_queue(uint8_t ep)
 	unsigned long x;
 	int ret = 0;
 
+	if (bep->out_from_host) {
+		/* the host may never send the data the armed buffer waits for:
+		 * cancel it, usb_read_cb() releases it */
+		local_irq_save(x);
+		if (bep->out_armed)
+			USBD_HAL_CancelIo(1 << bep->ep);
+		msg = bep->out_armed;
+		if (msg) {
+			/* the driver had already dropped the transfer, e.g. on
+			 * an endpoint reset, without calling back */
+			bep->out_armed = NULL;
+			bep->in_progress--;
+			usb_buf_free(msg);
+			ret++;
+		}
+		local_irq_restore(x);
+	}
+
 	/* wait until no transfers are in progress anymore and block
 	 * further interrupts */
 	while (1) {
@@ -188,9 +269,99 @@ int usb_drain_queue(uint8_t ep)
 		usb_buf_free(msg);
 		ret++;
 	}
+	while ((msg = msgb_dequeue_count(&bep->out_posted, &bep->out_posted_len))) {
+		usb_buf_free(msg);
+		ret++;
+	}
 
 	/* re-enable interrupts and return number of free'd msgbs */
 	local_irq_restore(x);
 
 	return ret;
 }
+
+/***********************************************************************
+ * Board information
+ ***********************************************************************/
+
+#if defined(ENVIRONMENT_dfu)
+/* patched into the image by misc/crctool; word 2 is the CRC the stub checks at boot */
+extern volatile uint32_t crcstub_dummy_table[];
+#endif
+
+/* time of the phase for the board information, saturated to 16 bit */
+static uint16_t boot_time_ms(enum boot_phase phase)
+{
+	int ms = boot_time_get(phase);
+
+	if (ms < 0 || ms > 0xffff)
+		return 0xffff;
+	return ms;
+}
+
+static void cap_set(uint8_t *mask, unsigned int cap)
+{
+	mask[cap / 8] |= 1 << (cap % 8);
+}
+
+/* answer SIMTRACE_CMD_BD_BOARD_INFO on the given IN endpoint.  sw_name is the
+ * name of the application, max_out_msg_len the size up to which it accepts
+ * messages from the host */
+int usb_send_board_info(uint8_t ep, const char *sw_name, uint16_t max_out_msg_len)
+{
+	struct simtrace_msg_hdr *sh;
+	struct simtrace_board_info *bi;
+	struct simtrace_board_perf *perf;
+	struct simtrace_board_boot_time *boot;
+	uint8_t *cap;
+	struct msgb *msg;
+
+	msg = usb_buf_alloc(ep);
+	if (!msg)
+		return -ENOMEM;
+
+	msg->l1h = msgb_put(msg, sizeof(*sh));
+	sh = (struct simtrace_msg_hdr *) msg->l1h;
+	memset(sh, 0, sizeof(*sh));
+	sh->msg_class = SIMTRACE_MSGC_GENERIC;
+	sh->msg_type = SIMTRACE_CMD_BD_BOARD_INFO;
+
+	msg->l2h = msgb_put(msg, sizeof(*bi));
+	bi = (struct simtrace_board_info *) msg->l2h;
+	memset(bi, 0, sizeof(*bi));
+	osmo_strlcpy(bi->hardware.model, BOARD, sizeof(bi->hardware.model));
+	osmo_strlcpy(bi->software.provider, "osmocom", sizeof(bi->software.provider));
+	osmo_strlcpy(bi->software.name, sw_name, sizeof(bi->software.name));
+	osmo_strlcpy(bi->software.version, GIT_VERSION, sizeof(bi->software.version));
+#if defined(ENVIRONMENT_dfu)
+	/* lets the host tell whether the image it is about to flash is already running */
+	bi->software.crc = crcstub_dummy_table[2];
+#endif
+	bi->cap_generic_bytes = (SIMTRACE_CAP_BOOT_TIME + 8) / 8;
+	bi->cap_vendor_bytes = 0;
+
+	cap = msgb_put(msg, bi->cap_generic_bytes);
+	memset(cap, 0, bi->cap_generic_bytes);
+	cap_set(cap, SIMTRACE_CAP_PERF_INFO);
+	cap_set(cap, SIMTRACE_CAP_BOOT_TIME);
+	if (max_out_msg_len > USB_OUT_READ_SIZE)
+		cap_set(cap, SIMTRACE_CAP_OUT_MSG_REASSEMBLY);
+
+	perf = (struct simtrace_board_perf *) msgb_put(msg, sizeof(*perf));
+	perf->max_out_msg_len = max_out_msg_len;
+	perf->max_in_msg_len = USB_ALLOC_SIZE;
+	perf->num_out_bufs = USB_OUT_NUM_BUFS;
+	perf->num_large_bufs = NUM_RCTX_LARGE;
+
+	boot = (struct simtrace_board_boot_time *) msgb_put(msg, sizeof(*boot));
+	boot->main = boot_time_ms(BOOT_P_MAIN);
+	boot->board = boot_time_ms(BOOT_P_BOARD);
+	boot->usb_init = boot_time_ms(BOOT_P_USB_INIT);
+	boot->usb_configured = boot_time_ms(BOOT_P_USB_CONFIGURED);
+	boot->ready = boot_time_ms(BOOT_P_READY);
+	boot->deferred = boot_time_ms(BOOT_P_DEFERRED);
+	boot->ready_target = BOOT_TIME_TARGET_MS;
+
+	sh->msg_len = msgb_length(msg);
+	return usb_buf_submit(msg);
+}
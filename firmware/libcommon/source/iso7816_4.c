@@ -44,6 +44,10 @@
  *------------------------------------------------------------------------------*/
 
 #include "board.h"
+#include "iso7816_fidi.h"
+
+#include <errno.h>
+#include <string.h>
 
 /*------------------------------------------------------------------------------
  *         Definitions
@@ -63,6 +67,9 @@
 /** Pin reset master card */
 static Pin *st_pinIso7816RstMC;
 
+/** Clock divisor (CD of US_BRGR) of the ICC clock, when generated by us */
+static uint32_t st_clockDivisor;
+
 struct Usart_info usart_sim = {.base = USART_SIM, .id = ID_USART_SIM, .state = USART_RCV};
 
 /*----------------------------------------------------------------------------
@@ -72,7 +79,7 @@ struct Usart_info usart_sim = {.base = USART_SIM, .id = ID_USART_SIM, .state = U
 /**
  * Get a character from ISO7816
  * \param pCharToReceive Pointer for store the received char
- * \return 0: if timeout else status of US_CSR
+ * \return status of US_CSR, US_CSR_TIMEOUT if no char has been received
  */
 uint32_t ISO7816_GetChar( uint8_t *pCharToReceive, Usart_info *usart)
 {
@@ -93,7 +100,7 @@ uint32_t ISO7816_GetChar( uint8_t *pCharToReceive, Usart_info *usart)
 	WDT_Restart(WDT);
 		if(timeout++ > 12000 * (BOARD_MCK/1000000)) {
 			TRACE_WARNING("TimeOut\n\r");
-			return( 0 );
+			return( US_CSR_TIMEOUT );
 		}
 	}
 
@@ -198,169 +205,367 @@ void ISO7816_IccPowerOff( void )
 	}
 }
 
-/**
- * Transfert Block      TPDU T=0
- * \param pAPDU         APDU buffer
- * \param pMessage      Message buffer
- * \param wLength       Block length
- * \param indexMsg      Message index
- * \return              0 on success, content of US_CSR otherwise
- */
-uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
-					                    uint8_t *pMessage,
-					                    uint16_t wLength,
-					                    uint16_t *retlen )
+/*----------------------------------------------------------------------------
+ *          Non-blocking T=0 TPDU engine
+ *----------------------------------------------------------------------------*/
+
+/* The TPDU is exchanged from the USART interrupt: the header and data sent
+ * to the card, as well as data received from it after an INS procedure byte,
+ * are moved by the PDC, while procedure bytes and status words are handled
+ * one by one.  The waiting time is supervised by the receiver time-out, which
+ * is restarted with every received character (see section 33.7.3.11
+ * "Receiver Time-out" of the SAM3S8 Data Sheet).  The main loop polls for the
+ * completion with ISO7816_XfrBlockTPDU_T0_Done(). */
+
+enum t0_state {
+	T0_S_IDLE,
+	/* header or data are sent by the PDC, waiting for ENDTX */
+	T0_S_TX,
+	/* last character is being sent, waiting for TXEMPTY */
+	T0_S_TX_DRAIN,
+	/* waiting for a procedure byte */
+	T0_S_WAIT_PB,
+	/* data are received by the PDC, waiting for ENDRX */
+	T0_S_RX,
+	/* waiting for a single data byte (after INS ^ 0xFF) */
+	T0_S_RX_ONE,
+	/* waiting for SW2 */
+	T0_S_WAIT_SW2,
+	T0_S_DONE,
+};
+
+/* errors of the interface character, as reported in US_CSR */
+#define T0_CSR_ERRORS	(US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE | US_CSR_NACK | US_CSR_ITER)
+
+static struct {
+	volatile enum t0_state state;
+	/* TPDU header, with P3=0 for case 1 */
+	uint8_t hdr[5];
+	/* command data still to be sent */
+	const uint8_t *data;
+	/* response buffer and its current length */
+	uint8_t *resp;
+	uint16_t resp_len;
+	/* number of data bytes still to be exchanged */
+	uint16_t remaining;
+	/* data are received from (case 2) or sent to (case 3) the card */
+	bool rx;
+	/* number of bytes handed to the PDC for the current transfer */
+	uint16_t pdc_len;
+	/* state after the current transmission */
+	enum t0_state next;
+	/* waiting time in etu, and what is left of it */
+	uint32_t wt;
+	uint32_t wt_remaining;
+	uint16_t rcr;
+	/* result */
+	uint32_t status;
+} t0 = {
+	.wt = 9600,
+};
+
+static void t0_finish(uint32_t status)
 {
-	uint16_t NeNc;
-	uint16_t indexApdu = 4;
-	uint16_t indexMsg = 0;
-	uint8_t SW1 = 0;
-	uint8_t procByte;
-	uint8_t cmdCase;
-	uint32_t status = 0;
+	Usart *us_base = usart_sim.base;
 
-	TRACE_INFO("pAPDU[0]=0x%X\n\r",pAPDU[0]);
-	TRACE_INFO("pAPDU[1]=0x%X\n\r",pAPDU[1]);
-	TRACE_INFO("pAPDU[2]=0x%X\n\r",pAPDU[2]);
-	TRACE_INFO("pAPDU[3]=0x%X\n\r",pAPDU[3]);
-	TRACE_INFO("pAPDU[4]=0x%X\n\r",pAPDU[4]);
-	TRACE_INFO("pAPDU[5]=0x%X\n\r",pAPDU[5]);
-	TRACE_INFO("wlength=%d\n\r",wLength);
+	us_base->US_PTCR = US_PTCR_RXTDIS | US_PTCR_TXTDIS;
+	USART_DisableIt(us_base, (uint32_t) -1);
+	us_base->US_CR = US_CR_STTTO;
+	t0.status = status;
+	t0.state = T0_S_DONE;
+}
 
-	ISO7816_SendChar( pAPDU[0], &usart_sim ); /* CLA */
-	ISO7816_SendChar( pAPDU[1], &usart_sim ); /* INS */
-	ISO7816_SendChar( pAPDU[2], &usart_sim ); /* P1 */
-	ISO7816_SendChar( pAPDU[3], &usart_sim ); /* P2 */
-	ISO7816_SendChar( pAPDU[4], &usart_sim ); /* P3 */
+/* (re)start counting the waiting time */
+static void t0_restart_wt(Usart *us_base)
+{
+	t0.wt_remaining = t0.wt;
+	us_base->US_RTOR = t0.wt > 0xffff ? 0xffff : t0.wt;
+	us_base->US_CR = US_CR_RETTO;
+}
 
-	/* Handle the four structures of command APDU */
-	indexApdu = 5;
+/* send len bytes with the PDC, then continue in state next */
+static void t0_send(const uint8_t *buf, uint16_t len, enum t0_state next)
+{
+	Usart *us_base = usart_sim.base;
 
-	if( wLength == 4 ) {
-		cmdCase = CASE1;
-		NeNc = 0;
-	}
-	else if( wLength == 5) {
-		cmdCase = CASE2;
-		NeNc = pAPDU[4]; /* C5 */
-		if (NeNc == 0) {
-			NeNc = 256;
-		}
-	}
-	else if( wLength == 6) {
-		NeNc = pAPDU[4]; /* C5 */
-		cmdCase = CASE3;
-	}
-	else if( wLength == 7) {
-		NeNc = pAPDU[4]; /* C5 */
-		if( NeNc == 0 ) {
-			cmdCase = CASE2;
-			NeNc = (pAPDU[5]<<8)+pAPDU[6];
+	USART_DisableIt(us_base, US_IDR_RXRDY | US_IDR_TIMEOUT | US_IDR_ENDRX);
+	if (usart_sim.state == USART_RCV) {
+		us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
+		usart_sim.state = USART_SEND;
+	}
+	us_base->US_TPR = (uint32_t) buf;
+	us_base->US_TCR = len;
+	t0.pdc_len = len;
+	t0.next = next;
+	t0.state = T0_S_TX;
+	us_base->US_PTCR = US_PTCR_TXTEN;
+	USART_EnableIt(us_base, US_IER_ENDTX);
+}
+
+/* switch to reception, once the last character has left the shift register */
+static void t0_start_rx(enum t0_state state)
+{
+	Usart *us_base = usart_sim.base;
+
+	if (usart_sim.state == USART_SEND) {
+		us_base->US_RHR;
+		us_base->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
+		usart_sim.state = USART_RCV;
+	}
+	t0.state = state;
+	t0_restart_wt(us_base);
+	if (state == T0_S_RX) {
+		us_base->US_RPR = (uint32_t) (t0.resp + t0.resp_len);
+		us_base->US_RCR = t0.remaining;
+		t0.rcr = t0.remaining;
+		t0.pdc_len = t0.remaining;
+		us_base->US_PTCR = US_PTCR_RXTEN;
+		USART_EnableIt(us_base, US_IER_ENDRX | US_IER_TIMEOUT);
+	} else
+		USART_EnableIt(us_base, US_IER_RXRDY | US_IER_TIMEOUT);
+}
+
+static void t0_proc_byte(uint8_t byte)
+{
+	uint8_t ins = t0.hdr[1];
+
+	if (byte == ISO_NULL_VAL) {
+		/* the card asks for more time, the waiting time has been
+		 * restarted with the reception of this character */
+	} else if ((byte & 0xF0) == 0x60 || (byte & 0xF0) == 0x90) {
+		/* SW1 */
+		t0.resp[t0.resp_len++] = byte;
+		t0.state = T0_S_WAIT_SW2;
+	} else if (byte == ins && t0.remaining) {
+		/* all remaining data */
+		if (t0.rx) {
+			USART_DisableIt(usart_sim.base, US_IDR_RXRDY);
+			t0_start_rx(T0_S_RX);
+		} else {
+			t0_send(t0.data, t0.remaining, T0_S_WAIT_PB);
+			t0.data += t0.remaining;
+			t0.remaining = 0;
 		}
+	} else if (byte == (ins ^ 0xFF) && t0.remaining) {
+		/* a single data byte */
+		if (t0.rx)
+			t0.state = T0_S_RX_ONE;
 		else {
-			cmdCase = CASE3;
+			t0_send(t0.data++, 1, T0_S_WAIT_PB);
+			t0.remaining--;
 		}
+	} else {
+		TRACE_INFO("procByte=0x%X\n\r", byte);
+		t0_finish(ISO7816_T0_ERR_PROC_BYTE);
 	}
-	else {
-		NeNc = pAPDU[4]; /* C5 */
-		if( NeNc == 0 ) {
-			cmdCase = CASE3;
-			NeNc = (pAPDU[5]<<8)+pAPDU[6];
-		}
-		else {
-			cmdCase = CASE3;
-		}
+}
+
+/* the receiver time-out expired: either the waiting time is over, or the next
+ * part of it is to be counted */
+static void t0_timeout(Usart *us_base)
+{
+	uint16_t rto = us_base->US_RTOR & 0xffff;
+
+	us_base->US_CR = US_CR_STTTO;
+
+	/* characters were received by the PDC since the time-out was started */
+	if (t0.state == T0_S_RX && us_base->US_RCR != t0.rcr) {
+		t0.rcr = us_base->US_RCR;
+		t0_restart_wt(us_base);
+		return;
 	}
 
-	TRACE_DEBUG("CASE=0x%X NeNc=0x%X\n\r", cmdCase, NeNc);
+	if (t0.wt_remaining <= rto) {
+		TRACE_WARNING("TimeOut\n\r");
+		t0_finish(US_CSR_TIMEOUT);
+		return;
+	}
+	t0.wt_remaining -= rto;
+	us_base->US_RTOR = t0.wt_remaining > 0xffff ? 0xffff : t0.wt_remaining;
+	us_base->US_CR = US_CR_RETTO;
+}
 
-	/* Handle Procedure Bytes */
-	do {
-		status = ISO7816_GetChar(&procByte, &usart_sim);
-		if (status != 0) {
-			return status;
-		}
-		TRACE_INFO("procByte: 0x%X\n\r", procByte);
-		/* Handle NULL */
-		if ( procByte == ISO_NULL_VAL ) {
-			TRACE_INFO("INS\n\r");
-			continue;
-		}
-		/* Handle SW1 */
-		else if ( ((procByte & 0xF0) ==0x60) || ((procByte & 0xF0) ==0x90) ) {
-			TRACE_INFO("SW1\n\r");
-			SW1 = 1;
-		}
-		/* Handle INS */
-		else if ( pAPDU[1] == procByte) {
-			TRACE_INFO("HdlINS\n\r");
-			if (cmdCase == CASE2) {
-				/* receive data from card */
-				do {
-					status = ISO7816_GetChar(&pMessage[indexMsg++], &usart_sim);
-				} while(( 0 != --NeNc) && (status == 0) );
-				if (status != 0) {
-					return status;
-				}
-			}
-			else {
-				 /* Send data */
-				do {
-					TRACE_INFO("Send %X", pAPDU[indexApdu]);
-					ISO7816_SendChar(pAPDU[indexApdu++], &usart_sim);
-				} while( 0 != --NeNc );
-			}
-		}
-		/* Handle INS ^ 0xff */
-		else
-		#pragma GCC diagnostic push
-		#pragma GCC diagnostic ignored "-Wsign-compare"
-		if ( pAPDU[1] == (procByte ^ 0xff)) {
-		#pragma GCC diagnostic pop
-			TRACE_INFO("HdlINS+\n\r");
-			if (cmdCase == CASE2) {
-				/* receive data from card */
-				status = ISO7816_GetChar(&pMessage[indexMsg++], &usart_sim);
-				if (status != 0) {
-					return status;
-				}
-				TRACE_INFO("Rcv: 0x%X\n\r", pMessage[indexMsg-1]);
-			}
-			else {
-				status = ISO7816_SendChar(pAPDU[indexApdu++], &usart_sim);
-				if (status != 0) {
-					return status;
-				}
-			}
-			NeNc--;
-		}
-		else {
-			/* ?? */
-			TRACE_INFO("procByte=0x%X\n\r", procByte);
-			break;
-		}
-	} while (NeNc != 0);
+/**
+ * USART interrupt handler of the T=0 engine
+ */
+void ISO7816_IrqHandler( void )
+{
+	Usart *us_base = usart_sim.base;
+	uint32_t csr = us_base->US_CSR & us_base->US_IMR;
+	uint32_t err = us_base->US_CSR & T0_CSR_ERRORS;
+	uint8_t byte;
 
-	/* Status Bytes */
-	if (SW1 == 0) {
-		status = ISO7816_GetChar(&pMessage[indexMsg++], &usart_sim); /* SW1 */
-		if (status != 0) {
-			return status;
+	if (t0.state == T0_S_IDLE || t0.state == T0_S_DONE) {
+		USART_DisableIt(us_base, (uint32_t) -1);
+		return;
+	}
+
+	if (err) {
+		TRACE_DEBUG("R:0x%" PRIX32 "\n\r", err);
+		us_base->US_CR = US_CR_RSTSTA;
+		t0_finish(err);
+		return;
+	}
+
+	if (csr & US_CSR_ENDTX) {
+		/* the PDC has written the last character */
+		us_base->US_PTCR = US_PTCR_TXTDIS;
+		USART_DisableIt(us_base, US_IDR_ENDTX);
+		t0.state = T0_S_TX_DRAIN;
+		USART_EnableIt(us_base, US_IER_TXEMPTY);
+		return;
+	}
+
+	if (csr & US_CSR_TXEMPTY) {
+		USART_DisableIt(us_base, US_IDR_TXEMPTY);
+		t0_start_rx(t0.next);
+		return;
+	}
+
+	if (csr & US_CSR_ENDRX) {
+		us_base->US_PTCR = US_PTCR_RXTDIS;
+		USART_DisableIt(us_base, US_IDR_ENDRX);
+		t0.resp_len += t0.pdc_len;
+		t0.remaining = 0;
+		t0.state = T0_S_WAIT_PB;
+		t0_restart_wt(us_base);
+		USART_EnableIt(us_base, US_IER_RXRDY);
+		return;
+	}
+
+	if (csr & US_CSR_RXRDY) {
+		byte = us_base->US_RHR & 0xFF;
+		t0_restart_wt(us_base);
+		switch (t0.state) {
+		case T0_S_WAIT_PB:
+			t0_proc_byte(byte);
+			break;
+		case T0_S_RX_ONE:
+			t0.resp[t0.resp_len++] = byte;
+			t0.remaining--;
+			t0.state = T0_S_WAIT_PB;
+			break;
+		case T0_S_WAIT_SW2:
+			t0.resp[t0.resp_len++] = byte;
+			TRACE_DEBUG("SW1=0x%X, SW2=0x%X\n\r", t0.resp[t0.resp_len-2], byte);
+			t0_finish(0);
+			break;
+		default:
+			break;
 		}
+		return;
 	}
-	else {
-		pMessage[indexMsg++] = procByte;
+
+	if (csr & US_CSR_TIMEOUT)
+		t0_timeout(us_base);
+}
+
+/**
+ * Start the exchange of a T=0 TPDU.  The buffers have to remain valid until
+ * ISO7816_XfrBlockTPDU_T0_Done() reports the completion.
+ * \param pAPDU         APDU buffer
+ * \param pMessage      Response buffer, for up to 256 data bytes and SW1 SW2
+ * \param wLength       Block length
+ * \return              0 on success, ISO7816_T0_ERR_BUSY if an exchange is ongoing
+ */
+uint32_t ISO7816_XfrBlockTPDU_T0_Start(const uint8_t *pAPDU,
+					uint8_t *pMessage,
+					uint16_t wLength )
+{
+	uint16_t NeNc;
+
+	if (t0.state != T0_S_IDLE && t0.state != T0_S_DONE)
+		return ISO7816_T0_ERR_BUSY;
+
+	memcpy(t0.hdr, pAPDU, 4);
+	t0.hdr[4] = wLength > 4 ? pAPDU[4] : 0;
+	t0.data = pAPDU + 5;
+	t0.resp = pMessage;
+	t0.resp_len = 0;
+
+	/* Handle the four structures of command APDU */
+	if (wLength <= 4) {
+		/* case 1 */
+		t0.rx = false;
+		NeNc = 0;
+	} else if (wLength == 5 || (wLength == 7 && pAPDU[4] == 0)) {
+		/* case 2, from the card P3=0 means 256 bytes */
+		t0.rx = true;
+		NeNc = pAPDU[4] ? pAPDU[4] : 256;
+	} else {
+		/* case 3, P3 bytes to the card, at most what was given */
+		t0.rx = false;
+		NeNc = pAPDU[4] < wLength - 5 ? pAPDU[4] : wLength - 5;
 	}
-	status = ISO7816_GetChar(&pMessage[indexMsg++], &usart_sim); /* SW2 */
-	if (status != 0) {
+	t0.remaining = NeNc;
+
+	TRACE_DEBUG("CASE=%u NeNc=0x%X\n\r", wLength <= 4 ? 1 : (t0.rx ? 2 : 3), NeNc);
+
+	NVIC_EnableIRQ(IRQ_USART_SIM);
+	t0_send(t0.hdr, sizeof(t0.hdr), T0_S_WAIT_PB);
+
+	return 0;
+}
+
+/**
+ * Check for the completion of a T=0 TPDU exchange
+ * \param status        0 on success, content of US_CSR or ISO7816_T0_ERR_* otherwise
+ * \param retlen        Length of the response (data and SW1 SW2)
+ * \return              true if the exchange is complete
+ */
+bool ISO7816_XfrBlockTPDU_T0_Done( uint32_t *status, uint16_t *retlen )
+{
+	if (t0.state != T0_S_DONE)
+		return false;
+
+	*status = t0.status;
+	*retlen = t0.resp_len;
+	t0.state = T0_S_IDLE;
+	return true;
+}
+
+/**
+ * Abort an ongoing T=0 TPDU exchange, which then completes with
+ * ISO7816_T0_ERR_ABORTED
+ */
+void ISO7816_XfrBlockTPDU_T0_Abort( void )
+{
+	if (t0.state != T0_S_IDLE && t0.state != T0_S_DONE)
+		t0_finish(ISO7816_T0_ERR_ABORTED);
+}
+
+/**
+ * Set the waiting time of the T=0 engine
+ * \param wt            Waiting time in etu, WT = WI x 960 x D
+ */
+void ISO7816_SetWaitingTime( uint32_t wt )
+{
+	t0.wt = wt;
+}
+
+/**
+ * Transfert Block      TPDU T=0, waiting for the completion
+ * \param pAPDU         APDU buffer
+ * \param pMessage      Message buffer
+ * \param wLength       Block length
+ * \param retlen        Response length
+ * \return              0 on success, content of US_CSR otherwise
+ */
+uint32_t ISO7816_XfrBlockTPDU_T0(const uint8_t *pAPDU,
+					                    uint8_t *pMessage,
+					                    uint16_t wLength,
+					                    uint16_t *retlen )
+{
+	uint32_t status;
+
+	status = ISO7816_XfrBlockTPDU_T0_Start(pAPDU, pMessage, wLength);
+	if (status != 0)
 		return status;
-	}
 
-	TRACE_WARNING("SW1=0x%X, SW2=0x%X\n\r", pMessage[indexMsg-2], pMessage[indexMsg-1]);
+	while (!ISO7816_XfrBlockTPDU_T0_Done(&status, retlen))
+		WDT_Restart(WDT);
 
-	*retlen = indexMsg;
 	return status;
-
 }
 
 /**
@@ -377,7 +582,7 @@ void ISO7816_Escape( void )
 void ISO7816_RestartClock( void )
 {
 	TRACE_DEBUG("ISO7816_RestartClock\n\r");
-	USART_SIM->US_BRGR = 13;
+	USART_SIM->US_BRGR = st_clockDivisor;
 }
 
 /**
@@ -402,7 +607,7 @@ void ISO7816_toAPDU( void )
  * Answer To Reset (ATR)
  * \param pAtr    ATR buffer
  * \param pLength Pointer for store the ATR length
- * \return 0: if timeout else status of US_CSR
+ * \return 0 on success, status of US_CSR otherwise (US_CSR_TIMEOUT on timeout)
  */
 uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 {
@@ -414,7 +619,6 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 	*pLength = 0;
 
 	/* Read ATR TS */
-	// FIXME: There should always be a check for the GetChar return value..0 means timeout
 	status = ISO7816_GetChar(&pAtr[0], &usart_sim);
 	if (status != 0) {
 		return status;
@@ -468,24 +672,101 @@ uint32_t ISO7816_Datablock_ATR( uint8_t* pAtr, uint8_t* pLength )
 
 /**
  * Set data rate and clock frequency
- * \param dwClockFrequency ICC clock frequency in KHz.
- * \param dwDataRate       ICC data rate in bpd
+ * \param pClockFrequency ICC clock frequency in KHz, set to the clock generated.
+ * \param pDataRate       ICC data rate in bps, set to the data rate used.  0
+ *                        keeps the current F/D ratio.
  */
-void ISO7816_SetDataRateandClockFrequency( uint32_t dwClockFrequency, uint32_t dwDataRate )
+void ISO7816_SetDataRateandClockFrequency( uint32_t *pClockFrequency, uint32_t *pDataRate )
 {
-	uint8_t ClockFrequency;
+	uint32_t cd, sck, fidi;
 
 	/* Define the baud rate divisor register */
-	/* CD  = MCK / SCK */
-	/* SCK = FIDI x BAUD = 372 x 9600 */
-	/* BOARD_MCK */
-	/* CD = MCK/(FIDI x BAUD) = 48000000 / (372x9600) = 13 */
-	USART_SIM->US_BRGR = BOARD_MCK / (dwClockFrequency*1000);
+	/* CD  = MCK / SCK, rounded up not to exceed the requested clock */
+	if (*pClockFrequency) {
+		cd = (BOARD_MCK + *pClockFrequency * 1000 - 1) / (*pClockFrequency * 1000);
+		if (cd < BOARD_MCK / (ISO7816_MAX_CLOCK_KHZ * 1000))
+			cd = BOARD_MCK / (ISO7816_MAX_CLOCK_KHZ * 1000);
+		if (cd > 0xffff)
+			cd = 0xffff;
+		st_clockDivisor = cd;
+		USART_SIM->US_BRGR = cd;
+	}
+	sck = BOARD_MCK / st_clockDivisor;
+
+	/* FIDI = SCK / BAUD, within the 11 bits of FI_DI_RATIO */
+	fidi = USART_SIM->US_FIDI & US_FIDI_FI_DI_RATIO_Msk;
+	if (*pDataRate) {
+		fidi = (sck + *pDataRate / 2) / *pDataRate;
+		if (fidi < 1)
+			fidi = 1;
+		if (fidi > US_FIDI_FI_DI_RATIO_Msk)
+			fidi = US_FIDI_FI_DI_RATIO_Msk;
+		USART_SIM->US_FIDI = fidi;
+	}
+
+	*pClockFrequency = sck / 1000;
+	*pDataRate = sck / fidi;
+}
+
+/**
+ * Set the F/D ratio from Fi/Di, as selected by TA1 or PPS1
+ * \param fidi Fi in the upper, Di in the lower nibble
+ * \return the F/D ratio, -EINVAL if Fi/Di is not supported
+ */
+int ISO7816_SetFiDi( uint8_t fidi )
+{
+	int ratio = iso7816_3_compute_fd_ratio(fidi >> 4, fidi & 0x0f);
+
+	if (ratio <= 0 || ratio > US_FIDI_FI_DI_RATIO_Msk)
+		return -EINVAL;
+
+	USART_SIM->US_FIDI = ratio;
+	return ratio;
+}
 
-	ClockFrequency = BOARD_MCK / USART_SIM->US_BRGR;
+/**
+ * Protocol and parameters selection (PPS) right after the ATR
+ * \param t    Protocol to select
+ * \param fidi Fi/Di to propose, as selected by iso7816_3_select_fidi()
+ * \return Fi/Di now in use, -EIO or -EINVAL if the exchange failed, in which
+ *         case the card has to be reset
+ */
+int ISO7816_PPS( uint8_t t, uint8_t fidi )
+{
+	uint8_t req[4], resp[6];
+	unsigned int req_len, resp_len, i;
+	uint32_t status = 0;
+	int rc;
+
+	req_len = iso7816_3_pps_request(req, t, fidi);
+	for (i = 0; i < req_len; i++)
+		status |= ISO7816_SendChar(req[i], &usart_sim);
 
-	USART_SIM->US_FIDI = (ClockFrequency)/dwDataRate;
+	/* PPSS and PPS0, which tells how many bytes follow */
+	for (i = 0; i < 2 && !status; i++)
+		status = ISO7816_GetChar(&resp[i], &usart_sim);
+	if (status) {
+		TRACE_WARNING("PPS: no response (0x%" PRIX32 ")\n\r", status);
+		return -EIO;
+	}
+	resp_len = iso7816_3_pps_len(resp[1]);
+	for (; i < resp_len && !status; i++)
+		status = ISO7816_GetChar(&resp[i], &usart_sim);
+	if (status) {
+		TRACE_WARNING("PPS: truncated response (0x%" PRIX32 ")\n\r", status);
+		return -EIO;
+	}
+
+	rc = iso7816_3_pps_check(req, resp, resp_len);
+	if (rc < 0) {
+		TRACE_WARNING("PPS: invalid response\n\r");
+		return rc;
+	}
 
+	/* the card uses the new parameters right after its response */
+	ISO7816_SetFiDi(rc);
+	TRACE_INFO("PPS: Fi/Di 0x%02X\n\r", rc);
+	return rc;
 }
 
 /**
@@ -681,7 +962,8 @@ void ISO7816_Init( Usart_info *usart, bool master_clock )
 	/* BOARD_MCK */
 	/* CD = MCK/(FIDI x BAUD) = 48000000 / (372x9600) = 13 */
 	if (master_clock == true) {
-		us_base->US_BRGR = BOARD_MCK / (372*9600);
+		st_clockDivisor = BOARD_MCK / (372*9600);
+		us_base->US_BRGR = st_clockDivisor;
 	} else {
 		us_base->US_BRGR = US_BRGR_CD(1);
 	}
@@ -1,4 +1,4 @@
-/* ISO7816-3 Fi/Di tables + computation
+/* ISO7816-3 Fi/Di tables + computation, ATR, PPS and T=1 EDC
  *
  * (C) 2010-2015 by Harald Welte <laforge@gnumonks.org>
  *
@@ -14,6 +14,7 @@
  */
 #include <stdint.h>
 #include <errno.h>
+#include <string.h>
 
 #include "utils.h"
 #include "iso7816_fidi.h"
@@ -30,6 +31,12 @@ const uint8_t iso7816_3_di_table[] = {
 	12, 20, 2, 4, 8, 16, 32, 64,
 };
 
+/* Table 7 of ISO 7816-3:2006, f(max) in kHz */
+const uint16_t iso7816_3_fmax_table[] = {
+	4000, 5000, 6000, 8000, 12000, 16000, 20000, 0,
+	0, 5000, 7500, 10000, 15000, 20000, 0, 0
+};
+
 /* compute the F/D ratio based on Fi and Di values */
 int iso7816_3_compute_fd_ratio(uint8_t f_index, uint8_t d_index)
 {
@@ -61,3 +68,198 @@ int iso7816_3_compute_fd_ratio(uint8_t f_index, uint8_t d_index)
 
 	return ret;
 }
+
+/*! parse the interface bytes of an ATR which define the transmission parameters
+ *  \param[in] atr ATR, starting with TS
+ *  \param[in] len length of the ATR
+ *  \param[out] p parameters, with the default values of absent bytes
+ *  \returns 0 on success; -EINVAL if the ATR is truncated
+ *
+ *  The T=1 specific bytes are the ones following the first TDi (i > 1)
+ *  indicating T=1 (ISO 7816-3:2006 clause 11.4). */
+int iso7816_3_atr_parse(const uint8_t *atr, unsigned int len, struct iso7816_3_atr_params *p)
+{
+	unsigned int i = 2, n;
+	uint8_t y, t = 0;
+	bool t1 = false, t1_seen = false;
+
+	memset(p, 0, sizeof(*p));
+	p->fidi = ISO7816_3_DEFAULT_FIDI;
+	p->wi = ISO7816_3_DEFAULT_WI;
+	p->ifsc = ISO7816_3_DEFAULT_IFS;
+	p->cwi = ISO7816_3_DEFAULT_CWI;
+	p->bwi = ISO7816_3_DEFAULT_BWI;
+
+	if (len < 2)
+		return -EINVAL;
+
+	/* n is the index of the interface bytes TAn..TDn, y their indicator */
+	y = atr[1];
+	for (n = 1; ; n++) {
+		if (i + __builtin_popcount(y & 0xf0) > len)
+			return -EINVAL;
+		/* interface bytes specific to T=1 */
+		t1 = n > 2 && t == 1 && !t1_seen;
+		if (y & 0x10) {
+			if (n == 1)
+				p->fidi = atr[i];
+			else if (n == 2) {
+				p->specific = true;
+				p->implicit = atr[i] & 0x10;
+			} else if (t1)
+				p->ifsc = atr[i];
+			i++;
+		}
+		if (y & 0x20) {
+			if (t1) {
+				p->bwi = atr[i] >> 4;
+				p->cwi = atr[i] & 0x0f;
+			}
+			i++;
+		}
+		if (y & 0x40) {
+			if (n == 1)
+				p->n = atr[i];
+			else if (n == 2 && atr[i])
+				p->wi = atr[i];
+			else if (t1)
+				p->crc = atr[i] & 0x01;
+			i++;
+		}
+		if (t1)
+			t1_seen = true;
+		if (!(y & 0x80))
+			break;
+		y = atr[i++];
+		t = y & 0x0f;
+		p->protocols |= 1 << t;
+		if (n == 1)
+			p->t = t;
+	}
+
+	/* without TD1, only T=0 is offered */
+	if (!p->protocols)
+		p->protocols = 1 << 0;
+
+	return 0;
+}
+
+/*! select the fastest Fi/Di to propose in a PPS request
+ *  \param[in] ta1 Fi/Di indicated by the card in TA1 of its ATR
+ *  \returns Fi/Di to propose, or ISO7816_3_DEFAULT_FIDI if none is faster
+ *
+ *  The card supports Fi of TA1 together with any D up to Di of TA1.  Only
+ *  combinations with an integer F/D ratio are considered, as the USART cannot
+ *  generate others. */
+uint8_t iso7816_3_select_fidi(uint8_t ta1)
+{
+	uint8_t f_index = ta1 >> 4, d_index = ta1 & 0x0f, i;
+	uint8_t fidi = ISO7816_3_DEFAULT_FIDI;
+	uint16_t f, d, d_max;
+	int ratio = iso7816_3_compute_fd_ratio(1, 1);
+
+	/* D indices from 10 on are RFU */
+	if (d_index >= 10 || iso7816_3_compute_fd_ratio(f_index, d_index) < 0)
+		return ISO7816_3_DEFAULT_FIDI;
+
+	f = iso7816_3_fi_table[f_index];
+	d_max = iso7816_3_di_table[d_index];
+	for (i = 1; i < 10; i++) {
+		d = iso7816_3_di_table[i];
+		if (d > d_max || f % d || f / d >= ratio)
+			continue;
+		ratio = f / d;
+		fidi = (f_index << 4) | i;
+	}
+
+	return fidi;
+}
+
+/*! length of a PPS request or response
+ *  \param[in] pps0 PPS0 byte
+ *  \returns number of bytes from PPSS to PCK */
+unsigned int iso7816_3_pps_len(uint8_t pps0)
+{
+	return 3 + __builtin_popcount(pps0 & 0x70);
+}
+
+/*! build a PPS request
+ *  \param[out] req buffer of at least 4 bytes for the request
+ *  \param[in] t protocol to select
+ *  \param[in] fidi Fi/Di to select (PPS1)
+ *  \returns length of the request */
+unsigned int iso7816_3_pps_request(uint8_t *req, uint8_t t, uint8_t fidi)
+{
+	req[0] = 0xff;
+	req[1] = 0x10 | (t & 0x0f);
+	req[2] = fidi;
+	req[3] = req[0] ^ req[1] ^ req[2];
+
+	return 4;
+}
+
+/*! check the PPS response of the card to a request
+ *  \param[in] req request built by iso7816_3_pps_request()
+ *  \param[in] resp response of the card
+ *  \param[in] resp_len length of the response
+ *  \returns Fi/Di to use from now on; -EINVAL if the PPS exchange failed
+ *
+ *  The card either confirms PPS1 of the request, or omits it to keep the
+ *  default Fi/Di (ISO 7816-3:2006 clause 9.3). */
+int iso7816_3_pps_check(const uint8_t *req, const uint8_t *resp, unsigned int resp_len)
+{
+	uint8_t pck = 0;
+	unsigned int i;
+
+	if (resp_len < 3 || resp_len != iso7816_3_pps_len(resp[1]))
+		return -EINVAL;
+	if (resp[0] != 0xff || (resp[1] & 0x0f) != (req[1] & 0x0f))
+		return -EINVAL;
+	/* PPS2 and PPS3 are only echoed, and never requested */
+	if ((resp[1] & 0x70) & ~(req[1] & 0x70))
+		return -EINVAL;
+	for (i = 0; i < resp_len; i++)
+		pck ^= resp[i];
+	if (pck)
+		return -EINVAL;
+
+	if (!(resp[1] & 0x10))
+		return ISO7816_3_DEFAULT_FIDI;
+	if (resp[2] != req[2])
+		return -EINVAL;
+	return resp[2];
+}
+
+/*! compute the error detection code of a T=1 block
+ *  \param[out] edc buffer of at least 2 bytes for the EDC
+ *  \param[in] blk prologue and information field of the block
+ *  \param[in] len length of prologue and information field
+ *  \param[in] crc use the CRC instead of the LRC
+ *  \returns length of the EDC
+ *
+ *  The LRC is the exclusive-or of all bytes.  The CRC is the one of ISO/IEC
+ *  13239 (polynomial 0x1021 processed LSB first, initial value 0xffff), of which
+ *  the most significant byte is transmitted first (ISO 7816-3:2006 clause
+ *  11.3.5). */
+unsigned int iso7816_3_t1_edc(uint8_t *edc, const uint8_t *blk, unsigned int len, bool crc)
+{
+	unsigned int i, bit;
+	uint16_t c = 0xffff;
+	uint8_t lrc = 0;
+
+	if (!crc) {
+		for (i = 0; i < len; i++)
+			lrc ^= blk[i];
+		edc[0] = lrc;
+		return 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		c ^= blk[i];
+		for (bit = 0; bit < 8; bit++)
+			c = (c & 1) ? (c >> 1) ^ 0x8408 : c >> 1;
+	}
+	edc[0] = c >> 8;
+	edc[1] = c & 0xff;
+	return 2;
+}
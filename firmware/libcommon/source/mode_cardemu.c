@@ -22,14 +22,24 @@
 #include "utils.h"
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
+#include <errno.h>
 #include "llist_irqsafe.h"
 #include "usb_buf.h"
 #include "simtrace_usb.h"
 #include "simtrace_prot.h"
 #include "sim_switch.h"
+#include "clk_ctr.h"
+#include "vcc_adc.h"
+#include "modem_status.h"
+#ifdef HAVE_SLOT_MUX
+#include "mux.h"
+#include "slot_sched.h"
+#endif
 
 #define TRACE_ENTRY()	TRACE_DEBUG("%s entering\r\n", __func__)
 
+extern volatile uint32_t jiffies;
+
 #ifdef PINS_CARDSIM
 static const Pin pins_cardsim[] = PINS_CARDSIM;
 #endif
@@ -41,12 +51,14 @@ static const Pin pin_usim1_rst	= PIN_USIM2_nRST;
 #define FIRST_USART_BASE USART0
 #define FIRST_USART_ID ID_USART0
 #define FIRST_USART_IRQ USART0_IRQn
+#define FIRST_CLK_TCLK CLK_CTR_TCLK0
 #else
 static const Pin pins_usim1[]	= {PINS_USIM1};
 static const Pin pin_usim1_rst	= PIN_USIM1_nRST;
 #define FIRST_USART_BASE USART1
 #define FIRST_USART_ID ID_USART1
 #define FIRST_USART_IRQ USART1_IRQn
+#define FIRST_CLK_TCLK CLK_CTR_TCLK2
 #endif
 static const Pin pin_usim1_vcc	= PIN_USIM1_VCC;
 
@@ -76,17 +88,22 @@ struct cardem_inst {
 		bool half_time_notified;
 	} wt;
 	int usb_pending_old;
+	/*! message from the host which continues in the next USB buffer */
+	struct msgb *rx_partial;
+	/*! header from the host which continues in the next USB buffer */
+	uint8_t rx_hdr[sizeof(struct simtrace_msg_hdr)];
+	uint8_t rx_hdr_len;
+	/*! bytes of a message from the host we had no buffer for */
+	uint16_t rx_skip;
 	uint8_t ep_out;
 	uint8_t ep_in;
 	uint8_t ep_int;
+	/*! TC clock input the CLK of the reader is connected to (CLK_CTR_TCLK*) */
+	uint8_t clk_tclk;
 	/*! Pin to set when SIM is present/inserted (SIM presence pin). */
 	const Pin pin_insert;
 	/*! Invert the Pin polarity. When not inverted, the SIM pin_insert will be High, when a SIM is present. */
 	bool pin_insert_inverted;
-#ifdef DETECT_VCC_BY_ADC
-	uint32_t vcc_uv;
-#endif
-
 	/*! real-time state of VCC I/O line, irrespective of enabled flag */
 	bool vcc_active;
 
@@ -103,6 +120,25 @@ struct cardem_inst {
 	bool enabled;
 };
 
+#ifdef HAVE_SLOT_MUX
+/* time after connecting a slot, until its I/O lines are valid: VCC is only
+ * known once the ADC filled the buffers of the PDC holding samples of the
+ * previous slot, and the next one */
+#define SLOT_IO_SETTLE_MS	5
+
+/* the slots behind the mux share the UART of instance 0, each with its own card
+ * handle; the one of the connected slot is cardem_inst[0].ch */
+static struct {
+	struct card_handle *ch;
+	/* VCC/RST state last reported to the card handle */
+	bool vcc_active_last;
+	bool rst_active_last;
+} slots[SLOT_SCHED_NUM_SLOTS];
+
+/* when the connected slot was connected */
+static uint32_t slot_connected_at;
+#endif
+
 struct cardem_inst cardem_inst[] = {
 	{
 		.num = 0,
@@ -114,6 +150,7 @@ struct cardem_inst cardem_inst[] = {
 		.ep_out = SIMTRACE_CARDEM_USB_EP_USIM1_DATAOUT,
 		.ep_in = SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
 		.ep_int = SIMTRACE_CARDEM_USB_EP_USIM1_INT,
+		.clk_tclk = FIRST_CLK_TCLK,
 #ifdef PIN_SET_USIM1_PRES
 		.pin_insert = PIN_SET_USIM1_PRES,
 #endif /* PIN_SET_USIM1_PRES */
@@ -132,6 +169,7 @@ struct cardem_inst cardem_inst[] = {
 		.ep_out = SIMTRACE_CARDEM_USB_EP_USIM2_DATAOUT,
 		.ep_in = SIMTRACE_CARDEM_USB_EP_USIM2_DATAIN,
 		.ep_int = SIMTRACE_CARDEM_USB_EP_USIM2_INT,
+		.clk_tclk = CLK_CTR_TCLK0,
 #ifdef PIN_SET_USIM2_PRES
 		.pin_insert = PIN_SET_USIM2_PRES,
 #endif /* PIN_SET_USIM2_PRES */
@@ -142,6 +180,11 @@ struct cardem_inst cardem_inst[] = {
 #endif
 };
 
+#ifdef DETECT_VCC_BY_ADC
+/* VCC of each instance: AD7 for the first, AD6 for the second */
+static struct vcc_adc_chan vcc_adc[ARRAY_SIZE(cardem_inst)];
+#endif
+
 static Usart *get_usart_by_chan(uint8_t uart_chan)
 {
 	if (uart_chan < ARRAY_SIZE(cardem_inst)) {
@@ -192,7 +235,7 @@ int card_emu_get_vcc(uint8_t uart_chan)
 {
 	struct cardem_inst *ci = &cardem_inst[uart_chan];
 #ifdef DETECT_VCC_BY_ADC
-	return ci->vcc_uv / 1000;
+	return vcc_adc[ci->num].avg_uv / 1000;
 #else
 	return -1;
 #endif
@@ -225,6 +268,7 @@ void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 		USART_SetTransmitterEnabled(usart, 1);
 		break;
 	case ENABLE_RX:
+	case ENABLE_RX_TIMER:
 		USART_DisableIt(usart, ~US_IER_RXRDY);
 		/* as irritating as it is, we actually want to keep the
 		 * transmitter enabled during receive */
@@ -233,6 +277,9 @@ void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 		card_emu_uart_set_direction(uart_chan, false);;
 		usart->US_CR = US_CR_RSTSTA | US_CR_RSTIT | US_CR_RSTNACK;
 		USART_EnableIt(usart, US_IER_RXRDY);
+		/* the timer is used for the character waiting time of T=1 */
+		if (rxtx == ENABLE_RX_TIMER)
+			USART_EnableIt(usart, US_IER_TIMEOUT);
 		USART_SetReceiverEnabled(usart, 1);
 		break;
 	case 0:
@@ -449,9 +496,41 @@ void card_emu_uart_interrupt(uint8_t uart_chan)
 #error "You must define VCC_UV_THRESH_{1V8,3V} if you use ADC VCC detection"
 #endif
 
+#ifdef octsimtest
+#define VCC_UV_THRESH_ON	VCC_UV_THRESH_1V8
+#else
+#define VCC_UV_THRESH_ON	VCC_UV_THRESH_3V
+#endif
+/* boards whose ADC input range includes a 5V VCC define its threshold */
+#ifndef VCC_UV_THRESH_5V
+#define VCC_UV_THRESH_5V	0
+#endif
+
+static const struct vcc_adc_thresh vcc_thresh = {
+	.on_uv = VCC_UV_THRESH_ON,
+	.class_c_uv = VCC_UV_THRESH_1V8,
+	/* boards which can't tell 3V from 1.8V use the same threshold for both */
+	.class_b_uv = VCC_UV_THRESH_3V > VCC_UV_THRESH_1V8 ? VCC_UV_THRESH_3V : 0,
+	.class_a_uv = VCC_UV_THRESH_5V,
+};
+
+/* the PDC writes the samples into the buffers in turn */
+static uint16_t vcc_adc_buf[2][VCC_ADC_BUF_SAMPLES];
+static uint8_t vcc_adc_buf_cur;
+
 static volatile int adc_triggered = 0;
 static int adc_sam3s_reva_errata = 0;
 
+static void vcc_adc_pdc_start(void)
+{
+	vcc_adc_buf_cur = 0;
+	ADC->ADC_RPR = (uint32_t) vcc_adc_buf[0];
+	ADC->ADC_RCR = VCC_ADC_BUF_SAMPLES;
+	ADC->ADC_RNPR = (uint32_t) vcc_adc_buf[1];
+	ADC->ADC_RNCR = VCC_ADC_BUF_SAMPLES;
+	ADC->ADC_PTCR = ADC_PTCR_RXTEN;
+}
+
 static int card_vcc_adc_init(void)
 {
 	uint32_t chip_arch = CHIPID->CHIPID_CIDR & CHIPID_CIDR_ARCH_Msk;
@@ -476,61 +555,90 @@ static int card_vcc_adc_init(void)
 			foo = ADC->ADC_CDR[i];
 	}
 
-	/* Initialize ADC for AD7 / AD6, fADC=48/24=2MHz */
+	vcc_adc_chan_init(&vcc_adc[0], 7, &vcc_thresh, jiffies);
+#ifdef CARDEMU_SECOND_UART
+	vcc_adc_chan_init(&vcc_adc[1], 6, &vcc_thresh, jiffies);
+#endif
+
+	/* Initialize ADC for AD7 / AD6, fADC=48/24=2MHz.  It converts them over
+	 * and over, except on Rev.A, where each conversion is started from
+	 * ADC_IrqHandler() */
 	ADC->ADC_MR = ADC_MR_TRGEN_DIS | ADC_MR_LOWRES_BITS_12 |
 		      ADC_MR_SLEEP_NORMAL | ADC_MR_FWUP_OFF |
-		      ADC_MR_FREERUN_OFF | ADC_MR_PRESCAL(23) |
+		      (adc_sam3s_reva_errata ? ADC_MR_FREERUN_OFF : ADC_MR_FREERUN_ON) |
+		      ADC_MR_PRESCAL(23) |
 		      ADC_MR_STARTUP_SUT8 | ADC_MR_SETTLING(3) |
 		      ADC_MR_ANACH_NONE | ADC_MR_TRACKTIM(4) |
 		      ADC_MR_TRANSFER(1) | ADC_MR_USEQ_NUM_ORDER;
+	/* the samples are tagged with their channel number */
+	ADC->ADC_EMR = ADC_EMR_TAG;
 	/* enable AD6 + AD7 channels */
 	ADC->ADC_CHER = ADC_CHER_CH7;
-	ADC->ADC_IER = ADC_IER_EOC7;
 #ifdef CARDEMU_SECOND_UART
-	ADC->ADC_CHER |= ADC_CHER_CH6;
-	ADC->ADC_IER |= ADC_IER_EOC6;
+	ADC->ADC_CHER = ADC_CHER_CH6;
+#endif
+	vcc_adc_pdc_start();
+	ADC->ADC_IER = ADC_IER_ENDRX;
+	if (adc_sam3s_reva_errata) {
+		ADC->ADC_IER = ADC_IER_EOC7;
+#ifdef CARDEMU_SECOND_UART
+		ADC->ADC_IER = ADC_IER_EOC6;
 #endif
+	}
 	NVIC_SetPriority(ADC_IRQn, 13);
 	NVIC_EnableIRQ(ADC_IRQn);
-	ADC->ADC_CR |= ADC_CR_START;
+	ADC->ADC_CR = ADC_CR_START;
 
 	return 0;
 }
 
-static void process_vcc_adc(struct cardem_inst *ci)
+static void card_vcc_adc_exit(void)
 {
-#ifdef octsimtest
-	if (ci->vcc_uv >= VCC_UV_THRESH_1V8)
-#else
-	if (ci->vcc_uv >= VCC_UV_THRESH_3V)
-#endif
-		ci->vcc_active = true;
-	else
-		ci->vcc_active = false;
+	NVIC_DisableIRQ(ADC_IRQn);
+	ADC->ADC_IDR = 0xffffffff;
+	ADC->ADC_PTCR = ADC_PTCR_RXTDIS;
+	ADC->ADC_MR &= ~ADC_MR_FREERUN_ON;
+	ADC->ADC_CHDR = 0xffff;
 }
 
+/* a buffer was filled by the PDC, which now fills the other one.  On Rev.A
+ * also called at the end of each conversion */
 void ADC_IrqHandler(void)
 {
-#ifdef CARDEMU_SECOND_UART
-	if (ADC->ADC_ISR & ADC_ISR_EOC6) {
-		uint16_t val = ADC->ADC_CDR[6] & 0xFFF;
-		cardem_inst[1].vcc_uv = adc2uv(val);
-		process_vcc_adc(&cardem_inst[1]);
-		if (adc_sam3s_reva_errata) {
-			/* Errata: START doesn't start a conversion
-			 * sequence, but only a single conversion */
-			ADC->ADC_CR |= ADC_CR_START;
-		}
+	uint32_t isr = ADC->ADC_ISR;
+	uint16_t *buf;
+	int i;
+
+	if (adc_sam3s_reva_errata && (isr & (ADC_ISR_EOC6 | ADC_ISR_EOC7))) {
+		/* Errata: START doesn't start a conversion sequence, but
+		 * only a single conversion.  The PDC took the sample from
+		 * ADC_LCDR, reading ADC_CDRx clears its EOCx flag */
+		if (isr & ADC_ISR_EOC6)
+			(void) ADC->ADC_CDR[6];
+		if (isr & ADC_ISR_EOC7)
+			(void) ADC->ADC_CDR[7];
+		ADC->ADC_CR = ADC_CR_START;
 	}
-#endif
 
-	if (ADC->ADC_ISR & ADC_ISR_EOC7) {
-		uint16_t val = ADC->ADC_CDR[7] & 0xFFF;
-		cardem_inst[0].vcc_uv = adc2uv(val);
-		process_vcc_adc(&cardem_inst[0]);
-		ADC->ADC_CR |= ADC_CR_START;
-		adc_triggered = 1;
+	if (!(isr & ADC_ISR_ENDRX))
+		return;
+
+	if (isr & ADC_ISR_RXBUFF) {
+		/* the interrupt came too late, both buffers are full: start over */
+		vcc_adc_pdc_start();
+		return;
 	}
+
+	buf = vcc_adc_buf[vcc_adc_buf_cur];
+	vcc_adc_buf_cur ^= 1;
+	vcc_adc_process(vcc_adc, ARRAY_SIZE(vcc_adc), buf, VCC_ADC_BUF_SAMPLES, jiffies);
+	/* processed: the PDC may fill it once the other one is full */
+	ADC->ADC_RNPR = (uint32_t) buf;
+	ADC->ADC_RNCR = VCC_ADC_BUF_SAMPLES;
+
+	for (i = 0; i < ARRAY_SIZE(vcc_adc); i++)
+		cardem_inst[i].vcc_active = vcc_adc[i].active;
+	adc_triggered = 1;
 }
 #endif /* DETECT_VCC_BY_ADC */
 
@@ -542,6 +650,11 @@ void ADC_IrqHandler(void)
  */
 static void process_io_statechg(struct cardem_inst *ci)
 {
+#ifdef HAVE_SLOT_MUX
+	/* the line states of the slot just connected are not yet known */
+	if (ci->num == 0 && jiffies - slot_connected_at < SLOT_IO_SETTLE_MS)
+		return;
+#endif
 	const bool vcc_active = ci->vcc_active && ci->enabled;
 	if (vcc_active != ci->vcc_active_last) {
 		card_emu_io_statechg(ci->ch, CARD_IO_VCC, vcc_active);
@@ -557,6 +670,67 @@ static void process_io_statechg(struct cardem_inst *ci)
 	}
 }
 
+/* pass the measured CLK frequency on to card_emu, for the status of the card */
+static void process_clk(struct cardem_inst *ci)
+{
+	struct clk_ctr_state clk;
+
+	if (clk_ctr_get(ci->clk_tclk, &clk) && clk.valid)
+		card_emu_clk_measured(ci->ch, &clk);
+}
+
+#ifdef DETECT_VCC_BY_ADC
+/* pass a window of VCC measurements on to card_emu */
+static void process_vcc(struct cardem_inst *ci)
+{
+	struct vcc_adc_state vcc;
+	unsigned long state;
+	bool new;
+
+	local_irq_save(state);
+	new = vcc_adc_get(&vcc_adc[ci->num], &vcc);
+	local_irq_restore(state);
+
+	if (new)
+		card_emu_vcc_measured(ci->ch, &vcc);
+}
+#endif /* DETECT_VCC_BY_ADC */
+
+/* report the status of the modem, and its changes since the last report */
+static void report_modem_status(struct cardem_inst *ci, uint8_t ep)
+{
+	struct st_modem_status *sts;
+	struct msgb *msg;
+	unsigned long state;
+
+	msg = usb_buf_alloc_st(ep, SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
+	if (!msg)
+		return;
+
+	sts = (struct st_modem_status *) msgb_put(msg, sizeof(*sts));
+	local_irq_save(state);
+	modem_status_poll(ci->num, jiffies);
+	modem_status_get(ci->num, sts, jiffies);
+	local_irq_restore(state);
+
+	usb_buf_set_prio(msg);
+	usb_buf_upd_len_and_submit(msg);
+}
+
+/* push the debounced changes of the modem status, if the host asked for them */
+static void process_modem_status(struct cardem_inst *ci)
+{
+	unsigned long state;
+	bool changed;
+
+	local_irq_save(state);
+	changed = modem_status_poll(ci->num, jiffies);
+	local_irq_restore(state);
+
+	if (changed && card_emu_feature_enabled(ci->ch, CEMU_FEAT_F_MODEM_STATUS_IRQ))
+		report_modem_status(ci, ci->ep_int);
+}
+
 /***********************************************************************
  * Core USB  / main loop integration
  ***********************************************************************/
@@ -612,6 +786,8 @@ void mode_cardemu_init(void)
 	INIT_LLIST_HEAD(&cardem_inst[0].usb_out_queue);
 	rbuf_reset(&cardem_inst[0].rb);
 	PIO_Configure(pins_usim1, PIO_LISTSIZE(pins_usim1));
+	clk_ctr_init();
+	clk_ctr_add(cardem_inst[0].clk_tclk);
 
 	/* configure USART as ISO-7816 slave (e.g. card) */
 	ISO7816_Init(&cardem_inst[0].usart_info, CLK_SLAVE);
@@ -632,15 +808,31 @@ void mode_cardemu_init(void)
 	do {} while (!adc_triggered); /* wait for first ADC reading */
 #endif /* DETECT_VCC_BY_ADC */
 
+#ifdef HAVE_SLOT_MUX
+	for (i = 0; i < ARRAY_SIZE(slots); i++) {
+		/* only the I/O lines of the connected slot can be seen; the others
+		 * send their ATR after the next reset of their reader */
+		bool connected = i == mux_get_slot();
+		slots[i].ch = card_emu_init(i, 0, SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
+					    SIMTRACE_CARDEM_USB_EP_USIM1_INT,
+					    connected && cardem_inst[0].vcc_active,
+					    !connected || cardem_inst[0].rst_active,
+					    connected && cardem_inst[0].vcc_active);
+	}
+	cardem_inst[0].ch = slots[mux_get_slot()].ch;
+	slot_sched_init(mux_get_slot(), jiffies);
+#else
 	cardem_inst[0].ch = card_emu_init(0, 0, SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
 					  SIMTRACE_CARDEM_USB_EP_USIM1_INT, cardem_inst[0].vcc_active,
 					  cardem_inst[0].rst_active, cardem_inst[0].vcc_active);
+#endif
 	sim_switch_use_physical(0, 1);
 
 #ifdef CARDEMU_SECOND_UART
 	INIT_LLIST_HEAD(&cardem_inst[1].usb_out_queue);
 	rbuf_reset(&cardem_inst[1].rb);
 	PIO_Configure(pins_usim2, PIO_LISTSIZE(pins_usim2));
+	clk_ctr_add(cardem_inst[1].clk_tclk);
 	ISO7816_Init(&cardem_inst[1].usart_info, CLK_SLAVE);
 	/* TODO enable timeout */
 	NVIC_SetPriority(USART0_IRQn, 0);
@@ -672,6 +864,11 @@ void mode_cardemu_exit(void)
 	/* FIXME: stop tc_fdt */
 	/* FIXME: release all msg, unlink them from any queue */
 
+	clk_ctr_exit();
+#ifdef DETECT_VCC_BY_ADC
+	card_vcc_adc_exit();
+#endif
+
 	PIO_DisableIt(&pin_usim1_rst);
 	PIO_DisableIt(&pin_usim1_vcc);
 
@@ -697,6 +894,10 @@ static void dispatch_usb_command_generic(struct msgb *msg, struct cardem_inst *c
 	hdr = (struct simtrace_msg_hdr *) msg->l1h;
 	switch (hdr->msg_type) {
 	case SIMTRACE_CMD_BD_BOARD_INFO:
+		/* messages spanning several buffers are reassembled, up to the
+		 * size of the large ones */
+		usb_send_board_info(ci->ep_in, APPLICATION,
+				    NUM_RCTX_LARGE > 0 ? USB_ALLOC_SIZE_LARGE : USB_OUT_READ_SIZE);
 		break;
 	default:
 		break;
@@ -724,6 +925,16 @@ static void process_card_insert(struct cardem_inst *ci, bool card_insert)
 #endif
 }
 
+#ifdef HAVE_SLOT_MUX
+/* slot a command of the host is for: without scheduling, the connected one */
+static uint8_t host_msg_slot(const struct simtrace_msg_hdr *hdr)
+{
+	if (slot_sched_get_mask() && hdr->slot_nr < ARRAY_SIZE(slots))
+		return hdr->slot_nr;
+	return mux_get_slot();
+}
+#endif
+
 /* handle a single USB command as received from the USB host */
 static void dispatch_usb_command_cardem(struct msgb *msg, struct cardem_inst *ci)
 {
@@ -732,24 +943,31 @@ static void dispatch_usb_command_cardem(struct msgb *msg, struct cardem_inst *ci
 	struct cardemu_usb_msg_cardinsert *cardins;
 	struct cardemu_usb_msg_config *cfg;
 	struct llist_head *queue;
+	struct card_handle *ch = ci->ch;
+	uint32_t connected_ms = jiffies, connections = 1;
 
 	hdr = (struct simtrace_msg_hdr *) msg->l1h;
+#ifdef HAVE_SLOT_MUX
+	uint8_t slot = host_msg_slot(hdr);
+	ch = slots[slot].ch;
+#endif
 	switch (hdr->msg_type) {
 	case SIMTRACE_MSGT_DT_CEMU_TX_DATA:
-		/* drop message when the card emu channel is in-active */
-		if (!card_emu_ch_ready(ci->ch)) {
+		/* drop message when the card emu channel is in-active, or its
+		 * slot is not connected to the UART */
+		if (!card_emu_ch_ready(ch) || ch != ci->ch) {
 			/* FIXME: enqueue an error message for IN */
 			usb_buf_free(msg);
 			return;
 		}
-		queue = card_emu_get_uart_tx_queue(ci->ch);
+		queue = card_emu_get_uart_tx_queue(ch);
 		/* drained from the USART IRQ handler at highest NVIC prio */
 		llist_add_tail_irqsafe(&msg->list, queue);
-		card_emu_have_new_uart_tx(ci->ch);
+		card_emu_have_new_uart_tx(ch);
 		break;
 	case SIMTRACE_MSGT_DT_CEMU_SET_ATR:
 		atr = (struct cardemu_usb_msg_set_atr *) msg->l2h;
-		card_emu_set_atr(ci->ch, atr->atr, atr->atr_len);
+		card_emu_set_atr(ch, atr->atr, atr->atr_len);
 		usb_buf_free(msg);
 		break;
 	case SIMTRACE_MSGT_DT_CEMU_CARDINSERT:
@@ -758,15 +976,21 @@ static void dispatch_usb_command_cardem(struct msgb *msg, struct cardem_inst *ci
 		usb_buf_free(msg);
 		break;
 	case SIMTRACE_MSGT_BD_CEMU_STATUS:
-		card_emu_report_status(ci->ch, false);
+		card_emu_report_status(ch, false);
 		usb_buf_free(msg);
 		break;
 	case SIMTRACE_MSGT_BD_CEMU_CONFIG:
 		cfg = (struct cardemu_usb_msg_config *) msg->l2h;
-		card_emu_set_config(ci->ch, cfg, msgb_l2len(msg));
+		card_emu_set_config(ch, cfg, msgb_l2len(msg));
 		usb_buf_free(msg);
 		break;
 	case SIMTRACE_MSGT_BD_CEMU_STATS:
+#ifdef HAVE_SLOT_MUX
+		slot_sched_get_stats(slot, jiffies, &connected_ms, &connections);
+#endif
+		card_emu_report_stats(ch, connected_ms, connections);
+		usb_buf_free(msg);
+		break;
 	default:
 		/* FIXME: Send Error */
 		usb_buf_free(msg);
@@ -831,6 +1055,7 @@ static void dispatch_usb_command_modem(struct msgb *msg, struct cardem_inst *ci)
 		usb_command_sim_select(msg, ci);
 		break;
 	case SIMTRACE_MSGT_BD_MODEM_STATUS:
+		report_modem_status(ci, ci->ep_in);
 		break;
 	default:
 		break;
@@ -869,49 +1094,84 @@ static void dispatch_usb_command(struct msgb *msg, struct cardem_inst *ci)
 	}
 }
 
+/* dispatch the messages in one USB buffer from the host */
 static void dispatch_received_msg(struct msgb *msg, struct cardem_inst *ci)
 {
 	struct msgb *segm;
 	struct simtrace_msg_hdr *mh;
+	unsigned int need, len;
 
 	/* check if we have multiple concatenated commands in
 	 * one message.  USB endpoints are streams that don't
 	 * preserve the message boundaries */
 	mh = (struct simtrace_msg_hdr *) msg->data;
-	if (mh->msg_len == msgb_length(msg)) {
+	if (!ci->rx_partial && !ci->rx_hdr_len && !ci->rx_skip &&
+	    msgb_length(msg) >= sizeof(*mh) && mh->msg_len == msgb_length(msg)) {
 		/* fast path: only one message in buffer */
 		dispatch_usb_command(msg, ci);
 		return;
 	}
 
 	/* slow path: iterate over list of messages, allocating one new
-	 * reqe_ctx per segment */
-	while (1) {
-		mh = (struct simtrace_msg_hdr *) msg->data;
-
-		segm = usb_buf_alloc(ci->ep_out);
-		if (!segm) {
-			TRACE_ERROR("%u: ENOMEM during msg segmentation\r\n",
-				    ci->num);
-			break;
+	 * reqe_ctx per segment.  A message may continue in the next
+	 * buffer, then it is completed from there */
+	while (msgb_length(msg) > 0) {
+		/* the rest of a message we had no buffer for */
+		if (ci->rx_skip) {
+			len = OSMO_MIN(ci->rx_skip, msgb_length(msg));
+			msgb_pull(msg, len);
+			ci->rx_skip -= len;
+			continue;
 		}
 
-		if (mh->msg_len > msgb_length(msg)) {
-			TRACE_ERROR("%u: Unexpected large message (%u bytes)\r\n",
-					ci->num, mh->msg_len);
-			usb_buf_free(segm);
-			break;
-		} else {
-			uint8_t *cur = msgb_put(segm, mh->msg_len);
+		if (!ci->rx_partial) {
+			/* only the header tells how large a buffer the message needs:
+			 * collect it first, it may as well be split */
+			len = OSMO_MIN(sizeof(ci->rx_hdr) - ci->rx_hdr_len, msgb_length(msg));
+			memcpy(ci->rx_hdr + ci->rx_hdr_len, msg->data, len);
+			msgb_pull(msg, len);
+			ci->rx_hdr_len += len;
+			if (ci->rx_hdr_len < sizeof(ci->rx_hdr))
+				break;
+			ci->rx_hdr_len = 0;
+
+			need = ((struct simtrace_msg_hdr *) ci->rx_hdr)->msg_len;
+			if (need < sizeof(*mh)) {
+				/* we lost track of the message boundaries */
+				TRACE_ERROR("%u: Invalid message length (%u bytes)\r\n", ci->num, need);
+				break;
+			}
+			if (need > USB_ALLOC_SIZE_LARGE) {
+				TRACE_ERROR("%u: Unexpected large message (%u bytes)\r\n", ci->num, need);
+				ci->rx_skip = need - sizeof(*mh);
+				continue;
+			}
+			/* don't wait for a large buffer to be released: they are only
+			 * released as their data is sent to the reader, and holding off
+			 * the OUT queue meanwhile may hold off the very message doing so */
+			segm = usb_buf_alloc_size(ci->ep_out, need);
+			if (!segm) {
+				TRACE_ERROR("%u: ENOMEM during msg segmentation (%u bytes)\r\n",
+					    ci->num, need);
+				ci->rx_skip = need - sizeof(*mh);
+				continue;
+			}
 			segm->l1h = segm->head;
-			memcpy(cur, mh, mh->msg_len);
+			memcpy(msgb_put(segm, sizeof(ci->rx_hdr)), ci->rx_hdr, sizeof(ci->rx_hdr));
+			ci->rx_partial = segm;
+		}
+		segm = ci->rx_partial;
+
+		need = ((struct simtrace_msg_hdr *) segm->data)->msg_len;
+		len = OSMO_MIN(need - msgb_length(segm), msgb_length(msg));
+		memcpy(msgb_put(segm, len), msg->data, len);
+		/* pull this part of the message */
+		msgb_pull(msg, len);
+
+		if (msgb_length(segm) == need) {
+			ci->rx_partial = NULL;
 			dispatch_usb_command(segm, ci);
 		}
-		/* pull this message */
-		msgb_pull(msg, mh->msg_len);
-		/* abort if we're done */
-		if (msgb_length(msg) <= 0)
-			break;
 	}
 
 	usb_buf_free(msg);
@@ -938,12 +1198,95 @@ static void process_any_usb_commands(struct llist_head *main_q,
 	}
 }
 
+#ifdef HAVE_SLOT_MUX
+/* connect the UART of instance 0 to another slot, with its own card handle */
+static void switch_slot(struct cardem_inst *ci, uint8_t slot)
+{
+	uint8_t cur = mux_get_slot();
+#ifdef DETECT_VCC_BY_ADC
+	unsigned long state;
+#endif
+
+	card_emu_uart_enable(ci->num, 0);
+	card_emu_uart_update_wt(ci->num, 0);
+
+	slots[cur].vcc_active_last = ci->vcc_active_last;
+	slots[cur].rst_active_last = ci->rst_active_last;
+
+	mux_set_slot(slot);
+	ci->ch = slots[slot].ch;
+	ci->vcc_active_last = slots[slot].vcc_active_last;
+	ci->rst_active_last = slots[slot].rst_active_last;
+
+	/* obtain the I/O line states of the new slot */
+	usim1_rst_irqhandler(&pin_usim1_rst);
+#ifndef DETECT_VCC_BY_ADC
+	usim1_vcc_irqhandler(&pin_usim1_vcc);
+#endif
+	/* ... and with the ADC, once it filled the next buffers */
+	slot_connected_at = jiffies;
+	/* the CLK input now is the one of the new slot */
+	clk_ctr_restart(ci->clk_tclk);
+#ifdef DETECT_VCC_BY_ADC
+	/* ... and its VCC */
+	local_irq_save(state);
+	vcc_adc_chan_restart(&vcc_adc[ci->num], jiffies);
+	local_irq_restore(state);
+#endif
+
+	card_emu_resume(ci->ch);
+	slot_sched_switched(slot, jiffies);
+}
+
+/* explicit slot selection by the host */
+int mode_cardemu_select_slot(uint8_t slot)
+{
+	if (slot >= ARRAY_SIZE(slots))
+		return -EINVAL;
+
+	if (slot != mux_get_slot())
+		switch_slot(&cardem_inst[0], slot);
+	return slot;
+}
+
+/* what the reader of the connected slot is doing, as the card handle saw it */
+static enum slot_sched_activity slot_activity(struct cardem_inst *ci)
+{
+	struct clk_ctr_state clk;
+	/* only known once measured since the slot was connected */
+	bool clk_stopped = clk_ctr_get(ci->clk_tclk, &clk) && clk.valid && !clk.hz;
+
+	return slot_sched_classify(ci->vcc_active_last, ci->rst_active_last, clk_stopped,
+				   card_emu_ch_idle(ci->ch));
+}
+
+/* move on to the next slot, once the connected one is between transactions */
+static void schedule_slot(struct cardem_inst *ci)
+{
+	int next;
+
+	next = slot_sched_poll(slot_activity(ci), jiffies);
+	if (next < 0)
+		return;
+
+	/* a character from the reader may just have started a transaction */
+	card_emu_uart_enable(ci->num, 0);
+	if (!rbuf_is_empty(&ci->rb)) {
+		card_emu_resume(ci->ch);
+		return;
+	}
+	switch_slot(ci, next);
+}
+#endif /* HAVE_SLOT_MUX */
+
 /* main loop function, called repeatedly */
 void mode_cardemu_run(void)
 {
 	struct llist_head *queue;
 	unsigned int i;
 
+	clk_ctr_poll();
+
 	for (i = 0; i < ARRAY_SIZE(cardem_inst); i++) {
 		struct cardem_inst *ci = &cardem_inst[i];
 
@@ -964,6 +1307,15 @@ void mode_cardemu_run(void)
 		}
 
 		process_io_statechg(ci);
+		process_clk(ci);
+#ifdef DETECT_VCC_BY_ADC
+		process_vcc(ci);
+#endif
+		process_modem_status(ci);
+#ifdef HAVE_SLOT_MUX
+		if (ci->num == 0)
+			schedule_slot(ci);
+#endif
 
 		/* first try to send any pending messages on IRQ */
 		usb_refill_to_host(ci->ep_int);
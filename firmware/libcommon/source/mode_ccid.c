@@ -138,6 +138,8 @@ void CCID_configure(void)
 void CCID_exit(void)
 {
 	PIO_DisableIt(&pinSmartCard);
+	ISO7816_XfrBlockTPDU_T0_Abort();
+	NVIC_DisableIRQ(IRQ_USART_SIM);
 	USART_SetTransmitterEnabled(usart_info.base, 0);
 	USART_SetReceiverEnabled(usart_info.base, 0);
 }
@@ -182,6 +184,12 @@ void CCID_init(void)
 	}
 }
 
+/* the T=0 engine exchanges the TPDUs with the card from the USART interrupt */
+void CCID_usart0_irq(void)
+{
+	ISO7816_IrqHandler();
+}
+
 /* main (idle/busy) loop of this USB configuration */
 void CCID_run(void)
 {
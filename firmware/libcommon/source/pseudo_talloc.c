@@ -18,13 +18,23 @@
 #include "utils.h"
 #include <osmocom/core/utils.h>
 
-/* TODO: this number should dynamically scale. We need at least one per IN/IRQ endpoint,
- * as well as at least 3 for every OUT endpoint.  Plus some more depending on the application */
-#define NUM_RCTX_SMALL 20
+/* one USB buffer of usb_buf.c plus its struct msgb (host builds with
+ * 64 bit pointers need to override this) */
+#ifndef RCTX_SIZE_SMALL
 #define RCTX_SIZE_SMALL 348
+#endif
+
+/* USB_ALLOC_SIZE_LARGE plus struct msgb */
+#ifndef RCTX_SIZE_LARGE
+#define RCTX_SIZE_LARGE 1092
+#endif
 
 static uint8_t msgb_data[NUM_RCTX_SMALL][RCTX_SIZE_SMALL] __attribute__((aligned(sizeof(long))));
 static uint8_t msgb_inuse[NUM_RCTX_SMALL];
+#if NUM_RCTX_LARGE > 0
+static uint8_t msgb_data_large[NUM_RCTX_LARGE][RCTX_SIZE_LARGE] __attribute__((aligned(sizeof(long))));
+static uint8_t msgb_inuse_large[NUM_RCTX_LARGE];
+#endif
 
 void *_talloc_zero(const void *ctx, size_t size, const char *name)
 {
@@ -32,11 +42,8 @@ void *_talloc_zero(const void *ctx, size_t size, const char *name)
 	unsigned long x;
 
 	local_irq_save(x);
-	if (size > RCTX_SIZE_SMALL) {
-		local_irq_restore(x);
-		TRACE_ERROR("%s() request too large(%d > %d)\r\n", __func__, size, RCTX_SIZE_SMALL);
-		return NULL;
-	}
+	if (size > RCTX_SIZE_SMALL)
+		goto large;
 
 	for (i = 0; i < ARRAY_SIZE(msgb_inuse); i++) {
 		if (!msgb_inuse[i]) {
@@ -47,7 +54,28 @@ void *_talloc_zero(const void *ctx, size_t size, const char *name)
 			return out;
 		}
 	}
+
+large:
+	/* also used when the small buffers are exhausted */
+#if NUM_RCTX_LARGE > 0
+	if (size <= RCTX_SIZE_LARGE) {
+		for (i = 0; i < ARRAY_SIZE(msgb_inuse_large); i++) {
+			if (!msgb_inuse_large[i]) {
+				uint8_t *out = msgb_data_large[i];
+				msgb_inuse_large[i] = 1;
+				memset(out, 0, size);
+				local_irq_restore(x);
+				return out;
+			}
+		}
+	}
+#endif
 	local_irq_restore(x);
+	if (size > RCTX_SIZE_SMALL && (NUM_RCTX_LARGE == 0 || size > RCTX_SIZE_LARGE)) {
+		TRACE_ERROR("%s() request too large(%d > %d)\r\n", __func__, size,
+			    NUM_RCTX_LARGE ? RCTX_SIZE_LARGE : RCTX_SIZE_SMALL);
+		return NULL;
+	}
 	TRACE_ERROR("%s() out of memory!\r\n", __func__);
 	return NULL;
 }
@@ -70,6 +98,20 @@ int _talloc_free(void *ptr, const char *location)
 			return 0;
 		}
 	}
+#if NUM_RCTX_LARGE > 0
+	for (i = 0; i < ARRAY_SIZE(msgb_inuse_large); i++) {
+		if (ptr == msgb_data_large[i]) {
+			if (!msgb_inuse_large[i]) {
+				TRACE_ERROR("%s: double_free by %s\r\n", __func__, location);
+				OSMO_ASSERT(0);
+			} else {
+				msgb_inuse_large[i] = 0;
+			}
+			local_irq_restore(x);
+			return 0;
+		}
+	}
+#endif
 
 	local_irq_restore(x);
 	TRACE_ERROR("%s: invalid pointer %p from %s\r\n", __func__, ptr, location);
@@ -88,6 +130,15 @@ void talloc_report(const void *ptr, FILE *f)
 		else
 			fputc('_', f);
 	}
+#if NUM_RCTX_LARGE > 0
+	fputc(' ', f);
+	for (i = 0; i < ARRAY_SIZE(msgb_inuse_large); i++) {
+		if (msgb_inuse_large[i])
+			fputc('X', f);
+		else
+			fputc('_', f);
+	}
+#endif
 	fprintf(f, "\r\n");
 }
 
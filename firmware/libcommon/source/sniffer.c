@@ -40,6 +40,7 @@
 #include "usb_buf.h"
 #include "simtrace_usb.h"
 #include "simtrace_prot.h"
+#include "clk_ctr.h"
 
 /*------------------------------------------------------------------------------
  *         Internal definitions
@@ -65,6 +66,7 @@ enum iso7816_3_sniff_state {
 	ISO7816_S_IN_PPS_REQ, /*!< while we are inside the PPS request */
 	ISO7816_S_WAIT_PPS_RSP, /*!< waiting for start of the PPS response */
 	ISO7816_S_IN_PPS_RSP, /*!< while we are inside the PPS request */
+	ISO7816_S_IN_BLOCK, /*!< inside a single T=1 block */
 };
 
 /*! Answer-To-Reset (ATR) sub-states of ISO7816_S_IN_ATR
@@ -111,6 +113,11 @@ enum tpdu_sniff_state {
 	TPDU_S_SW2, /*!< second status word */
 };
 
+/*! Maximum T=1 block size in bytes (prologue, information field and CRC)
+ *  @note defined in ISO/IEC 7816-3:2006(E) section 11.3
+ */
+#define MAX_BLOCK_SIZE (3+254+2)
+
 /*! Error flags we use to report USART errors via the ringbuffer */
 #define RBUF16_F_OVERRUN	0x0100
 #define RBUF16_F_FRAMING	0x0200
@@ -150,6 +157,9 @@ static struct ringbuf16 sniff_buffer;
 /* Flags  to know is the card status changed (see SIMTRACE_MSGT_DT_SNIFF_CHANGE flags) */
 static volatile uint32_t change_flags = 0;
 
+/* CLK measurement last reported to the host */
+static struct clk_ctr_state clk_reported;
+
 /* ISO 7816 variables */
 /*! ISO 7816-3 state */
 static enum iso7816_3_sniff_state iso_state = ISO7816_S_RESET;
@@ -193,10 +203,34 @@ static struct {
 	uint16_t packet_i;
 } g_tpdu;
 
+/*! Transmission protocol in use (T=0 or T=1)
+ *  @note the first offered by the ATR, or the one selected by PPS
+ */
+static uint8_t t_protocol = 0;
+
+static struct {
+	/*! Character Waiting Time (CWT) in ETU, between two characters of a block */
+	uint32_t cwt;
+	/*! Block Waiting Time (BWT) in ETU, between two blocks */
+	uint32_t bwt;
+	/*! CWI and BWI as indicated in the ATR */
+	uint8_t cwi;
+	uint8_t bwi;
+	/*! If CRC instead of LRC is used as Error Detection Code (EDC) */
+	bool crc;
+	/*! Current block, including prologue and EDC */
+	uint8_t block[MAX_BLOCK_SIZE];
+	/*! Current index in the block */
+	uint16_t block_i;
+} g_t1;
+
 /*! Waiting Time (WT)
  *  @note defined in ISO/IEC 7816-3:2006(E) section 8.1 and 10.2
+ *  @note in T=1, this is the CWT inside a block and the BWT otherwise
  */
 static uint32_t g_wt = 9600;
+/*! Remaining Waiting Time (WT), counted down by the receiver time-out (>16 bits) */
+static volatile uint32_t wt_remaining = 9600;
 
 /*------------------------------------------------------------------------------
  *         Internal functions
@@ -230,6 +264,39 @@ static void update_wt(uint8_t wi, uint8_t d, const char *cause)
 	TRACE_INFO("WT updated (wi=%u, d=%u, cause=%s) to %lu ETU\n\r", wi, d, cause, g_wt);
 }
 
+/*! Update the T=1 waiting times
+ *  @param[in] fidi Fi/Di factor as encoded in TA1
+ *  @note defined in ISO/IEC 7816-3:2006(E) section 11.4.3
+ */
+static void update_t1_wt(uint8_t fidi)
+{
+	int ratio = iso7816_3_compute_fd_ratio(fidi >> 4, fidi & 0x0f);
+
+	if (ratio <= 0) {
+		ratio = 372;
+	}
+	g_t1.cwt = 11 + (1UL << g_t1.cwi);
+	g_t1.bwt = 11 + ((960UL * 372 / ratio) << g_t1.bwi);
+	TRACE_INFO("T=1 CWT updated to %lu ETU, BWT to %lu ETU\n\r", g_t1.cwt, g_t1.bwt);
+}
+
+/*! Change the time-out of the receiver now
+ *  @param[in] wt new waiting time in ETU, counted from now on
+ *  @note unlike update_wt(), this also restarts the current time-out, which is needed
+ *  when switching between the CWT and the BWT of T=1
+ */
+static void restart_wt(uint32_t wt)
+{
+	unsigned long flags;
+
+	local_irq_save(flags);
+	g_wt = wt;
+	wt_remaining = wt;
+	sniff_usart.base->US_RTOR = wt > 0xffff ? 0xffff : wt;
+	sniff_usart.base->US_CR |= US_CR_RETTO;
+	local_irq_restore(flags);
+}
+
 /*! Allocate USB buffer and push + initialize simtrace_msg_hdr
  *  @param[in] ep USB IN endpoint where the message will be sent to
  *  @param[in] msg_class SIMtrace USB message class
@@ -238,15 +305,12 @@ static void update_wt(uint8_t wi, uint8_t d, const char *cause)
  */
 static struct msgb *usb_msg_alloc_hdr(uint8_t ep, uint8_t msg_class, uint8_t msg_type)
 {
-	/* Only allocate message if not too many are already in the queue */
-	struct llist_head *head = usb_get_queue(ep);
-	if (!head) {
-		return NULL;
-	}
-	if (llist_count(head) > 5) {
-		return NULL;
-	}
+	/* the queue grows as far as the buffer pool allows (see usb_buf_submit()),
+	 * and only once it is exhausted the oldest data is dropped */
 	struct msgb *usb_msg = usb_buf_alloc(ep);
+	if (!usb_msg && usb_buf_evict() == 0) {
+		usb_msg = usb_buf_alloc(ep);
+	}
 	if (!usb_msg) {
 		return NULL;
 	}
@@ -296,6 +360,7 @@ static void change_state(enum iso7816_3_sniff_state iso_state_new)
 	case ISO7816_S_RESET:
 		update_fidi(&sniff_usart, 0x11); /* reset baud rate to default Di/Fi values */
 		update_wt(10, 1, "RESET"); /* reset WT time-out */
+		t_protocol = 0;
 		break;
 	case ISO7816_S_WAIT_ATR:
 		rbuf16_reset(&sniff_buffer); /* reset buffer for new communication */
@@ -313,6 +378,13 @@ static void change_state(enum iso7816_3_sniff_state iso_state_new)
 	case ISO7816_S_WAIT_TPDU:
 		change_tpdu_state(TPDU_S_CLA);
 		g_tpdu.packet_i = 0;
+		g_t1.block_i = 0;
+		if (1 == t_protocol && ISO7816_S_IN_BLOCK == iso_state) {
+			restart_wt(g_t1.bwt); /* the next block is expected within BWT */
+		}
+		break;
+	case ISO7816_S_IN_BLOCK:
+		restart_wt(g_t1.cwt); /* the block ends if no character follows within CWT */
 		break;
 	default:
 		break;
@@ -347,7 +419,8 @@ static void print_flags(const struct value_string* flag_meanings, uint32_t nb_fl
 static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data, uint16_t length, uint32_t flags)
 {
 	/* Sanity check */
-	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS && type != SIMTRACE_MSGT_SNIFF_TPDU) {
+	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS &&
+	    type != SIMTRACE_MSGT_SNIFF_TPDU && type != SIMTRACE_MSGT_SNIFF_BLOCK) {
 		return;
 	}
 
@@ -365,6 +438,9 @@ static void usb_send_data(enum simtrace_msg_type_sniff type, const uint8_t* data
 	case SIMTRACE_MSGT_SNIFF_TPDU:
 		printf("TPDU");
 		break;
+	case SIMTRACE_MSGT_SNIFF_BLOCK:
+		printf("BLOCK");
+		break;
 	default:
 		printf("???");
 		break;
@@ -525,8 +601,26 @@ static void process_byte_atr(uint8_t byte)
 				 */
 			}
 		}
+		/* the first offered protocol is used, unless PPS selects another one */
+		struct iso7816_3_atr_params atr_params;
+		if (0 == iso7816_3_atr_parse(g_atr.atr, g_atr.atr_i, &atr_params)) {
+			t_protocol = atr_params.t;
+			g_t1.cwi = atr_params.cwi;
+			g_t1.bwi = atr_params.bwi;
+			g_t1.crc = atr_params.crc;
+		} else {
+			t_protocol = 0;
+		}
+		if (t_protocol > 1) {
+			TRACE_WARNING("T=%u not supported, assuming T=0\n\r", t_protocol);
+			t_protocol = 0;
+		}
+		update_t1_wt(ISO7816_3_DEFAULT_FIDI);
 		usb_send_atr(flags); /* send ATR to host software using USB */
 		change_state(ISO7816_S_WAIT_TPDU); /* go to next state */
+		if (1 == t_protocol) {
+			restart_wt(g_t1.bwt); /* the first block is expected within BWT */
+		}
 		break;
 	default:
 		TRACE_INFO("Unknown ATR state %u\n\r", g_atr.state);
@@ -589,6 +683,7 @@ static void usb_send_fidi(uint8_t fidi)
 	}
 	struct sniff_fidi *usb_sniff_fidi = (struct sniff_fidi *) msgb_put(usb_msg, sizeof(*usb_sniff_fidi));
 	usb_sniff_fidi->fidi = fidi;
+	usb_buf_set_prio(usb_msg); /* needed to decode everything which follows */
 	usb_msg_upd_len_and_submit(usb_msg);
 }
 
@@ -685,10 +780,19 @@ static void process_byte_pps(uint8_t byte)
 				update_fidi(&sniff_usart, pps_cur[2]);
 				update_wt(0, iso7816_3_di_table[dn], "PPS");
 				usb_send_fidi(pps_cur[2]); /* send Fi/Di change notification to host software over USB */
+				t_protocol = pps_cur[1] & 0x0f;
+				if (t_protocol > 1) {
+					TRACE_WARNING("T=%u not supported, assuming T=0\n\r", t_protocol);
+					t_protocol = 0;
+				}
+				update_t1_wt((fn << 4) | dn);
 			} else { /* checksum is invalid */
 				TRACE_INFO("PPS negotiation failed\n\r");
 			}
 			change_state(ISO7816_S_WAIT_TPDU); /* go to next state */
+			if (1 == t_protocol) {
+				restart_wt(g_t1.bwt); /* the first block is expected within BWT */
+			}
 		}
 		break;
 	case PPS_S_WAIT_END:
@@ -817,12 +921,71 @@ static void process_byte_tpdu(uint8_t byte)
 	}
 }
 
+/*! Send current T=1 block over USB
+ *  @param[in] flags SNIFF_DATA_FLAG_ data flags
+ *  @note Also print the block over the debug console
+ */
+static void usb_send_block(uint32_t flags)
+{
+	/* Check state */
+	if (ISO7816_S_IN_BLOCK != iso_state) {
+		TRACE_WARNING("Can't print block in ISO 7816-3 state %u\n\r", iso_state);
+		return;
+	}
+
+	/* Send block over USB */
+	usb_send_data(SIMTRACE_MSGT_SNIFF_BLOCK, g_t1.block, g_t1.block_i, flags);
+}
+
+/*! Process T=1 block byte
+ *  @param[in] byte block byte to process
+ *  @note defined in ISO/IEC 7816-3:2006(E) section 11.3
+ *  @remark the direction of the block can't be told from the line, only from the block sequence
+ */
+static void process_byte_t1(uint8_t byte)
+{
+	uint8_t edc[2];
+	unsigned int edc_len = g_t1.crc ? 2 : 1;
+
+	/* sanity check */
+	if (ISO7816_S_IN_BLOCK != iso_state) {
+		TRACE_ERROR("Processing T=1 data in wrong ISO 7816-3 state %u\n\r", iso_state);
+		return;
+	}
+	if (g_t1.block_i >= ARRAY_SIZE(g_t1.block)) {
+		TRACE_ERROR("T=1 block data overflow\n\r");
+		return;
+	}
+
+	g_t1.block[g_t1.block_i++] = byte;
+
+	/* LEN: 0xff is reserved */
+	if (3 == g_t1.block_i && 0xff == byte) {
+		TRACE_WARNING("invalid LEN 0x%02x\n\r", byte);
+		led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
+		usb_send_block(SNIFF_DATA_FLAG_ERROR_MALFORMED); /* send block to host software using USB */
+		change_state(ISO7816_S_WAIT_TPDU); /* go back to TPDU state */
+		return;
+	}
+
+	/* wait for the complete block */
+	if (g_t1.block_i < 3 || g_t1.block_i < 3 + g_t1.block[2] + edc_len) {
+		return;
+	}
+
+	iso7816_3_t1_edc(edc, g_t1.block, 3 + g_t1.block[2], g_t1.crc);
+	if (memcmp(edc, &g_t1.block[3 + g_t1.block[2]], edc_len)) {
+		led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
+		usb_send_block(SNIFF_DATA_FLAG_ERROR_CHECKSUM); /* send block to host software using USB */
+	} else {
+		usb_send_block(0); /* send block to host software using USB */
+	}
+	change_state(ISO7816_S_WAIT_TPDU); /* this is the end of the block */
+}
+
 /*! Interrupt Service Routine called on USART activity */
 void Sniffer_usart_isr(void)
 {
-	/* Remaining Waiting Time (WI) counter (>16 bits) */
-	static volatile uint32_t wt_remaining = 9600;
-
 	/* Read channel status register */
 	uint32_t csr = sniff_usart.base->US_CSR;
 
@@ -938,6 +1101,7 @@ void Sniffer_exit(void)
 	/* Disable RST IRQ */
 	PIO_DisableIt(&pin_rst);
 	NVIC_DisableIRQ(PIOA_IRQn); /* CAUTION this needs to match to the correct port */
+	clk_ctr_exit();
 }
 
 /* called when *Sniffer* configuration is set by host */
@@ -947,6 +1111,11 @@ void Sniffer_init(void)
 
 	/* Configure pins to sniff communication between phone and card */
 	PIO_Configure(pins_sniff, PIO_LISTSIZE(pins_sniff));
+	/* Configure pins to measure the CLK frequency */
+	PIO_Configure(pins_tc, PIO_LISTSIZE(pins_tc));
+	clk_ctr_init();
+	clk_ctr_add(CLK_CTR_TCLK0);
+	memset(&clk_reported, 0, sizeof(clk_reported));
 	/* Configure pins to connect phone to card */
 	PIO_Configure(pins_bus, PIO_LISTSIZE(pins_bus));
 	/* Configure pins to forward phone power to card */
@@ -1002,23 +1171,76 @@ static void usb_send_change(uint32_t flags)
 	}
 	struct sniff_change *usb_sniff_change = (struct sniff_change *) msgb_put(usb_msg, sizeof(*usb_sniff_change));
 	usb_sniff_change->flags = flags;
+	usb_buf_set_prio(usb_msg); /* card changes are not dropped in favour of data */
 	usb_msg_upd_len_and_submit(usb_msg);
 }
 
+/*! Send the measured CLK over USB
+ *  @param[in] clk measurement, with the frequency being 0 if the clock is stopped
+ */
+static void usb_send_clk(const struct clk_ctr_state *clk)
+{
+	if (clk->hz)
+		printf("CLK %lu Hz\n\r", clk->hz);
+	else
+		printf("CLK stopped\n\r");
+
+	/* Send message over USB */
+	struct msgb *usb_msg = usb_msg_alloc_hdr(SIMTRACE_USB_EP_CARD_DATAIN, SIMTRACE_MSGC_SNIFF, SIMTRACE_MSGT_SNIFF_CLK);
+	if (!usb_msg) {
+		return;
+	}
+	struct sniff_clk *usb_sniff_clk = (struct sniff_clk *) msgb_put(usb_msg, sizeof(*usb_sniff_clk));
+	usb_sniff_clk->hz = clk->hz;
+	usb_sniff_clk->stops = clk->stops;
+	usb_buf_set_prio(usb_msg); /* needed to convert the etu of what follows */
+	usb_msg_upd_len_and_submit(usb_msg);
+}
+
+/* handle the requests of the host.  Sniffing needs no configuration, the host
+ * only asks for the board information */
+static void process_any_usb_commands(struct llist_head *queue)
+{
+	struct llist_head *lh;
+	struct simtrace_msg_hdr *mh;
+	struct msgb *msg;
+
+	while ((lh = llist_head_dequeue_irqsafe(queue))) {
+		msg = llist_entry(lh, struct msgb, list);
+		/* the requests are small: they don't span USB buffers */
+		while (msgb_length(msg) >= sizeof(*mh)) {
+			mh = (struct simtrace_msg_hdr *) msgb_data(msg);
+			if (mh->msg_len < sizeof(*mh) || mh->msg_len > msgb_length(msg))
+				break;
+			if (mh->msg_class == SIMTRACE_MSGC_GENERIC &&
+			    mh->msg_type == SIMTRACE_CMD_BD_BOARD_INFO)
+				usb_send_board_info(SIMTRACE_USB_EP_CARD_DATAIN, APPLICATION, USB_OUT_READ_SIZE);
+			msgb_pull(msg, mh->msg_len);
+		}
+		usb_buf_free(msg);
+	}
+}
+
 /* Main (idle/busy) loop of this USB configuration */
 void Sniffer_run(void)
 {
+	struct clk_ctr_state clk;
+
 	/* Handle USB queue */
 	/* first try to send any pending messages on INT */
 	usb_refill_to_host(SIMTRACE_USB_EP_CARD_INT);
 	/* then try to send any pending messages on IN */
 	usb_refill_to_host(SIMTRACE_USB_EP_CARD_DATAIN);
 	/* ensure we can handle incoming USB messages from the host */
-	/* currently we don't need any incoming data
 	usb_refill_from_host(SIMTRACE_USB_EP_CARD_DATAOUT);
-	struct llist_head *queue = usb_get_queue(SIMTRACE_USB_EP_CARD_DATAOUT);
-	process_any_usb_commands(queue);
-	*/
+	process_any_usb_commands(usb_get_queue(SIMTRACE_USB_EP_CARD_DATAOUT));
+
+	/* Report the CLK once measured, and when it stops or changes */
+	clk_ctr_poll();
+	if (clk_ctr_get(CLK_CTR_TCLK0, &clk) && clk_ctr_changed(&clk, &clk_reported)) {
+		usb_send_clk(&clk);
+		clk_reported = clk;
+	}
 
 	/* WARNING: the signal data and flags are not synchronized. We have to hope 
 	 * the processing is fast enough to not land in the wrong state while data
@@ -1056,10 +1278,15 @@ void Sniffer_run(void)
 					break;
 				}
 			case ISO7816_S_IN_TPDU: /* More TPDU data incoming */
+			case ISO7816_S_IN_BLOCK: /* More T=1 block data incoming */
 				if (ISO7816_S_WAIT_TPDU == iso_state) {
-					change_state(ISO7816_S_IN_TPDU);
+					change_state(1 == t_protocol ? ISO7816_S_IN_BLOCK : ISO7816_S_IN_TPDU);
+				}
+				if (ISO7816_S_IN_BLOCK == iso_state) {
+					process_byte_t1(byte);
+				} else {
+					process_byte_tpdu(byte);
 				}
-				process_byte_tpdu(byte);
 				break;
 			case ISO7816_S_IN_PPS_REQ:
 			case ISO7816_S_IN_PPS_RSP:
@@ -1084,6 +1311,11 @@ void Sniffer_run(void)
 				usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
 				change_state(ISO7816_S_WAIT_TPDU);
 				break;
+			case ISO7816_S_IN_BLOCK: /* CWT exceeded */
+				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
+				usb_send_block(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete block to host software using USB */
+				change_state(ISO7816_S_WAIT_TPDU);
+				break;
 			case ISO7816_S_IN_PPS_REQ:
 			case ISO7816_S_IN_PPS_RSP:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
@@ -1115,6 +1347,10 @@ void Sniffer_run(void)
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
 				usb_send_tpdu(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete PPS to host software using USB */
 				break;
+			case ISO7816_S_IN_BLOCK:
+				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
+				usb_send_block(SNIFF_DATA_FLAG_ERROR_INCOMPLETE); /* send incomplete block to host software using USB */
+				break;
 			case ISO7816_S_IN_PPS_REQ:
 			case ISO7816_S_IN_PPS_RSP:
 				led_blink(LED_RED, BLINK_2F_O); /* indicate error to user */
@@ -247,10 +247,10 @@ static const CCIDDriverConfigurationDescriptors configurationDescriptorCCID = {
 		.bVoltageSupport	= VOLTS_3_0,
 		.dwProtocols		= (1 << PROTOCOL_TO),
 		.dwDefaultClock		= 3580,
-		.dwMaximumClock		= 3580,
+		.dwMaximumClock		= ISO7816_MAX_CLOCK_KHZ,
 		.bNumClockSupported	= 0,
 		.dwDataRate		= 9600,
-		.dwMaxDataRate		= 9600,
+		.dwMaxDataRate		= ISO7816_MAX_CLOCK_KHZ * 1000 / 8,	/* Fi 512, Di 64 */
 		.bNumDataRatesSupported = 0,
 		.dwMaxIFSD		= 0xfe,
 		.dwSynchProtocols	= 0,
@@ -496,10 +496,10 @@ static const SIMTraceDriverConfigurationDescriptorMITM
 		.bVoltageSupport	= VOLTS_3_0,
 		.dwProtocols		= (1 << PROTOCOL_TO),
 		.dwDefaultClock		= 3580,
-		.dwMaximumClock		= 3580,
+		.dwMaximumClock		= ISO7816_MAX_CLOCK_KHZ,
 		.bNumClockSupported	= 0,
 		.dwDataRate		= 9600,
-		.dwMaxDataRate		= 9600,
+		.dwMaxDataRate		= ISO7816_MAX_CLOCK_KHZ * 1000 / 8,	/* Fi 512, Di 64 */
 		.bNumDataRatesSupported = 0,
 		.dwMaxIFSD		= 0xfe,
 		.dwSynchProtocols	= 0,
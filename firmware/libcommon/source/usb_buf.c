@@ -14,15 +14,19 @@
 #include "trace.h"
 #include "usb_buf.h"
 #include "simtrace_usb.h"
+#include "talloc.h"
+#include "utils.h"
 
 #include <osmocom/core/linuxlist.h>
 #include <osmocom/core/msgb.h>
 #include <errno.h>
 
-#define USB_ALLOC_SIZE	280
-#define USB_MAX_QLEN	3
+/* all buffers of the pool; the large ones are used once the regular ones are exhausted */
+#define USB_BUF_POOL_SIZE	(NUM_RCTX_SMALL + NUM_RCTX_LARGE)
 
 static struct usb_buffered_ep usb_buffered_ep[BOARD_USB_NUMENDPOINTS];
+/* buffers currently taken from the pool (also released from the USB interrupt) */
+static volatile unsigned int usb_bufs_in_use;
 
 struct usb_buffered_ep *usb_get_buf_ep(uint8_t ep)
 {
@@ -44,6 +48,23 @@ struct llist_head *usb_get_queue(uint8_t ep)
 	return &bep->queue;
 }
 
+static void usb_bufs_in_use_add(int delta)
+{
+	unsigned long x;
+
+	local_irq_save(x);
+	usb_bufs_in_use += delta;
+	local_irq_restore(x);
+}
+
+/* number of buffers left in the pool */
+unsigned int usb_buf_num_free(void)
+{
+	unsigned int in_use = usb_bufs_in_use;
+
+	return in_use < USB_BUF_POOL_SIZE ? USB_BUF_POOL_SIZE - in_use : 0;
+}
+
 /* allocate a USB buffer for use with given end-point */
 struct msgb *usb_buf_alloc(uint8_t ep)
 {
@@ -52,6 +73,23 @@ struct msgb *usb_buf_alloc(uint8_t ep)
 	msg = msgb_alloc(USB_ALLOC_SIZE, "USB");
 	if (!msg)
 		return NULL;
+	usb_bufs_in_use_add(1);
+	msg->dst = usb_get_buf_ep(ep);
+	return msg;
+}
+
+/* allocate a USB buffer of at least the given size (up to USB_ALLOC_SIZE_LARGE),
+ * e.g. for a message which spans several receive buffers of an OUT endpoint */
+struct msgb *usb_buf_alloc_size(uint8_t ep, uint16_t size)
+{
+	struct msgb *msg;
+
+	if (size > USB_ALLOC_SIZE_LARGE)
+		return NULL;
+	msg = msgb_alloc(size > USB_ALLOC_SIZE ? USB_ALLOC_SIZE_LARGE : USB_ALLOC_SIZE, "USB");
+	if (!msg)
+		return NULL;
+	usb_bufs_in_use_add(1);
 	msg->dst = usb_get_buf_ep(ep);
 	return msg;
 }
@@ -60,12 +98,80 @@ struct msgb *usb_buf_alloc(uint8_t ep)
 void usb_buf_free(struct msgb *msg)
 {
 	msgb_free(msg);
+	usb_bufs_in_use_add(-1);
+}
+
+/* mark a USB buffer as status message: it is only evicted from the queue of its
+ * endpoint by a newer status message, never in favour of data */
+void usb_buf_set_prio(struct msgb *msg)
+{
+	msg->cb[USB_BUF_CB_FLAGS] |= USB_BUF_F_PRIO;
+}
+
+static bool usb_buf_is_prio(const struct msgb *msg)
+{
+	return msg->cb[USB_BUF_CB_FLAGS] & USB_BUF_F_PRIO;
+}
+
+/* oldest status (prio) or data (!prio) message in the queue of an endpoint */
+static struct msgb *queue_oldest(struct usb_buffered_ep *ep, bool prio, unsigned int *count)
+{
+	struct msgb *msg, *oldest = NULL;
+
+	*count = 0;
+	llist_for_each_entry(msg, &ep->queue, list) {
+		if (usb_buf_is_prio(msg) != prio)
+			continue;
+		if (!oldest)
+			oldest = msg;
+		(*count)++;
+	}
+	return oldest;
+}
+
+static void queue_evict(struct usb_buffered_ep *ep, struct msgb *msg)
+{
+	llist_del(&msg->list);
+	ep->queue_len--;
+	usb_buf_free(msg);
+}
+
+/* make room in the pool by freeing the oldest data message of the longest data
+ * queue of all IN endpoints.  Returns -ENOSPC if no data message is queued */
+int usb_buf_evict(void)
+{
+	struct usb_buffered_ep *ep = NULL;
+	struct msgb *msg, *evict = NULL;
+	unsigned int i, count, max = 0;
+
+	for (i = 0; i < ARRAY_SIZE(usb_buffered_ep); i++) {
+		if (usb_buffered_ep[i].out_from_host)
+			continue;
+		msg = queue_oldest(&usb_buffered_ep[i], false, &count);
+		if (count > max) {
+			max = count;
+			ep = &usb_buffered_ep[i];
+			evict = msg;
+		}
+	}
+	if (!evict)
+		return -ENOSPC;
+
+	TRACE_INFO("EP%02x: dropping oldest data message (qlen=%u)\r\n",
+		   ep->ep, ep->queue_len);
+	queue_evict(ep, evict);
+	ep->num_evicted++;
+	return 0;
 }
 
-/* submit a USB buffer for transmission to host */
+/* submit a USB buffer for transmission to host.  The data queues grow as long as
+ * the pool has more than USB_BUF_RESERVE buffers left, so that a stalled host
+ * loses as little as possible */
 int usb_buf_submit(struct msgb *msg)
 {
 	struct usb_buffered_ep *ep = msg->dst;
+	struct msgb *evict;
+	unsigned int count;
 
 	if (!msg->dst) {
 		TRACE_ERROR("%s: msg without dst\r\n", __func__);
@@ -76,14 +182,19 @@ int usb_buf_submit(struct msgb *msg)
 	/* no need for irqsafe operation, as the usb_tx_queue is
 	 * processed only by the main loop context */
 
-	if (ep->queue_len >= USB_MAX_QLEN) {
-		struct msgb *evict;
-		/* free the first pending buffer in the queue */
-		TRACE_INFO("EP%02x: dropping first queue element (qlen=%u)\r\n",
-			   ep->ep, ep->queue_len);
-		evict = msgb_dequeue_count(&ep->queue, &ep->queue_len);
-		OSMO_ASSERT(evict);
-		usb_buf_free(evict);
+	if (ep->status_only)
+		usb_buf_set_prio(msg);
+
+	if (usb_buf_is_prio(msg)) {
+		evict = queue_oldest(ep, true, &count);
+		if (count >= USB_MAX_QLEN_PRIO) {
+			TRACE_INFO("EP%02x: dropping oldest status message (qlen=%u)\r\n",
+				   ep->ep, ep->queue_len);
+			queue_evict(ep, evict);
+		}
+	} else if (usb_buf_num_free() < USB_BUF_RESERVE) {
+		/* if only status messages are queued, they keep their buffers */
+		usb_buf_evict();
 	}
 
 	msgb_enqueue_count(&ep->queue, msg, &ep->queue_len);
@@ -97,6 +208,11 @@ void usb_buf_init(void)
 	for (i = 0; i < ARRAY_SIZE(usb_buffered_ep); i++) {
 		struct usb_buffered_ep *ep = &usb_buffered_ep[i];
 		INIT_LLIST_HEAD(&ep->queue);
+		INIT_LLIST_HEAD(&ep->out_posted);
 		ep->ep = i;
+		/* the endpoints are the same in all configurations using usb_buf */
+		ep->out_from_host = i == SIMTRACE_USB_EP_CARD_DATAOUT ||
+				    i == SIMTRACE_USB_EP_PHONE_DATAOUT;
+		ep->status_only = i == SIMTRACE_USB_EP_CARD_INT || i == SIMTRACE_USB_EP_PHONE_INT;
 	}
 }
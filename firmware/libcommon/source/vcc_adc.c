@@ -0,0 +1,218 @@
+/* decimation of the VCC samples of the ADC
+ *
+ * The ADC converts the VCC of the slots continuously, and the PDC writes the
+ * samples into buffers, tagged with the channel number.  Each buffer is reduced
+ * to its min/max/avg per channel, which give the state of VCC and its class.
+ * The buffers are further reduced to the min/max/avg of a window, which is
+ * passed to card_emu after VCC_ADC_WINDOW_MS, or at once after an event: a new
+ * class, or a glitch of VCC.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>
+#include <string.h>
+
+#include "boardver_adc.h"
+#include "simtrace_prot.h"
+#include "vcc_adc.h"
+
+#define MAX_CHANS	2
+
+/* buffers to drop after a restart: the one being written, and the one whose
+ * interrupt may be pending */
+#define RESTART_SKIP_BUFS	2
+
+/* min/max/sum of the samples of a channel in a buffer */
+struct buf_stats {
+	uint16_t min;
+	uint16_t max;
+	uint32_t sum;
+	uint32_t num;
+};
+
+static uint8_t get_class(const struct vcc_adc_thresh *t, uint32_t uv)
+{
+	if (t->class_a_uv && uv >= t->class_a_uv)
+		return CEMU_VCC_CLASS_A;
+	if (t->class_b_uv && uv >= t->class_b_uv)
+		return CEMU_VCC_CLASS_B;
+	if (uv >= t->class_c_uv)
+		return CEMU_VCC_CLASS_C;
+	return CEMU_VCC_CLASS_NONE;
+}
+
+static void window_reset(struct vcc_adc_chan *c, uint32_t now_ms)
+{
+	c->min = 0xffff;
+	c->max = 0;
+	c->sum = 0;
+	c->num = 0;
+	c->glitches = 0;
+	c->window_start = now_ms;
+}
+
+static void window_close(struct vcc_adc_chan *c, uint32_t now_ms)
+{
+	if (c->num) {
+		c->st.min_uv = adc2uv(c->min);
+		c->st.max_uv = adc2uv(c->max);
+		c->st.avg_uv = adc2uv(c->sum / c->num);
+	}
+	c->st.vcc_class = c->vcc_class;
+	c->st.glitches = c->glitches;
+	c->st.valid = true;
+	c->new = true;
+	window_reset(c, now_ms);
+}
+
+void vcc_adc_chan_init(struct vcc_adc_chan *c, uint8_t adc_ch, const struct vcc_adc_thresh *thresh,
+		       uint32_t now_ms)
+{
+	memset(c, 0, sizeof(*c));
+	c->adc_ch = adc_ch;
+	c->thresh = thresh;
+	vcc_adc_chan_restart(c, now_ms);
+	/* nothing was measured before */
+	c->skip = 0;
+}
+
+/* another VCC is connected to the channel (slot mux): forget the measurement,
+ * and the samples of the previous VCC */
+void vcc_adc_chan_restart(struct vcc_adc_chan *c, uint32_t now_ms)
+{
+	c->vcc_class = CEMU_VCC_CLASS_NONE;
+	c->class_pending = CEMU_VCC_CLASS_NONE;
+	c->in_dip = false;
+	c->dip_pending = false;
+	c->level_uv = 0;
+	c->skip = RESTART_SKIP_BUFS;
+	memset(&c->st, 0, sizeof(c->st));
+	c->new = false;
+	window_reset(c, now_ms);
+}
+
+static void process_buf(struct vcc_adc_chan *c, const struct buf_stats *b, uint32_t now_ms)
+{
+	uint32_t min_uv, avg_uv;
+	bool event = false;
+	uint8_t cls;
+
+	if (!b->num)
+		return;
+	if (c->skip) {
+		if (--c->skip == 0)
+			window_reset(c, now_ms);
+		return;
+	}
+
+	min_uv = adc2uv(b->min);
+	avg_uv = adc2uv(b->sum / b->num);
+	c->avg_uv = avg_uv;
+	c->active = avg_uv >= c->thresh->on_uv;
+
+	/* a class is taken once measured in two buffers in a row, not to report
+	 * the lower ones VCC passes through while ramping up */
+	cls = get_class(c->thresh, avg_uv);
+	if (cls != c->vcc_class && cls == c->class_pending) {
+		c->vcc_class = cls;
+		c->level_uv = cls == CEMU_VCC_CLASS_NONE ? 0 : avg_uv;
+		c->in_dip = false;
+		c->dip_pending = false;
+		event = true;
+	}
+	c->class_pending = cls;
+
+	/* a drop below 90% of the level (the lower limit of each class in ISO
+	 * 7816-3) is a glitch if VCC is still active in the next buffer: else it
+	 * was switched off.  A drop lasting several buffers is counted once */
+	if (c->dip_pending) {
+		c->dip_pending = false;
+		if (c->active) {
+			c->glitches++;
+			c->in_dip = true;
+			event = true;
+		}
+	}
+	if (c->active && c->vcc_class != CEMU_VCC_CLASS_NONE) {
+		if (min_uv < c->level_uv / 10 * 9) {
+			if (!c->in_dip)
+				c->dip_pending = true;
+		} else
+			c->in_dip = false;
+		if (avg_uv > c->level_uv)
+			c->level_uv = avg_uv;
+	} else
+		c->in_dip = false;
+
+	if (b->min < c->min)
+		c->min = b->min;
+	if (b->max > c->max)
+		c->max = b->max;
+	c->sum += b->sum;
+	c->num += b->num;
+
+	if (event || now_ms - c->window_start >= VCC_ADC_WINDOW_MS)
+		window_close(c, now_ms);
+}
+
+/*! Process a buffer of samples written by the PDC.  Called from the ADC
+ *  interrupt.
+ *  \param[in] chans channels measuring VCC
+ *  \param[in] samples ADC_LCDR values, with the channel number (TAG)
+ *  \param[in] now_ms current time in ms */
+void vcc_adc_process(struct vcc_adc_chan *chans, unsigned int num_chans,
+		     const uint16_t *samples, unsigned int num, uint32_t now_ms)
+{
+	struct buf_stats b[MAX_CHANS];
+	unsigned int i, j;
+
+	if (num_chans > MAX_CHANS)
+		num_chans = MAX_CHANS;
+	for (j = 0; j < num_chans; j++) {
+		b[j].min = 0xffff;
+		b[j].max = 0;
+		b[j].sum = 0;
+		b[j].num = 0;
+	}
+
+	for (i = 0; i < num; i++) {
+		uint8_t ch = samples[i] >> 12;
+		uint16_t val = samples[i] & 0xfff;
+
+		for (j = 0; j < num_chans; j++) {
+			if (chans[j].adc_ch != ch)
+				continue;
+			if (val < b[j].min)
+				b[j].min = val;
+			if (val > b[j].max)
+				b[j].max = val;
+			b[j].sum += val;
+			b[j].num++;
+			break;
+		}
+	}
+
+	for (j = 0; j < num_chans; j++)
+		process_buf(&chans[j], &b[j], now_ms);
+}
+
+/*! Get the last window measured on a channel.  To be called with the ADC
+ *  interrupt disabled.
+ *  \param[out] st last window
+ *  \returns whether a window was measured since the last call */
+bool vcc_adc_get(struct vcc_adc_chan *c, struct vcc_adc_state *st)
+{
+	bool new = c->new;
+
+	*st = c->st;
+	c->new = false;
+	return new;
+}
@@ -0,0 +1,18 @@
+/* SITL: definitions of the emulated board
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+/* pull in the definitions of the SIMtrace board, then redirect the peripherals
+ * used by the firmware to their emulation in sitl_hw.c */
+#include "../libboard/simtrace/include/board.h"
+#include "sitl.h"
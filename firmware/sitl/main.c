@@ -0,0 +1,227 @@
+/* SITL: host build of the cardem and trace (sniffer) firmware
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "simtrace.h"
+#include "simtrace_usb.h"
+#include "usb_buf.h"
+#include "boot_time.h"
+#include "utils.h"
+
+#include <osmocom/core/timer.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/* not declared by the stdio.h of the firmware, which shadows the one of the host */
+int fflush(FILE *stream);
+int setvbuf(FILE *stream, char *buf, int mode, size_t size);
+#define _IOLBF	1
+
+/* the SITL does not wait longer than this in one iteration, so that
+ * time-outs of the firmware itself are still serviced */
+#define MAX_POLL_MS	10
+
+static char **g_argv;
+
+signed int vfprintf_sync(FILE *pStream, const char *pFormat, va_list ap)
+{
+	int rc = vfprintf(pStream, pFormat, ap);
+
+	fflush(pStream);
+	return rc;
+}
+
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	int rc;
+
+	va_start(ap, pFormat);
+	rc = vfprintf_sync(stdout, pFormat, ap);
+	va_end(ap);
+	return rc;
+}
+
+/* the firmware resets on USB disconnect: start over with a fresh process */
+void sitl_system_reset(void)
+{
+	TRACE_INFO("Resetting\r\n");
+	fflush(stdout);
+	execv("/proc/self/exe", g_argv);
+	exit(1);
+}
+
+/* advance the emulated peripherals to the current time */
+static int sitl_service(uint64_t *next)
+{
+	uint64_t now = sitl_now_us();
+	int events = 0;
+
+	*next = now + MAX_POLL_MS * 1000;
+	events += sitl_line_service(now, next);
+	events += sitl_usart_service(now, next);
+	events += sitl_usb_service();
+
+	return events;
+}
+
+int sitl_poll(int timeout_ms)
+{
+	struct pollfd pfd[4];
+	struct timespec ts;
+	unsigned int nfds = 0, i;
+	uint64_t now, next, wait_us = 0;
+	int events;
+
+	/* first act upon what the main loop has done */
+	events = sitl_service(&next);
+
+	sitl_line_add_fds(pfd, &nfds);
+	sitl_usb_add_fds(pfd, &nfds);
+
+	/* then wait for the peers, or the next deadline of the peripherals */
+	now = sitl_now_us();
+	if (!events && next > now) {
+		wait_us = next - now;
+		if (timeout_ms >= 0 && (uint64_t) timeout_ms * 1000 < wait_us)
+			wait_us = timeout_ms * 1000;
+	}
+	ts.tv_sec = wait_us / 1000000;
+	ts.tv_nsec = (wait_us % 1000000) * 1000;
+
+	if (ppoll(pfd, nfds, &ts, NULL) > 0) {
+		for (i = 0; i < nfds; i++) {
+			events += sitl_line_handle_fds(&pfd[i]);
+			events += sitl_usb_handle_fds(&pfd[i]);
+		}
+	}
+
+	events += sitl_service(&next);
+
+	return events;
+}
+
+static void print_help(void)
+{
+	printf("Usage: simtrace2-" APPLICATION "-sitl [-u USB_SOCKET] [-l LINE_SOCKET_OR_FILE] [-c CLK_HZ]\n"
+	       "\t-u\tunix domain socket on which the USB device is served (default: " APPLICATION "-usb.sock)\n"
+	       "\t-l\tunix domain socket on which the ISO 7816 line is served, or file to replay\n"
+	       "\t\t(default: " APPLICATION "-line.sock)\n"
+	       "\t-c\tfrequency of the CLK signal in Hz (default: 3571200)\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *usb_path = APPLICATION "-usb.sock";
+	const char *line_path = APPLICATION "-line.sock";
+	unsigned long clk_hz = 0;
+	int opt;
+
+	g_argv = argv;
+
+	while ((opt = getopt(argc, argv, "u:l:c:h")) != -1) {
+		switch (opt) {
+		case 'u':
+			usb_path = optarg;
+			break;
+		case 'l':
+			line_path = optarg;
+			break;
+		case 'c':
+			clk_hz = strtoul(optarg, NULL, 0);
+			break;
+		default:
+			print_help();
+			exit(opt == 'h' ? 0 : 2);
+		}
+	}
+
+	setvbuf(stdout, NULL, _IOLBF, 0);
+	boot_time_start(sitl_now_us() / 1000);
+	boot_time_mark(BOOT_P_MAIN);
+
+#if defined(APPLICATION_cardem)
+	static const Pin pin_rst = PIN_USIM1_nRST;
+	static const Pin pin_vcc = PIN_USIM1_VCC;
+
+	if (sitl_usb_open(usb_path, SIMTRACE_CARDEM_USB_EP_USIM1_DATAOUT,
+			  SIMTRACE_CARDEM_USB_EP_USIM1_DATAIN,
+			  SIMTRACE_CARDEM_USB_EP_USIM1_INT) < 0) {
+		fprintf(stderr, "Cannot open USB socket %s\n", usb_path);
+		exit(1);
+	}
+	sitl_line_set_usart(USART1);
+	sitl_line_set_pins(&pin_rst, true, &pin_vcc);
+	sitl_set_usart_irq(USART1_IRQn, mode_cardemu_usart1_irq);
+#elif defined(APPLICATION_trace)
+	static const Pin pin_rst = PIN_SIM_RST_SNIFF;
+
+	if (sitl_usb_open(usb_path, SIMTRACE_USB_EP_CARD_DATAOUT,
+			  SIMTRACE_USB_EP_CARD_DATAIN,
+			  SIMTRACE_USB_EP_CARD_INT) < 0) {
+		fprintf(stderr, "Cannot open USB socket %s\n", usb_path);
+		exit(1);
+	}
+	sitl_line_set_usart(USART_SIM);
+	sitl_line_set_pins(&pin_rst, true, NULL);
+	sitl_set_usart_irq(IRQ_USART_SIM, Sniffer_usart0_irq);
+#else
+#error "SITL only supports the cardem and trace applications"
+#endif
+
+	printf("=============================================================================\n\r"
+	       "SIMtrace2 firmware " GIT_VERSION ", SITL build of " APPLICATION "\n\r"
+	       "=============================================================================\n\r");
+
+	TRACE_INFO("Waiting for USB host on %s\r\n", usb_path);
+	while (!sitl_usb_connected())
+		sitl_poll(MAX_POLL_MS);
+	boot_time_mark(BOOT_P_USB_CONFIGURED);
+
+	/* the line only comes alive once the firmware runs, so that a replayed
+	 * file is not consumed before */
+	if (sitl_line_open(line_path) < 0) {
+		fprintf(stderr, "Cannot open line %s\n", line_path);
+		exit(1);
+	}
+	if (clk_hz)
+		sitl_line_set_clock(clk_hz);
+
+	usb_buf_init();
+#if defined(APPLICATION_cardem)
+	mode_cardemu_configure();
+	mode_cardemu_init();
+#else
+	Sniffer_configure();
+	Sniffer_init();
+#endif
+	boot_time_mark(BOOT_P_READY);
+	boot_time_print();
+
+	TRACE_INFO("entering main loop...\n\r");
+	while (1) {
+		sitl_poll(MAX_POLL_MS);
+		osmo_timers_prepare();
+		osmo_timers_update();
+
+		if (!sitl_usb_connected())
+			NVIC_SystemReset();
+
+#if defined(APPLICATION_cardem)
+		mode_cardemu_run();
+#else
+		Sniffer_run();
+#endif
+	}
+}
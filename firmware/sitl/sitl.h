@@ -0,0 +1,84 @@
+/* SITL: software-in-the-loop emulation of the SAM3S peripherals
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <poll.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The firmware runs single-threaded in one process.  Interrupt handlers
+ * are called from sitl_poll() in between the main loop iterations, so they
+ * never preempt the main loop, and masking interrupts is a no-op. */
+
+/* the USART register blocks live in memory */
+extern Usart sitl_usart[2];
+#undef USART0
+#undef USART1
+#define USART0	(&sitl_usart[0])
+#define USART1	(&sitl_usart[1])
+
+/* the static inline NVIC/PRIMASK accessors of CMSIS access the system
+ * control space, so replace them at their call sites */
+void sitl_nvic_enable(IRQn_Type irq);
+void sitl_nvic_disable(IRQn_Type irq);
+void sitl_nvic_set_pending(IRQn_Type irq);
+void sitl_system_reset(void);
+
+#undef __disable_irq
+#undef __enable_irq
+#define __disable_irq()			do {} while (0)
+#define __enable_irq()			do {} while (0)
+#define NVIC_EnableIRQ(irq)		sitl_nvic_enable(irq)
+#define NVIC_DisableIRQ(irq)		sitl_nvic_disable(irq)
+#define NVIC_SetPendingIRQ(irq)		sitl_nvic_set_pending(irq)
+#define NVIC_SetPriority(irq, prio)	do {} while (0)
+#define NVIC_GetPriority(irq)		0
+#define NVIC_SystemReset()		sitl_system_reset()
+
+/***********************************************************************
+ * emulator API, used by the SITL main loop
+ ***********************************************************************/
+
+/* virtual ISO 7816 line between the emulated device and its peer */
+int sitl_line_open(const char *path);
+void sitl_line_set_clock(uint32_t clk_hz);
+/* USART which receives the characters from the line */
+void sitl_line_set_usart(Usart *usart);
+/* pins whose level is driven by the peer */
+void sitl_line_set_pins(const Pin *rst, bool rst_active_low, const Pin *vcc);
+
+/* virtual USB device: one interface, served on a local socket */
+int sitl_usb_open(const char *path, uint8_t ep_out, uint8_t ep_in, uint8_t ep_int);
+bool sitl_usb_connected(void);
+
+/* emulated interrupt handlers */
+void sitl_set_usart_irq(IRQn_Type irq, void (*handler)(void));
+
+/* wait for (at most timeout_ms) and dispatch events of the emulated
+ * peripherals.  Returns the number of events handled. */
+int sitl_poll(int timeout_ms);
+
+/* internal interface between the emulated peripherals */
+uint64_t sitl_now_us(void);
+void sitl_pio_set_level(const Pin *pin, bool high);
+void sitl_usart_rx_byte(Usart *usart, uint8_t byte);
+void sitl_usart_set_clock(uint32_t clk_hz);
+uint64_t sitl_usart_char_us(Usart *usart);
+int sitl_usart_service(uint64_t now, uint64_t *next);
+void sitl_line_tx_byte(uint8_t byte);
+int sitl_line_service(uint64_t now, uint64_t *next);
+void sitl_line_add_fds(struct pollfd *pfd, unsigned int *nfds);
+int sitl_line_handle_fds(struct pollfd *pfd);
+void sitl_usb_add_fds(struct pollfd *pfd, unsigned int *nfds);
+int sitl_usb_handle_fds(struct pollfd *pfd);
+int sitl_usb_service(void);
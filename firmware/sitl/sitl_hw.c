@@ -0,0 +1,554 @@
+/* SITL: emulation of the USART, PIO and NVIC of the SAM3S
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include "board.h"
+#include "led.h"
+#include "sim_switch.h"
+#include "clk_ctr.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+/* write access to registers which are read-only for the firmware */
+#define REG(r)		(*(volatile uint32_t *) &(r))
+
+/* value of US_THR while no character has been written to it */
+#define THR_EMPTY	0xffffffff
+
+/* characters take 12 etu: start, 8 data, parity and 2 guard bits */
+#define ETU_PER_CHAR	12
+
+Usart sitl_usart[2];
+
+/* milliseconds since start-up, as counted by the SysTick of the board */
+volatile uint32_t jiffies;
+
+static uint32_t g_clk_hz = 3571200;
+/* the peer stopped the clock; g_clk_hz is the one it restarts with */
+static bool g_clk_stopped;
+
+static struct sitl_usart_state {
+	IRQn_Type irq;
+	bool rx_enabled;
+	bool tx_enabled;
+	/* a transmitted character is still on the line */
+	bool tx_busy;
+	uint64_t tx_done;
+	/* character waiting in the holding register */
+	bool tx_hold_valid;
+	uint8_t tx_hold;
+	/* receiver time-out: counting, or waiting for the next character to start */
+	bool to_running;
+	bool to_wait_rx;
+	uint64_t to_expire;
+} usart_state[ARRAY_SIZE(sitl_usart)] = {
+	{ .irq = USART0_IRQn },
+	{ .irq = USART1_IRQn },
+};
+
+static struct {
+	void (*handler)(void);
+	bool enabled;
+	bool pending;
+} nvic[2];
+
+uint64_t sitl_now_us(void)
+{
+	struct timespec ts;
+	uint64_t now;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	jiffies = now / 1000;
+	return now;
+}
+
+/***********************************************************************
+ * NVIC
+ ***********************************************************************/
+
+static int usart_nr_by_irq(IRQn_Type irq)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(usart_state); i++) {
+		if (usart_state[i].irq == irq)
+			return i;
+	}
+	return -1;
+}
+
+void sitl_set_usart_irq(IRQn_Type irq, void (*handler)(void))
+{
+	int nr = usart_nr_by_irq(irq);
+
+	if (nr >= 0)
+		nvic[nr].handler = handler;
+}
+
+void sitl_nvic_enable(IRQn_Type irq)
+{
+	int nr = usart_nr_by_irq(irq);
+
+	if (nr >= 0)
+		nvic[nr].enabled = true;
+}
+
+void sitl_nvic_disable(IRQn_Type irq)
+{
+	int nr = usart_nr_by_irq(irq);
+
+	if (nr >= 0)
+		nvic[nr].enabled = false;
+}
+
+void sitl_nvic_set_pending(IRQn_Type irq)
+{
+	int nr = usart_nr_by_irq(irq);
+
+	if (nr >= 0)
+		nvic[nr].pending = true;
+}
+
+/***********************************************************************
+ * USART
+ ***********************************************************************/
+
+static struct sitl_usart_state *usart2state(Usart *usart)
+{
+	return &usart_state[usart - sitl_usart];
+}
+
+/* duration of n etu at the current clock and F/D ratio */
+static uint64_t etu_to_us(Usart *usart, uint32_t n)
+{
+	uint32_t fidi = usart->US_FIDI & 0x7ff;
+
+	if (!fidi)
+		fidi = 372;
+	return (uint64_t) n * fidi * 1000000 / g_clk_hz;
+}
+
+/* time a character takes on the line */
+uint64_t sitl_usart_char_us(Usart *usart)
+{
+	return etu_to_us(usart, ETU_PER_CHAR);
+}
+
+void sitl_usart_set_clock(uint32_t clk_hz)
+{
+	g_clk_stopped = !clk_hz;
+	if (clk_hz)
+		g_clk_hz = clk_hz;
+}
+
+void ISO7816_Init(Usart_info *usart, bool master_clock)
+{
+	Usart *us = usart->base;
+	struct sitl_usart_state *st = usart2state(us);
+
+	memset(us, 0, sizeof(*us));
+	REG(us->US_CSR) = US_CSR_TXRDY | US_CSR_TXEMPTY;
+	us->US_THR = THR_EMPTY;
+	us->US_FIDI = 372;
+	st->rx_enabled = st->tx_enabled = st->tx_busy = st->tx_hold_valid = false;
+	st->to_running = st->to_wait_rx = false;
+}
+
+void USART_EnableIt(Usart *usart, uint32_t mode)
+{
+	REG(usart->US_IMR) |= mode;
+}
+
+void USART_DisableIt(Usart *usart, uint32_t mode)
+{
+	REG(usart->US_IMR) &= ~mode;
+}
+
+void USART_SetTransmitterEnabled(Usart *usart, uint8_t enabled)
+{
+	usart2state(usart)->tx_enabled = enabled;
+}
+
+void USART_SetReceiverEnabled(Usart *usart, uint8_t enabled)
+{
+	usart2state(usart)->rx_enabled = enabled;
+}
+
+static void usart_restart_timeout(Usart *usart, uint64_t now)
+{
+	struct sitl_usart_state *st = usart2state(usart);
+	uint32_t rtor = usart->US_RTOR & 0xffff;
+
+	st->to_running = rtor != 0;
+	st->to_expire = now + etu_to_us(usart, rtor);
+}
+
+/* a character has been received from the line */
+void sitl_usart_rx_byte(Usart *usart, uint8_t byte)
+{
+	struct sitl_usart_state *st = usart2state(usart);
+
+	if (!st->rx_enabled)
+		return;
+
+	if (usart->US_CSR & US_CSR_RXRDY)
+		REG(usart->US_CSR) |= US_CSR_OVRE;
+	REG(usart->US_RHR) = byte;
+	REG(usart->US_CSR) |= US_CSR_RXRDY;
+
+	/* the time-out counter is reloaded with every character */
+	if (st->to_running || st->to_wait_rx) {
+		st->to_wait_rx = false;
+		usart_restart_timeout(usart, sitl_now_us());
+	}
+}
+
+/* move the holding register to the shift register once the line is free.
+ * TXEMPTY stays set, as the firmware busy-waits for it. */
+static void usart_shift_out(Usart *usart, uint64_t now)
+{
+	struct sitl_usart_state *st = usart2state(usart);
+
+	if (st->tx_busy && now >= st->tx_done)
+		st->tx_busy = false;
+	if (st->tx_busy || !st->tx_hold_valid)
+		return;
+
+	sitl_line_tx_byte(st->tx_hold);
+	st->tx_hold_valid = false;
+	st->tx_busy = true;
+	st->tx_done = now + etu_to_us(usart, ETU_PER_CHAR);
+	REG(usart->US_CSR) |= US_CSR_TXRDY;
+}
+
+/* act upon what the firmware wrote into the control and holding registers */
+static void usart_apply_writes(Usart *usart, uint64_t now)
+{
+	struct sitl_usart_state *st = usart2state(usart);
+	uint32_t cr = usart->US_CR;
+
+	usart->US_CR = 0;
+
+	if (cr & (US_CR_RSTSTA | US_CR_RSTNACK))
+		REG(usart->US_CSR) &= ~(US_CSR_OVRE | US_CSR_FRAME | US_CSR_PARE | US_CSR_NACK);
+	if (cr & (US_CR_RSTRX | US_CR_RXDIS))
+		st->rx_enabled = false;
+	if (cr & US_CR_RXEN)
+		st->rx_enabled = true;
+	if (cr & US_CR_RSTTX) {
+		st->tx_busy = st->tx_hold_valid = false;
+		REG(usart->US_CSR) |= US_CSR_TXRDY;
+	}
+	if (cr & US_CR_STTTO) {
+		REG(usart->US_CSR) &= ~US_CSR_TIMEOUT;
+		st->to_running = false;
+		st->to_wait_rx = true;
+	}
+	if (cr & US_CR_RETTO) {
+		REG(usart->US_CSR) &= ~US_CSR_TIMEOUT;
+		st->to_wait_rx = false;
+		usart_restart_timeout(usart, now);
+	}
+
+	if (usart->US_THR != THR_EMPTY) {
+		uint8_t byte = usart->US_THR & 0xff;
+
+		usart->US_THR = THR_EMPTY;
+		if (st->tx_enabled) {
+			st->tx_hold = byte;
+			st->tx_hold_valid = true;
+			REG(usart->US_CSR) &= ~US_CSR_TXRDY;
+		}
+	}
+
+	usart_shift_out(usart, now);
+}
+
+/* advance the state of one USART to 'now' and call its interrupt handler if needed */
+static int usart_service_one(unsigned int nr, uint64_t now, uint64_t *next)
+{
+	Usart *usart = &sitl_usart[nr];
+	struct sitl_usart_state *st = &usart_state[nr];
+	uint32_t active;
+	int i, events = 0;
+
+	for (i = 0; i < 8; i++) {
+		usart_apply_writes(usart, now);
+
+		if (st->to_running && now >= st->to_expire) {
+			st->to_running = false;
+			REG(usart->US_CSR) |= US_CSR_TIMEOUT;
+		}
+
+		active = usart->US_CSR & usart->US_IMR;
+		if (!nvic[nr].handler || !nvic[nr].enabled || (!active && !nvic[nr].pending))
+			break;
+
+		nvic[nr].pending = false;
+		nvic[nr].handler();
+		events++;
+
+		/* the handler has read the holding register */
+		if (active & US_CSR_RXRDY)
+			REG(usart->US_CSR) &= ~US_CSR_RXRDY;
+	}
+	usart_apply_writes(usart, now);
+
+	if (st->tx_busy && st->tx_done < *next)
+		*next = st->tx_done;
+	if (st->to_running && st->to_expire < *next)
+		*next = st->to_expire;
+
+	return events;
+}
+
+int sitl_usart_service(uint64_t now, uint64_t *next)
+{
+	unsigned int i;
+	int events = 0;
+
+	for (i = 0; i < ARRAY_SIZE(sitl_usart); i++)
+		events += usart_service_one(i, now, next);
+
+	return events;
+}
+
+/***********************************************************************
+ * PIO
+ ***********************************************************************/
+
+static uint32_t pio_level[3];
+
+static struct {
+	const Pin *pin;
+	void (*handler)(const Pin *);
+	bool enabled;
+} pio_it[8];
+
+static uint32_t *pin2level(const Pin *pin)
+{
+	if (pin->pio == PIOB)
+		return &pio_level[1];
+	if (pin->pio == PIOC)
+		return &pio_level[2];
+	return &pio_level[0];
+}
+
+uint8_t PIO_Configure(const Pin *list, uint32_t size)
+{
+	uint32_t i;
+
+	for (i = 0; i < size; i++) {
+		const Pin *pin = &list[i];
+
+		switch (pin->type) {
+		case PIO_OUTPUT_1:
+			*pin2level(pin) |= pin->mask;
+			break;
+		case PIO_OUTPUT_0:
+			*pin2level(pin) &= ~pin->mask;
+			break;
+		case PIO_INPUT:
+			if (pin->attribute & PIO_PULLUP)
+				*pin2level(pin) |= pin->mask;
+			break;
+		default:
+			break;
+		}
+	}
+	return 1;
+}
+
+void PIO_Set(const Pin *pin)
+{
+	*pin2level(pin) |= pin->mask;
+}
+
+void PIO_Clear(const Pin *pin)
+{
+	*pin2level(pin) &= ~pin->mask;
+}
+
+uint8_t PIO_Get(const Pin *pin)
+{
+	return (*pin2level(pin) & pin->mask) ? 1 : 0;
+}
+
+void PIO_ConfigureIt(const Pin *pin, void (*handler)(const Pin *))
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pio_it); i++) {
+		if (!pio_it[i].pin || pio_it[i].pin == pin) {
+			pio_it[i].pin = pin;
+			pio_it[i].handler = handler;
+			return;
+		}
+	}
+	TRACE_ERROR("too many PIO interrupt sources\r\n");
+}
+
+static void pio_set_it(const Pin *pin, bool enabled)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(pio_it); i++) {
+		if (pio_it[i].pin == pin)
+			pio_it[i].enabled = enabled;
+	}
+}
+
+void PIO_EnableIt(const Pin *pin)
+{
+	pio_set_it(pin, true);
+}
+
+void PIO_DisableIt(const Pin *pin)
+{
+	pio_set_it(pin, false);
+}
+
+/* the peer changed the level of an input pin: raise its interrupt */
+void sitl_pio_set_level(const Pin *pin, bool high)
+{
+	uint32_t *level = pin2level(pin);
+	uint32_t old = *level;
+	unsigned int i;
+
+	if (high)
+		*level |= pin->mask;
+	else
+		*level &= ~pin->mask;
+	if (old == *level)
+		return;
+
+	for (i = 0; i < ARRAY_SIZE(pio_it); i++) {
+		if (pio_it[i].pin && pio_it[i].enabled && pio_it[i].pin->pio == pin->pio &&
+		    (pio_it[i].pin->mask & pin->mask))
+			pio_it[i].handler(pio_it[i].pin);
+	}
+}
+
+/***********************************************************************
+ * TC frequency counter: the clock of the line is known, so each gate time
+ * measures it exactly
+ ***********************************************************************/
+
+static struct {
+	struct {
+		uint8_t tclk;
+		struct clk_ctr_state st;
+		bool new;
+	} in[2];
+	unsigned int num;
+	unsigned int cur;
+	uint32_t start;
+} g_ctr;
+
+void clk_ctr_init(void)
+{
+	memset(&g_ctr, 0, sizeof(g_ctr));
+}
+
+void clk_ctr_exit(void)
+{
+	g_ctr.num = 0;
+}
+
+int clk_ctr_add(uint8_t tclk)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_ctr.num; i++) {
+		if (g_ctr.in[i].tclk == tclk)
+			return 0;
+	}
+	if (g_ctr.num >= ARRAY_SIZE(g_ctr.in))
+		return -1;
+	memset(&g_ctr.in[g_ctr.num], 0, sizeof(g_ctr.in[0]));
+	g_ctr.in[g_ctr.num].tclk = tclk;
+	if (g_ctr.num++ == 0)
+		g_ctr.start = jiffies;
+	return 0;
+}
+
+void clk_ctr_restart(uint8_t tclk)
+{
+	unsigned int i;
+
+	for (i = 0; i < g_ctr.num; i++) {
+		if (g_ctr.in[i].tclk != tclk)
+			continue;
+		g_ctr.in[i].st.hz = 0;
+		g_ctr.in[i].st.valid = false;
+		g_ctr.in[i].new = false;
+		if (i == g_ctr.cur)
+			g_ctr.start = jiffies;
+	}
+}
+
+void clk_ctr_poll(void)
+{
+	struct clk_ctr_state *st;
+
+	if (!g_ctr.num || jiffies - g_ctr.start < CLK_CTR_GATE_MS)
+		return;
+
+	st = &g_ctr.in[g_ctr.cur].st;
+	if (st->valid && st->hz && g_clk_stopped)
+		st->stops++;
+	st->hz = g_clk_stopped ? 0 : g_clk_hz;
+	st->valid = true;
+	g_ctr.in[g_ctr.cur].new = true;
+
+	g_ctr.cur = (g_ctr.cur + 1) % g_ctr.num;
+	g_ctr.start = jiffies;
+}
+
+bool clk_ctr_get(uint8_t tclk, struct clk_ctr_state *st)
+{
+	unsigned int i;
+	bool new;
+
+	for (i = 0; i < g_ctr.num; i++) {
+		if (g_ctr.in[i].tclk != tclk)
+			continue;
+		*st = g_ctr.in[i].st;
+		new = g_ctr.in[i].new;
+		g_ctr.in[i].new = false;
+		return new;
+	}
+	memset(st, 0, sizeof(*st));
+	return false;
+}
+
+/***********************************************************************
+ * board functions
+ ***********************************************************************/
+
+int sim_switch_use_physical(unsigned int nr, int physical)
+{
+	TRACE_INFO("%u: use %s SIM\r\n", nr, physical ? "physical" : "emulated");
+	return 0;
+}
+
+int sim_switch_init(void)
+{
+	return 1;
+}
+
+/* LEDs have no emulation */
+void led_blink(enum led led, enum led_pattern blink)
+{
+}
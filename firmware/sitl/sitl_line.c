@@ -0,0 +1,255 @@
+/* SITL: virtual ISO 7816 line between the emulated device and its peer
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* The peer (a modem in card emulation, or phone and card when sniffing)
+ * talks a line based text protocol, either through a listening unix domain
+ * stream socket, or replayed from a file:
+ *
+ *	V 0|1		VCC off/on
+ *	R 0|1		RST released/asserted
+ *	C HZ		CLK frequency (default 3571200), 0 to stop the clock
+ *	D HEX...	characters sent on the I/O line
+ *	W MS		wait before processing the next line
+ *	# ...		comment
+ *
+ * Characters are handed to the USART one by one, at the pace of 12 etu per
+ * character.  Characters transmitted by the emulated device are sent to the
+ * peer as "D XX" lines. */
+
+#include "board.h"
+#include "utils.h"
+
+#include <osmocom/core/utils.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+static struct {
+	/* listening socket, or -1 when replaying a file */
+	int listen_fd;
+	/* connected peer or replayed file */
+	int fd;
+	bool eof;
+
+	char in[1024];
+	unsigned int in_len;
+
+	/* characters of the current D line still to be sent */
+	uint8_t rx[256];
+	unsigned int rx_len;
+	unsigned int rx_idx;
+	uint64_t rx_next;
+	/* end of a W line */
+	uint64_t wait_until;
+
+	Usart *usart;
+	const Pin *rst;
+	bool rst_active_low;
+	const Pin *vcc;
+} line = {
+	.listen_fd = -1,
+	.fd = -1,
+	.usart = USART0,
+};
+
+int sitl_line_open(const char *path)
+{
+	struct sockaddr_un sun;
+	struct stat st;
+	int fd;
+
+	if (stat(path, &st) == 0 && S_ISREG(st.st_mode)) {
+		line.fd = open(path, O_RDONLY);
+		return line.fd;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+		return -errno;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	osmo_strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 1) < 0) {
+		close(fd);
+		return -errno;
+	}
+	line.listen_fd = fd;
+	return fd;
+}
+
+void sitl_line_set_usart(Usart *usart)
+{
+	line.usart = usart;
+}
+
+void sitl_line_set_pins(const Pin *rst, bool rst_active_low, const Pin *vcc)
+{
+	line.rst = rst;
+	line.rst_active_low = rst_active_low;
+	line.vcc = vcc;
+}
+
+void sitl_line_set_clock(uint32_t clk_hz)
+{
+	sitl_usart_set_clock(clk_hz);
+}
+
+/* a character has been transmitted by the emulated device */
+void sitl_line_tx_byte(uint8_t byte)
+{
+	char buf[8];
+	int len;
+
+	if (line.fd < 0 || line.listen_fd < 0)
+		return;
+	len = snprintf(buf, sizeof(buf), "D %02x\n", byte);
+	if (write(line.fd, buf, len) != len)
+		TRACE_ERROR("short write to line peer\r\n");
+}
+
+/* execute one line received from the peer */
+static void line_exec(char *cmd, uint64_t now)
+{
+	unsigned long val = strtoul(cmd + 1, NULL, 0);
+	int len;
+
+	switch (cmd[0]) {
+	case 'V':
+		if (line.vcc)
+			sitl_pio_set_level(line.vcc, val);
+		break;
+	case 'R':
+		if (line.rst)
+			sitl_pio_set_level(line.rst, line.rst_active_low ? !val : val);
+		break;
+	case 'C':
+		sitl_line_set_clock(val);
+		break;
+	case 'D':
+		len = osmo_hexparse(cmd + 1, line.rx, sizeof(line.rx));
+		if (len < 0) {
+			TRACE_ERROR("invalid line data '%s'\r\n", cmd);
+			break;
+		}
+		line.rx_len = len;
+		line.rx_idx = 0;
+		/* the previous character may still be on the line */
+		if (line.rx_next < now)
+			line.rx_next = now;
+		break;
+	case 'W':
+		line.wait_until = now + val * 1000;
+		break;
+	case '#':
+	case '\0':
+		break;
+	default:
+		TRACE_ERROR("unknown line command '%s'\r\n", cmd);
+		break;
+	}
+}
+
+void sitl_line_add_fds(struct pollfd *pfd, unsigned int *nfds)
+{
+	if (line.fd >= 0) {
+		/* only read more once the buffer has room */
+		if (line.in_len < sizeof(line.in) - 1 && !line.eof) {
+			pfd[*nfds].fd = line.fd;
+			pfd[*nfds].events = POLLIN;
+			(*nfds)++;
+		}
+	} else if (line.listen_fd >= 0) {
+		pfd[*nfds].fd = line.listen_fd;
+		pfd[*nfds].events = POLLIN;
+		(*nfds)++;
+	}
+}
+
+int sitl_line_handle_fds(struct pollfd *pfd)
+{
+	int rc;
+
+	if (pfd->fd == line.listen_fd && line.fd < 0) {
+		line.fd = accept(line.listen_fd, NULL, NULL);
+		line.eof = false;
+		line.in_len = 0;
+		return 1;
+	}
+
+	if (pfd->fd != line.fd || !(pfd->revents & (POLLIN | POLLHUP)))
+		return 0;
+
+	rc = read(line.fd, line.in + line.in_len, sizeof(line.in) - 1 - line.in_len);
+	if (rc <= 0) {
+		line.eof = true;
+		if (line.listen_fd >= 0) {
+			/* wait for the next peer */
+			close(line.fd);
+			line.fd = -1;
+		} else
+			TRACE_INFO("end of line input\r\n");
+		return 1;
+	}
+	line.in_len += rc;
+	return 1;
+}
+
+/* hand characters to the USART and execute lines as time progresses */
+int sitl_line_service(uint64_t now, uint64_t *next)
+{
+	int events = 0;
+	char *nl;
+
+	while (1) {
+		if (line.rx_idx < line.rx_len) {
+			if (now < line.rx_next) {
+				if (line.rx_next < *next)
+					*next = line.rx_next;
+				break;
+			}
+			sitl_usart_rx_byte(line.usart, line.rx[line.rx_idx++]);
+			line.rx_next = now + sitl_usart_char_us(line.usart);
+			events++;
+			/* let the firmware take the character first */
+			if (line.rx_idx < line.rx_len && line.rx_next < *next)
+				*next = line.rx_next;
+			break;
+		}
+
+		if (now < line.wait_until) {
+			if (line.wait_until < *next)
+				*next = line.wait_until;
+			break;
+		}
+
+		line.in[line.in_len] = '\0';
+		nl = strchr(line.in, '\n');
+		if (!nl)
+			break;
+		*nl = '\0';
+		if (nl > line.in && nl[-1] == '\r')
+			nl[-1] = '\0';
+		line_exec(line.in, now);
+		line.in_len -= nl + 1 - line.in;
+		memmove(line.in, nl + 1, line.in_len);
+		events++;
+	}
+
+	return events;
+}
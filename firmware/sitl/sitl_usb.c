@@ -0,0 +1,270 @@
+/* SITL: virtual USB device on a local socket
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+/* The USB interface of the emulated device is served on a listening unix
+ * domain SOCK_SEQPACKET socket, to which libosmo-simtrace2 can attach with
+ * osmo_st2_transport_sock_connect().  Each packet is one transfer:
+ *
+ *  - on connect, the device sends a packet on endpoint 0, containing the
+ *    addresses of its OUT, IN and interrupt endpoints;
+ *  - device to host: one byte endpoint address, followed by the data;
+ *  - host to device: the data of one transfer on the OUT endpoint.
+ *
+ * The socket is only read while a read is pending on the OUT endpoint, so
+ * the host is flow controlled the same way as by NAKs on the bus.  Like on
+ * the bus, a transfer larger than the read buffer completes several reads. */
+
+#include "board.h"
+#include "utils.h"
+
+#include <osmocom/core/utils.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define NUM_EP		16
+#define EP_SIZE		64
+
+struct sitl_ep {
+	TransferCallback cb;
+	void *arg;
+	/* a read is pending (OUT) or a write is to be completed (IN) */
+	bool busy;
+	uint8_t *buf;
+	uint32_t len;
+};
+
+static struct {
+	int listen_fd;
+	int fd;
+	uint8_t ep_out;
+	uint8_t ep_in;
+	uint8_t ep_int;
+	struct sitl_ep ep[NUM_EP];
+	/* transfer from the host which did not fit into the read buffer */
+	uint8_t out[4096];
+	unsigned int out_len;
+	unsigned int out_ofs;
+} usb = {
+	.listen_fd = -1,
+	.fd = -1,
+};
+
+int sitl_usb_open(const char *path, uint8_t ep_out, uint8_t ep_in, uint8_t ep_int)
+{
+	struct sockaddr_un sun;
+	int fd;
+
+	usb.ep_out = ep_out;
+	usb.ep_in = ep_in;
+	usb.ep_int = ep_int;
+
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0)
+		return -errno;
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	osmo_strlcpy(sun.sun_path, path, sizeof(sun.sun_path));
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sun, sizeof(sun)) < 0 || listen(fd, 1) < 0) {
+		close(fd);
+		return -errno;
+	}
+	usb.listen_fd = fd;
+	return fd;
+}
+
+bool sitl_usb_connected(void)
+{
+	return usb.fd >= 0;
+}
+
+uint8_t USBD_GetState(void)
+{
+	return sitl_usb_connected() ? USBD_STATE_CONFIGURED : USBD_STATE_POWERED;
+}
+
+uint16_t USBD_GetEndpointSize(uint8_t bEndpoint)
+{
+	return EP_SIZE;
+}
+
+uint8_t USBD_Write(uint8_t bEndpoint, const void *pData, uint32_t size,
+		   TransferCallback callback, void *pArg)
+{
+	struct sitl_ep *ep = &usb.ep[bEndpoint & 0xf];
+	uint8_t buf[1 + 4096];
+
+	if (!sitl_usb_connected())
+		return USBD_STATUS_WRONG_STATE;
+	if (ep->busy)
+		return USBD_STATUS_LOCKED;
+	if (size > sizeof(buf) - 1)
+		return USBD_STATUS_INVALID_PARAMETER;
+
+	/* zero length packets terminate a transfer, which the packet boundaries
+	 * of the socket already do */
+	if (size) {
+		buf[0] = bEndpoint | 0x80;
+		memcpy(buf + 1, pData, size);
+		if (send(usb.fd, buf, size + 1, MSG_NOSIGNAL) < 0)
+			TRACE_ERROR("USB write to host failed: %s\r\n", strerror(errno));
+	}
+
+	/* complete the transfer from sitl_usb_service(), as the interrupt
+	 * would after the host has taken the data */
+	ep->busy = true;
+	ep->cb = callback;
+	ep->arg = pArg;
+	ep->len = size;
+	return USBD_STATUS_SUCCESS;
+}
+
+uint8_t USBD_Read(uint8_t bEndpoint, void *pData, uint32_t dLength,
+		  TransferCallback fCallback, void *pArg)
+{
+	struct sitl_ep *ep = &usb.ep[bEndpoint & 0xf];
+
+	if (ep->busy)
+		return USBD_STATUS_LOCKED;
+
+	ep->busy = true;
+	ep->cb = fCallback;
+	ep->arg = pArg;
+	ep->buf = pData;
+	ep->len = dLength;
+	return USBD_STATUS_SUCCESS;
+}
+
+void USBD_HAL_CancelIo(uint32_t bmEPs)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(usb.ep); i++) {
+		struct sitl_ep *ep = &usb.ep[i];
+
+		if (!(bmEPs & (1 << i)) || !ep->busy)
+			continue;
+		ep->busy = false;
+		ep->cb(ep->arg, USBD_STATUS_CANCELED, 0, ep->len);
+	}
+}
+
+static void usb_disconnect(void)
+{
+	unsigned int i;
+
+	TRACE_INFO("USB host disconnected\r\n");
+	close(usb.fd);
+	usb.fd = -1;
+	usb.out_len = usb.out_ofs = 0;
+	for (i = 0; i < ARRAY_SIZE(usb.ep); i++)
+		usb.ep[i].busy = false;
+}
+
+static void usb_accept(void)
+{
+	uint8_t hello[4] = { 0, usb.ep_out, usb.ep_in | 0x80, usb.ep_int | 0x80 };
+
+	usb.fd = accept(usb.listen_fd, NULL, NULL);
+	if (usb.fd < 0)
+		return;
+	TRACE_INFO("USB host connected\r\n");
+	if (send(usb.fd, hello, sizeof(hello), MSG_NOSIGNAL) != sizeof(hello))
+		usb_disconnect();
+}
+
+void sitl_usb_add_fds(struct pollfd *pfd, unsigned int *nfds)
+{
+	if (usb.fd < 0) {
+		if (usb.listen_fd >= 0) {
+			pfd[*nfds].fd = usb.listen_fd;
+			pfd[*nfds].events = POLLIN;
+			(*nfds)++;
+		}
+		return;
+	}
+
+	pfd[*nfds].fd = usb.fd;
+	pfd[*nfds].events = usb.ep[usb.ep_out].busy && usb.out_ofs == usb.out_len ? POLLIN : 0;
+	(*nfds)++;
+}
+
+/* complete the pending read with the next part of the transfer from the host */
+static void usb_complete_read(void)
+{
+	struct sitl_ep *ep = &usb.ep[usb.ep_out];
+	unsigned int len = OSMO_MIN(ep->len, usb.out_len - usb.out_ofs);
+
+	memcpy(ep->buf, usb.out + usb.out_ofs, len);
+	usb.out_ofs += len;
+	ep->busy = false;
+	ep->cb(ep->arg, USBD_STATUS_SUCCESS, len, 0);
+}
+
+int sitl_usb_handle_fds(struct pollfd *pfd)
+{
+	struct sitl_ep *ep = &usb.ep[usb.ep_out];
+	int rc;
+
+	if (usb.fd < 0) {
+		if (pfd->fd == usb.listen_fd && (pfd->revents & POLLIN)) {
+			usb_accept();
+			return 1;
+		}
+		return 0;
+	}
+
+	if (pfd->fd != usb.fd || !pfd->revents)
+		return 0;
+
+	if (ep->busy && (pfd->revents & POLLIN)) {
+		rc = recv(usb.fd, usb.out, sizeof(usb.out), 0);
+		if (rc > 0) {
+			usb.out_len = rc;
+			usb.out_ofs = 0;
+			usb_complete_read();
+			return 1;
+		}
+	} else if (!(pfd->revents & (POLLHUP | POLLERR)))
+		return 0;
+
+	usb_disconnect();
+	return 1;
+}
+
+/* complete the pending transfers */
+int sitl_usb_service(void)
+{
+	unsigned int i;
+	int events = 0;
+
+	if (usb.ep[usb.ep_out].busy && usb.out_ofs < usb.out_len) {
+		usb_complete_read();
+		events++;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(usb.ep); i++) {
+		struct sitl_ep *ep = &usb.ep[i];
+
+		if (i == usb.ep_out || !ep->busy)
+			continue;
+		ep->busy = false;
+		ep->cb(ep->arg, USBD_STATUS_SUCCESS, ep->len, 0);
+		events++;
+	}
+
+	return events;
+}
@@ -0,0 +1,495 @@
+/* benchmark of the card_emu FSM: throughput, latency and USB buffer usage.
+ *
+ * Drives card_emu_process_rx_byte()/card_emu_tx_byte() with a deterministic
+ * pseudo-random mix of T=0 TPDUs (cases 1 to 4, 0 to 256 data bytes), NULL
+ * procedure bytes and PPS exchanges after a warm reset, the way the reader
+ * and the USB host would.  The CPU time per character and the number of
+ * buffers taken from the usb_buf pool are reported, and compared against a
+ * baseline:
+ *
+ *	card_emu_bench [-n NUM_TPDUS] [-b BASELINE [-t TOLERANCE_PERCENT]] [-w BASELINE]
+ *
+ * Exits with 1 if the time per character exceeds the baseline by more than
+ * the tolerance, or if more buffers are used than in the baseline.  As the
+ * timing depends on the machine, the baseline is to be written (-w) on the
+ * machine on which changes are evaluated, before making them. */
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "card_emu.h"
+#include "simtrace_prot.h"
+#include "usb_buf.h"
+
+/* not declared by the stdio.h of the firmware, which shadows the one of the host */
+int fflush(FILE *stream);
+
+#define PHONE_DATAIN	1
+#define PHONE_INT	2
+#define PHONE_DATAOUT	3
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+
+/***********************************************************************
+ * usb_buf pool accounting (the bench is linked with --wrap)
+ ***********************************************************************/
+
+struct msgb *__real_usb_buf_alloc(uint8_t ep);
+void __real_usb_buf_free(struct msgb *msg);
+
+static struct {
+	unsigned long allocs;
+	unsigned long in_use;
+	unsigned long peak;
+} pool;
+
+struct msgb *__wrap_usb_buf_alloc(uint8_t ep)
+{
+	struct msgb *msg = __real_usb_buf_alloc(ep);
+
+	if (msg) {
+		pool.allocs++;
+		if (++pool.in_use > pool.peak)
+			pool.peak = pool.in_use;
+	}
+	return msg;
+}
+
+void __wrap_usb_buf_free(struct msgb *msg)
+{
+	pool.in_use--;
+	__real_usb_buf_free(msg);
+}
+
+
+/***********************************************************************
+ * stub functions required by card_emu.c
+ ***********************************************************************/
+
+void card_emu_uart_wait_tx_idle(uint8_t uart_chan)
+{
+}
+
+int card_emu_uart_update_fidi(uint8_t uart_chan, unsigned int fidi)
+{
+	return 0;
+}
+
+/* the bytes sent by the UART towards the reader since the last check */
+static uint8_t tx_buf[512];
+static unsigned int tx_buf_idx;
+
+int card_emu_uart_tx(uint8_t uart_chan, uint8_t byte)
+{
+	assert(tx_buf_idx < sizeof(tx_buf));
+	tx_buf[tx_buf_idx++] = byte;
+	return 1;
+}
+
+void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
+{
+}
+
+void card_emu_uart_interrupt(uint8_t uart_chan)
+{
+}
+
+void card_emu_uart_update_wt(uint8_t uart_chan, uint32_t wt)
+{
+}
+
+void card_emu_uart_reset_wt(uint8_t uart_chan)
+{
+}
+
+void mode_cardemu_set_presence_pol(uint8_t instance, bool high)
+{
+}
+
+bool mode_cardemu_get_presence_pol(uint8_t instance)
+{
+	return false;
+}
+
+
+/***********************************************************************
+ * reader and USB host
+ ***********************************************************************/
+
+/* characters exchanged on the I/O line, in both directions */
+static unsigned long num_chars;
+
+/* xorshift32, so that every run sees the same sequence */
+static uint32_t rnd_state = 0x53494d32;
+
+static uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state << 13;
+	rnd_state ^= rnd_state >> 17;
+	rnd_state ^= rnd_state << 5;
+	return rnd_state;
+}
+
+static void reader_send_bytes(struct card_handle *ch, const uint8_t *bytes, unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++)
+		card_emu_process_rx_byte(ch, bytes[i]);
+	num_chars += len;
+}
+
+/* card-transmit any pending characters and check them */
+static void reader_recv_bytes(struct card_handle *ch, const uint8_t *data, unsigned int len)
+{
+	while (card_emu_tx_byte(ch))
+		;
+	assert(tx_buf_idx == len);
+	assert(!memcmp(tx_buf, data, len));
+	tx_buf_idx = 0;
+	num_chars += len;
+}
+
+/* the host takes all messages from the IN and interrupt endpoints */
+static unsigned int host_drain(uint8_t ep, uint8_t msg_type)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(ep);
+	struct simtrace_msg_hdr *mh;
+	struct msgb *msg;
+	unsigned int count = 0;
+
+	while ((msg = msgb_dequeue_count(&bep->queue, &bep->queue_len))) {
+		mh = (struct simtrace_msg_hdr *) msg->l1h;
+		assert(!msg_type || mh->msg_type == msg_type);
+		usb_buf_free(msg);
+		count++;
+	}
+	return count;
+}
+
+/* emulate a SIMTRACE_MSGT_DT_CEMU_TX_DATA received from USB */
+static void host_to_device_data(struct card_handle *ch, const uint8_t *data, uint16_t len,
+				unsigned int flags)
+{
+	struct cardemu_usb_msg_tx_data *td;
+	struct simtrace_msg_hdr *mh;
+	struct msgb *msg;
+
+	msg = usb_buf_alloc(PHONE_DATAOUT);
+	assert(msg);
+	msg->l1h = msg->head;
+	mh = (struct simtrace_msg_hdr *) msgb_put(msg, sizeof(*mh));
+	mh->msg_class = SIMTRACE_MSGC_CARDEM;
+	mh->msg_type = SIMTRACE_MSGT_DT_CEMU_TX_DATA;
+	msg->l2h = msgb_put(msg, sizeof(*td) + len);
+	td = (struct cardemu_usb_msg_tx_data *) msg->l2h;
+	td->flags = flags;
+	td->data_len = len;
+	memcpy(td->data, data, len);
+	mh->msg_len = sizeof(*mh) + sizeof(*td) + len;
+
+	msgb_enqueue(card_emu_get_uart_tx_queue(ch), msg);
+}
+
+static const uint8_t atr[] = { 0x3b, 0x02, 0x14, 0x50 };
+static const uint8_t sw_ok[] = { 0x90, 0x00 };
+static const uint8_t null_pb = 0x60;
+
+/* warm reset, ATR and a PPS exchange proposing Fi/Di of the given PPS1 */
+static void reset_and_pps(struct card_handle *ch, uint8_t pps1)
+{
+	uint8_t pps[] = { 0xff, 0x10, pps1, 0xff ^ 0x10 ^ pps1 };
+
+	card_emu_io_statechg(ch, CARD_IO_RST, 1);
+	card_emu_io_statechg(ch, CARD_IO_RST, 0);
+	card_emu_wtime_expired(ch);
+	reader_recv_bytes(ch, atr, sizeof(atr));
+	host_drain(PHONE_INT, 0);
+
+	reader_send_bytes(ch, pps, sizeof(pps));
+	assert(host_drain(PHONE_DATAIN, SIMTRACE_MSGT_DO_CEMU_PTS) == 1);
+	reader_recv_bytes(ch, pps, sizeof(pps));
+}
+
+/* one TPDU of the given ISO 7816-4 case, with len data bytes */
+static void tpdu(struct card_handle *ch, unsigned int apdu_case, unsigned int len, bool null_pbs)
+{
+	uint8_t hdr[5] = { 0xa0, 0x00, 0x00, 0x00, len };
+	uint8_t buf[1 + 256 + 2];
+	unsigned int i;
+
+	switch (apdu_case) {
+	case 1:
+		hdr[1] = 0x44;	/* REHABILITATE */
+		hdr[4] = len = 0;
+		break;
+	case 2:
+		hdr[1] = 0xb0;	/* READ BINARY */
+		/* from the card, P3=0 means 256 bytes */
+		if (!len)
+			len = 256;
+		break;
+	case 3:
+	case 4:
+		hdr[1] = 0xd6;	/* UPDATE BINARY */
+		/* from the reader, P3=0 means no data, i.e. case 1 */
+		if (!len)
+			hdr[4] = len = 1;
+		break;
+	}
+
+	for (i = 0; i < len; i++)
+		buf[1 + i] = rnd();
+
+	reader_send_bytes(ch, hdr, sizeof(hdr));
+	assert(host_drain(PHONE_DATAIN, SIMTRACE_MSGT_DO_CEMU_RX_DATA) == 1);
+	reader_recv_bytes(ch, NULL, 0);
+
+	/* the host takes its time to respond */
+	if (null_pbs) {
+		card_emu_wtime_half_expired(ch);
+		reader_recv_bytes(ch, &null_pb, 1);
+	}
+
+	switch (apdu_case) {
+	case 1:
+		host_to_device_data(ch, sw_ok, sizeof(sw_ok), CEMU_DATA_F_FINAL);
+		reader_recv_bytes(ch, sw_ok, sizeof(sw_ok));
+		break;
+	case 2:
+		/* procedure byte, data and status word in one message */
+		buf[0] = hdr[1];
+		memcpy(buf + 1 + len, sw_ok, sizeof(sw_ok));
+		host_to_device_data(ch, buf, 1 + len + 2, CEMU_DATA_F_PB_AND_TX | CEMU_DATA_F_FINAL);
+		reader_recv_bytes(ch, buf, 1 + len + 2);
+		break;
+	case 3:
+	case 4:
+		host_to_device_data(ch, &hdr[1], 1, CEMU_DATA_F_FINAL | CEMU_DATA_F_PB_AND_RX);
+		reader_recv_bytes(ch, &hdr[1], 1);
+		reader_send_bytes(ch, buf + 1, len);
+		assert(host_drain(PHONE_DATAIN, SIMTRACE_MSGT_DO_CEMU_RX_DATA) == 1);
+		if (null_pbs) {
+			card_emu_wtime_half_expired(ch);
+			reader_recv_bytes(ch, &null_pb, 1);
+		}
+		if (apdu_case == 3) {
+			host_to_device_data(ch, sw_ok, sizeof(sw_ok), CEMU_DATA_F_FINAL | CEMU_DATA_F_PB_AND_TX);
+			reader_recv_bytes(ch, sw_ok, sizeof(sw_ok));
+		} else {
+			/* 61xx, the response data is then fetched by a case 2 TPDU */
+			uint8_t sw_61[] = { 0x61, rnd() };
+
+			host_to_device_data(ch, sw_61, sizeof(sw_61), CEMU_DATA_F_FINAL | CEMU_DATA_F_PB_AND_TX);
+			reader_recv_bytes(ch, sw_61, sizeof(sw_61));
+			tpdu(ch, 2, sw_61[1], false);
+		}
+		break;
+	}
+}
+
+
+/***********************************************************************
+ * measurement and baseline
+ ***********************************************************************/
+
+struct result {
+	double ns_per_char;
+	double allocs_per_tpdu;
+	unsigned long peak_bufs;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void run(struct card_handle *ch, unsigned long num_tpdus, struct result *res)
+{
+	unsigned long i;
+	double t_start;
+	int saved_stdout, devnull;
+
+	/* card_emu.c writes an 'N' to the console for every NULL procedure
+	 * byte, which is not what is to be measured */
+	fflush(stdout);
+	saved_stdout = dup(1);
+	devnull = open("/dev/null", O_WRONLY);
+	assert(saved_stdout >= 0 && devnull >= 0);
+	dup2(devnull, 1);
+
+	num_chars = 0;
+	memset(&pool, 0, sizeof(pool));
+	t_start = now_ns();
+	for (i = 0; i < num_tpdus; i++) {
+		uint32_t r = rnd();
+
+		/* renegotiate, alternating between the default Fi/Di and 512/8 */
+		if (i % 1024 == 0)
+			reset_and_pps(ch, i % 2048 ? 0x94 : 0x11);
+		tpdu(ch, 1 + (r & 3), (r >> 8) % 257, (r >> 4) % 16 == 0);
+	}
+	res->ns_per_char = (now_ns() - t_start) / num_chars;
+
+	fflush(stdout);
+	dup2(saved_stdout, 1);
+	close(saved_stdout);
+	close(devnull);
+
+	assert(pool.in_use == 0);
+	res->allocs_per_tpdu = (double) pool.allocs / num_tpdus;
+	res->peak_bufs = pool.peak;
+}
+
+/* the baseline is kept as "name value" lines, read and written with
+ * POSIX I/O, as the stdio.h of the firmware has no file streams */
+static int read_baseline(const char *path, struct result *res)
+{
+	char buf[512], *line, *val;
+	int fd, len, found = 0;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	len = read(fd, buf, sizeof(buf) - 1);
+	close(fd);
+	if (len < 0)
+		return -1;
+	buf[len] = '\0';
+
+	for (line = strtok(buf, "\n"); line; line = strtok(NULL, "\n")) {
+		val = strchr(line, ' ');
+		if (line[0] == '#' || !val)
+			continue;
+		*val++ = '\0';
+		if (!strcmp(line, "ns_per_char"))
+			res->ns_per_char = strtod(val, NULL);
+		else if (!strcmp(line, "allocs_per_tpdu"))
+			res->allocs_per_tpdu = strtod(val, NULL);
+		else if (!strcmp(line, "peak_bufs"))
+			res->peak_bufs = strtoul(val, NULL, 0);
+		else
+			continue;
+		found++;
+	}
+	return found == 3 ? 0 : -1;
+}
+
+static int write_baseline(const char *path, const struct result *res)
+{
+	char buf[512];
+	int fd, len;
+
+	len = snprintf(buf, sizeof(buf),
+		       "# written by card_emu_bench -w, the timing is specific to the machine\n"
+		       "ns_per_char %.2f\n"
+		       "allocs_per_tpdu %.4f\n"
+		       "peak_bufs %lu\n",
+		       res->ns_per_char, res->allocs_per_tpdu, res->peak_bufs);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return -1;
+	if (write(fd, buf, len) != len) {
+		close(fd);
+		return -1;
+	}
+	return close(fd);
+}
+
+int main(int argc, char **argv)
+{
+	const char *baseline = NULL, *write_path = NULL;
+	unsigned long num_tpdus = 1000000;
+	double tolerance = 10;
+	struct result res, base;
+	struct card_handle *ch;
+	int opt, rc = 0;
+
+	while ((opt = getopt(argc, argv, "n:b:t:w:")) != -1) {
+		switch (opt) {
+		case 'n':
+			num_tpdus = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			baseline = optarg;
+			break;
+		case 't':
+			tolerance = atof(optarg);
+			break;
+		case 'w':
+			write_path = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n NUM_TPDUS] [-b BASELINE [-t TOLERANCE_PERCENT]] "
+				"[-w BASELINE]\n", argv[0]);
+			exit(2);
+		}
+	}
+
+	ch = card_emu_init(0, 42, PHONE_DATAIN, PHONE_INT, false, true, false);
+	assert(ch);
+	usb_buf_init();
+
+	/* bring the card up */
+	card_emu_set_atr(ch, atr, sizeof(atr));
+	card_emu_io_statechg(ch, CARD_IO_VCC, 1);
+	card_emu_io_statechg(ch, CARD_IO_CLK, 1);
+
+	run(ch, num_tpdus, &res);
+
+	printf("%lu TPDUs, %lu characters\n", num_tpdus, num_chars);
+	printf("ns_per_char %.2f\n", res.ns_per_char);
+	printf("allocs_per_tpdu %.4f\n", res.allocs_per_tpdu);
+	printf("peak_bufs %lu\n", res.peak_bufs);
+
+	if (baseline) {
+		if (read_baseline(baseline, &base) < 0) {
+			fprintf(stderr, "cannot read baseline %s\n", baseline);
+			exit(2);
+		}
+		if (res.ns_per_char > base.ns_per_char * (1 + tolerance / 100)) {
+			printf("REGRESSION: ns_per_char %.2f > %.2f + %.0f%%\n",
+			       res.ns_per_char, base.ns_per_char, tolerance);
+			rc = 1;
+		}
+		if (res.allocs_per_tpdu > base.allocs_per_tpdu + 0.0001) {
+			printf("REGRESSION: allocs_per_tpdu %.4f > %.4f\n",
+			       res.allocs_per_tpdu, base.allocs_per_tpdu);
+			rc = 1;
+		}
+		if (res.peak_bufs > base.peak_bufs) {
+			printf("REGRESSION: peak_bufs %lu > %lu\n", res.peak_bufs, base.peak_bufs);
+			rc = 1;
+		}
+		if (!rc)
+			printf("no regression against %s\n", baseline);
+	}
+
+	if (write_path && write_baseline(write_path, &res) < 0) {
+		fprintf(stderr, "cannot write baseline %s\n", write_path);
+		exit(2);
+	}
+
+	exit(rc);
+}
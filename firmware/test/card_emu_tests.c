@@ -5,6 +5,7 @@
 #include <stdlib.h>
 
 #include "card_emu.h"
+#include "iso7816_fidi.h"
 #include "simtrace_prot.h"
 #include "tc_etu.h"
 #include "usb_buf.h"
@@ -70,6 +71,9 @@ void card_emu_uart_enable(uint8_t uart_chan, uint8_t rxtx)
 	case ENABLE_RX:
 		rts = "RX";
 		break;
+	case ENABLE_RX_TIMER:
+		rts = "RX-TIMER";
+		break;
 	default:
 		rts = "unknown";
 		break;
@@ -473,6 +477,152 @@ const uint8_t tpdu_body_read_rec[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06,
 const uint8_t tpdu_hdr_write_rec[] = { 0xA0, 0xD2, 0x00, 0x00, 0x07 };
 const uint8_t tpdu_body_write_rec[] = { 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06 };
 
+/***********************************************************************
+ * T=1
+ ***********************************************************************/
+
+/* ATR offering T=0 and T=1, with the default T=1 parameters (IFSC 32, LRC) */
+static const uint8_t atr_t1[] = { 0x3b, 0x80, 0x80, 0x01, 0x01 };
+
+/* PPS selecting T=1, without PPS1 */
+static const uint8_t pps_t1[] = { 0xff, 0x01, 0xfe };
+
+/* reset the card, and verify the ATR it sends */
+static void io_reset_card(struct card_handle *ch, const uint8_t *atr, unsigned int atr_len)
+{
+	unsigned int i;
+
+	card_emu_set_atr(ch, atr, atr_len);
+	card_emu_io_statechg(ch, CARD_IO_RST, 1);
+	card_emu_io_statechg(ch, CARD_IO_RST, 0);
+	card_emu_wtime_expired(ch);
+
+	printf("receiving + verifying ATR:\n");
+	for (i = 0; i < atr_len; i++)
+		assert(card_emu_tx_byte(ch) == 1);
+	assert(card_emu_tx_byte(ch) == 0);
+	reader_check_and_clear(atr, atr_len);
+}
+
+/* build a T=1 block with LRC, returning its length */
+static unsigned int t1_block(uint8_t *blk, uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	blk[0] = 0x00;
+	blk[1] = pcb;
+	blk[2] = len;
+	memcpy(blk + 3, inf, len);
+	return 3 + len + iso7816_3_t1_edc(blk + 3 + len, blk, 3 + len, false);
+}
+
+/* emulate the reader sending a T=1 block */
+static void rdr_send_t1_block(struct card_handle *ch, uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	uint8_t blk[3 + 254 + 1];
+
+	reader_send_bytes(ch, blk, t1_block(blk, pcb, inf, len));
+}
+
+/* verify the T=1 block the card transmits */
+static void card_tx_verify_t1_block(struct card_handle *ch, uint8_t pcb, const uint8_t *inf, uint8_t len)
+{
+	uint8_t blk[3 + 254 + 1];
+
+	card_tx_verify_chars(ch, blk, t1_block(blk, pcb, inf, len));
+}
+
+/* verify the information field the USB host receives */
+static void get_and_verify_rctx_t1(const uint8_t *data, unsigned int len, uint32_t flags)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(PHONE_DATAIN);
+	struct cardemu_usb_msg_rx_data *rd;
+	struct simtrace_msg_hdr *mh;
+	struct msgb *msg;
+
+	assert(bep);
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	assert(msg);
+	dump_rctx(msg);
+	mh = (struct simtrace_msg_hdr *) msg->l1h;
+	assert(mh->msg_type == SIMTRACE_MSGT_DO_CEMU_RX_DATA);
+	rd = (struct cardemu_usb_msg_rx_data *) msg->l2h;
+	assert(rd->flags == flags);
+	assert(rd->data_len == len);
+	assert(!memcmp(rd->data, data, len));
+
+	usb_buf_free(msg);
+}
+
+/* SELECT MF */
+static const uint8_t apdu_sel_mf[] = { 0x00, 0xa4, 0x00, 0x04, 0x02, 0x3f, 0x00 };
+static const uint8_t rapdu_sel_mf[] = { 0x62, 0x03, 0x82, 0x01, 0x38, 0x90, 0x00 };
+
+static void test_t1(struct card_handle *ch)
+{
+	const uint8_t ifsd = 4, wtx = 1;
+	uint8_t bad[3 + 7 + 1];
+
+	printf("\n==> PPS exchange to T=1\n");
+	io_reset_card(ch, atr_t1, sizeof(atr_t1));
+	reader_send_bytes(ch, pps_t1, sizeof(pps_t1));
+	get_and_verify_rctx_pps(pps_t1, sizeof(pps_t1));
+	card_tx_verify_chars(ch, pps_t1, sizeof(pps_t1));
+	/* without PPS1, Fi/Di stay at their defaults */
+	verify_status(ch, 1, 1, 10 * 960);
+
+	printf("\n==> T=1 I-block exchange\n");
+	rdr_send_t1_block(ch, 0x00, apdu_sel_mf, sizeof(apdu_sel_mf));
+	get_and_verify_rctx_t1(apdu_sel_mf, sizeof(apdu_sel_mf), CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+	card_tx_verify_chars(ch, NULL, 0);
+	host_to_device_data(ch, rapdu_sel_mf, sizeof(rapdu_sel_mf), CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+	card_emu_have_new_uart_tx(ch);
+	card_tx_verify_t1_block(ch, 0x00, rapdu_sel_mf, sizeof(rapdu_sel_mf));
+
+	printf("\n==> T=1 command chaining by the reader\n");
+	rdr_send_t1_block(ch, 0x40 | 0x20, apdu_sel_mf, 4);
+	get_and_verify_rctx_t1(apdu_sel_mf, 4, CEMU_DATA_F_T1);
+	/* R(N(R)=0) acknowledges the chained block */
+	card_tx_verify_t1_block(ch, 0x80, NULL, 0);
+	rdr_send_t1_block(ch, 0x00, apdu_sel_mf + 4, 3);
+	get_and_verify_rctx_t1(apdu_sel_mf + 4, 3, CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+
+	printf("\n==> T=1 waiting time extension\n");
+	card_emu_wtime_half_expired(ch);
+	card_tx_verify_t1_block(ch, 0xc3, &wtx, 1);
+	rdr_send_t1_block(ch, 0xe3, &wtx, 1);
+	card_tx_verify_chars(ch, NULL, 0);
+
+	printf("\n==> T=1 response chaining by the card, in two USB messages\n");
+	host_to_device_data(ch, rapdu_sel_mf, 3, CEMU_DATA_F_T1);
+	card_emu_have_new_uart_tx(ch);
+	/* 3 bytes don't fill IFSD=32, and are not the end of the response */
+	card_tx_verify_chars(ch, NULL, 0);
+	host_to_device_data(ch, rapdu_sel_mf + 3, sizeof(rapdu_sel_mf) - 3, CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+	card_emu_have_new_uart_tx(ch);
+	card_tx_verify_t1_block(ch, 0x40, rapdu_sel_mf, sizeof(rapdu_sel_mf));
+
+	printf("\n==> T=1 IFSD of the reader\n");
+	rdr_send_t1_block(ch, 0xc1, &ifsd, 1);
+	card_tx_verify_t1_block(ch, 0xe1, &ifsd, 1);
+	rdr_send_t1_block(ch, 0x40, apdu_sel_mf, sizeof(apdu_sel_mf));
+	get_and_verify_rctx_t1(apdu_sel_mf, sizeof(apdu_sel_mf), CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+	host_to_device_data(ch, rapdu_sel_mf, sizeof(rapdu_sel_mf), CEMU_DATA_F_T1 | CEMU_DATA_F_FINAL);
+	card_emu_have_new_uart_tx(ch);
+	card_tx_verify_t1_block(ch, 0x00 | 0x20, rapdu_sel_mf, 4);
+	/* R(N(R)=1) asks for the next block */
+	rdr_send_t1_block(ch, 0x90, NULL, 0);
+	card_tx_verify_t1_block(ch, 0x40, rapdu_sel_mf + 4, 3);
+	/* R(N(R)=1) now asks for the retransmission of the last block */
+	rdr_send_t1_block(ch, 0x90, NULL, 0);
+	card_tx_verify_t1_block(ch, 0x40, rapdu_sel_mf + 4, 3);
+
+	printf("\n==> T=1 block with EDC error\n");
+	t1_block(bad, 0x00, apdu_sel_mf, sizeof(apdu_sel_mf));
+	bad[sizeof(bad) - 1] ^= 0x01;
+	reader_send_bytes(ch, bad, sizeof(bad));
+	card_tx_verify_t1_block(ch, 0x81, NULL, 0);
+	assert(llist_empty(usb_get_queue(PHONE_DATAIN)));
+}
+
 int main(int argc, char **argv)
 {
 	struct card_handle *ch;
@@ -500,5 +650,7 @@ int main(int argc, char **argv)
 		test_tpdu_card2reader(ch, tpdu_hdr_read_rec, tpdu_body_read_rec, sizeof(tpdu_body_read_rec));
 	}
 
+	test_t1(ch);
+
 	exit(0);
 }
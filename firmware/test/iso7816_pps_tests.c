@@ -0,0 +1,248 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+
+#include <osmocom/core/utils.h>
+
+#include "iso7816_fidi.h"
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/***********************************************************************
+ * simulated cards, answering to a PPS request like ISO 7816-3 clause 9
+ ***********************************************************************/
+
+enum card_pps {
+	/* confirm the request, if within the capabilities of TA1 */
+	CARD_PPS_ACCEPT,
+	/* always answer with the default Fi/Di */
+	CARD_PPS_DEFAULT,
+	/* do not answer at all */
+	CARD_PPS_MUTE,
+	/* answer with a wrong PCK */
+	CARD_PPS_BAD_PCK,
+};
+
+struct sim_card {
+	const char *name;
+	const char *atr;
+	enum card_pps pps;
+	/* Fi/Di in use after the activation */
+	uint8_t fidi;
+	/* F/D ratio in use after the activation */
+	int ratio;
+};
+
+static const struct sim_card cards[] = {
+	{ "UICC, Fi 512 Di 32", "3b9f96801fc78031e073fe211b633a204e83009000e8", CARD_PPS_ACCEPT, 0x96, 16 },
+	{ "Fi 512 Di 64", "3b1097", CARD_PPS_ACCEPT, 0x97, 8 },
+	{ "Fi 372 Di 12", "3b1018", CARD_PPS_ACCEPT, 0x18, 31 },
+	/* 372/8 is no integer: fall back to Di 4 */
+	{ "Fi 372 Di 8", "3b1014", CARD_PPS_ACCEPT, 0x13, 93 },
+	{ "no TA1", "3b00", CARD_PPS_ACCEPT, 0x11, 372 },
+	{ "default TA1", "3b1011", CARD_PPS_ACCEPT, 0x11, 372 },
+	{ "RFU Di", "3b109a", CARD_PPS_ACCEPT, 0x11, 372 },
+	{ "specific mode", "3b90961080", CARD_PPS_MUTE, 0x96, 16 },
+	{ "specific mode, implicit", "3b90961090", CARD_PPS_MUTE, 0x11, 372 },
+	{ "rejecting PPS1", "3b1096", CARD_PPS_DEFAULT, 0x11, 372 },
+	{ "mute on PPS", "3b1096", CARD_PPS_MUTE, 0x11, 372 },
+	{ "bad PCK", "3b1096", CARD_PPS_BAD_PCK, 0x11, 372 },
+};
+
+/* answer of the card to a PPS request, returns its length */
+static unsigned int sim_card_pps(const struct sim_card *card, uint8_t ta1,
+				 const uint8_t *req, unsigned int req_len, uint8_t *resp)
+{
+	unsigned int i, len;
+	uint8_t pck = 0;
+
+	assert(req_len == iso7816_3_pps_len(req[1]));
+	for (i = 0; i < req_len; i++)
+		pck ^= req[i];
+	assert(pck == 0);
+
+	switch (card->pps) {
+	case CARD_PPS_MUTE:
+		return 0;
+	case CARD_PPS_DEFAULT:
+		resp[0] = 0xff;
+		resp[1] = req[1] & 0x0f;
+		len = 3;
+		break;
+	default:
+		/* Fi as indicated, and a D up to the one indicated */
+		assert((req[2] >> 4) == (ta1 >> 4));
+		assert(iso7816_3_di_table[req[2] & 0x0f] <= iso7816_3_di_table[ta1 & 0x0f]);
+		memcpy(resp, req, req_len);
+		len = req_len;
+		break;
+	}
+
+	resp[len - 1] = 0;
+	for (i = 0; i < len - 1; i++)
+		resp[len - 1] ^= resp[i];
+	if (card->pps == CARD_PPS_BAD_PCK)
+		resp[len - 1] ^= 0x01;
+
+	return len;
+}
+
+/* select the transmission parameters like the CCID reader does after the ATR */
+static uint8_t activate(const struct sim_card *card)
+{
+	struct iso7816_3_atr_params atr;
+	uint8_t atr_buf[33], req[4], resp[6], fidi;
+	unsigned int req_len, resp_len;
+	int atr_len, rc;
+
+	atr_len = osmo_hexparse(card->atr, atr_buf, sizeof(atr_buf));
+	assert(atr_len > 0);
+	assert(iso7816_3_atr_parse(atr_buf, atr_len, &atr) == 0);
+
+	if (atr.specific)
+		return atr.implicit ? ISO7816_3_DEFAULT_FIDI : atr.fidi;
+
+	fidi = iso7816_3_select_fidi(atr.fidi);
+	if (fidi == ISO7816_3_DEFAULT_FIDI)
+		return fidi;
+
+	req_len = iso7816_3_pps_request(req, atr.t, fidi);
+	resp_len = sim_card_pps(card, atr.fidi, req, req_len, resp);
+	rc = iso7816_3_pps_check(req, resp, resp_len);
+	printf("\tPPS %s -> ", osmo_hexdump_nospc(req, req_len));
+	printf("%s: ", resp_len ? osmo_hexdump_nospc(resp, resp_len) : "(none)");
+	if (rc < 0) {
+		/* the reader resets the card and stays with the defaults */
+		printf("failed\n");
+		return ISO7816_3_DEFAULT_FIDI;
+	}
+	printf("Fi/Di 0x%02x\n", rc);
+	return rc;
+}
+
+static void test_cards(void)
+{
+	unsigned int i;
+	uint8_t fidi;
+	int ratio;
+
+	for (i = 0; i < ARRAY_SIZE(cards); i++) {
+		printf("card '%s', ATR %s\n", cards[i].name, cards[i].atr);
+		fidi = activate(&cards[i]);
+		ratio = iso7816_3_compute_fd_ratio(fidi >> 4, fidi & 0x0f);
+		printf("\t=> Fi/Di 0x%02x, F/D %d, %d times the default data rate\n",
+		       fidi, ratio, 372 / ratio);
+		assert(fidi == cards[i].fidi);
+		assert(ratio == cards[i].ratio);
+	}
+}
+
+static void test_atr_parse(void)
+{
+	struct iso7816_3_atr_params atr;
+	/* TD1 with T=0 and TC2 = 0x20, followed by TD2 offering T=1 */
+	const uint8_t atr_wi[] = { 0x3b, 0x80, 0xc0, 0x20, 0x01 };
+	/* TA1, TC1 = 5 and TD1 offering T=1 */
+	const uint8_t atr_tc1[] = { 0x3b, 0xd0, 0x95, 0x05, 0x01 };
+	/* no interface bytes at all */
+	const uint8_t atr_t0[] = { 0x3b, 0x00 };
+	/* TD1 offering T=0, TD2 offering T=1 with TA3 = IFSC, TB3 = BWI/CWI and
+	 * TC3 = CRC, TD3 offering T=15 with TA4 */
+	const uint8_t atr_t1[] = { 0x3b, 0x80, 0x80, 0xf1, 0xfe, 0x45, 0x01, 0x1f, 0xc7 };
+
+	printf("ATR parsing\n");
+
+	assert(iso7816_3_atr_parse(atr_wi, sizeof(atr_wi), &atr) == 0);
+	assert(atr.fidi == ISO7816_3_DEFAULT_FIDI);
+	assert(atr.t == 0);
+	assert(atr.wi == 0x20);
+	assert(!atr.specific);
+
+	assert(iso7816_3_atr_parse(atr_tc1, sizeof(atr_tc1), &atr) == 0);
+	assert(atr.fidi == 0x95);
+	assert(atr.n == 0x05);
+	assert(atr.t == 1);
+	assert(atr.wi == ISO7816_3_DEFAULT_WI);
+
+	/* T=0 only, without TD1 */
+	assert(iso7816_3_atr_parse(atr_t0, sizeof(atr_t0), &atr) == 0);
+	assert(atr.protocols == (1 << 0));
+
+	/* T=1 specific bytes after TD2 */
+	assert(iso7816_3_atr_parse(atr_t1, sizeof(atr_t1), &atr) == 0);
+	assert(atr.t == 0);
+	assert(atr.protocols == ((1 << 0) | (1 << 1) | (1 << 15)));
+	assert(atr.ifsc == 0xfe);
+	assert(atr.bwi == 4 && atr.cwi == 5);
+	assert(atr.crc);
+	assert(iso7816_3_atr_parse(atr_wi, sizeof(atr_wi), &atr) == 0);
+	assert(atr.protocols == ((1 << 0) | (1 << 1)));
+	assert(atr.ifsc == ISO7816_3_DEFAULT_IFS);
+	assert(atr.bwi == ISO7816_3_DEFAULT_BWI && atr.cwi == ISO7816_3_DEFAULT_CWI);
+	assert(!atr.crc);
+
+	/* interface bytes missing */
+	assert(iso7816_3_atr_parse(atr_tc1, 3, &atr) == -EINVAL);
+	assert(iso7816_3_atr_parse(atr_wi, 4, &atr) == -EINVAL);
+	assert(iso7816_3_atr_parse(atr_wi, 1, &atr) == -EINVAL);
+}
+
+static void test_pps_check(void)
+{
+	uint8_t req[4];
+	const uint8_t resp_ok[] = { 0xff, 0x10, 0x96, 0x79 };
+	const uint8_t resp_other_t[] = { 0xff, 0x11, 0x96, 0x78 };
+	const uint8_t resp_other_fidi[] = { 0xff, 0x10, 0x95, 0x7a };
+	const uint8_t resp_pps2[] = { 0xff, 0x30, 0x96, 0x00, 0x59 };
+
+	printf("PPS response checks\n");
+
+	assert(iso7816_3_pps_request(req, 0, 0x96) == 4);
+	assert(!memcmp(req, resp_ok, sizeof(resp_ok)));
+
+	assert(iso7816_3_pps_check(req, resp_ok, sizeof(resp_ok)) == 0x96);
+	assert(iso7816_3_pps_check(req, resp_ok, 3) == -EINVAL);
+	assert(iso7816_3_pps_check(req, resp_other_t, sizeof(resp_other_t)) == -EINVAL);
+	assert(iso7816_3_pps_check(req, resp_other_fidi, sizeof(resp_other_fidi)) == -EINVAL);
+	assert(iso7816_3_pps_check(req, resp_pps2, sizeof(resp_pps2)) == -EINVAL);
+}
+
+static void test_t1_edc(void)
+{
+	const uint8_t check[] = "123456789";
+	/* S(IFS request) with IFS = 254 */
+	const uint8_t s_ifs[] = { 0x00, 0xc1, 0x01, 0xfe };
+	uint8_t edc[2];
+
+	printf("T=1 error detection codes\n");
+
+	assert(iso7816_3_t1_edc(edc, s_ifs, sizeof(s_ifs), false) == 1);
+	assert(edc[0] == 0x3e);
+	/* check value of the CRC of ISO/IEC 13239, without the final XOR */
+	assert(iso7816_3_t1_edc(edc, check, sizeof(check) - 1, true) == 2);
+	assert(edc[0] == 0x6f && edc[1] == 0x91);
+}
+
+int main(int argc, char **argv)
+{
+	test_atr_parse();
+	test_t1_edc();
+	test_pps_check();
+	test_cards();
+
+	printf("OK\n");
+	return 0;
+}
@@ -0,0 +1,130 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "simtrace_prot.h"
+#include "modem_status.h"
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+#define LED	ST_MDM_STS_BIT_WWAN_LED
+#define CARD	ST_MDM_STS_BIT_CARD_INSERTED
+
+static uint32_t now;
+
+static bool poll(unsigned int modem, struct st_modem_status *sts)
+{
+	if (!modem_status_poll(modem, now))
+		return false;
+	modem_status_get(modem, sts, now);
+	return true;
+}
+
+/* the initial levels are no change; a change is taken once stable, with the
+ * time of its edge */
+static void test_debounce(void)
+{
+	struct st_modem_status sts;
+
+	printf("==> %s\n", __func__);
+
+	now = 1000;
+	modem_status_input(0, LED, false, now);
+	modem_status_input(0, CARD, true, now);
+	assert(!poll(0, &sts));
+	modem_status_get(0, &sts, now);
+	assert(sts.supported_mask == (LED | CARD));
+	assert(sts.status_mask == CARD);
+	assert(sts.changed_mask == 0);
+
+	/* a bounce of the LED is filtered */
+	modem_status_input(0, LED, true, now);
+	now += MODEM_STATUS_DEBOUNCE_MS / 2;
+	modem_status_input(0, LED, false, now);
+	now += MODEM_STATUS_DEBOUNCE_MS;
+	assert(!poll(0, &sts));
+
+	modem_status_input(0, LED, true, 1100);
+	now = 1100 + MODEM_STATUS_DEBOUNCE_MS - 1;
+	assert(!poll(0, &sts));
+	now++;
+	assert(poll(0, &sts));
+	printf("status 0x%02x changed 0x%02x, edge at %u, %u edges\n", sts.status_mask, sts.changed_mask,
+	       sts.wwan_led_edge_ms, sts.wwan_led_edges);
+	assert(sts.status_mask == (LED | CARD));
+	assert(sts.changed_mask == LED);
+	assert(sts.wwan_led_edge_ms == 1100);
+	assert(sts.card_inserted_edge_ms == 1000);
+	assert(sts.wwan_led_edges == 1);
+	assert(sts.timestamp_ms == now);
+	assert(!poll(0, &sts));
+}
+
+/* the changes between two reports are accumulated */
+static void test_coalesce(void)
+{
+	struct st_modem_status sts;
+
+	printf("==> %s\n", __func__);
+
+	modem_status_input(0, LED, false, 2000);
+	modem_status_input(0, CARD, false, 2000);
+	now = 2000 + MODEM_STATUS_DEBOUNCE_MS;
+	assert(modem_status_poll(0, now));
+	modem_status_input(0, LED, true, now);
+	now += MODEM_STATUS_DEBOUNCE_MS;
+	assert(modem_status_poll(0, now));
+
+	modem_status_get(0, &sts, now);
+	assert(sts.status_mask == LED);
+	assert(sts.changed_mask == (LED | CARD));
+	assert(sts.wwan_led_edge_ms == 2000 + MODEM_STATUS_DEBOUNCE_MS);
+	assert(sts.card_inserted_edge_ms == 2000);
+	assert(sts.wwan_led_edges == 3);
+}
+
+/* the modems are independent, and a modem without inputs supports nothing */
+static void test_modems(void)
+{
+	struct st_modem_status sts;
+
+	printf("==> %s\n", __func__);
+
+	modem_status_get(1, &sts, now);
+	assert(sts.supported_mask == 0);
+	modem_status_input(1, CARD, false, now);
+	modem_status_input(1, CARD, true, now);
+	now += MODEM_STATUS_DEBOUNCE_MS;
+	assert(poll(1, &sts));
+	assert(sts.supported_mask == CARD);
+	assert(sts.changed_mask == CARD);
+	assert(!modem_status_poll(0, now));
+
+	/* out of range */
+	modem_status_input(MODEM_STATUS_NUM, CARD, true, now);
+	assert(!modem_status_poll(MODEM_STATUS_NUM, now));
+}
+
+int main(int argc, char **argv)
+{
+	test_debounce();
+	test_coalesce();
+	test_modems();
+
+	printf("OK\n");
+	exit(0);
+}
@@ -0,0 +1,238 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "slot_sched.h"
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/* simulated reader of one slot: it powers the card, and runs its work queue of
+ * transactions.  Only while its slot is connected does the card answer */
+struct sim_reader {
+	bool powered;
+	/* transactions still to be done */
+	unsigned int todo;
+	/* ms until the end of the current transaction; 0 if between two */
+	unsigned int busy;
+	/* ms until the next transaction, after the previous one */
+	unsigned int gap;
+	/* stops the clock once its work is done */
+	bool clk_stop;
+};
+
+#define TRANSACTION_MS	15
+#define GAP_MS		2
+
+static struct sim_reader readers[SLOT_SCHED_NUM_SLOTS];
+static uint8_t cur;
+static uint32_t now;
+static unsigned int num_switches;
+
+static enum slot_sched_activity reader_activity(const struct sim_reader *r)
+{
+	bool idle = !r->busy;
+
+	return slot_sched_classify(r->powered, false, r->clk_stop && idle && !r->todo && !r->gap, idle);
+}
+
+/* one ms of the main loop: the connected reader progresses, then the scheduler
+ * may move on to the next slot */
+static void tick(void)
+{
+	struct sim_reader *r = &readers[cur];
+	int next;
+
+	if (r->powered) {
+		if (r->busy) {
+			if (--r->busy == 0)
+				r->gap = GAP_MS;
+		} else if (r->gap) {
+			r->gap--;
+		} else if (r->todo) {
+			r->todo--;
+			r->busy = TRANSACTION_MS;
+		}
+	}
+
+	next = slot_sched_poll(reader_activity(r), now);
+	if (next >= 0) {
+		/* never within a transaction */
+		assert(!r->busy);
+		assert(next != cur);
+		cur = next;
+		slot_sched_switched(cur, now);
+		num_switches++;
+	}
+	now++;
+}
+
+static void setup(uint8_t mask, uint8_t first)
+{
+	memset(readers, 0, sizeof(readers));
+	cur = first;
+	now = 1000;
+	num_switches = 0;
+	slot_sched_init(cur, now);
+	slot_sched_set_mask(mask);
+}
+
+/* without a mask, the scheduler stays with the connected slot */
+static void test_no_mask(void)
+{
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	setup(0, 3);
+	for (i = 0; i < 1000; i++)
+		tick();
+	assert(num_switches == 0);
+	assert(cur == 3);
+}
+
+/* idle slots are left after a while, unpowered ones even earlier */
+static void test_round_robin(void)
+{
+	uint32_t connected_ms, connections;
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	setup(0xff, 0);
+	for (i = 0; i < SLOT_SCHED_NUM_SLOTS; i++)
+		readers[i].powered = i != 2;
+	for (i = 0; i < 2 * (7 * SLOT_SCHED_IDLE_MS + SLOT_SCHED_SETTLE_MS); i++)
+		tick();
+
+	for (i = 0; i < SLOT_SCHED_NUM_SLOTS; i++) {
+		slot_sched_get_stats(i, now, &connected_ms, &connections);
+		printf("slot %u: connected %u times, for %u ms\n", i, connections, connected_ms);
+		assert(connections == 2 || (i == 0 && connections == 3));
+		if (i == 2) {
+			assert(connected_ms == 2 * SLOT_SCHED_SETTLE_MS);
+		} else if (i != 0) {
+			assert(connected_ms == 2 * SLOT_SCHED_IDLE_MS);
+		}
+	}
+}
+
+/* a slot removed from the mask is left at once, but not within a transaction */
+static void test_mask_change(void)
+{
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	setup(0x01, 0);
+	readers[0].powered = true;
+	readers[0].todo = 1;
+	tick();
+	assert(readers[0].busy);
+
+	slot_sched_set_mask(0x10);
+	for (i = 0; i < TRANSACTION_MS - 2; i++)
+		tick();
+	assert(cur == 0);
+	tick();
+	tick();
+	assert(cur == 4);
+	assert(num_switches == 1);
+}
+
+/* a reader stopping the clock between transactions: its slot is left like an
+ * unpowered one, but a stopped clock never ends a transaction */
+static void test_clock_stop(void)
+{
+	uint32_t connected_ms, connections;
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	assert(slot_sched_classify(true, false, true, true) == SLOT_SCHED_A_OFF);
+	assert(slot_sched_classify(true, false, true, false) == SLOT_SCHED_A_BUSY);
+	assert(slot_sched_classify(true, true, true, true) == SLOT_SCHED_A_RESET);
+	assert(slot_sched_classify(true, false, false, true) == SLOT_SCHED_A_IDLE);
+
+	setup(0x03, 0);
+	for (i = 0; i < 2; i++) {
+		readers[i].powered = true;
+		readers[i].clk_stop = true;
+	}
+	readers[0].todo = 1;
+	/* the transaction, the gap after it, then the clock stops */
+	for (i = 0; i < 1 + TRANSACTION_MS + GAP_MS + 1; i++)
+		tick();
+	assert(cur == 1);
+	for (i = 0; i < SLOT_SCHED_SETTLE_MS; i++)
+		tick();
+	assert(cur == 0);
+
+	slot_sched_get_stats(1, now, &connected_ms, &connections);
+	printf("slot 1: connected %u times, for %u ms\n", connections, connected_ms);
+	assert(connections == 1 && connected_ms == SLOT_SCHED_SETTLE_MS);
+}
+
+/* each slot has a work queue, processed while it is connected: compare the time
+ * to process all of them with the time of their transactions */
+static void test_work_queues(void)
+{
+	uint32_t connected_ms, connections, start;
+	unsigned int i, done = 0, todo = 20;
+	bool finished;
+
+	printf("==> %s\n", __func__);
+
+	setup(0xff, 0);
+	for (i = 0; i < SLOT_SCHED_NUM_SLOTS; i++) {
+		readers[i].powered = true;
+		readers[i].todo = todo;
+	}
+	start = now;
+	do {
+		tick();
+		finished = true;
+		for (i = 0; i < SLOT_SCHED_NUM_SLOTS; i++) {
+			if (readers[i].todo || readers[i].busy)
+				finished = false;
+		}
+	} while (!finished && now - start < 100000);
+	assert(finished);
+
+	for (i = 0; i < SLOT_SCHED_NUM_SLOTS; i++) {
+		slot_sched_get_stats(i, now, &connected_ms, &connections);
+		printf("slot %u: %u transactions in %u ms, connected %u times\n",
+		       i, todo, connected_ms, connections);
+		done += todo;
+	}
+	printf("%u transactions of %u cards in %u ms (%u ms of transactions), %u switches\n",
+	       done, SLOT_SCHED_NUM_SLOTS, now - start,
+	       SLOT_SCHED_NUM_SLOTS * todo * (TRANSACTION_MS + GAP_MS), num_switches);
+	/* the time slices lost: the idle time before leaving a slot whose work is done */
+	assert(now - start < SLOT_SCHED_NUM_SLOTS * todo * (TRANSACTION_MS + GAP_MS) * 12 / 10);
+}
+
+int main(int argc, char **argv)
+{
+	test_no_mask();
+	test_round_robin();
+	test_mask_change();
+	test_clock_stop();
+	test_work_queues();
+
+	printf("OK\n");
+	exit(0);
+}
@@ -0,0 +1,180 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+
+#include "simtrace_usb.h"
+#include "usb_buf.h"
+
+/* the IN queues before they were limited by the pool: the oldest message was
+ * evicted once three were queued */
+#define OLD_MAX_QLEN	3
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/* receive buffers posted on the OUT endpoint, as by usb_refill_from_host() */
+static struct msgb *out_bufs[USB_OUT_NUM_BUFS];
+
+static void post_out_bufs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < USB_OUT_NUM_BUFS; i++) {
+		out_bufs[i] = usb_buf_alloc(SIMTRACE_USB_EP_CARD_DATAOUT);
+		assert(out_bufs[i]);
+	}
+}
+
+static void free_out_bufs(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < USB_OUT_NUM_BUFS; i++)
+		usb_buf_free(out_bufs[i]);
+}
+
+/* submit a message numbered seq, like the sniffer does for a TPDU (data) or a
+ * card change (status) */
+static void submit(uint8_t ep, uint32_t seq, bool status)
+{
+	struct msgb *msg = usb_buf_alloc(ep);
+
+	assert(msg);
+	memcpy(msgb_put(msg, sizeof(seq)), &seq, sizeof(seq));
+	if (status)
+		usb_buf_set_prio(msg);
+	assert(usb_buf_submit(msg) == 0);
+}
+
+/* the host takes the next message from the queue, as usb_refill_to_host() does.
+ * Returns its number, or -1 if the queue is empty */
+static int64_t host_read(uint8_t ep, bool *status)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(ep);
+	struct msgb *msg;
+	uint32_t seq;
+
+	msg = msgb_dequeue_count(&bep->queue, &bep->queue_len);
+	if (!msg)
+		return -1;
+	memcpy(&seq, msgb_data(msg), sizeof(seq));
+	*status = msg->cb[USB_BUF_CB_FLAGS] & USB_BUF_F_PRIO;
+	usb_buf_free(msg);
+	return seq;
+}
+
+/* one message per ms, every tenth one a status message.  The host stalls, and we
+ * measure after how many ms the first message is lost */
+static void test_host_stall(void)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(SIMTRACE_USB_EP_CARD_DATAIN);
+	unsigned int ms, survived = 0, num_status = 0, num_data = 0;
+	int64_t seq, last_data = -1, last_status = -1;
+	bool status;
+
+	printf("==> %s\n", __func__);
+
+	post_out_bufs();
+
+	for (ms = 0; ms < 200; ms++) {
+		submit(SIMTRACE_USB_EP_CARD_DATAIN, ms, ms % 10 == 0);
+		if (!survived && bep->num_evicted)
+			survived = ms;
+		/* the pool is never exhausted: the status messages only take
+		 * buffers of the reserve */
+		assert(usb_buf_num_free() > 0);
+	}
+	printf("host stall survived for %u ms without loss (was %u ms), qlen=%u, evicted=%u\n",
+	       survived, OLD_MAX_QLEN, bep->queue_len, bep->num_evicted);
+	assert(survived > OLD_MAX_QLEN);
+
+	/* the host resumes: the latest status messages are all there, and the data is
+	 * what came last, without gaps */
+	while ((seq = host_read(SIMTRACE_USB_EP_CARD_DATAIN, &status)) >= 0) {
+		if (status) {
+			assert(seq > last_status);
+			last_status = seq;
+			num_status++;
+		} else {
+			assert(last_data < 0 || seq == last_data + 1 || seq == last_data + 2);
+			last_data = seq;
+			num_data++;
+		}
+	}
+	printf("host received %u status messages (last %lld), %u data messages (last %lld)\n",
+	       num_status, (long long) last_status, num_data, (long long) last_data);
+	assert(num_status == USB_MAX_QLEN_PRIO);
+	assert(last_status == 190);
+	assert(last_data == 199);
+
+	free_out_bufs();
+	bep->num_evicted = 0;
+}
+
+/* a stalled endpoint doesn't starve the other one, which the host keeps reading */
+static void test_two_endpoints(void)
+{
+	struct usb_buffered_ep *card = usb_get_buf_ep(SIMTRACE_USB_EP_CARD_DATAIN);
+	struct usb_buffered_ep *phone = usb_get_buf_ep(SIMTRACE_USB_EP_PHONE_DATAIN);
+	unsigned int ms;
+	bool status;
+
+	printf("==> %s\n", __func__);
+
+	for (ms = 0; ms < 100; ms++) {
+		submit(SIMTRACE_USB_EP_PHONE_DATAIN, ms, false);
+		submit(SIMTRACE_USB_EP_CARD_DATAIN, ms, false);
+		assert(host_read(SIMTRACE_USB_EP_CARD_DATAIN, &status) == ms);
+	}
+	printf("stalled endpoint: qlen=%u, evicted=%u; other endpoint: evicted=%u\n",
+	       phone->queue_len, phone->num_evicted, card->num_evicted);
+	assert(card->num_evicted == 0);
+	assert(phone->num_evicted > 0);
+
+	while (host_read(SIMTRACE_USB_EP_PHONE_DATAIN, &status) >= 0)
+		;
+	assert(usb_buf_num_free() == NUM_RCTX_SMALL + NUM_RCTX_LARGE);
+}
+
+/* everything on an interrupt endpoint is a status message */
+static void test_status_endpoint(void)
+{
+	struct usb_buffered_ep *bep = usb_get_buf_ep(SIMTRACE_USB_EP_CARD_INT);
+	unsigned int i;
+	bool status;
+
+	printf("==> %s\n", __func__);
+
+	for (i = 0; i < 10; i++)
+		submit(SIMTRACE_USB_EP_CARD_INT, i, false);
+	assert(bep->queue_len == USB_MAX_QLEN_PRIO);
+	assert(bep->num_evicted == 0);
+	for (i = 10 - USB_MAX_QLEN_PRIO; i < 10; i++) {
+		assert(host_read(SIMTRACE_USB_EP_CARD_INT, &status) == i);
+		assert(status);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	usb_buf_init();
+
+	test_host_stall();
+	test_two_endpoints();
+	test_status_endpoint();
+
+	printf("OK\n");
+	exit(0);
+}
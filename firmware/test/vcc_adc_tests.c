@@ -0,0 +1,226 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#include "simtrace_prot.h"
+#include "vcc_adc.h"
+
+/* stub for stdio */
+signed int printf_sync(const char *pFormat, ...)
+{
+	va_list ap;
+	signed int result;
+
+	va_start(ap, pFormat);
+	result = vprintf(pFormat, ap);
+	va_end(ap);
+
+	return result;
+}
+
+/* stub of boardver_adc.c, which needs the board */
+#define UV_PER_LSB	((3300 * 1000) / 4096)
+uint32_t adc2uv(uint16_t adc)
+{
+	return (uint32_t) adc * UV_PER_LSB;
+}
+
+#define MV(x)	((x) * 1000 / UV_PER_LSB)
+
+/* thresholds of the qmod, which can't measure 5V */
+static const struct vcc_adc_thresh thresh = {
+	.on_uv = 2500000,
+	.class_c_uv = 1500000,
+	.class_b_uv = 2500000,
+};
+
+/* a buffer is filled in about 1 ms, with the samples of both channels */
+static struct vcc_adc_chan chans[2];
+static uint16_t buf[VCC_ADC_BUF_SAMPLES];
+static uint32_t now;
+
+/* one buffer: channel 7 at mv7, with a drop to dip_mv in its middle, and
+ * channel 6 at mv6 */
+static void feed(unsigned int mv7, unsigned int dip_mv, unsigned int mv6)
+{
+	unsigned int i;
+
+	for (i = 0; i < VCC_ADC_BUF_SAMPLES; i += 2) {
+		unsigned int mv = mv7;
+
+		if (dip_mv && i == VCC_ADC_BUF_SAMPLES / 2)
+			mv = dip_mv;
+		buf[i] = (7 << 12) | MV(mv);
+		buf[i + 1] = (6 << 12) | MV(mv6);
+	}
+	vcc_adc_process(chans, 2, buf, VCC_ADC_BUF_SAMPLES, now);
+	now++;
+}
+
+static void setup(void)
+{
+	now = 1000;
+	vcc_adc_chan_init(&chans[0], 7, &thresh, now);
+	vcc_adc_chan_init(&chans[1], 6, &thresh, now);
+}
+
+/* VCC ramps up through the thresholds of 1.8V: only 3V is reported */
+static void test_ramp_up(void)
+{
+	struct vcc_adc_state st;
+
+	printf("==> %s\n", __func__);
+
+	setup();
+	feed(0, 0, 0);
+	assert(!vcc_adc_get(&chans[0], &st));
+	feed(1000, 0, 0);
+	feed(2000, 0, 0);
+	assert(!chans[0].active);
+	feed(2900, 0, 0);
+	assert(chans[0].active);
+	assert(!vcc_adc_get(&chans[0], &st));
+	feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	printf("class %u, %u..%u mV, avg %u mV\n", st.vcc_class, st.min_uv / 1000, st.max_uv / 1000,
+	       st.avg_uv / 1000);
+	assert(st.valid);
+	assert(st.vcc_class == CEMU_VCC_CLASS_B);
+	assert(st.glitches == 0);
+	assert(st.min_uv < 100000 && st.max_uv > 2950000);
+	assert(!vcc_adc_get(&chans[0], &st));
+
+	/* the other channel stays off */
+	assert(!chans[1].active);
+	assert(chans[1].vcc_class == CEMU_VCC_CLASS_NONE);
+}
+
+/* without an event, a window is passed on after VCC_ADC_WINDOW_MS */
+static void test_window(void)
+{
+	struct vcc_adc_state st;
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	setup();
+	feed(3000, 0, 1800);
+	feed(3000, 0, 1800);
+	assert(vcc_adc_get(&chans[0], &st));
+	assert(vcc_adc_get(&chans[1], &st));
+	assert(st.vcc_class == CEMU_VCC_CLASS_C);
+
+	for (i = 0; i < VCC_ADC_WINDOW_MS - 1; i++) {
+		feed(3000 + i % 2 * 100, 0, 1800);
+		assert(!vcc_adc_get(&chans[0], &st));
+	}
+	feed(3000, 0, 1800);
+	assert(vcc_adc_get(&chans[0], &st));
+	printf("%u..%u mV, avg %u mV\n", st.min_uv / 1000, st.max_uv / 1000, st.avg_uv / 1000);
+	assert(st.min_uv / 1000 >= 2990 && st.min_uv / 1000 <= 3000);
+	assert(st.max_uv / 1000 >= 3090 && st.max_uv / 1000 <= 3100);
+	assert(st.avg_uv / 1000 >= 3030 && st.avg_uv / 1000 <= 3060);
+	assert(st.glitches == 0);
+}
+
+/* short drops while VCC stays on are glitches, reported at once; a drop
+ * lasting several buffers is one glitch */
+static void test_glitch(void)
+{
+	struct vcc_adc_state st;
+	unsigned int i;
+
+	printf("==> %s\n", __func__);
+
+	setup();
+	feed(3000, 0, 0);
+	feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+
+	/* 2.8V is within the tolerance */
+	feed(3000, 2800, 0);
+	feed(3000, 0, 0);
+	assert(!vcc_adc_get(&chans[0], &st));
+
+	feed(3000, 1000, 0);
+	assert(!vcc_adc_get(&chans[0], &st));
+	feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	printf("glitch: %u glitches, min %u mV\n", st.glitches, st.min_uv / 1000);
+	assert(st.glitches == 1);
+	assert(st.min_uv < 1100000);
+	assert(chans[0].active);
+
+	/* brown-out */
+	for (i = 0; i < 10; i++)
+		feed(2600, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	assert(st.glitches == 1);
+	assert(st.vcc_class == CEMU_VCC_CLASS_B);
+	for (i = 0; i < VCC_ADC_WINDOW_MS; i++)
+		feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	assert(st.glitches == 0);
+}
+
+/* VCC switched off is not a glitch */
+static void test_power_down(void)
+{
+	struct vcc_adc_state st;
+
+	printf("==> %s\n", __func__);
+
+	setup();
+	feed(3000, 0, 0);
+	feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+
+	feed(3000, 200, 0);
+	feed(100, 0, 0);
+	assert(!chans[0].active);
+	feed(0, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	assert(st.vcc_class == CEMU_VCC_CLASS_NONE);
+	assert(st.glitches == 0);
+}
+
+/* another slot connected: the buffers with samples of the previous one are
+ * dropped */
+static void test_restart(void)
+{
+	struct vcc_adc_state st;
+
+	printf("==> %s\n", __func__);
+
+	setup();
+	feed(3000, 0, 0);
+	feed(3000, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+
+	vcc_adc_chan_restart(&chans[0], now);
+	feed(3000, 1800, 0);
+	feed(1800, 0, 0);
+	assert(chans[0].vcc_class == CEMU_VCC_CLASS_NONE);
+	feed(1800, 0, 0);
+	feed(1800, 0, 0);
+	assert(vcc_adc_get(&chans[0], &st));
+	assert(st.vcc_class == CEMU_VCC_CLASS_C);
+	assert(st.glitches == 0);
+	assert(st.max_uv < 1850000);
+	assert(!chans[0].active);
+}
+
+int main(int argc, char **argv)
+{
+	test_ramp_up();
+	test_window();
+	test_glitch();
+	test_power_down();
+	test_restart();
+
+	printf("OK\n");
+	exit(0);
+}
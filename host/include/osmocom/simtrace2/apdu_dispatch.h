@@ -19,19 +19,27 @@
 
 #include <osmocom/sim/sim.h>
 
+/* maximum Nc/Ne of an extended length APDU (ISO 7816-4:2013 clause 5.1) */
+#define OSMO_APDU_MAX_DATA_LEN	65535
+
 struct osmo_apdu_context {
 	struct osim_apdu_cmd_hdr hdr;
 	uint8_t dc[256];
 	uint8_t de[256];
 	uint8_t sw[2];
 	uint8_t apdu_case;
+	/* Lc/Le fields are of extended length (only from a T=1 APDU) */
+	bool extended;
+	/* Dc of an extended APDU, which isn't copied into dc: it points into the
+	 * buffer passed to osmo_apdu_parse_capdu() */
+	const uint8_t *ext_dc;
 	struct {
-		uint8_t tot;
-		uint8_t cur;
+		uint16_t tot;
+		uint16_t cur;
 	} lc;
 	struct {
-		uint8_t tot;
-		uint8_t cur;
+		uint16_t tot;
+		uint16_t cur;
 	} le;
 };
 
@@ -48,3 +56,6 @@ int osmo_apdu_segment_in(struct osmo_apdu_context *ac, const uint8_t *apdu_buf,
 
 int osmo_apdu_segment_in2(struct osmo_apdu_context *ac, struct osmo_apdu_context *prev_ac,
 			 const uint8_t *apdu_buf, unsigned int apdu_len, bool new_apdu);
+
+int osmo_apdu_parse_capdu(struct osmo_apdu_context *ac, const uint8_t *apdu_buf,
+			  unsigned int apdu_len);
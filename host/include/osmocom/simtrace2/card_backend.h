@@ -0,0 +1,64 @@
+/* card_backend - abstract card behind a card emulation instance
+ *
+ * (C) 2026 by sysmocom - s.f.m.c. GmbH <info@sysmocom.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include <osmocom/core/msgb.h>
+#include <osmocom/sim/sim.h>
+
+struct osmo_st2_card_backend;
+
+/* operations a card backend has to implement */
+struct osmo_st2_card_backend_ops {
+	/* human-readable name of the backend */
+	const char *name;
+	/* (cold or warm) reset the card; update be->atr / be->atr_len */
+	int (*reset)(struct osmo_st2_card_backend *be, bool cold);
+	/* transceive a TPDU.  On entry, msg contains the 5-byte TPDU header followed by
+	 * the command data (if any) and msg->l3h points to msg->tail.  On return, any
+	 * response data has been appended at msg->l3h, followed by the two SW bytes.
+	 * A command APDU with extended Lc/Le fields (received by T=1) is passed as it is,
+	 * see osmo_st2_tpdu_is_extended(); a backend not supporting it answers 6700. */
+	int (*transceive)(struct osmo_st2_card_backend *be, struct msgb *msg);
+};
+
+/* a card (physical or virtual) which answers the TPDUs of a card emulation instance */
+struct osmo_st2_card_backend {
+	const struct osmo_st2_card_backend_ops *ops;
+	/* ATR of the card as of the last reset */
+	uint8_t atr[OSIM_MAX_ATR_LEN];
+	unsigned int atr_len;
+	/* opaque data of the backend implementation */
+	void *priv;
+};
+
+static inline int osmo_st2_card_backend_reset(struct osmo_st2_card_backend *be, bool cold)
+{
+	return be->ops->reset(be, cold);
+}
+
+/* does the command in msg (before the response is appended) have extended Lc/Le fields?
+ * A TPDU of T=0 never has command data with P3 = 0 */
+static inline bool osmo_st2_tpdu_is_extended(const struct msgb *msg)
+{
+	return msg->l3h - msg->data > 5 && msg->data[4] == 0;
+}
+
+static inline int osmo_st2_card_backend_transceive(struct osmo_st2_card_backend *be, struct msgb *msg)
+{
+	return be->ops->transceive(be, msg);
+}
@@ -0,0 +1,45 @@
+/* prefetch - speculatively issue the likely next command to a card backend
+ *
+ * (C) 2026 by sysmocom - s.f.m.c. GmbH <info@sysmocom.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdbool.h>
+
+#include <osmocom/simtrace2/card_backend.h>
+
+struct osmo_st2_prefetch;
+
+/* statistics of one prefetcher */
+struct osmo_st2_prefetch_stats {
+	/* commands passed to the prefetcher */
+	unsigned long commands;
+	/* predicted commands sent to the card ahead of time */
+	unsigned long issued;
+	/* commands answered from a prefetched response */
+	unsigned long hits;
+	/* prefetched responses dropped without having been used */
+	unsigned long misses;
+	/* prefetched responses dropped because of UPDATE / reset */
+	unsigned long invalidated;
+	/* command sequences learned */
+	unsigned long learned;
+};
+
+struct osmo_st2_prefetch *osmo_st2_prefetch_alloc(void *ctx, struct osmo_st2_card_backend *inner,
+						  bool learn);
+void osmo_st2_prefetch_free(struct osmo_st2_prefetch *pf);
+
+struct osmo_st2_card_backend *osmo_st2_prefetch_backend(struct osmo_st2_prefetch *pf);
+int osmo_st2_prefetch_run(struct osmo_st2_prefetch *pf);
+const struct osmo_st2_prefetch_stats *osmo_st2_prefetch_get_stats(const struct osmo_st2_prefetch *pf);
@@ -2,6 +2,9 @@
 
 #include <stdint.h>
 #include <osmocom/sim/sim.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+struct osmo_st2_tx_pool;
 
 /* transport to a SIMtrace device */
 struct osmo_st2_transport {
@@ -17,6 +20,73 @@ struct osmo_st2_transport {
 
 	/* UDP */
 	int udp_fd;
+
+	/* optional pool of pre-allocated message buffers / USB OUT transfers;
+	 * see osmo_st2_tx_pool_alloc() */
+	struct osmo_st2_tx_pool *tx_pool;
+
+	/* largest message accepted by the firmware, as announced in its board
+	 * information; 0 if unknown.  See osmo_st2_transport_apply_board_info() */
+	uint16_t max_out_msg_len;
+};
+
+/* decoded SIMTRACE_CMD_BD_BOARD_INFO of a firmware */
+struct osmo_st2_board_info {
+	struct simtrace_board_info info;
+	/* SIMTRACE_CAP_* supported by the firmware, bit n being capability n */
+	uint32_t cap_generic;
+	/* only valid if SIMTRACE_CAP_PERF_INFO is set */
+	struct simtrace_board_perf perf;
+	/* only valid if SIMTRACE_CAP_BOOT_TIME is set */
+	struct simtrace_board_boot_time boot;
+};
+
+/* decoded SIMTRACE_MSGT_BD_MODEM_STATUS */
+struct osmo_st2_modem_status {
+	/* ST_MDM_STS_BIT_* supported by the board, currently set, changed since the
+	 * last report */
+	uint8_t supported_mask;
+	uint8_t status_mask;
+	uint8_t changed_mask;
+	/* firmware time of the report and of the last edges, in ms; edges of the
+	 * WWAN LED since the start of the firmware.  Zero with older firmware */
+	uint32_t timestamp_ms;
+	uint32_t wwan_led_edge_ms;
+	uint32_t card_inserted_edge_ms;
+	uint32_t wwan_led_edges;
+};
+
+/* decoded SIMTRACE_MSGT_BD_CEMU_STATS of a slot */
+struct osmo_st2_cardem_stats {
+	/* bytes received from / transmitted to the reader */
+	uint32_t rx_bytes;
+	uint32_t tx_bytes;
+	/* commands of the reader, and its PPS requests */
+	uint32_t commands;
+	uint32_t pps;
+	/* time in ms the slot was connected to the UART, and how often */
+	uint32_t connected_ms;
+	uint32_t connections;
+};
+
+/* statistics of a transmit pool */
+struct osmo_st2_tx_pool_stats {
+	/* size of the pool */
+	unsigned int num_msgs;
+	unsigned int num_xfers;
+	/* currently in use / maximum ever in use */
+	unsigned int msgs_in_use;
+	unsigned int msgs_in_use_max;
+	unsigned int xfers_in_flight;
+	unsigned int xfers_in_flight_max;
+	/* message buffers handed out */
+	unsigned long msg_allocs;
+	/* message buffer allocations refused because the pool was empty */
+	unsigned long msg_exhausted;
+	/* USB OUT transfers submitted */
+	unsigned long xfer_submits;
+	/* messages which had to wait for a USB OUT transfer to become available */
+	unsigned long xfer_queued;
 };
 
 /* a SIMtrace slot; communicates over a transport */
@@ -27,6 +97,12 @@ struct osmo_st2_slot {
 	uint8_t slot_nr;
 };
 
+struct osmo_st2_cardem_inst;
+
+/* called with each modem status received, see osmo_st2_modem_status_subscribe() */
+typedef void (*osmo_st2_modem_status_cb_t)(struct osmo_st2_cardem_inst *ci,
+					   const struct osmo_st2_modem_status *sts, void *data);
+
 /* One istance of card emulation */
 struct osmo_st2_cardem_inst {
 	/* slot on which this card emulation instance runs */
@@ -39,6 +115,11 @@ struct osmo_st2_cardem_inst {
 	char *usb_path;
 	/* opaque data TBD by user */
 	void *priv;
+	/* CEMU_FEAT_F_* last requested by osmo_st2_cardem_request_config*() */
+	uint32_t features;
+	/* subscriber to the changes of the modem status */
+	osmo_st2_modem_status_cb_t modem_status_cb;
+	void *modem_status_cb_data;
 };
 
 struct cardemu_usb_msg_config;
@@ -46,16 +127,40 @@ struct cardemu_usb_msg_config;
 int osmo_st2_slot_tx_msg(struct osmo_st2_slot *slot, struct msgb *msg,
                          uint8_t msg_class, uint8_t msg_type);
 
+struct osmo_st2_tx_pool *osmo_st2_tx_pool_alloc(void *ctx, struct osmo_st2_transport *transp,
+						unsigned int num_msgs, unsigned int num_xfers);
+void osmo_st2_tx_pool_free(struct osmo_st2_tx_pool *pool);
+const struct osmo_st2_tx_pool_stats *osmo_st2_tx_pool_get_stats(const struct osmo_st2_tx_pool *pool);
+struct msgb *osmo_st2_transport_msgb_alloc(struct osmo_st2_transport *transp);
+
+int osmo_st2_request_board_info(struct osmo_st2_slot *slot);
+int osmo_st2_board_info_decode(struct osmo_st2_board_info *bi, const uint8_t *buf, unsigned int len);
+void osmo_st2_transport_apply_board_info(struct osmo_st2_transport *transp,
+					 const struct osmo_st2_board_info *bi);
+
+int osmo_st2_transport_sock_connect(struct osmo_st2_transport *transp, const char *path);
+int osmo_st2_transport_sock_recv(struct osmo_st2_transport *transp, uint8_t *ep,
+				 uint8_t *buf, unsigned int buf_len);
+
 
 int osmo_st2_cardem_request_card_insert(struct osmo_st2_cardem_inst *ci, bool inserted);
 int osmo_st2_cardem_request_pb_and_rx(struct osmo_st2_cardem_inst *ci, uint8_t pb, uint8_t le);
 int osmo_st2_cardem_request_pb_and_tx(struct osmo_st2_cardem_inst *ci, uint8_t pb,
 				      const uint8_t *data, uint16_t data_len_in);
 int osmo_st2_cardem_request_sw_tx(struct osmo_st2_cardem_inst *ci, const uint8_t *sw);
+/* response data per message of osmo_st2_cardem_request_t1_tx(), so that the message
+ * fills exactly one USB read (of 256 bytes) of the firmware.  Larger messages are
+ * only sent to a firmware which announced that it reassembles them */
+#define OSMO_ST2_T1_TX_CHUNK_LEN	242
+int osmo_st2_cardem_request_t1_tx(struct osmo_st2_cardem_inst *ci, const uint8_t *data,
+				  unsigned int data_len);
 int osmo_st2_cardem_request_set_atr(struct osmo_st2_cardem_inst *ci, const uint8_t *atr,
 				    unsigned int atr_len);
 int osmo_st2_cardem_request_config(struct osmo_st2_cardem_inst *ci, uint32_t features);
 int osmo_st2_cardem_request_config2(struct osmo_st2_cardem_inst *ci, const struct cardemu_usb_msg_config *config);
+int osmo_st2_cardem_request_slot_sched(struct osmo_st2_cardem_inst *ci, uint8_t slot_mux_nr, uint8_t mask);
+int osmo_st2_cardem_request_stats(struct osmo_st2_cardem_inst *ci);
+int osmo_st2_cardem_stats_decode(struct osmo_st2_cardem_stats *st, const uint8_t *buf, unsigned int len);
 
 int osmo_st2_modem_reset_pulse(struct osmo_st2_slot *slot, uint16_t duration_ms);
 int osmo_st2_modem_reset_active(struct osmo_st2_slot *slot);
@@ -63,3 +168,6 @@ int osmo_st2_modem_reset_inactive(struct osmo_st2_slot *slot);
 int osmo_st2_modem_sim_select_local(struct osmo_st2_slot *slot);
 int osmo_st2_modem_sim_select_remote(struct osmo_st2_slot *slot);
 int osmo_st2_modem_get_status(struct osmo_st2_slot *slot);
+int osmo_st2_modem_status_decode(struct osmo_st2_modem_status *sts, const uint8_t *buf, unsigned int len);
+int osmo_st2_modem_status_subscribe(struct osmo_st2_cardem_inst *ci, osmo_st2_modem_status_cb_t cb, void *data);
+int osmo_st2_cardem_rx_modem_status(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, unsigned int len);
@@ -0,0 +1,106 @@
+/* vsim - virtual SIM card served from a file-system image
+ *
+ * (C) 2026 by sysmocom - s.f.m.c. GmbH <info@sysmocom.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <osmocom/sim/sim.h>
+#include <osmocom/simtrace2/card_backend.h>
+
+/***********************************************************************
+ * file-system image format (all multi-byte values little endian)
+ *
+ * [struct osmo_st2_vsim_img_hdr]
+ * [struct osmo_st2_vsim_img_file] * num_files
+ * [file bodies, referenced by offset/size]
+ *
+ * File 0 must be the MF (FID 3F00, parent OSMO_ST2_VSIM_NO_PARENT).
+ * Every other file refers to its DF/ADF by index in the file table.
+ ***********************************************************************/
+
+#define OSMO_ST2_VSIM_MAGIC	"ST2VSIM1"
+#define OSMO_ST2_VSIM_NO_PARENT	0xffff
+
+enum osmo_st2_vsim_ftype {
+	OSMO_ST2_VSIM_FT_DF		= 1,	/* MF or DF */
+	OSMO_ST2_VSIM_FT_ADF		= 2,	/* application DF, selectable by AID */
+	OSMO_ST2_VSIM_FT_EF_TRANSP	= 3,	/* transparent EF */
+	OSMO_ST2_VSIM_FT_EF_LINFIX	= 4,	/* linear fixed EF */
+	OSMO_ST2_VSIM_FT_EF_CYCLIC	= 5,	/* cyclic EF */
+};
+
+struct osmo_st2_vsim_img_hdr {
+	uint8_t magic[8];
+	uint16_t num_files;
+	uint8_t atr_len;
+	uint8_t atr[OSIM_MAX_ATR_LEN];
+	uint32_t reserved;
+} __attribute__ ((packed));
+
+struct osmo_st2_vsim_img_file {
+	uint16_t fid;
+	/* index of the parent DF/ADF in the file table */
+	uint16_t parent;
+	/* enum osmo_st2_vsim_ftype */
+	uint8_t type;
+	/* short file identifier (1..30), 0 if none */
+	uint8_t sfi;
+	/* record length of linear fixed / cyclic EF */
+	uint8_t rec_len;
+	/* AID of an ADF */
+	uint8_t aid_len;
+	uint8_t aid[16];
+	/* location of the file body within the image */
+	uint32_t offset;
+	uint32_t size;
+} __attribute__ ((packed));
+
+/***********************************************************************
+ * run-time API
+ ***********************************************************************/
+
+struct osmo_st2_vsim;
+
+/*! call-back handling AUTHENTICATE / RUN GSM ALGORITHM (INS 0x88).
+ *  \param[in] vs virtual SIM on which the command was received
+ *  \param[in] hdr TPDU header of the command
+ *  \param[in] data command data (RAND, AUTN, ...)
+ *  \param[in] data_len length of data in bytes
+ *  \param[out] resp caller-allocated buffer of 256 bytes for the response data
+ *  \param[out] resp_len number of bytes written to resp
+ *  \param[in] priv opaque pointer as passed to osmo_st2_vsim_set_auth_cb()
+ *  \returns status word to be returned to the modem */
+typedef uint16_t (*osmo_st2_vsim_auth_cb_t)(struct osmo_st2_vsim *vs,
+					    const struct osim_apdu_cmd_hdr *hdr,
+					    const uint8_t *data, unsigned int data_len,
+					    uint8_t *resp, unsigned int *resp_len, void *priv);
+
+/* statistics of one virtual SIM */
+struct osmo_st2_vsim_stats {
+	unsigned long commands;
+	unsigned long updates;
+	unsigned long auth;
+	unsigned long errors;
+};
+
+struct osmo_st2_vsim *osmo_st2_vsim_open_mem(void *ctx, uint8_t *img, size_t img_len);
+struct osmo_st2_vsim *osmo_st2_vsim_open_file(void *ctx, const char *path, bool persistent);
+void osmo_st2_vsim_close(struct osmo_st2_vsim *vs);
+
+void osmo_st2_vsim_set_auth_cb(struct osmo_st2_vsim *vs, osmo_st2_vsim_auth_cb_t cb, void *priv);
+struct osmo_st2_card_backend *osmo_st2_vsim_backend(struct osmo_st2_vsim *vs);
+const struct osmo_st2_vsim_stats *osmo_st2_vsim_get_stats(const struct osmo_st2_vsim *vs);
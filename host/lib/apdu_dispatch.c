@@ -20,6 +20,7 @@
 #include <errno.h>
 
 #include <osmocom/core/utils.h>
+#include <osmocom/core/bit16gen.h>
 #include <osmocom/core/logging.h>
 #include <osmocom/sim/sim.h>
 #include <osmocom/sim/class_tables.h>
@@ -211,3 +212,91 @@ int osmo_apdu_segment_in2(struct osmo_apdu_context *ac, struct osmo_apdu_context
 
 	return rc;
 }
+
+/*! \brief parse a complete command APDU, as received by T=1
+ *  \param ac APDU context to fill
+ *  \param[in] apdu_buf command APDU: CLA INS P1 P2 [Lc Data] [Le]
+ *  \param[in] apdu_len Length of apdu_buf
+ *
+ *  Unlike with the TPDUs of T=0, the case of the APDU follows from its
+ *  length (ISO 7816-3:2006 clause 12.1.3).  P3 of the header is set like in
+ *  the TPDU transmitting the APDU by T=0: Lc in case 3 and 4, Le in case 2.
+ *  For an APDU with extended Lc/Le fields, ac->extended is set and P3 is 0,
+ *  as such an APDU cannot be transmitted in one TPDU of T=0.  Its Dc is not
+ *  copied: ac->ext_dc points to it in apdu_buf.
+ *
+ *  Like P3, a Le of 0 stands for the maximum of 256, or 65536 if extended.
+ *
+ *  The function returns APDU_ACT_TX_CAPDU_TO_CARD, as the command-APDU is
+ *  complete.  It returns -1 if the APDU is malformed.
+ */
+int osmo_apdu_parse_capdu(struct osmo_apdu_context *ac, const uint8_t *apdu_buf,
+			  unsigned int apdu_len)
+{
+	unsigned int lc = 0, data_ofs = 5;
+	uint8_t p3;
+
+	memset(ac, 0, sizeof(*ac));
+	if (apdu_len < 4) {
+		LOGP(DLGLOBAL, LOGL_ERROR, "APDU too short (%u)\n", apdu_len);
+		return -1;
+	}
+	memcpy(&ac->hdr, apdu_buf, 4);
+	p3 = apdu_len > 4 ? apdu_buf[4] : 0;
+
+	if (apdu_len == 4) {
+		/* no Lc/Le */
+		ac->apdu_case = 1;
+	} else if (apdu_len == 5) {
+		/* Le */
+		ac->apdu_case = 2;
+		ac->le.tot = p3;
+	} else if (p3 && apdu_len == 5 + p3) {
+		/* Lc + Dc */
+		ac->apdu_case = 3;
+		lc = p3;
+	} else if (p3 && apdu_len == 5 + p3 + 1) {
+		/* Lc + Dc + Le */
+		ac->apdu_case = 4;
+		lc = p3;
+		ac->le.tot = apdu_buf[apdu_len - 1];
+	} else if (p3 == 0 && apdu_len >= 7) {
+		/* extended length fields, introduced by a zero byte */
+		ac->extended = true;
+		lc = osmo_load16be(apdu_buf + 5);
+		data_ofs = 7;
+		p3 = 0;
+		if (apdu_len == 7) {
+			/* Le */
+			ac->apdu_case = 2;
+			ac->le.tot = lc;
+			lc = 0;
+		} else if (lc && apdu_len == 7 + lc) {
+			/* Lc + Dc */
+			ac->apdu_case = 3;
+		} else if (lc && apdu_len == 7 + lc + 2) {
+			/* Lc + Dc + Le */
+			ac->apdu_case = 4;
+			ac->le.tot = osmo_load16be(apdu_buf + apdu_len - 2);
+		} else {
+			LOGP(DLGLOBAL, LOGL_ERROR, "Extended APDU of unsupported length (%u, Lc=%u)\n",
+			     apdu_len, lc);
+			return -1;
+		}
+	} else {
+		LOGP(DLGLOBAL, LOGL_ERROR, "APDU of unsupported length (%u, P3=%u)\n",
+		     apdu_len, p3);
+		return -1;
+	}
+
+	ac->hdr.p3 = p3;
+	if (ac->apdu_case >= 3) {
+		ac->lc.tot = ac->lc.cur = lc;
+		if (ac->extended)
+			ac->ext_dc = apdu_buf + data_ofs;
+		else
+			memcpy(ac->dc, apdu_buf + data_ofs, lc);
+	}
+
+	return APDU_ACT_TX_CAPDU_TO_CARD;
+}
@@ -0,0 +1,464 @@
+/* prefetch - speculatively issue the likely next command to a card backend
+ *
+ * Modems issue very predictable command sequences: SELECT is followed by
+ * GET RESPONSE and a READ BINARY of the just-selected EF, READ RECORD n
+ * by READ RECORD n+1, and so on.  The prefetcher is a card backend stacked
+ * on top of another one.  After each command it predicts the command most
+ * likely to follow; osmo_st2_prefetch_run() sends that command to the card
+ * while the modem is still busy with the previous response, and the next
+ * command from the modem is answered from the stored response if it matches.
+ *
+ * Only commands which don't change the state of the card are prefetched:
+ * GET RESPONSE (right after the card announced response data), READ BINARY
+ * and READ RECORD in absolute mode, both without SFI.  Once prefetched, the
+ * response to GET RESPONSE only exists here, so a GET RESPONSE with another
+ * Le is answered from it as well.
+ *
+ * (C) 2026 by sysmocom - s.f.m.c. GmbH <info@sysmocom.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/sim/sim.h>
+
+#include <osmocom/simtrace2/prefetch.h>
+
+#define LOGPF(pf, lvl, fmt, args...) \
+	LOGP(DLGLOBAL, lvl, "PREFETCH: " fmt, ## args)
+
+/* maximum length of a command (header + data) used as key of a learned sequence */
+#define PF_MAX_KEY	(sizeof(struct osim_apdu_cmd_hdr) + 32)
+/* number of learned sequences */
+#define PF_LEARN_SIZE	64
+
+struct pf_key {
+	uint8_t buf[PF_MAX_KEY];
+	unsigned int len;
+};
+
+/* "after command 'trigger', the modem issued 'next'" */
+struct pf_learned {
+	bool valid;
+	struct pf_key trigger;
+	struct osim_apdu_cmd_hdr next;
+};
+
+struct osmo_st2_prefetch {
+	/* backend through which card emulation talks to us */
+	struct osmo_st2_card_backend be;
+	/* backend of the actual card */
+	struct osmo_st2_card_backend *inner;
+	bool learn;
+
+	/* last command (other than GET RESPONSE) executed by the card; the key for learning */
+	struct pf_key anchor;
+	bool anchor_valid;
+
+	/* command predicted to follow, not yet sent to the card */
+	struct osim_apdu_cmd_hdr next;
+	bool next_pending;
+
+	/* prefetched command and the response (data + SW) of the card to it */
+	struct osim_apdu_cmd_hdr cached;
+	uint8_t resp[256 + 2];
+	unsigned int resp_len;
+	bool cached_valid;
+	/* prefetched response has been served at least once */
+	bool cached_used;
+
+	/* message buffer for prefetching, allocated up-front as we may run in a worker thread */
+	struct msgb *msg;
+
+	struct pf_learned learned[PF_LEARN_SIZE];
+	struct osmo_st2_prefetch_stats stats;
+};
+
+static inline unsigned int hdr_le(const struct osim_apdu_cmd_hdr *h)
+{
+	return h->p3 ? h->p3 : 256;
+}
+
+static inline bool is_read_binary(const struct osim_apdu_cmd_hdr *h)
+{
+	/* P1 b8 set means SFI referencing, which implicitly selects the EF */
+	return h->ins == 0xB0 && !(h->p1 & 0x80);
+}
+
+static inline bool is_read_record_abs(const struct osim_apdu_cmd_hdr *h)
+{
+	/* SFI 0 (current EF), absolute mode: doesn't move the record pointer */
+	return h->ins == 0xB2 && h->p2 == 0x04;
+}
+
+static inline bool is_get_response(const struct osim_apdu_cmd_hdr *h)
+{
+	return h->ins == 0xC0 && h->p1 == 0 && h->p2 == 0;
+}
+
+static inline bool is_update(uint8_t ins)
+{
+	switch (ins) {
+	case 0xD6:	/* UPDATE BINARY */
+	case 0xDC:	/* UPDATE RECORD */
+	case 0x32:	/* INCREASE */
+	case 0xDB:	/* SET DATA */
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* can a prefetched READ response survive the given command? */
+static inline bool keeps_cache(const struct osim_apdu_cmd_hdr *h)
+{
+	/* STATUS, or reading from the current EF */
+	return h->ins == 0xF2 || is_read_binary(h) || (h->ins == 0xB2 && (h->p2 >> 3) == 0);
+}
+
+static unsigned int key_hash(const struct pf_key *key)
+{
+	uint32_t hash = 2166136261u;
+	unsigned int i;
+
+	for (i = 0; i < key->len; i++)
+		hash = (hash ^ key->buf[i]) * 16777619u;
+
+	return hash % PF_LEARN_SIZE;
+}
+
+static void drop_cache(struct osmo_st2_prefetch *pf, bool invalidate)
+{
+	if (!pf->cached_valid)
+		return;
+
+	if (invalidate)
+		pf->stats.invalidated++;
+	else if (!pf->cached_used)
+		pf->stats.misses++;
+	pf->cached_valid = false;
+}
+
+/* answer a GET RESPONSE whose Le differs from the prefetched one.  The card has
+ * handed out its response already, so it must be served from here */
+static void serve_get_response(struct osmo_st2_prefetch *pf, const struct osim_apdu_cmd_hdr *h,
+			       struct msgb *msg)
+{
+	unsigned int avail = pf->resp_len - 2;
+	unsigned int le = h->p3;
+
+	if (!le || le > avail) {
+		/* wrong length: tell the right one, like the card would */
+		msgb_put_u8(msg, h->cla == 0xA0 ? 0x67 : 0x6C);
+		msgb_put_u8(msg, avail);
+		return;
+	}
+
+	/* hand out the first Le bytes, and keep the rest for the next GET RESPONSE */
+	memcpy(msgb_put(msg, le), pf->resp, le);
+	memmove(pf->resp, pf->resp + le, pf->resp_len - le);
+	pf->resp_len -= le;
+	pf->cached.p3 = avail - le;
+	msgb_put_u8(msg, h->cla == 0xA0 ? 0x9F : 0x61);
+	msgb_put_u8(msg, avail - le);
+}
+
+/* try to answer the command from the prefetched response */
+static bool serve_cached(struct osmo_st2_prefetch *pf, const struct osim_apdu_cmd_hdr *h,
+			 unsigned int data_len, struct msgb *msg)
+{
+	const struct osim_apdu_cmd_hdr *c = &pf->cached;
+	unsigned int offset = 0, len = pf->resp_len;
+
+	if (!pf->cached_valid || data_len)
+		return false;
+
+	if (!memcmp(h, c, sizeof(*h))) {
+		/* exact match */
+	} else if (is_read_binary(h) && is_read_binary(c) && h->cla == c->cla &&
+		   pf->resp_len == hdr_le(c) + 2 &&
+		   pf->resp[pf->resp_len - 2] == 0x90 && pf->resp[pf->resp_len - 1] == 0x00) {
+		/* READ BINARY of a range within the prefetched one */
+		unsigned int c_off = (c->p1 << 8) | c->p2;
+		unsigned int h_off = (h->p1 << 8) | h->p2;
+		if (h_off < c_off || h_off + hdr_le(h) > c_off + hdr_le(c))
+			return false;
+		offset = h_off - c_off;
+		len = hdr_le(h);
+	} else if (is_get_response(h) && is_get_response(c) && h->cla == c->cla &&
+		   pf->resp_len == hdr_le(c) + 2 &&
+		   pf->resp[pf->resp_len - 2] == 0x90 && pf->resp[pf->resp_len - 1] == 0x00) {
+		/* GET RESPONSE with another Le */
+		serve_get_response(pf, h, msg);
+		pf->stats.hits++;
+		pf->cached_used = true;
+		return true;
+	} else
+		return false;
+
+	memcpy(msgb_put(msg, len), pf->resp + offset, len);
+	if (offset || len != pf->resp_len)
+		memcpy(msgb_put(msg, 2), pf->resp + pf->resp_len - 2, 2);
+
+	pf->stats.hits++;
+	pf->cached_used = true;
+	/* the card has answered GET RESPONSE only once */
+	if (is_get_response(c))
+		pf->cached_valid = false;
+
+	return true;
+}
+
+/* remember that 'next' followed the current anchor command */
+static void learn(struct osmo_st2_prefetch *pf, const struct osim_apdu_cmd_hdr *next)
+{
+	struct pf_learned *l;
+
+	if (!pf->learn || !pf->anchor_valid)
+		return;
+	if (!is_read_binary(next) && !is_read_record_abs(next))
+		return;
+
+	l = &pf->learned[key_hash(&pf->anchor)];
+	if (l->valid && l->trigger.len == pf->anchor.len &&
+	    !memcmp(l->trigger.buf, pf->anchor.buf, pf->anchor.len) &&
+	    !memcmp(&l->next, next, sizeof(*next)))
+		return;
+
+	l->valid = true;
+	l->trigger = pf->anchor;
+	l->next = *next;
+	pf->stats.learned++;
+}
+
+/* predict the command following the one just executed (or served) */
+static void predict(struct osmo_st2_prefetch *pf, const struct osim_apdu_cmd_hdr *h,
+		    uint8_t sw1, uint8_t sw2)
+{
+	struct pf_learned *l;
+
+	pf->next_pending = false;
+
+	if (sw1 == 0x61 || sw1 == 0x9F) {
+		/* card has response data waiting to be picked up */
+		pf->next = (struct osim_apdu_cmd_hdr) {
+			.cla = h->cla, .ins = 0xC0, .p1 = 0, .p2 = 0, .p3 = sw2,
+		};
+		pf->next_pending = true;
+		return;
+	}
+
+	if (sw1 != 0x90 || sw2 != 0x00)
+		return;
+
+	if (pf->learn && pf->anchor_valid) {
+		l = &pf->learned[key_hash(&pf->anchor)];
+		if (l->valid && l->trigger.len == pf->anchor.len &&
+		    !memcmp(l->trigger.buf, pf->anchor.buf, pf->anchor.len) &&
+		    memcmp(&l->next, h, sizeof(*h))) {
+			pf->next = l->next;
+			pf->next_pending = true;
+			return;
+		}
+	}
+
+	if (is_read_binary(h)) {
+		unsigned int offset = ((h->p1 << 8) | h->p2) + hdr_le(h);
+		if (offset > 0x7fff)
+			return;
+		pf->next = *h;
+		pf->next.p1 = offset >> 8;
+		pf->next.p2 = offset & 0xff;
+		pf->next_pending = true;
+	} else if (is_read_record_abs(h) && h->p1 < 0xfe) {
+		pf->next = *h;
+		pf->next.p1 = h->p1 + 1;
+		pf->next_pending = true;
+	}
+}
+
+/* update the anchor and predict after a command has been answered, by the card or by us */
+static void command_done(struct osmo_st2_prefetch *pf, const uint8_t *cmd, unsigned int cmd_len,
+			 const uint8_t *sw)
+{
+	const struct osim_apdu_cmd_hdr *h = (const struct osim_apdu_cmd_hdr *) cmd;
+
+	if (!is_get_response(h)) {
+		learn(pf, h);
+		if (cmd_len <= sizeof(pf->anchor.buf)) {
+			memcpy(pf->anchor.buf, cmd, cmd_len);
+			pf->anchor.len = cmd_len;
+			pf->anchor_valid = true;
+		} else
+			pf->anchor_valid = false;
+	}
+
+	predict(pf, h, sw[0], sw[1]);
+}
+
+static int prefetch_reset(struct osmo_st2_card_backend *be, bool cold)
+{
+	struct osmo_st2_prefetch *pf = be->priv;
+	int rc;
+
+	drop_cache(pf, true);
+	pf->next_pending = false;
+	pf->anchor_valid = false;
+
+	rc = osmo_st2_card_backend_reset(pf->inner, cold);
+	memcpy(be->atr, pf->inner->atr, pf->inner->atr_len);
+	be->atr_len = pf->inner->atr_len;
+
+	return rc;
+}
+
+static int prefetch_transceive(struct osmo_st2_card_backend *be, struct msgb *msg)
+{
+	struct osmo_st2_prefetch *pf = be->priv;
+	const struct osim_apdu_cmd_hdr *h = (const struct osim_apdu_cmd_hdr *) msg->data;
+	unsigned int cmd_len = msg->l3h - msg->data;
+	int rc;
+
+	pf->stats.commands++;
+	pf->next_pending = false;
+
+	if (cmd_len < sizeof(*h) || osmo_st2_tpdu_is_extended(msg)) {
+		pf->anchor_valid = false;
+		return osmo_st2_card_backend_transceive(pf->inner, msg);
+	}
+
+	if (serve_cached(pf, h, cmd_len - sizeof(*h), msg)) {
+		LOGPF(pf, LOGL_DEBUG, "INS=%02x P1=%02x P2=%02x P3=%02x served from prefetch\n",
+		      h->ins, h->p1, h->p2, h->p3);
+		command_done(pf, msg->data, cmd_len, msg->tail - 2);
+		/* the rest of the response is held here, the card has none left */
+		if (pf->cached_valid && is_get_response(&pf->cached))
+			pf->next_pending = false;
+		return 0;
+	}
+
+	if (!keeps_cache(h) || is_get_response(&pf->cached))
+		drop_cache(pf, is_update(h->ins));
+
+	rc = osmo_st2_card_backend_transceive(pf->inner, msg);
+	if (rc < 0 || msgb_l3len(msg) < 2) {
+		pf->anchor_valid = false;
+		return rc;
+	}
+
+	command_done(pf, msg->data, cmd_len, msg->tail - 2);
+	return rc;
+}
+
+static const struct osmo_st2_card_backend_ops prefetch_backend_ops = {
+	.name = "prefetch",
+	.reset = prefetch_reset,
+	.transceive = prefetch_transceive,
+};
+
+/***********************************************************************
+ * public API
+ ***********************************************************************/
+
+/*! allocate a prefetcher on top of a card backend.
+ *  \param[in] ctx talloc context from which to allocate
+ *  \param[in] inner card backend to which commands are forwarded
+ *  \param[in] learn learn command sequences observed from the modem
+ *  \returns prefetcher on success; NULL on error */
+struct osmo_st2_prefetch *osmo_st2_prefetch_alloc(void *ctx, struct osmo_st2_card_backend *inner,
+						  bool learn)
+{
+	struct osmo_st2_prefetch *pf = talloc_zero(ctx, struct osmo_st2_prefetch);
+	if (!pf)
+		return NULL;
+
+	pf->msg = msgb_alloc(1024, "prefetch");
+	if (!pf->msg) {
+		talloc_free(pf);
+		return NULL;
+	}
+	talloc_steal(pf, pf->msg);
+
+	pf->inner = inner;
+	pf->learn = learn;
+	pf->be.ops = &prefetch_backend_ops;
+	pf->be.priv = pf;
+	memcpy(pf->be.atr, inner->atr, inner->atr_len);
+	pf->be.atr_len = inner->atr_len;
+
+	return pf;
+}
+
+/*! release a prefetcher; the inner backend is not affected */
+void osmo_st2_prefetch_free(struct osmo_st2_prefetch *pf)
+{
+	talloc_free(pf);
+}
+
+/*! obtain the card backend interface of a prefetcher */
+struct osmo_st2_card_backend *osmo_st2_prefetch_backend(struct osmo_st2_prefetch *pf)
+{
+	return &pf->be;
+}
+
+/*! send the predicted next command (if any) to the card.
+ *  Must be called from the same thread as the backend operations, while the
+ *  backend is otherwise idle.
+ *  \returns 1 if a command was prefetched; 0 if there was none; negative on error */
+int osmo_st2_prefetch_run(struct osmo_st2_prefetch *pf)
+{
+	struct msgb *msg = pf->msg;
+	int rc;
+
+	if (!pf->next_pending)
+		return 0;
+	pf->next_pending = false;
+
+	msgb_reset(msg);
+	memcpy(msgb_put(msg, sizeof(pf->next)), &pf->next, sizeof(pf->next));
+	msg->l3h = msg->tail;
+
+	rc = osmo_st2_card_backend_transceive(pf->inner, msg);
+	if (rc < 0 || msgb_l3len(msg) < 2 || msgb_l3len(msg) > sizeof(pf->resp)) {
+		/* we no longer know what the card thinks; don't try again before the modem does */
+		drop_cache(pf, true);
+		pf->anchor_valid = false;
+		return rc < 0 ? rc : -EIO;
+	}
+
+	/* replace any earlier prefetched response */
+	drop_cache(pf, false);
+	pf->cached = pf->next;
+	pf->resp_len = msgb_l3len(msg);
+	memcpy(pf->resp, msgb_l3(msg), pf->resp_len);
+	pf->cached_valid = true;
+	pf->cached_used = false;
+	pf->stats.issued++;
+
+	LOGPF(pf, LOGL_DEBUG, "prefetched INS=%02x P1=%02x P2=%02x P3=%02x -> SW=%02x%02x\n",
+	      pf->cached.ins, pf->cached.p1, pf->cached.p2, pf->cached.p3,
+	      pf->resp[pf->resp_len - 2], pf->resp[pf->resp_len - 1]);
+
+	return 1;
+}
+
+/*! obtain the statistics of a prefetcher */
+const struct osmo_st2_prefetch_stats *osmo_st2_prefetch_get_stats(const struct osmo_st2_prefetch *pf)
+{
+	return &pf->stats;
+}
@@ -21,6 +21,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <signal.h>
 #include <time.h>
 #define _GNU_SOURCE
@@ -40,6 +41,7 @@
 #include <osmocom/core/utils.h>
 #include <osmocom/core/socket.h>
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/talloc.h>
 #include <osmocom/core/logging.h>
 #include <osmocom/sim/class_tables.h>
 #include <osmocom/sim/sim.h>
@@ -51,12 +53,75 @@
  * SIMTRACE core protocol
  ***********************************************************************/
 
+#define ST_MSGB_SIZE		(1024+32)
+#define ST_MSGB_HEADROOM	32
+
+/* pre-allocated message buffers and USB OUT transfers of one transport, so that
+ * sending a message doesn't require any heap allocation */
+struct osmo_st2_tx_pool {
+	struct osmo_st2_transport *transp;
+	/* unused message buffers */
+	struct llist_head free_msgs;
+	/* unused USB OUT transfers */
+	struct llist_head free_xfers;
+	/* messages waiting for a USB OUT transfer to become available */
+	struct llist_head tx_queue;
+	struct osmo_st2_tx_pool_stats stats;
+};
+
+/* a pre-allocated USB OUT transfer */
+struct st_tx_xfer {
+	struct llist_head list;
+	struct osmo_st2_tx_pool *pool;
+	struct libusb_transfer *xfer;
+	/* was the buffer allocated by libusb_dev_mem_alloc()? */
+	bool dev_mem;
+};
+
+static struct msgb *tx_pool_msgb_get(struct osmo_st2_tx_pool *pool)
+{
+	struct msgb *msg;
+
+	if (llist_empty(&pool->free_msgs)) {
+		pool->stats.msg_exhausted++;
+		return NULL;
+	}
+
+	msg = llist_entry(pool->free_msgs.next, struct msgb, list);
+	llist_del(&msg->list);
+	msgb_reset(msg);
+	msgb_reserve(msg, ST_MSGB_HEADROOM);
+
+	pool->stats.msg_allocs++;
+	pool->stats.msgs_in_use++;
+	if (pool->stats.msgs_in_use > pool->stats.msgs_in_use_max)
+		pool->stats.msgs_in_use_max = pool->stats.msgs_in_use;
+
+	return msg;
+}
+
 /*! \brief allocate a message buffer for simtrace use */
-static struct msgb *st_msgb_alloc(void)
+static struct msgb *st_msgb_alloc(struct osmo_st2_transport *transp)
 {
-	return msgb_alloc_headroom(1024+32, 32, "SIMtrace");
+	if (transp && transp->tx_pool)
+		return tx_pool_msgb_get(transp->tx_pool);
+
+	return msgb_alloc_headroom(ST_MSGB_SIZE, ST_MSGB_HEADROOM, "SIMtrace");
 }
 
+/*! \brief release a message buffer, returning it to the pool it came from (if any) */
+static void st_msgb_free(struct osmo_st2_transport *transp, struct msgb *msg)
+{
+	struct osmo_st2_tx_pool *pool = transp->tx_pool;
+
+	if (pool && talloc_parent(msg) == pool) {
+		llist_add(&msg->list, &pool->free_msgs);
+		pool->stats.msgs_in_use--;
+		return;
+	}
+
+	msgb_free(msg);
+}
 
 static void usb_out_xfer_cb(struct libusb_transfer *xfer)
 {
@@ -79,12 +144,85 @@ static void usb_out_xfer_cb(struct libusb_transfer *xfer)
 	libusb_free_transfer(xfer);
 }
 
+static int tx_pool_xfer_submit(struct osmo_st2_tx_pool *pool, struct msgb *msg);
+
+static void usb_out_pool_xfer_cb(struct libusb_transfer *xfer)
+{
+	struct st_tx_xfer *tx = xfer->user_data;
+	struct osmo_st2_tx_pool *pool = tx->pool;
+	struct msgb *msg;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		break;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		fprintf(stderr, "USB device disappeared\n");
+		exit(1);
+		break;
+	default:
+		fprintf(stderr, "USB OUT transfer failed, status=%u\n", xfer->status);
+		exit(1);
+		break;
+	}
+
+	llist_add(&tx->list, &pool->free_xfers);
+	pool->stats.xfers_in_flight--;
+
+	/* a transfer has become available: send the oldest waiting message */
+	msg = msgb_dequeue(&pool->tx_queue);
+	if (msg && tx_pool_xfer_submit(pool, msg) < 0)
+		LOGP(DLINP, LOGL_ERROR, "unable to submit queued USB OUT transfer\n");
+}
+
+/* copy a message into an unused pre-allocated transfer and submit it */
+static int tx_pool_xfer_submit(struct osmo_st2_tx_pool *pool, struct msgb *msg)
+{
+	struct osmo_st2_transport *transp = pool->transp;
+	struct st_tx_xfer *tx;
+	struct libusb_transfer *xfer;
+	int rc;
+
+	OSMO_ASSERT(!llist_empty(&pool->free_xfers));
+	tx = llist_entry(pool->free_xfers.next, struct st_tx_xfer, list);
+	xfer = tx->xfer;
+
+	xfer->dev_handle = transp->usb_devh;
+	xfer->endpoint = transp->usb_ep.out;
+	xfer->length = msgb_length(msg);
+	memcpy(xfer->buffer, msgb_data(msg), msgb_length(msg));
+	st_msgb_free(transp, msg);
+
+	rc = libusb_submit_transfer(xfer);
+	if (rc < 0)
+		return rc;
+
+	llist_del(&tx->list);
+	pool->stats.xfer_submits++;
+	pool->stats.xfers_in_flight++;
+	if (pool->stats.xfers_in_flight > pool->stats.xfers_in_flight_max)
+		pool->stats.xfers_in_flight_max = pool->stats.xfers_in_flight;
+
+	return 0;
+}
 
 static int st2_transp_tx_msg_usb_async(struct osmo_st2_transport *transp, struct msgb *msg)
 {
+	struct osmo_st2_tx_pool *pool = transp->tx_pool;
 	struct libusb_transfer *xfer;
 	int rc;
 
+	if (pool && pool->stats.num_xfers) {
+		/* all transfers busy: keep the message until one completes.  This
+		 * holds on to a message buffer, so the pool eventually runs empty
+		 * and the caller gets to see -ENOBUFS. */
+		if (llist_empty(&pool->free_xfers)) {
+			msgb_enqueue(&pool->tx_queue, msg);
+			pool->stats.xfer_queued++;
+			return 0;
+		}
+		return tx_pool_xfer_submit(pool, msg);
+	}
+
 	xfer = libusb_alloc_transfer(0);
 	OSMO_ASSERT(xfer);
 	xfer->dev_handle = transp->usb_devh;
@@ -111,7 +249,7 @@ static int st2_transp_tx_msg_usb_sync(struct osmo_st2_transport *transp, struct
 	rc = libusb_bulk_transfer(transp->usb_devh, transp->usb_ep.out,
 				  msgb_data(msg), msgb_length(msg),
 				  &xfer_len, 100000);
-	msgb_free(msg);
+	st_msgb_free(transp, msg);
 	return rc;
 }
 
@@ -149,11 +287,251 @@ int osmo_st2_slot_tx_msg(struct osmo_st2_slot *slot, struct msgb *msg,
 			rc = st2_transp_tx_msg_usb_sync(transp, msg);
 	} else {
 		rc = write(transp->udp_fd, msgb_data(msg), msgb_length(msg));
-		msgb_free(msg);
+		st_msgb_free(transp, msg);
 	}
 	return rc;
 }
 
+/*! \brief Allocate a pool of message buffers and USB OUT transfers for a transport.
+ *  Once allocated, all messages sent through the transport use buffers from the pool,
+ *  and requests fail with -ENOBUFS while all of them are in use.  USB OUT transfers
+ *  can only be pre-allocated for an already opened asynchronous USB transport.
+ *  \param[in] ctx talloc context from which to allocate
+ *  \param[in] transp transport whose messages shall be taken from the pool
+ *  \param[in] num_msgs number of message buffers
+ *  \param[in] num_xfers number of USB OUT transfers
+ *  \returns pool on success; NULL on error */
+struct osmo_st2_tx_pool *osmo_st2_tx_pool_alloc(void *ctx, struct osmo_st2_transport *transp,
+						unsigned int num_msgs, unsigned int num_xfers)
+{
+	struct osmo_st2_tx_pool *pool;
+	unsigned int i;
+
+	OSMO_ASSERT(!transp->tx_pool);
+
+	pool = talloc_zero(ctx, struct osmo_st2_tx_pool);
+	if (!pool)
+		return NULL;
+	pool->transp = transp;
+	INIT_LLIST_HEAD(&pool->free_msgs);
+	INIT_LLIST_HEAD(&pool->free_xfers);
+	INIT_LLIST_HEAD(&pool->tx_queue);
+
+	for (i = 0; i < num_msgs; i++) {
+		struct msgb *msg = msgb_alloc(ST_MSGB_SIZE, "SIMtrace");
+		if (!msg)
+			goto free_out;
+		talloc_steal(pool, msg);
+		llist_add_tail(&msg->list, &pool->free_msgs);
+		pool->stats.num_msgs++;
+	}
+
+	if (!transp->usb_devh || !transp->usb_async)
+		num_xfers = 0;
+
+	for (i = 0; i < num_xfers; i++) {
+		struct st_tx_xfer *tx = talloc_zero(pool, struct st_tx_xfer);
+		if (!tx)
+			goto free_out;
+		tx->pool = pool;
+		tx->xfer = libusb_alloc_transfer(0);
+		if (!tx->xfer) {
+			talloc_free(tx);
+			goto free_out;
+		}
+		/* DMA-able memory avoids a copy in the kernel; not every platform has it */
+		tx->xfer->buffer = libusb_dev_mem_alloc(transp->usb_devh, ST_MSGB_SIZE);
+		if (tx->xfer->buffer)
+			tx->dev_mem = true;
+		else
+			tx->xfer->buffer = talloc_size(tx, ST_MSGB_SIZE);
+		if (!tx->xfer->buffer) {
+			libusb_free_transfer(tx->xfer);
+			talloc_free(tx);
+			goto free_out;
+		}
+		tx->xfer->flags = 0;
+		tx->xfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+		tx->xfer->timeout = 100000;
+		tx->xfer->user_data = tx;
+		tx->xfer->callback = usb_out_pool_xfer_cb;
+		llist_add_tail(&tx->list, &pool->free_xfers);
+		pool->stats.num_xfers++;
+	}
+
+	transp->tx_pool = pool;
+	return pool;
+
+free_out:
+	osmo_st2_tx_pool_free(pool);
+	return NULL;
+}
+
+/*! \brief Release a transmit pool and detach it from its transport.
+ *  Must not be called while any of its USB OUT transfers are in flight. */
+void osmo_st2_tx_pool_free(struct osmo_st2_tx_pool *pool)
+{
+	struct st_tx_xfer *tx;
+
+	OSMO_ASSERT(pool->stats.xfers_in_flight == 0);
+
+	llist_for_each_entry(tx, &pool->free_xfers, list) {
+		if (tx->dev_mem)
+			libusb_dev_mem_free(pool->transp->usb_devh, tx->xfer->buffer, ST_MSGB_SIZE);
+		tx->xfer->buffer = NULL;
+		libusb_free_transfer(tx->xfer);
+	}
+
+	if (pool->transp->tx_pool == pool)
+		pool->transp->tx_pool = NULL;
+	talloc_free(pool);
+}
+
+/*! \brief obtain the statistics of a transmit pool */
+const struct osmo_st2_tx_pool_stats *osmo_st2_tx_pool_get_stats(const struct osmo_st2_tx_pool *pool)
+{
+	return &pool->stats;
+}
+
+/*! \brief Allocate a message buffer for osmo_st2_slot_tx_msg() on the given transport.
+ *  \returns message buffer with headroom for the simtrace header; NULL if the
+ *  transmit pool of the transport is exhausted */
+struct msgb *osmo_st2_transport_msgb_alloc(struct osmo_st2_transport *transp)
+{
+	return st_msgb_alloc(transp);
+}
+
+/***********************************************************************
+ * Board information / capability handshake
+ ***********************************************************************/
+
+/*! \brief Request the board information (including the capabilities) of the firmware.
+ *  The answer is a SIMTRACE_MSGC_GENERIC message of type SIMTRACE_CMD_BD_BOARD_INFO on
+ *  the IN endpoint; see osmo_st2_board_info_decode() */
+int osmo_st2_request_board_info(struct osmo_st2_slot *slot)
+{
+	struct msgb *msg = st_msgb_alloc(slot->transp);
+
+	if (!msg)
+		return -ENOBUFS;
+
+	return osmo_st2_slot_tx_msg(slot, msg, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_BD_BOARD_INFO);
+}
+
+/*! \brief Decode the board information sent by the firmware.
+ *  \param[out] bi caller-allocated output structure
+ *  \param[in] buf message, following the struct simtrace_msg_hdr
+ *  \param[in] len length of buf
+ *  \returns 0 on success; -EINVAL if the message is truncated
+ *
+ *  Older firmware doesn't announce any capabilities, or no struct simtrace_board_perf
+ *  or struct simtrace_board_boot_time; the missing parts are left zero. */
+int osmo_st2_board_info_decode(struct osmo_st2_board_info *bi, const uint8_t *buf, unsigned int len)
+{
+	const struct simtrace_board_info *info = (const struct simtrace_board_info *) buf;
+	unsigned int i, caps_len, offset;
+
+	memset(bi, 0, sizeof(*bi));
+	if (len < sizeof(*info))
+		return -EINVAL;
+	caps_len = info->cap_generic_bytes + info->cap_vendor_bytes;
+	if (len < sizeof(*info) + caps_len)
+		return -EINVAL;
+
+	memcpy(&bi->info, info, sizeof(*info));
+	for (i = 0; i < OSMO_MIN(info->cap_generic_bytes, sizeof(bi->cap_generic)); i++)
+		bi->cap_generic |= (uint32_t) info->data[i] << (i * 8);
+
+	offset = caps_len;
+	if (bi->cap_generic & (1 << SIMTRACE_CAP_PERF_INFO)) {
+		if (len < sizeof(*info) + offset + sizeof(bi->perf))
+			return -EINVAL;
+		memcpy(&bi->perf, info->data + offset, sizeof(bi->perf));
+		offset += sizeof(bi->perf);
+	}
+
+	/* follows the performance information, if any */
+	if (bi->cap_generic & (1 << SIMTRACE_CAP_BOOT_TIME)) {
+		if (len < sizeof(*info) + offset + sizeof(bi->boot))
+			return -EINVAL;
+		memcpy(&bi->boot, info->data + offset, sizeof(bi->boot));
+	}
+
+	return 0;
+}
+
+/*! \brief Adapt the messages sent through a transport to the firmware behind it.
+ *  Messages larger than one USB read of the firmware are only sent if it reassembles
+ *  them; they are limited by the size of our message buffers either way. */
+void osmo_st2_transport_apply_board_info(struct osmo_st2_transport *transp,
+					 const struct osmo_st2_board_info *bi)
+{
+	const uint32_t needed = (1 << SIMTRACE_CAP_PERF_INFO) | (1 << SIMTRACE_CAP_OUT_MSG_REASSEMBLY);
+
+	if ((bi->cap_generic & needed) != needed) {
+		transp->max_out_msg_len = 0;
+		return;
+	}
+	transp->max_out_msg_len = OSMO_MIN(bi->perf.max_out_msg_len,
+					   ST_MSGB_SIZE - ST_MSGB_HEADROOM);
+}
+
+/***********************************************************************
+ * Local socket transport (SITL firmware build)
+ ***********************************************************************/
+
+/*! \brief Attach a transport to the USB socket of a SITL (host) build of the firmware.
+ *  The endpoint addresses announced by the firmware are stored in transp->usb_ep, and
+ *  messages are subsequently sent through transp->udp_fd.
+ *  \param[in] transp transport to attach; must not be attached to a USB device
+ *  \param[in] path file system path of the unix domain socket
+ *  \returns file descriptor of the socket on success; negative on error */
+int osmo_st2_transport_sock_connect(struct osmo_st2_transport *transp, const char *path)
+{
+	uint8_t hello[4];
+	int fd, rc;
+
+	fd = osmo_sock_unix_init(SOCK_SEQPACKET, 0, path, OSMO_SOCK_F_CONNECT);
+	if (fd < 0)
+		return fd;
+
+	/* the firmware announces its endpoints on EP0 */
+	rc = recv(fd, hello, sizeof(hello), 0);
+	if (rc != sizeof(hello) || hello[0] != 0) {
+		close(fd);
+		return -EPROTO;
+	}
+	transp->usb_ep.out = hello[1];
+	transp->usb_ep.in = hello[2];
+	transp->usb_ep.irq_in = hello[3];
+	transp->udp_fd = fd;
+
+	return fd;
+}
+
+/*! \brief Receive the next IN transfer from a transport attached to a SITL firmware.
+ *  \param[in] transp transport attached with osmo_st2_transport_sock_connect()
+ *  \param[out] ep endpoint address (transp->usb_ep.in or .irq_in) of the transfer
+ *  \param[out] buf caller-allocated buffer for the transfer
+ *  \param[in] buf_len size of buf in bytes
+ *  \returns length of the transfer; 0 if the firmware has gone; negative on error */
+int osmo_st2_transport_sock_recv(struct osmo_st2_transport *transp, uint8_t *ep,
+				 uint8_t *buf, unsigned int buf_len)
+{
+	uint8_t pkt[1 + 4096];
+	int rc;
+
+	rc = recv(transp->udp_fd, pkt, sizeof(pkt), 0);
+	if (rc <= 0)
+		return rc < 0 ? -errno : 0;
+	if (rc - 1 > buf_len)
+		return -EMSGSIZE;
+
+	*ep = pkt[0];
+	memcpy(buf, pkt + 1, rc - 1);
+	return rc - 1;
+}
+
 /***********************************************************************
  * Card Emulation protocol
  ***********************************************************************/
@@ -162,9 +540,12 @@ int osmo_st2_slot_tx_msg(struct osmo_st2_slot *slot, struct msgb *msg,
 /*! \brief Request the SIMtrace2 to generate a card-insert signal */
 int osmo_st2_cardem_request_card_insert(struct osmo_st2_cardem_inst *ci, bool inserted)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_cardinsert *cins;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(inserted=%d)\n", __func__, inserted);
 
 	cins = (struct cardemu_usb_msg_cardinsert *) msgb_put(msg, sizeof(*cins));
@@ -178,8 +559,12 @@ int osmo_st2_cardem_request_card_insert(struct osmo_st2_cardem_inst *ci, bool in
 /*! \brief Request the SIMtrace2 to transmit a Procedure Byte, then Rx */
 int osmo_st2_cardem_request_pb_and_rx(struct osmo_st2_cardem_inst *ci, uint8_t pb, uint8_t le)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_tx_data *txd;
+
+	if (!msg)
+		return -ENOBUFS;
+
 	txd = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*txd));
 
 	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(pb=%02x, le=%u)\n", __func__, pb, le);
@@ -197,10 +582,13 @@ int osmo_st2_cardem_request_pb_and_rx(struct osmo_st2_cardem_inst *ci, uint8_t p
 int osmo_st2_cardem_request_pb_and_tx(struct osmo_st2_cardem_inst *ci, uint8_t pb,
 				      const uint8_t *data, uint16_t data_len_in)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_tx_data *txd;
 	uint8_t *cur;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	txd = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*txd));
 
 	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(pb=%02x, tx=%s, len=%d)\n", __func__, pb,
@@ -221,10 +609,13 @@ int osmo_st2_cardem_request_pb_and_tx(struct osmo_st2_cardem_inst *ci, uint8_t p
 /*! \brief Request the SIMtrace2 to send a Status Word */
 int osmo_st2_cardem_request_sw_tx(struct osmo_st2_cardem_inst *ci, const uint8_t *sw)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_tx_data *txd;
 	uint8_t *cur;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	txd = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*txd));
 
 	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(sw=%02x%02x)\n", __func__, sw[0], sw[1]);
@@ -239,12 +630,65 @@ int osmo_st2_cardem_request_sw_tx(struct osmo_st2_cardem_inst *ci, const uint8_t
 	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_TX_DATA);
 }
 
+/*! \brief Request the SIMtrace2 to send a response APDU by T=1
+ *  \param[in] ci card emulation instance
+ *  \param[in] data response data followed by the Status Word
+ *  \param[in] data_len length of data
+ *
+ *  The firmware transmits it in I-blocks of up to the IFSD of the reader.  A
+ *  response longer than OSMO_ST2_T1_TX_CHUNK_LEN (or the larger messages announced
+ *  by the firmware) is passed in several messages, the last one flagged as final. */
+int osmo_st2_cardem_request_t1_tx(struct osmo_st2_cardem_inst *ci, const uint8_t *data,
+				  unsigned int data_len)
+{
+	struct msgb *msg;
+	struct cardemu_usb_msg_tx_data *txd;
+	unsigned int len, chunk_len = OSMO_ST2_T1_TX_CHUNK_LEN;
+	uint16_t max_msg_len = ci->slot->transp->max_out_msg_len;
+	uint8_t *cur;
+	int rc;
+
+	LOGSLOT(ci->slot, LOGL_DEBUG, "<= %s(tx=%s, len=%u)\n", __func__,
+		osmo_hexdump(data, data_len), data_len);
+
+	/* fewer, larger messages if the firmware reassembles them */
+	if (max_msg_len > sizeof(struct simtrace_msg_hdr) + sizeof(*txd) + chunk_len)
+		chunk_len = max_msg_len - sizeof(struct simtrace_msg_hdr) - sizeof(*txd);
+
+	do {
+		len = OSMO_MIN(data_len, chunk_len);
+		msg = st_msgb_alloc(ci->slot->transp);
+		if (!msg)
+			return -ENOBUFS;
+
+		txd = (struct cardemu_usb_msg_tx_data *) msgb_put(msg, sizeof(*txd));
+		memset(txd, 0, sizeof(*txd));
+		txd->data_len = len;
+		txd->flags = CEMU_DATA_F_T1;
+		if (len == data_len)
+			txd->flags |= CEMU_DATA_F_FINAL;
+		cur = msgb_put(msg, len);
+		memcpy(cur, data, len);
+
+		rc = osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_TX_DATA);
+		if (rc < 0)
+			return rc;
+		data += len;
+		data_len -= len;
+	} while (data_len);
+
+	return rc;
+}
+
 int osmo_st2_cardem_request_set_atr(struct osmo_st2_cardem_inst *ci, const uint8_t *atr, unsigned int atr_len)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_set_atr *satr;
 	uint8_t *cur;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	satr = (struct cardemu_usb_msg_set_atr *) msgb_put(msg, sizeof(*satr));
 
 	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(%s)\n", __func__, osmo_hexdump(atr, atr_len));
@@ -257,45 +701,144 @@ int osmo_st2_cardem_request_set_atr(struct osmo_st2_cardem_inst *ci, const uint8
 	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_DT_CEMU_SET_ATR);
 }
 
+/* features to request: the ones of the user, and the push of the modem status if
+ * somebody subscribed to it */
+static uint32_t cardem_features(const struct osmo_st2_cardem_inst *ci)
+{
+	uint32_t features = ci->features;
+
+	if (ci->modem_status_cb)
+		features |= CEMU_FEAT_F_MODEM_STATUS_IRQ;
+	return features;
+}
+
+/*! \brief Request the CEMU_FEAT_F_* \a features of the card emulation.  Only the
+ *  features are sent: the slot of the mux, its schedule and the presence polarity
+ *  are left as they are, see osmo_st2_cardem_request_slot_sched() */
 int osmo_st2_cardem_request_config(struct osmo_st2_cardem_inst *ci, uint32_t features)
 {
-	struct msgb *msg = st_msgb_alloc();
-	struct cardemu_usb_msg_config *cfg;
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 
-	cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, sizeof(*cfg));
+	if (!msg)
+		return -ENOBUFS;
 
 	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(features=%08x)\n", __func__, features);
 
-	memset(cfg, 0, sizeof(*cfg));
-	cfg->features = features;
+	ci->features = features;
+	osmo_store32le(cardem_features(ci), msgb_put(msg, sizeof(uint32_t)));
 
 	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
 }
 
-/* user_cfg is in host byte order. */
+/* user_cfg is in host byte order.  The firmware applies the fields up to the
+ * end of the message, so it is cut after the features, or after pres_pol if
+ * CEMU_CONFIG_PRES_POL_VALID is set there: the slot_mux_nr before it is then
+ * applied as well, unless the firmware is scheduling the slots.  The schedule
+ * is never sent, see osmo_st2_cardem_request_slot_sched() */
 int osmo_st2_cardem_request_config2(struct osmo_st2_cardem_inst *ci, const struct cardemu_usb_msg_config *user_cfg)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
 	struct cardemu_usb_msg_config *tx_cfg;
+	size_t len = offsetof(struct cardemu_usb_msg_config, slot_mux_nr);
 
-	tx_cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, sizeof(*tx_cfg));
+	if (!msg)
+		return -ENOBUFS;
+
+	if (user_cfg->pres_pol & CEMU_CONFIG_PRES_POL_VALID)
+		len = offsetof(struct cardemu_usb_msg_config, slot_sched_mask);
+	tx_cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, len);
 
 	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(features=%08x)\n", __func__, user_cfg->features);
-	memcpy(tx_cfg, user_cfg, sizeof(*tx_cfg));
-	osmo_store32le(user_cfg->features, &tx_cfg->features);
+	memcpy(tx_cfg, user_cfg, len);
+	ci->features = user_cfg->features;
+	osmo_store32le(cardem_features(ci), &tx_cfg->features);
 
 	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
 }
 
+/*! \brief Connect the card emulation UART to a slot behind the mux of the board
+ *  (octsimtest), and cycle it through the slots of \a mask between their
+ *  transactions.
+ *  \param[in] ci card emulation instance
+ *  \param[in] slot_mux_nr slot to connect first
+ *  \param[in] mask bit-mask of the slots to cycle through; 0 to stay with slot_mux_nr
+ *  \returns 0 on success; negative on error
+ *
+ *  While a mask is set, the firmware routes the commands by the slot number of
+ *  their header, and tags its messages with the slot they are from: use one
+ *  osmo_st2_slot per slot on the same transport, and pass the messages received
+ *  to the instance of their slot_nr.  The features last requested with
+ *  osmo_st2_cardem_request_config*() are kept. */
+int osmo_st2_cardem_request_slot_sched(struct osmo_st2_cardem_inst *ci, uint8_t slot_mux_nr, uint8_t mask)
+{
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
+	struct cardemu_usb_msg_config *cfg;
+
+	if (!msg)
+		return -ENOBUFS;
+
+	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(slot_mux_nr=%u, mask=0x%02x)\n", __func__,
+		slot_mux_nr, mask);
+
+	cfg = (struct cardemu_usb_msg_config *) msgb_put(msg, sizeof(*cfg));
+	memset(cfg, 0, sizeof(*cfg));
+	osmo_store32le(cardem_features(ci), &cfg->features);
+	cfg->slot_mux_nr = slot_mux_nr;
+	/* without CEMU_CONFIG_PRES_POL_VALID, the presence polarity is left as it is */
+	cfg->slot_sched_mask = mask;
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
+}
+
+/*! \brief Request the statistics of the slot of \a ci; answered with a
+ *  SIMTRACE_MSGT_BD_CEMU_STATS, see osmo_st2_cardem_stats_decode() */
+int osmo_st2_cardem_request_stats(struct osmo_st2_cardem_inst *ci)
+{
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
+
+	if (!msg)
+		return -ENOBUFS;
+
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATS);
+}
+
+/*! \brief Decode the statistics of a slot sent by the firmware.
+ *  \param[out] st caller-allocated output structure
+ *  \param[in] buf message, following the struct simtrace_msg_hdr
+ *  \param[in] len length of buf
+ *  \returns 0 on success; -EINVAL if the message is truncated
+ *
+ *  The slot is the one of the message header. */
+int osmo_st2_cardem_stats_decode(struct osmo_st2_cardem_stats *st, const uint8_t *buf, unsigned int len)
+{
+	const struct cardemu_usb_msg_stats *ms = (const struct cardemu_usb_msg_stats *) buf;
+
+	memset(st, 0, sizeof(*st));
+	if (len < sizeof(*ms))
+		return -EINVAL;
+
+	st->rx_bytes = osmo_load32le(&ms->rx_bytes);
+	st->tx_bytes = osmo_load32le(&ms->tx_bytes);
+	st->commands = osmo_load32le(&ms->commands);
+	st->pps = osmo_load32le(&ms->pps);
+	st->connected_ms = osmo_load32le(&ms->connected_ms);
+	st->connections = osmo_load32le(&ms->connections);
+
+	return 0;
+}
+
 /***********************************************************************
  * Modem Control protocol
  ***********************************************************************/
 
 static int _modem_reset(struct osmo_st2_slot *slot, uint8_t asserted, uint16_t pulse_ms)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(slot->transp);
 	struct st_modem_reset *sr ;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	LOGSLOT(slot, LOGL_NOTICE, "<= %s(asserted=%u, pulse_ms=%u)\n", __func__,
 		asserted, pulse_ms);
 
@@ -326,9 +869,12 @@ int osmo_st2_modem_reset_inactive(struct osmo_st2_slot *slot)
 
 static int _modem_sim_select(struct osmo_st2_slot *slot, uint8_t remote_sim)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(slot->transp);
 	struct st_modem_sim_select *ss;
 
+	if (!msg)
+		return -ENOBUFS;
+
 	LOGSLOT(slot, LOGL_NOTICE, "<= %s(remote_sim=%u)\n", __func__, remote_sim);
 
 	ss = (struct st_modem_sim_select *) msgb_put(msg, sizeof(*ss));
@@ -352,7 +898,91 @@ int osmo_st2_modem_sim_select_remote(struct osmo_st2_slot *slot)
 /*! \brief Request slot to send us status information about the modem */
 int osmo_st2_modem_get_status(struct osmo_st2_slot *slot)
 {
-	struct msgb *msg = st_msgb_alloc();
+	struct msgb *msg = st_msgb_alloc(slot->transp);
+
+	if (!msg)
+		return -ENOBUFS;
 
 	return osmo_st2_slot_tx_msg(slot, msg, SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
 }
+
+/*! \brief Decode the modem status sent by the firmware.
+ *  \param[out] sts caller-allocated output structure
+ *  \param[in] buf message, following the struct simtrace_msg_hdr
+ *  \param[in] len length of buf
+ *  \returns 0 on success; -EINVAL if the message is truncated
+ *
+ *  Older firmware only sends the masks; the time of the edges is left zero. */
+int osmo_st2_modem_status_decode(struct osmo_st2_modem_status *sts, const uint8_t *buf, unsigned int len)
+{
+	const struct st_modem_status *ms = (const struct st_modem_status *) buf;
+
+	memset(sts, 0, sizeof(*sts));
+	if (len < offsetof(struct st_modem_status, timestamp_ms))
+		return -EINVAL;
+
+	sts->supported_mask = ms->supported_mask;
+	sts->status_mask = ms->status_mask;
+	sts->changed_mask = ms->changed_mask;
+	if (len >= sizeof(*ms)) {
+		sts->timestamp_ms = osmo_load32le(&ms->timestamp_ms);
+		sts->wwan_led_edge_ms = osmo_load32le(&ms->wwan_led_edge_ms);
+		sts->card_inserted_edge_ms = osmo_load32le(&ms->card_inserted_edge_ms);
+		sts->wwan_led_edges = osmo_load32le(&ms->wwan_led_edges);
+	}
+
+	return 0;
+}
+
+/*! \brief Subscribe to the changes of the modem status, instead of polling it with
+ *  osmo_st2_modem_get_status().  The firmware pushes the debounced changes on the
+ *  IRQ endpoint; the messages received are to be passed to
+ *  osmo_st2_cardem_rx_modem_status(), which calls the callback.  The callback is
+ *  first called with the current status.
+ *  \param[in] ci card emulation instance
+ *  \param[in] cb callback; NULL to unsubscribe
+ *  \param[in] data opaque data passed to the callback
+ *  \returns 0 on success; negative on error
+ *
+ *  The features last requested with osmo_st2_cardem_request_config*() are kept. */
+int osmo_st2_modem_status_subscribe(struct osmo_st2_cardem_inst *ci, osmo_st2_modem_status_cb_t cb, void *data)
+{
+	struct msgb *msg = st_msgb_alloc(ci->slot->transp);
+	int rc;
+
+	if (!msg)
+		return -ENOBUFS;
+
+	LOGSLOT(ci->slot, LOGL_NOTICE, "<= %s(%s)\n", __func__, cb ? "subscribe" : "unsubscribe");
+
+	ci->modem_status_cb = cb;
+	ci->modem_status_cb_data = data;
+
+	/* only the features: the rest of the configuration is left as it is */
+	osmo_store32le(cardem_features(ci), msgb_put(msg, sizeof(uint32_t)));
+	rc = osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_CONFIG);
+	if (rc < 0 || !cb)
+		return rc;
+
+	return osmo_st2_modem_get_status(ci->slot);
+}
+
+/*! \brief Process a modem status received from the firmware, on the IN or IRQ
+ *  endpoint, and pass it to the subscriber.
+ *  \param[in] ci card emulation instance
+ *  \param[in] buf message, following the struct simtrace_msg_hdr
+ *  \param[in] len length of buf
+ *  \returns 0 on success; -EINVAL if the message is truncated */
+int osmo_st2_cardem_rx_modem_status(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, unsigned int len)
+{
+	struct osmo_st2_modem_status sts;
+	int rc;
+
+	rc = osmo_st2_modem_status_decode(&sts, buf, len);
+	if (rc < 0)
+		return rc;
+
+	if (ci->modem_status_cb)
+		ci->modem_status_cb(ci, &sts, ci->modem_status_cb_data);
+	return 0;
+}
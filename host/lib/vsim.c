@@ -0,0 +1,879 @@
+/* vsim - virtual SIM card served from a file-system image
+ *
+ * (C) 2026 by sysmocom - s.f.m.c. GmbH <info@sysmocom.de>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <endian.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/sim/sim.h>
+
+#include <osmocom/simtrace2/vsim.h>
+
+#define LOGVS(vs, lvl, fmt, args...) \
+	LOGP(DLGLOBAL, lvl, "VSIM: " fmt, ## args)
+
+struct osmo_st2_vsim {
+	/* backend through which card emulation talks to us */
+	struct osmo_st2_card_backend be;
+
+	/* the (possibly memory-mapped) file-system image */
+	uint8_t *img;
+	size_t img_len;
+	bool mapped;
+	const struct osmo_st2_vsim_img_hdr *hdr;
+	struct osmo_st2_vsim_img_file *files;
+	unsigned int num_files;
+
+	/* currently selected DF/ADF and EF (index into files, -1 if none) */
+	int cur_df;
+	int cur_ef;
+	/* record pointer within cur_ef; 0 if undefined */
+	unsigned int cur_rec;
+
+	/* response data waiting to be picked up by GET RESPONSE */
+	uint8_t resp[256];
+	unsigned int resp_len;
+
+	osmo_st2_vsim_auth_cb_t auth_cb;
+	void *auth_priv;
+
+	struct osmo_st2_vsim_stats stats;
+};
+
+/* status words differ between GSM (CLA A0, TS 51.011) and UICC (TS 102 221) */
+enum vsim_err {
+	VSIM_E_FILE_NOT_FOUND,
+	VSIM_E_REC_NOT_FOUND,
+	VSIM_E_NO_EF,
+	VSIM_E_FTYPE,
+	VSIM_E_OFFSET,
+	VSIM_E_NO_RESP,
+};
+
+static const uint16_t sw_uicc[] = {
+	[VSIM_E_FILE_NOT_FOUND]	= 0x6a82,
+	[VSIM_E_REC_NOT_FOUND]	= 0x6a83,
+	[VSIM_E_NO_EF]		= 0x6986,
+	[VSIM_E_FTYPE]		= 0x6981,
+	[VSIM_E_OFFSET]		= 0x6b00,
+	[VSIM_E_NO_RESP]	= 0x6985,
+};
+
+static const uint16_t sw_gsm[] = {
+	[VSIM_E_FILE_NOT_FOUND]	= 0x9404,
+	[VSIM_E_REC_NOT_FOUND]	= 0x9402,
+	[VSIM_E_NO_EF]		= 0x9400,
+	[VSIM_E_FTYPE]		= 0x9408,
+	[VSIM_E_OFFSET]		= 0x9402,
+	[VSIM_E_NO_RESP]	= 0x9400,
+};
+
+static inline bool is_gsm(const struct osim_apdu_cmd_hdr *hdr)
+{
+	return hdr->cla == 0xa0;
+}
+
+static inline uint16_t vsim_sw(const struct osim_apdu_cmd_hdr *hdr, enum vsim_err err)
+{
+	return is_gsm(hdr) ? sw_gsm[err] : sw_uicc[err];
+}
+
+/* Le of a case 2 TPDU; P3=0 means 256 */
+static inline unsigned int tpdu_le(const struct osim_apdu_cmd_hdr *hdr)
+{
+	return hdr->p3 ? hdr->p3 : 256;
+}
+
+/***********************************************************************
+ * file table helpers
+ ***********************************************************************/
+
+static inline uint16_t f_fid(const struct osmo_st2_vsim_img_file *f)
+{
+	return le16toh(f->fid);
+}
+
+static inline uint16_t f_parent(const struct osmo_st2_vsim_img_file *f)
+{
+	return le16toh(f->parent);
+}
+
+static inline uint32_t f_size(const struct osmo_st2_vsim_img_file *f)
+{
+	return le32toh(f->size);
+}
+
+static inline uint8_t *f_body(struct osmo_st2_vsim *vs, const struct osmo_st2_vsim_img_file *f)
+{
+	return vs->img + le32toh(f->offset);
+}
+
+static inline bool f_is_df(const struct osmo_st2_vsim_img_file *f)
+{
+	return f->type == OSMO_ST2_VSIM_FT_DF || f->type == OSMO_ST2_VSIM_FT_ADF;
+}
+
+static inline bool f_is_record(const struct osmo_st2_vsim_img_file *f)
+{
+	return f->type == OSMO_ST2_VSIM_FT_EF_LINFIX || f->type == OSMO_ST2_VSIM_FT_EF_CYCLIC;
+}
+
+static inline unsigned int f_num_rec(const struct osmo_st2_vsim_img_file *f)
+{
+	return f_is_record(f) ? f_size(f) / f->rec_len : 0;
+}
+
+/* find a direct child of the DF with index 'df' */
+static int find_child(const struct osmo_st2_vsim *vs, int df, uint16_t fid)
+{
+	unsigned int i;
+
+	for (i = 1; i < vs->num_files; i++) {
+		if (f_parent(&vs->files[i]) == df && f_fid(&vs->files[i]) == fid)
+			return i;
+	}
+	return -1;
+}
+
+/* find an EF by its SFI within the current DF */
+static int find_sfi(const struct osmo_st2_vsim *vs, uint8_t sfi)
+{
+	unsigned int i;
+
+	for (i = 1; i < vs->num_files; i++) {
+		const struct osmo_st2_vsim_img_file *f = &vs->files[i];
+		if (f_parent(f) == vs->cur_df && !f_is_df(f) && f->sfi == sfi)
+			return i;
+	}
+	return -1;
+}
+
+/* find the ADF in which the current DF is located */
+static int find_cur_adf(const struct osmo_st2_vsim *vs)
+{
+	int df = vs->cur_df;
+
+	while (df > 0) {
+		if (vs->files[df].type == OSMO_ST2_VSIM_FT_ADF)
+			return df;
+		df = f_parent(&vs->files[df]);
+	}
+	return -1;
+}
+
+static unsigned int count_children(const struct osmo_st2_vsim *vs, int df, bool dfs)
+{
+	unsigned int i, n = 0;
+
+	for (i = 1; i < vs->num_files; i++) {
+		if (f_parent(&vs->files[i]) == df && f_is_df(&vs->files[i]) == dfs)
+			n++;
+	}
+	return n;
+}
+
+/*! resolve a FID relative to the current DF as per TS 102 221 Section 8.4.1 */
+static int resolve_fid(const struct osmo_st2_vsim *vs, uint16_t fid)
+{
+	int parent, idx;
+
+	if (fid == 0x3f00)
+		return 0;
+	if (fid == 0x7fff)
+		return find_cur_adf(vs);
+	/* immediate children of the current DF */
+	idx = find_child(vs, vs->cur_df, fid);
+	if (idx >= 0)
+		return idx;
+	/* the current DF itself */
+	if (f_fid(&vs->files[vs->cur_df]) == fid)
+		return vs->cur_df;
+	if (vs->cur_df == 0)
+		return -1;
+	/* the parent DF and its immediate children */
+	parent = f_parent(&vs->files[vs->cur_df]);
+	if (f_fid(&vs->files[parent]) == fid)
+		return parent;
+	return find_child(vs, parent, fid);
+}
+
+/***********************************************************************
+ * response encoding
+ ***********************************************************************/
+
+/* encode the FCP template of TS 102 221 Section 11.1.1.3 */
+static unsigned int encode_fcp(const struct osmo_st2_vsim *vs, int idx, uint8_t *out)
+{
+	const struct osmo_st2_vsim_img_file *f = &vs->files[idx];
+	uint8_t *cur = out + 2;
+
+	/* file descriptor */
+	*cur++ = 0x82;
+	switch (f->type) {
+	case OSMO_ST2_VSIM_FT_DF:
+	case OSMO_ST2_VSIM_FT_ADF:
+		*cur++ = 2; *cur++ = 0x78; *cur++ = 0x21;
+		break;
+	case OSMO_ST2_VSIM_FT_EF_TRANSP:
+		*cur++ = 2; *cur++ = 0x41; *cur++ = 0x21;
+		break;
+	case OSMO_ST2_VSIM_FT_EF_LINFIX:
+	case OSMO_ST2_VSIM_FT_EF_CYCLIC:
+		*cur++ = 5;
+		*cur++ = f->type == OSMO_ST2_VSIM_FT_EF_LINFIX ? 0x42 : 0x46;
+		*cur++ = 0x21;
+		*cur++ = 0x00;
+		*cur++ = f->rec_len;
+		*cur++ = f_num_rec(f);
+		break;
+	}
+	/* file identifier */
+	*cur++ = 0x83; *cur++ = 2;
+	*cur++ = f_fid(f) >> 8; *cur++ = f_fid(f) & 0xff;
+	/* DF name */
+	if (f->type == OSMO_ST2_VSIM_FT_ADF) {
+		*cur++ = 0x84; *cur++ = f->aid_len;
+		memcpy(cur, f->aid, f->aid_len);
+		cur += f->aid_len;
+	}
+	/* life cycle status: operational, activated */
+	*cur++ = 0x8a; *cur++ = 1; *cur++ = 0x05;
+	/* security attributes; access rules are not enforced */
+	*cur++ = 0x8b; *cur++ = 3;
+	*cur++ = f_is_df(f) ? 0x2f : 0x6f; *cur++ = 0x06; *cur++ = 0x01;
+	if (f_is_df(f)) {
+		/* PIN status template: no PIN enabled */
+		*cur++ = 0xc6; *cur++ = 3; *cur++ = 0x90; *cur++ = 1; *cur++ = 0x00;
+	} else {
+		/* file size */
+		*cur++ = 0x80; *cur++ = 2;
+		*cur++ = f_size(f) >> 8; *cur++ = f_size(f) & 0xff;
+		/* short file identifier */
+		*cur++ = 0x88;
+		if (f->sfi) {
+			*cur++ = 1; *cur++ = f->sfi << 3;
+		} else
+			*cur++ = 0;
+	}
+
+	out[0] = 0x62;
+	out[1] = cur - out - 2;
+	return cur - out;
+}
+
+/* encode the GSM response to SELECT/STATUS of TS 51.011 Section 9.2.1 */
+static unsigned int encode_gsm_rsp(const struct osmo_st2_vsim *vs, int idx, uint8_t *out)
+{
+	const struct osmo_st2_vsim_img_file *f = &vs->files[idx];
+
+	if (f_is_df(f)) {
+		memset(out, 0, 22);
+		out[4] = f_fid(f) >> 8;
+		out[5] = f_fid(f) & 0xff;
+		out[6] = idx == 0 ? 0x01 : 0x02;
+		out[12] = 22 - 13;
+		/* CHV1 disabled */
+		out[13] = 0x80;
+		out[14] = count_children(vs, idx, true);
+		out[15] = count_children(vs, idx, false);
+		out[16] = 0x04;
+		out[18] = 0x83; out[19] = 0x8a;
+		out[20] = 0x83; out[21] = 0x8a;
+		return 22;
+	}
+
+	memset(out, 0, 15);
+	out[2] = f_size(f) >> 8;
+	out[3] = f_size(f) & 0xff;
+	out[4] = f_fid(f) >> 8;
+	out[5] = f_fid(f) & 0xff;
+	out[6] = 0x04;
+	/* access conditions: all ALW, as access rules are not enforced */
+	out[11] = 0x01;
+	out[12] = 2;
+	switch (f->type) {
+	case OSMO_ST2_VSIM_FT_EF_LINFIX:
+		out[13] = 0x01;
+		out[14] = f->rec_len;
+		break;
+	case OSMO_ST2_VSIM_FT_EF_CYCLIC:
+		out[13] = 0x03;
+		out[14] = f->rec_len;
+		break;
+	}
+	return 15;
+}
+
+/* stash response data for a subsequent GET RESPONSE and return 61xx / 9Fxx */
+static uint16_t stash_resp(struct osmo_st2_vsim *vs, const struct osim_apdu_cmd_hdr *hdr,
+			   const uint8_t *data, unsigned int len)
+{
+	if (data != vs->resp)
+		memcpy(vs->resp, data, len);
+	vs->resp_len = len;
+	return (is_gsm(hdr) ? 0x9f00 : 0x6100) | (len & 0xff);
+}
+
+/* append data of a case 2 TPDU to msg, honouring Le */
+static uint16_t tx_data(struct msgb *msg, const struct osim_apdu_cmd_hdr *hdr,
+			const uint8_t *data, unsigned int len)
+{
+	unsigned int le = tpdu_le(hdr);
+
+	if (le > len)
+		return is_gsm(hdr) ? 0x6700 : 0x6c00 | (len & 0xff);
+
+	memcpy(msgb_put(msg, le), data, le);
+	return 0x9000;
+}
+
+/***********************************************************************
+ * command handlers
+ ***********************************************************************/
+
+static uint16_t cmd_select(struct osmo_st2_vsim *vs, const struct osim_apdu_cmd_hdr *hdr,
+			   const uint8_t *data, unsigned int len)
+{
+	const struct osmo_st2_vsim_img_file *f;
+	unsigned int i;
+	int idx = -1;
+
+	switch (hdr->p1) {
+	case 0x00: /* by FID */
+		if (len != 2)
+			return 0x6700;
+		idx = resolve_fid(vs, data[0] << 8 | data[1]);
+		break;
+	case 0x03: /* parent DF */
+		if (vs->cur_df != 0)
+			idx = f_parent(&vs->files[vs->cur_df]);
+		break;
+	case 0x04: /* by DF name (AID), partial match permitted */
+		for (i = 1; i < vs->num_files; i++) {
+			f = &vs->files[i];
+			if (f->type == OSMO_ST2_VSIM_FT_ADF && len && len <= f->aid_len &&
+			    !memcmp(f->aid, data, len)) {
+				idx = i;
+				break;
+			}
+		}
+		break;
+	case 0x08: /* path from MF */
+	case 0x09: /* path from current DF */
+		if (len < 2 || len % 2)
+			return 0x6700;
+		idx = hdr->p1 == 0x08 ? 0 : vs->cur_df;
+		for (i = 0; i < len && idx >= 0; i += 2) {
+			uint16_t fid = data[i] << 8 | data[i+1];
+			if (i == 0 && hdr->p1 == 0x08 && fid == 0x3f00)
+				continue;
+			if (i == 0 && fid == 0x7fff)
+				idx = find_cur_adf(vs);
+			else if (!f_is_df(&vs->files[idx]))
+				idx = -1;
+			else
+				idx = find_child(vs, idx, fid);
+		}
+		break;
+	default:
+		return is_gsm(hdr) ? 0x6b00 : 0x6a86;
+	}
+
+	if (idx < 0)
+		return vsim_sw(hdr, VSIM_E_FILE_NOT_FOUND);
+
+	f = &vs->files[idx];
+	if (f_is_df(f)) {
+		vs->cur_df = idx;
+		vs->cur_ef = -1;
+	} else {
+		vs->cur_df = f_parent(f);
+		vs->cur_ef = idx;
+	}
+	vs->cur_rec = 0;
+	vs->resp_len = 0;
+
+	if (is_gsm(hdr))
+		return stash_resp(vs, hdr, vs->resp, encode_gsm_rsp(vs, idx, vs->resp));
+	if ((hdr->p2 & 0x0c) == 0x0c)
+		return 0x9000;
+	return stash_resp(vs, hdr, vs->resp, encode_fcp(vs, idx, vs->resp));
+}
+
+static uint16_t cmd_status(struct osmo_st2_vsim *vs, struct msgb *msg,
+			   const struct osim_apdu_cmd_hdr *hdr)
+{
+	uint8_t buf[256];
+	unsigned int len;
+	int adf;
+
+	if (is_gsm(hdr)) {
+		len = encode_gsm_rsp(vs, vs->cur_df, buf);
+	} else {
+		switch (hdr->p2) {
+		case 0x0c:
+			return 0x9000;
+		case 0x01:
+			adf = find_cur_adf(vs);
+			if (adf < 0)
+				return 0x6a88;
+			buf[0] = 0x84;
+			buf[1] = vs->files[adf].aid_len;
+			memcpy(buf + 2, vs->files[adf].aid, buf[1]);
+			len = 2 + buf[1];
+			break;
+		default:
+			len = encode_fcp(vs, vs->cur_df, buf);
+			break;
+		}
+	}
+	return tx_data(msg, hdr, buf, len);
+}
+
+static uint16_t cmd_get_response(struct osmo_st2_vsim *vs, struct msgb *msg,
+				 const struct osim_apdu_cmd_hdr *hdr)
+{
+	uint16_t sw;
+
+	if (!vs->resp_len)
+		return vsim_sw(hdr, VSIM_E_NO_RESP);
+
+	sw = tx_data(msg, hdr, vs->resp, vs->resp_len);
+	if (sw == 0x9000)
+		vs->resp_len = 0;
+	return sw;
+}
+
+/* determine the EF addressed by an SFI-capable command; 0 means current EF */
+static int resolve_ef_sfi(struct osmo_st2_vsim *vs, uint8_t sfi)
+{
+	int idx;
+
+	if (!sfi)
+		return vs->cur_ef;
+
+	idx = find_sfi(vs, sfi);
+	if (idx >= 0 && idx != vs->cur_ef) {
+		vs->cur_ef = idx;
+		vs->cur_rec = 0;
+	}
+	return idx;
+}
+
+static uint16_t cmd_binary(struct osmo_st2_vsim *vs, struct msgb *msg, const struct osim_apdu_cmd_hdr *hdr,
+			   const uint8_t *data, unsigned int len)
+{
+	const struct osmo_st2_vsim_img_file *f;
+	unsigned int offset, size;
+	uint8_t *body;
+	int idx;
+
+	if ((hdr->p1 & 0x80) && !is_gsm(hdr)) {
+		idx = resolve_ef_sfi(vs, hdr->p1 & 0x1f);
+		offset = hdr->p2;
+	} else {
+		idx = vs->cur_ef;
+		offset = (hdr->p1 & 0x7f) << 8 | hdr->p2;
+	}
+	if (idx < 0)
+		return vsim_sw(hdr, VSIM_E_NO_EF);
+
+	f = &vs->files[idx];
+	if (f->type != OSMO_ST2_VSIM_FT_EF_TRANSP)
+		return vsim_sw(hdr, VSIM_E_FTYPE);
+
+	size = f_size(f);
+	body = f_body(vs, f);
+	if (offset >= size)
+		return vsim_sw(hdr, VSIM_E_OFFSET);
+
+	if (hdr->ins == 0xb0)
+		return tx_data(msg, hdr, body + offset, size - offset);
+
+	/* UPDATE BINARY */
+	if (offset + len > size)
+		return 0x6700;
+	memcpy(body + offset, data, len);
+	vs->stats.updates++;
+	return 0x9000;
+}
+
+static uint16_t cmd_record(struct osmo_st2_vsim *vs, struct msgb *msg, const struct osim_apdu_cmd_hdr *hdr,
+			   const uint8_t *data, unsigned int len)
+{
+	const struct osmo_st2_vsim_img_file *f;
+	unsigned int num_rec, rec_nr;
+	bool cyclic;
+	uint8_t *body;
+	int idx;
+
+	idx = resolve_ef_sfi(vs, is_gsm(hdr) ? 0 : hdr->p2 >> 3);
+	if (idx < 0)
+		return vsim_sw(hdr, VSIM_E_NO_EF);
+
+	f = &vs->files[idx];
+	if (!f_is_record(f))
+		return vsim_sw(hdr, VSIM_E_FTYPE);
+
+	num_rec = f_num_rec(f);
+	cyclic = f->type == OSMO_ST2_VSIM_FT_EF_CYCLIC;
+	body = f_body(vs, f);
+
+	if (hdr->ins == 0xdc) {
+		if (len != f->rec_len)
+			return 0x6700;
+		if (cyclic) {
+			/* only PREVIOUS is permitted: the oldest record becomes record 1 */
+			if ((hdr->p2 & 0x07) != 0x03)
+				return is_gsm(hdr) ? 0x6b00 : 0x6a86;
+			memmove(body + f->rec_len, body, f_size(f) - f->rec_len);
+			memcpy(body, data, len);
+			vs->cur_rec = 1;
+			vs->stats.updates++;
+			return 0x9000;
+		}
+	}
+
+	switch (hdr->p2 & 0x07) {
+	case 0x02: /* next */
+		rec_nr = vs->cur_rec + 1;
+		if (rec_nr > num_rec) {
+			if (!cyclic)
+				return vsim_sw(hdr, VSIM_E_REC_NOT_FOUND);
+			rec_nr = 1;
+		}
+		vs->cur_rec = rec_nr;
+		break;
+	case 0x03: /* previous */
+		rec_nr = vs->cur_rec ? vs->cur_rec - 1 : num_rec;
+		if (rec_nr < 1) {
+			if (!cyclic)
+				return vsim_sw(hdr, VSIM_E_REC_NOT_FOUND);
+			rec_nr = num_rec;
+		}
+		vs->cur_rec = rec_nr;
+		break;
+	case 0x04: /* absolute / current; record pointer is not changed */
+		rec_nr = hdr->p1 ? hdr->p1 : vs->cur_rec;
+		break;
+	default:
+		return is_gsm(hdr) ? 0x6b00 : 0x6a86;
+	}
+
+	if (rec_nr < 1 || rec_nr > num_rec)
+		return vsim_sw(hdr, VSIM_E_REC_NOT_FOUND);
+
+	body += (rec_nr - 1) * f->rec_len;
+	if (hdr->ins == 0xb2)
+		return tx_data(msg, hdr, body, f->rec_len);
+
+	memcpy(body, data, len);
+	vs->stats.updates++;
+	return 0x9000;
+}
+
+static uint16_t cmd_auth(struct osmo_st2_vsim *vs, const struct osim_apdu_cmd_hdr *hdr,
+			 const uint8_t *data, unsigned int len)
+{
+	uint8_t resp[256];
+	unsigned int resp_len = 0;
+	uint16_t sw;
+
+	if (!vs->auth_cb)
+		return 0x6d00;
+
+	vs->stats.auth++;
+	sw = vs->auth_cb(vs, hdr, data, len, resp, &resp_len, vs->auth_priv);
+	if (sw != 0x9000 || !resp_len)
+		return sw;
+	return stash_resp(vs, hdr, resp, OSMO_MIN(resp_len, sizeof(resp)));
+}
+
+/***********************************************************************
+ * backend interface
+ ***********************************************************************/
+
+static int vsim_reset(struct osmo_st2_card_backend *be, bool cold)
+{
+	struct osmo_st2_vsim *vs = be->priv;
+
+	LOGVS(vs, LOGL_INFO, "%s reset\n", cold ? "Cold" : "Warm");
+
+	vs->cur_df = 0;
+	vs->cur_ef = -1;
+	vs->cur_rec = 0;
+	vs->resp_len = 0;
+
+	return 0;
+}
+
+static int vsim_transceive(struct osmo_st2_card_backend *be, struct msgb *msg)
+{
+	struct osmo_st2_vsim *vs = be->priv;
+	const struct osim_apdu_cmd_hdr *hdr;
+	unsigned int data_len;
+	const uint8_t *data;
+	uint16_t sw;
+
+	if (msgb_length(msg) < sizeof(*hdr))
+		return -EINVAL;
+	/* response data (up to 256 bytes) and SW get appended */
+	if (msgb_tailroom(msg) < 256 + 2)
+		return -ENOSPC;
+
+	hdr = (const struct osim_apdu_cmd_hdr *) msgb_data(msg);
+	data = msgb_data(msg) + sizeof(*hdr);
+	data_len = msgb_length(msg) - sizeof(*hdr);
+	msg->l3h = msg->tail;
+
+	vs->stats.commands++;
+
+	if ((hdr->cla & 0xf0) != 0x00 && (hdr->cla & 0xf0) != 0x80 && hdr->cla != 0xa0) {
+		sw = 0x6e00;
+		goto out;
+	}
+	/* none of the supported commands has use for extended Lc/Le */
+	if (osmo_st2_tpdu_is_extended(msg)) {
+		sw = 0x6700;
+		goto out;
+	}
+
+	switch (hdr->ins) {
+	case 0xa4:
+		sw = cmd_select(vs, hdr, data, data_len);
+		break;
+	case 0xf2:
+		sw = cmd_status(vs, msg, hdr);
+		break;
+	case 0xc0:
+		sw = cmd_get_response(vs, msg, hdr);
+		break;
+	case 0xb0:
+	case 0xd6:
+		sw = cmd_binary(vs, msg, hdr, data, data_len);
+		break;
+	case 0xb2:
+	case 0xdc:
+		sw = cmd_record(vs, msg, hdr, data, data_len);
+		break;
+	case 0x88:
+		sw = cmd_auth(vs, hdr, data, data_len);
+		break;
+	default:
+		sw = 0x6d00;
+		break;
+	}
+
+out:
+	switch (sw >> 8) {
+	case 0x90:
+	case 0x91:
+	case 0x61:
+	case 0x6c:
+	case 0x9f:
+		break;
+	default:
+		vs->stats.errors++;
+		LOGVS(vs, LOGL_INFO, "CLA=%02x INS=%02x P1=%02x P2=%02x P3=%02x -> SW=%04x\n",
+		      hdr->cla, hdr->ins, hdr->p1, hdr->p2, hdr->p3, sw);
+		break;
+	}
+
+	msgb_put_u16(msg, sw);
+	return 0;
+}
+
+static const struct osmo_st2_card_backend_ops vsim_backend_ops = {
+	.name = "vsim",
+	.reset = vsim_reset,
+	.transceive = vsim_transceive,
+};
+
+/***********************************************************************
+ * public API
+ ***********************************************************************/
+
+static int vsim_img_validate(const uint8_t *img, size_t img_len)
+{
+	const struct osmo_st2_vsim_img_hdr *hdr = (const struct osmo_st2_vsim_img_hdr *) img;
+	const struct osmo_st2_vsim_img_file *files;
+	unsigned int i, num_files;
+	size_t table_end;
+
+	if (img_len < sizeof(*hdr) || memcmp(hdr->magic, OSMO_ST2_VSIM_MAGIC, sizeof(hdr->magic)))
+		return -EINVAL;
+	if (hdr->atr_len < 2 || hdr->atr_len > sizeof(hdr->atr))
+		return -EINVAL;
+
+	num_files = le16toh(hdr->num_files);
+	table_end = sizeof(*hdr) + num_files * sizeof(*files);
+	if (num_files < 1 || img_len < table_end)
+		return -EINVAL;
+
+	files = (const struct osmo_st2_vsim_img_file *) (img + sizeof(*hdr));
+	if (files[0].type != OSMO_ST2_VSIM_FT_DF || f_fid(&files[0]) != 0x3f00)
+		return -EINVAL;
+
+	for (i = 0; i < num_files; i++) {
+		const struct osmo_st2_vsim_img_file *f = &files[i];
+		uint16_t parent = f_parent(f);
+
+		/* the bodies follow the file table */
+		if (le32toh(f->offset) < table_end || le32toh(f->offset) > img_len ||
+		    f_size(f) > img_len - le32toh(f->offset))
+			return -EINVAL;
+		if (f->aid_len > sizeof(f->aid))
+			return -EINVAL;
+		if (i == 0) {
+			if (parent != OSMO_ST2_VSIM_NO_PARENT)
+				return -EINVAL;
+		} else if (parent >= i || !f_is_df(&files[parent])) {
+			/* a parent listed before its children can't form a loop */
+			return -EINVAL;
+		}
+		switch (f->type) {
+		case OSMO_ST2_VSIM_FT_DF:
+		case OSMO_ST2_VSIM_FT_ADF:
+			break;
+		case OSMO_ST2_VSIM_FT_EF_TRANSP:
+			/* P1/P2 offset is limited to 15 bits */
+			if (f_size(f) > 0x8000)
+				return -EINVAL;
+			break;
+		case OSMO_ST2_VSIM_FT_EF_LINFIX:
+		case OSMO_ST2_VSIM_FT_EF_CYCLIC:
+			if (!f->rec_len || f_size(f) % f->rec_len || f_size(f) / f->rec_len > 254)
+				return -EINVAL;
+			break;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return 0;
+}
+
+/*! open a virtual SIM from a file-system image in memory.
+ *  \param[in] ctx talloc context from which to allocate
+ *  \param[in] img file-system image; UPDATE commands modify it in place
+ *  \param[in] img_len length of img in bytes
+ *  \returns virtual SIM on success; NULL on invalid image */
+struct osmo_st2_vsim *osmo_st2_vsim_open_mem(void *ctx, uint8_t *img, size_t img_len)
+{
+	struct osmo_st2_vsim *vs;
+	int rc;
+
+	rc = vsim_img_validate(img, img_len);
+	if (rc < 0) {
+		LOGP(DLGLOBAL, LOGL_ERROR, "VSIM: invalid file-system image\n");
+		return NULL;
+	}
+
+	vs = talloc_zero(ctx, struct osmo_st2_vsim);
+	if (!vs)
+		return NULL;
+
+	vs->img = img;
+	vs->img_len = img_len;
+	vs->hdr = (const struct osmo_st2_vsim_img_hdr *) img;
+	vs->files = (struct osmo_st2_vsim_img_file *) (img + sizeof(*vs->hdr));
+	vs->num_files = le16toh(vs->hdr->num_files);
+
+	vs->be.ops = &vsim_backend_ops;
+	vs->be.priv = vs;
+	memcpy(vs->be.atr, vs->hdr->atr, vs->hdr->atr_len);
+	vs->be.atr_len = vs->hdr->atr_len;
+
+	vsim_reset(&vs->be, true);
+
+	return vs;
+}
+
+/*! open a virtual SIM from a file-system image file.
+ *  \param[in] ctx talloc context from which to allocate
+ *  \param[in] path file name of the image
+ *  \param[in] persistent write UPDATEs back to the file (otherwise they are private)
+ *  \returns virtual SIM on success; NULL on error */
+struct osmo_st2_vsim *osmo_st2_vsim_open_file(void *ctx, const char *path, bool persistent)
+{
+	struct osmo_st2_vsim *vs;
+	struct stat st;
+	void *img;
+	int fd;
+
+	fd = open(path, persistent ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	/* with MAP_PRIVATE, every instance gets copy-on-write pages of the shared image */
+	img = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		   persistent ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (img == MAP_FAILED)
+		return NULL;
+
+	vs = osmo_st2_vsim_open_mem(ctx, img, st.st_size);
+	if (!vs) {
+		munmap(img, st.st_size);
+		return NULL;
+	}
+	vs->mapped = true;
+
+	return vs;
+}
+
+/*! close a virtual SIM and release all its resources */
+void osmo_st2_vsim_close(struct osmo_st2_vsim *vs)
+{
+	if (vs->mapped)
+		munmap(vs->img, vs->img_len);
+	talloc_free(vs);
+}
+
+/*! register a call-back to which AUTHENTICATE / RUN GSM ALGORITHM is delegated */
+void osmo_st2_vsim_set_auth_cb(struct osmo_st2_vsim *vs, osmo_st2_vsim_auth_cb_t cb, void *priv)
+{
+	vs->auth_cb = cb;
+	vs->auth_priv = priv;
+}
+
+/*! obtain the card backend through which card emulation accesses the virtual SIM */
+struct osmo_st2_card_backend *osmo_st2_vsim_backend(struct osmo_st2_vsim *vs)
+{
+	return &vs->be;
+}
+
+/*! obtain the statistics of a virtual SIM */
+const struct osmo_st2_vsim_stats *osmo_st2_vsim_get_stats(const struct osmo_st2_vsim *vs)
+{
+	return &vs->stats;
+}
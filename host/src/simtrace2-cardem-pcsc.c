@@ -23,11 +23,14 @@
 #include <stdint.h>
 #include <signal.h>
 #include <time.h>
+#include <dlfcn.h>
+#include <pthread.h>
 #define _GNU_SOURCE
 #include <getopt.h>
 
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/eventfd.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
@@ -38,18 +41,125 @@
 #include <osmocom/simtrace2/simtrace2_api.h>
 #include <osmocom/simtrace2/simtrace_prot.h>
 #include <osmocom/simtrace2/apdu_dispatch.h>
+#include <osmocom/simtrace2/card_backend.h>
+#include <osmocom/simtrace2/vsim.h>
+#include <osmocom/simtrace2/prefetch.h>
 #include <osmocom/simtrace2/gsmtap.h>
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/socket.h>
 #include <osmocom/core/msgb.h>
 #include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/linuxlist.h>
 #include <osmocom/core/logging.h>
 #include <osmocom/core/application.h>
 #include <osmocom/sim/class_tables.h>
 #include <osmocom/sim/sim.h>
 
-#define LOGCI(ci, lvl, fmt, args ...) LOGP(DLGLOBAL, lvl,  fmt, ## args)
+/* one card emulation instance: a SIMtrace2 slot (USB interface) bound to a card backend */
+struct cardem_slot {
+	struct llist_head list;
+	/* name used as prefix in log messages */
+	char name[32];
+
+	/* how to find the USB interface and the card backend */
+	struct {
+		const char *usb_path;
+		int usb_addr;
+		int if_num;
+		int reader_num;
+		const char *vsim_image;
+		/* USB socket of a SITL firmware build, used instead of a USB device */
+		const char *sitl_socket;
+	} cfg;
+
+	struct osmo_st2_transport transp;
+	/* SITL firmware: IN and IRQ transfers from the socket */
+	struct osmo_fd sitl_ofd;
+	struct osmo_st2_slot slot;
+	struct osmo_st2_cardem_inst ci;
+	struct osmo_st2_card_backend *be;
+	/* optional prefetcher, stacked on top of the actual backend */
+	struct osmo_st2_prefetch *pf;
+
+	/* worker thread performing the (blocking) card backend operations, so that the
+	 * main loop keeps serving USB transfers and other slots in the mean time */
+	struct {
+		pthread_t thread;
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		/* jobs waiting for the worker thread */
+		struct llist_head req_queue;
+		/* jobs completed by the worker thread, waiting for the main loop */
+		struct llist_head done_queue;
+		/* eventfd signalling a non-empty done_queue to the main loop */
+		struct osmo_fd done_ofd;
+		/* incremented on every card reset, to discard stale responses */
+		unsigned int generation;
+	} worker;
+
+	/* APDU state; previous APDU is needed for the 6Cxx corner case */
+	struct osmo_apdu_context ac;
+	struct osmo_apdu_context prev_ac;
+	uint32_t last_status_flags;
+
+	/* T=1: the firmware passes complete APDUs, which we turn into TPDUs of T=0 for the
+	 * backend, and the response of one or more TPDUs back into one response APDU */
+	struct {
+		/* an APDU is being processed by the backend */
+		bool active;
+		uint8_t capdu[4 + 3 + OSMO_APDU_MAX_DATA_LEN + 2];
+		unsigned int capdu_len;
+		uint8_t rapdu[OSMO_APDU_MAX_DATA_LEN + 2];
+		unsigned int rapdu_len;
+	} t1;
+
+	struct {
+		unsigned long apdus;
+		unsigned long resets;
+		unsigned long errors;
+		unsigned long long xceive_us_total;
+		unsigned long xceive_us_max;
+		unsigned long stale;
+	} stats;
+};
+
+enum backend_job_type {
+	BE_JOB_RESET,
+	BE_JOB_XCEIVE,
+};
+
+/* one operation on the card backend, executed by the worker thread of a slot */
+struct backend_job {
+	struct llist_head list;
+	enum backend_job_type type;
+	/* worker.generation at the time the job was submitted */
+	unsigned int generation;
+	/* BE_JOB_RESET: cold or warm reset */
+	bool cold;
+	/* BE_JOB_XCEIVE: TPDU, see struct osmo_st2_card_backend_ops */
+	struct msgb *msg;
+	/* result of the backend operation */
+	int rc;
+	unsigned long duration_us;
+};
+
+static LLIST_HEAD(g_slots);
+
+#define ci2slot(ci) ((struct cardem_slot *)(ci)->priv)
+
+/* is the slot attached to its SIMtrace2 (USB device or SITL firmware)? */
+#define slot_attached(cs) ((cs)->transp.usb_devh || (cs)->transp.udp_fd >= 0)
+
+/* messages of the USB transmit pool: besides the other requests, enough to queue the
+ * T=1 response to an extended length APDU, which the firmware takes at the pace of the
+ * reader */
+#define TX_POOL_MSGS	(64 + (OSMO_APDU_MAX_DATA_LEN + 2 + OSMO_ST2_T1_TX_CHUNK_LEN - 1) / \
+			 OSMO_ST2_T1_TX_CHUNK_LEN)
+
+#define LOGCI(ci, lvl, fmt, args ...) LOGP(DLGLOBAL, lvl, "[%s] " fmt, ci2slot(ci)->name, ## args)
 
 static void atr_update_csum(uint8_t *atr, unsigned int atr_len)
 {
@@ -72,7 +182,311 @@ static void cemu_status_flags2str(char *out, unsigned int out_len, uint32_t flag
 		 flags & CEMU_STATUS_F_RCEMU_ACTIVE ? "RCEMU " : "");
 }
 
-static uint32_t last_status_flags = 0;
+/***********************************************************************
+ * Card backend worker thread
+ ***********************************************************************/
+
+static void *slot_worker_main(void *data)
+{
+	struct cardem_slot *cs = data;
+	struct backend_job *job;
+	struct timespec t_start, t_end;
+	uint64_t one = 1;
+
+	while (1) {
+		pthread_mutex_lock(&cs->worker.lock);
+		while (llist_empty(&cs->worker.req_queue))
+			pthread_cond_wait(&cs->worker.cond, &cs->worker.lock);
+		job = llist_entry(cs->worker.req_queue.next, struct backend_job, list);
+		llist_del(&job->list);
+		pthread_mutex_unlock(&cs->worker.lock);
+
+		clock_gettime(CLOCK_MONOTONIC, &t_start);
+		switch (job->type) {
+		case BE_JOB_RESET:
+			job->rc = osmo_st2_card_backend_reset(cs->be, job->cold);
+			break;
+		case BE_JOB_XCEIVE:
+			job->rc = osmo_st2_card_backend_transceive(cs->be, job->msg);
+			break;
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t_end);
+		job->duration_us = (t_end.tv_sec - t_start.tv_sec) * 1000000 +
+				   (t_end.tv_nsec - t_start.tv_nsec) / 1000;
+
+		pthread_mutex_lock(&cs->worker.lock);
+		llist_add_tail(&job->list, &cs->worker.done_queue);
+		pthread_mutex_unlock(&cs->worker.lock);
+
+		if (write(cs->worker.done_ofd.fd, &one, sizeof(one)) != sizeof(one))
+			LOGCI(&cs->ci, LOGL_ERROR, "unable to signal job completion: %s\n", strerror(errno));
+
+		/* use the time until the modem sends its next command to fetch the likely
+		 * response from the card */
+		if (cs->pf) {
+			bool idle;
+			pthread_mutex_lock(&cs->worker.lock);
+			idle = llist_empty(&cs->worker.req_queue);
+			pthread_mutex_unlock(&cs->worker.lock);
+			if (idle)
+				osmo_st2_prefetch_run(cs->pf);
+		}
+	}
+
+	return NULL;
+}
+
+/* hand a job over to the worker thread; its completion is handled in the main loop */
+static void slot_submit_job(struct cardem_slot *cs, struct backend_job *job)
+{
+	job->generation = cs->worker.generation;
+
+	pthread_mutex_lock(&cs->worker.lock);
+	llist_add_tail(&job->list, &cs->worker.req_queue);
+	pthread_cond_signal(&cs->worker.cond);
+	pthread_mutex_unlock(&cs->worker.lock);
+}
+
+static void slot_submit_reset(struct cardem_slot *cs, bool cold)
+{
+	struct backend_job *job = talloc_zero(cs, struct backend_job);
+	OSMO_ASSERT(job);
+
+	/* any TPDU still in flight belongs to the card session that is ending now */
+	cs->worker.generation++;
+	cs->t1.active = false;
+	cs->t1.capdu_len = 0;
+
+	job->type = BE_JOB_RESET;
+	job->cold = cold;
+	slot_submit_job(cs, job);
+}
+
+static void slot_submit_xceive(struct cardem_slot *cs, struct msgb *msg)
+{
+	struct backend_job *job = talloc_zero(cs, struct backend_job);
+	OSMO_ASSERT(job);
+
+	job->type = BE_JOB_XCEIVE;
+	job->msg = msg;
+	slot_submit_job(cs, job);
+}
+
+/* largest msgb, for an extended length APDU and its response */
+#define TPDU_MSGB_SIZE_MAX	0xffff
+
+/* size of the msgb for the TPDU of the command in ac: the command, Ne bytes of
+ * response data and the SW.  A Ne of 65536 (extended Le of 0, "as much as
+ * available") is limited to what fits into the largest msgb */
+static unsigned int tpdu_msgb_size(const struct osmo_apdu_context *ac)
+{
+	unsigned int size, ne = 0;
+
+	if (!ac->extended)
+		return 1024;
+
+	size = sizeof(ac->hdr) + 2 + ac->lc.tot;
+	if (ac->apdu_case == 2 || ac->apdu_case == 4) {
+		size += 2;
+		ne = ac->le.tot;
+		if (!ne)
+			return TPDU_MSGB_SIZE_MAX;
+	}
+	return size + ne + 2;
+}
+
+/* send the TPDU of the command in cs->ac to the backend.  An extended length
+ * APDU (from T=1) is passed as it is, for the backend to transmit it to the card */
+static void slot_submit_capdu(struct cardem_slot *cs)
+{
+	struct osmo_apdu_context *ac = &cs->ac;
+	struct msgb *tmsg = msgb_alloc(tpdu_msgb_size(ac), "TPDU");
+	uint8_t *cur;
+
+	OSMO_ASSERT(tmsg);
+	/* Copy TPDU header */
+	cur = msgb_put(tmsg, sizeof(ac->hdr));
+	memcpy(cur, &ac->hdr, sizeof(ac->hdr));
+	if (ac->extended && ac->lc.tot)
+		msgb_put_u16(tmsg, ac->lc.tot);
+	/* Copy D(c), if any */
+	if (ac->lc.tot) {
+		cur = msgb_put(tmsg, ac->lc.tot);
+		memcpy(cur, ac->extended ? ac->ext_dc : ac->dc, ac->lc.tot);
+	}
+	if (ac->extended && (ac->apdu_case == 2 || ac->apdu_case == 4))
+		msgb_put_u16(tmsg, ac->le.tot);
+	/* send to actual (or virtual) card; the response is handled by xceive_done()
+	 * once the worker thread has completed the transceive */
+	tmsg->l3h = tmsg->tail;
+	slot_submit_xceive(cs, tmsg);
+}
+
+static void reset_done(struct cardem_slot *cs, struct backend_job *job)
+{
+	cs->stats.resets++;
+	if (job->rc < 0) {
+		LOGCI(&cs->ci, LOGL_ERROR, "error during card reset: %d\n", job->rc);
+		cs->stats.errors++;
+	}
+
+	/* Mark reset event in GSMTAP wireshark trace */
+	osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_ATR, cs->be->atr, cs->be->atr_len);
+}
+
+/* T=1: complete the response APDU, where T=0 would have left it to the reader */
+static void xceive_done_t1(struct cardem_slot *cs, struct msgb *tmsg)
+{
+	struct osmo_apdu_context *ac = &cs->ac;
+	unsigned int len = msgb_l3len(tmsg);
+
+	if (len > sizeof(cs->t1.rapdu) - 2 - cs->t1.rapdu_len) {
+		/* don't pass a truncated response as if it was complete */
+		LOGCI(&cs->ci, LOGL_ERROR, "response data exceeds %zu bytes, rejecting the APDU\n",
+		      sizeof(cs->t1.rapdu) - 2);
+		cs->stats.errors++;
+		cs->t1.rapdu_len = 0;
+		ac->sw[0] = 0x6F;
+		ac->sw[1] = 0x00;
+		goto tx;
+	}
+
+	memcpy(cs->t1.rapdu + cs->t1.rapdu_len, tmsg->l3h, len);
+	cs->t1.rapdu_len += len;
+
+	switch (ac->sw[0]) {
+	case 0x61:
+		/* more data available: fetch it by GET RESPONSE */
+		if (cs->t1.rapdu_len + 2 < sizeof(cs->t1.rapdu)) {
+			ac->hdr.ins = 0xC0;
+			ac->hdr.p1 = ac->hdr.p2 = 0;
+			ac->hdr.p3 = ac->sw[1];
+			ac->lc.tot = 0;
+			ac->extended = false;
+			slot_submit_capdu(cs);
+			return;
+		}
+		break;
+	case 0x6C:
+		/* wrong Le: repeat the command with the one indicated by the card */
+		if (ac->apdu_case == 2 && !cs->t1.rapdu_len) {
+			ac->hdr.p3 = ac->sw[1];
+			ac->extended = false;
+			slot_submit_capdu(cs);
+			return;
+		}
+		break;
+	}
+
+tx:
+	memcpy(cs->t1.rapdu + cs->t1.rapdu_len, ac->sw, 2);
+	cs->t1.rapdu_len += 2;
+	cs->t1.active = false;
+	osmo_st2_cardem_request_t1_tx(&cs->ci, cs->t1.rapdu, cs->t1.rapdu_len);
+}
+
+static void xceive_done(struct cardem_slot *cs, struct backend_job *job)
+{
+	struct osmo_st2_cardem_inst *ci = &cs->ci;
+	struct osmo_apdu_context *ac = &cs->ac;
+	struct msgb *tmsg = job->msg;
+
+	cs->stats.apdus++;
+	if (job->rc < 0) {
+		LOGCI(ci, LOGL_ERROR, "error during transceive: %d\n", job->rc);
+		cs->stats.errors++;
+		return;
+	}
+	cs->stats.xceive_us_total += job->duration_us;
+	if (job->duration_us > cs->stats.xceive_us_max)
+		cs->stats.xceive_us_max = job->duration_us;
+
+	/* the modem has reset the card or we lost USB while the card was busy */
+	if (job->generation != cs->worker.generation || !slot_attached(cs)) {
+		LOGCI(ci, LOGL_NOTICE, "discarding stale response to INS=%02x\n",
+		      tmsg->data[1]);
+		cs->stats.stale++;
+		return;
+	}
+
+	/* send via GSMTAP for wireshark tracing */
+	osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, tmsg->data, msgb_length(tmsg));
+
+	msgb_apdu_sw(tmsg) = msgb_get_u16(tmsg);
+	ac->sw[0] = msgb_apdu_sw(tmsg) >> 8;
+	ac->sw[1] = msgb_apdu_sw(tmsg) & 0xff;
+	if (cs->t1.active) {
+		xceive_done_t1(cs, tmsg);
+		return;
+	}
+	if (msgb_l3len(tmsg))
+		osmo_st2_cardem_request_pb_and_tx(ci, ac->hdr.ins, tmsg->l3h, msgb_l3len(tmsg));
+	osmo_st2_cardem_request_sw_tx(ci, ac->sw);
+}
+
+/* call-back of the eventfd: handle all jobs completed by the worker thread */
+static int slot_worker_done_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct cardem_slot *cs = ofd->data;
+	struct backend_job *job, *job2;
+	LLIST_HEAD(done);
+	uint64_t count;
+
+	if (read(ofd->fd, &count, sizeof(count)) != sizeof(count))
+		return 0;
+
+	pthread_mutex_lock(&cs->worker.lock);
+	llist_splice_init(&cs->worker.done_queue, &done);
+	pthread_mutex_unlock(&cs->worker.lock);
+
+	llist_for_each_entry_safe(job, job2, &done, list) {
+		llist_del(&job->list);
+		switch (job->type) {
+		case BE_JOB_RESET:
+			reset_done(cs, job);
+			break;
+		case BE_JOB_XCEIVE:
+			xceive_done(cs, job);
+			msgb_free(job->msg);
+			break;
+		}
+		talloc_free(job);
+	}
+
+	return 0;
+}
+
+static int slot_worker_start(struct cardem_slot *cs)
+{
+	int fd, rc;
+
+	INIT_LLIST_HEAD(&cs->worker.req_queue);
+	INIT_LLIST_HEAD(&cs->worker.done_queue);
+	pthread_mutex_init(&cs->worker.lock, NULL);
+	pthread_cond_init(&cs->worker.cond, NULL);
+
+	fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "[%s] unable to create eventfd: %s\n", cs->name, strerror(errno));
+		return -errno;
+	}
+	osmo_fd_setup(&cs->worker.done_ofd, fd, OSMO_FD_READ, slot_worker_done_cb, cs, 0);
+	rc = osmo_fd_register(&cs->worker.done_ofd);
+	if (rc < 0) {
+		close(fd);
+		return rc;
+	}
+
+	rc = pthread_create(&cs->worker.thread, NULL, slot_worker_main, cs);
+	if (rc != 0) {
+		fprintf(stderr, "[%s] unable to start worker thread: %s\n", cs->name, strerror(rc));
+		osmo_fd_unregister(&cs->worker.done_ofd);
+		close(fd);
+		return -rc;
+	}
+
+	return 0;
+}
 
 #define NO_RESET 0
 #define COLD_RESET 1
@@ -80,7 +494,8 @@ static uint32_t last_status_flags = 0;
 
 static void update_status_flags(struct osmo_st2_cardem_inst *ci, uint32_t flags)
 {
-	struct osim_card_hdl *card = ci->chan->card;
+	struct cardem_slot *cs = ci2slot(ci);
+	uint32_t last_status_flags = cs->last_status_flags;
 	int reset = NO_RESET;
 
 	/* check if card is _now_ operational: VCC+CLK present, RST absent */
@@ -105,30 +520,104 @@ static void update_status_flags(struct osmo_st2_cardem_inst *ci, uint32_t flags)
 	if (reset) {
 		LOGCI(ci, LOGL_NOTICE, "%s Resetting card in reader...\n",
 			reset == COLD_RESET ? "Cold" : "Warm");
-		osim_card_reset(card, reset == COLD_RESET ? true : false);
-
-		/* Mark reset event in GSMTAP wireshark trace */
-		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_ATR, card->atr, card->atr_len);
+		slot_submit_reset(cs, reset == COLD_RESET ? true : false);
 	}
 
-	last_status_flags = flags;
+	cs->last_status_flags = flags;
 }
 
 static const char *cemu_data_flags2str(uint32_t flags)
 {
 	static char out[64];
-	snprintf(out, sizeof(out), "%s%s%s%s",
+	snprintf(out, sizeof(out), "%s%s%s%s%s",
 		 flags & CEMU_DATA_F_TPDU_HDR ? "HDR " : "",
+		 flags & CEMU_DATA_F_T1 ? "T1 " : "",
 		 flags & CEMU_DATA_F_FINAL ? "FINAL " : "",
 		 flags & CEMU_DATA_F_PB_AND_TX ? "PB_AND_TX " : "",
 		 flags & CEMU_DATA_F_PB_AND_RX ? "PB_AND_RX" : "");
 	return out;
 }
 
+/***********************************************************************
+ * Card backends
+ ***********************************************************************/
+
+/* PC/SC backend: forward to a physical card in a reader via libosmosim */
+static int pcsc_reset(struct osmo_st2_card_backend *be, bool cold)
+{
+	struct osim_card_hdl *card = be->priv;
+	int rc;
+
+	rc = osim_card_reset(card, cold);
+	memcpy(be->atr, card->atr, card->atr_len);
+	be->atr_len = card->atr_len;
+
+	return rc;
+}
+
+static int pcsc_transceive(struct osmo_st2_card_backend *be, struct msgb *msg)
+{
+	struct osim_card_hdl *card = be->priv;
+	struct osim_reader_hdl *rh = card->reader;
+
+	return rh->ops->transceive(rh, msg);
+}
+
+static const struct osmo_st2_card_backend_ops pcsc_backend_ops = {
+	.name = "pcsc",
+	.reset = pcsc_reset,
+	.transceive = pcsc_transceive,
+};
+
+/* load an authentication plugin for the virtual SIM.  The shared object has to
+ * export a function 'osmo_st2_vsim_auth' of type osmo_st2_vsim_auth_cb_t */
+static int vsim_load_auth_plugin(struct osmo_st2_vsim *vs, const char *path)
+{
+	osmo_st2_vsim_auth_cb_t auth_cb;
+	void *dlh;
+
+	dlh = dlopen(path, RTLD_NOW);
+	if (!dlh) {
+		fprintf(stderr, "unable to load auth plugin: %s\n", dlerror());
+		return -1;
+	}
+
+	auth_cb = (osmo_st2_vsim_auth_cb_t) dlsym(dlh, "osmo_st2_vsim_auth");
+	if (!auth_cb) {
+		fprintf(stderr, "auth plugin lacks osmo_st2_vsim_auth(): %s\n", dlerror());
+		dlclose(dlh);
+		return -1;
+	}
+
+	osmo_st2_vsim_set_auth_cb(vs, auth_cb, NULL);
+	return 0;
+}
+
 /***********************************************************************
  * Incoming Messages
  ***********************************************************************/
 
+static const struct value_string vcc_class_names[] = {
+	{ CEMU_VCC_CLASS_NONE,	"none" },
+	{ CEMU_VCC_CLASS_A,	"A (5V)" },
+	{ CEMU_VCC_CLASS_B,	"B (3V)" },
+	{ CEMU_VCC_CLASS_C,	"C (1.8V)" },
+	{ 0, NULL }
+};
+
+/* the clock and VCC measured by the firmware, appended to the status by newer firmware */
+static void log_status_measured(struct osmo_st2_cardem_inst *ci, const struct cardemu_usb_msg_status *status,
+				int len)
+{
+	if (len >= (int) offsetof(struct cardemu_usb_msg_status, vcc_min_mv) &&
+	    (status->flags & CEMU_STATUS_F_CLK_MEASURED))
+		LOGCI(ci, LOGL_INFO, "   CLK: %u Hz, stopped %u times\n", status->clk_hz, status->clk_stops);
+	if (len >= (int) sizeof(*status) && (status->flags & CEMU_STATUS_F_VCC_MEASURED))
+		LOGCI(ci, LOGL_INFO, "   VCC: %u..%u mV, avg %u mV, class %s, %u glitches\n",
+		      status->vcc_min_mv, status->vcc_max_mv, status->vcc_avg_mv,
+		      get_value_string(vcc_class_names, status->vcc_class), status->vcc_glitches);
+}
+
 /*! \brief Process a STATUS message from the SIMtrace2 */
 static int process_do_status(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len)
 {
@@ -139,6 +628,7 @@ static int process_do_status(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int
 	LOGCI(ci, LOGL_NOTICE, "=> STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u (%s)\n",
 		status->flags, status->fi, status->di, status->wi,
 		status->waiting_time, fbuf);
+	log_status_measured(ci, status, len);
 
 	update_status_flags(ci, status->flags);
 
@@ -156,10 +646,46 @@ static int process_do_pts(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len
 	return 0;
 }
 
+/* T=1: collect the information fields of the I-blocks until the APDU is complete */
+static int process_do_rx_da_t1(struct osmo_st2_cardem_inst *ci,
+			       const struct cardemu_usb_msg_rx_data *data)
+{
+	struct cardem_slot *cs = ci2slot(ci);
+	static const uint8_t sw_wrong_length[] = { 0x67, 0x00 };
+
+	if (cs->t1.capdu_len + data->data_len > sizeof(cs->t1.capdu)) {
+		LOGCI(ci, LOGL_ERROR, "T=1 command APDU too long\n");
+		cs->t1.capdu_len = sizeof(cs->t1.capdu) + 1;
+	} else if (cs->t1.capdu_len <= sizeof(cs->t1.capdu)) {
+		memcpy(cs->t1.capdu + cs->t1.capdu_len, data->data, data->data_len);
+		cs->t1.capdu_len += data->data_len;
+	}
+	if (!(data->flags & CEMU_DATA_F_FINAL))
+		return 0;
+
+	if (cs->t1.capdu_len > sizeof(cs->t1.capdu) ||
+	    osmo_apdu_parse_capdu(&cs->ac, cs->t1.capdu, cs->t1.capdu_len) < 0) {
+		cs->t1.capdu_len = 0;
+		return osmo_st2_cardem_request_t1_tx(ci, sw_wrong_length, sizeof(sw_wrong_length));
+	}
+	cs->t1.capdu_len = 0;
+	/* the command and Ne bytes of response have to fit into one msgb */
+	if (tpdu_msgb_size(&cs->ac) > TPDU_MSGB_SIZE_MAX) {
+		LOGCI(ci, LOGL_ERROR, "T=1 APDU with Lc=%u Le=%u exceeds the TPDU buffer\n",
+		      cs->ac.lc.tot, cs->ac.le.tot);
+		return osmo_st2_cardem_request_t1_tx(ci, sw_wrong_length, sizeof(sw_wrong_length));
+	}
+	cs->t1.active = true;
+	cs->t1.rapdu_len = 0;
+	slot_submit_capdu(cs);
+	return 0;
+}
+
 /*! \brief Process a RX-DATA indication message from the SIMtrace2 */
 static int process_do_rx_da(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len)
 {
-	static struct osmo_apdu_context ac, prev_ac;
+	struct cardem_slot *cs = ci2slot(ci);
+	struct osmo_apdu_context *ac = &cs->ac;
 	struct cardemu_usb_msg_rx_data *data;
 	int rc;
 
@@ -168,7 +694,10 @@ static int process_do_rx_da(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int l
 	LOGCI(ci, LOGL_INFO, "=> DATA: flags=0x%02x (%s), %s\n ", data->flags,
 	      cemu_data_flags2str(data->flags), osmo_hexdump(data->data, data->data_len));
 
-	rc = osmo_apdu_segment_in2(&ac, &prev_ac, data->data, data->data_len,
+	if (data->flags & CEMU_DATA_F_T1)
+		return process_do_rx_da_t1(ci, data);
+
+	rc = osmo_apdu_segment_in2(ac, &cs->prev_ac, data->data, data->data_len,
 				   data->flags & CEMU_DATA_F_TPDU_HDR);
 	if (rc < 0) {
 		/* At this point the communication is broken.  We cannot keep running, as we
@@ -179,41 +708,53 @@ static int process_do_rx_da(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int l
 	}
 
 	if (rc & APDU_ACT_TX_CAPDU_TO_CARD) {
-		struct msgb *tmsg = msgb_alloc(1024, "TPDU");
-		struct osim_reader_hdl *rh = ci->chan->card->reader;
-		uint8_t *cur;
-
-		/* Copy TPDU header */
-		cur = msgb_put(tmsg, sizeof(ac.hdr));
-		memcpy(cur, &ac.hdr, sizeof(ac.hdr));
-		/* Copy D(c), if any */
-		if (ac.lc.tot) {
-			cur = msgb_put(tmsg, ac.lc.tot);
-			memcpy(cur, ac.dc, ac.lc.tot);
-		}
-		/* send to actual card */
-		tmsg->l3h = tmsg->tail;
-		rc = rh->ops->transceive(rh, tmsg);
-		if (rc < 0) {
-			fprintf(stderr, "error during transceive: %d\n", rc);
-			msgb_free(tmsg);
-			return rc;
-		}
-		/* send via GSMTAP for wireshark tracing */
-		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, tmsg->data, msgb_length(tmsg));
-
-		msgb_apdu_sw(tmsg) = msgb_get_u16(tmsg);
-		ac.sw[0] = msgb_apdu_sw(tmsg) >> 8;
-		ac.sw[1] = msgb_apdu_sw(tmsg) & 0xff;
-		if (msgb_l3len(tmsg))
-			osmo_st2_cardem_request_pb_and_tx(ci, ac.hdr.ins, tmsg->l3h, msgb_l3len(tmsg));
-		osmo_st2_cardem_request_sw_tx(ci, ac.sw);
-	} else if (ac.lc.tot > ac.lc.cur) {
-		osmo_st2_cardem_request_pb_and_rx(ci, ac.hdr.ins, ac.lc.tot - ac.lc.cur);
+		slot_submit_capdu(cs);
+	} else if (ac->lc.tot > ac->lc.cur) {
+		osmo_st2_cardem_request_pb_and_rx(ci, ac->hdr.ins, ac->lc.tot - ac->lc.cur);
+	}
+	return 0;
+}
+
+/*! \brief Process the board information of the SIMtrace2 */
+static int process_board_info(struct osmo_st2_cardem_inst *ci, const uint8_t *buf, int len)
+{
+	struct osmo_st2_board_info bi;
+	struct osmo_st2_transport *transp = ci->slot->transp;
+
+	if (osmo_st2_board_info_decode(&bi, buf, len) < 0) {
+		LOGCI(ci, LOGL_ERROR, "=> BOARD INFO: truncated\n");
+		return -1;
+	}
+	osmo_st2_transport_apply_board_info(transp, &bi);
+
+	LOGCI(ci, LOGL_NOTICE, "=> BOARD INFO: %s %s %s, caps=0x%08x, max message %u bytes\n",
+	      bi.info.hardware.model, bi.info.software.name, bi.info.software.version,
+	      bi.cap_generic, transp->max_out_msg_len);
+	if (bi.cap_generic & (1 << SIMTRACE_CAP_BOOT_TIME)) {
+		LOGCI(ci, LOGL_NOTICE, "=> BOARD INFO: ready %u ms after reset (target %u ms)\n",
+		      bi.boot.ready, bi.boot.ready_target);
 	}
 	return 0;
 }
 
+/*! \brief Log the modem status pushed by the SIMtrace2 (WWAN LED, card inserted) */
+static void modem_status_cb(struct osmo_st2_cardem_inst *ci, const struct osmo_st2_modem_status *sts,
+			    void *data)
+{
+	if (sts->supported_mask & ST_MDM_STS_BIT_WWAN_LED) {
+		LOGCI(ci, sts->changed_mask & ST_MDM_STS_BIT_WWAN_LED ? LOGL_INFO : LOGL_DEBUG,
+		      "=> MODEM STATUS: WWAN LED %s at %u ms (%u edges)\n",
+		      sts->status_mask & ST_MDM_STS_BIT_WWAN_LED ? "on" : "off",
+		      sts->wwan_led_edge_ms, sts->wwan_led_edges);
+	}
+	if (sts->supported_mask & ST_MDM_STS_BIT_CARD_INSERTED) {
+		LOGCI(ci, sts->changed_mask & ST_MDM_STS_BIT_CARD_INSERTED ? LOGL_NOTICE : LOGL_DEBUG,
+		      "=> MODEM STATUS: card %s at %u ms\n",
+		      sts->status_mask & ST_MDM_STS_BIT_CARD_INSERTED ? "inserted" : "removed",
+		      sts->card_inserted_edge_ms);
+	}
+}
+
 /*! \brief Process an incoming message from the SIMtrace2 */
 static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int len)
 {
@@ -221,6 +762,20 @@ static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int le
 	int rc;
 
 	buf += sizeof(*sh);
+	len -= sizeof(*sh);
+
+	if (sh->msg_class == SIMTRACE_MSGC_GENERIC) {
+		if (sh->msg_type == SIMTRACE_CMD_BD_BOARD_INFO)
+			return process_board_info(ci, buf, len);
+		LOGCI(ci, LOGL_ERROR, "unknown generic msg type 0x%02x\n", sh->msg_type);
+		return -1;
+	}
+	if (sh->msg_class == SIMTRACE_MSGC_MODEM) {
+		if (sh->msg_type == SIMTRACE_MSGT_BD_MODEM_STATUS)
+			return osmo_st2_cardem_rx_modem_status(ci, buf, len);
+		LOGCI(ci, LOGL_ERROR, "unknown modem msg type 0x%02x\n", sh->msg_type);
+		return -1;
+	}
 
 	switch (sh->msg_type) {
 	case SIMTRACE_MSGT_BD_CEMU_STATUS:
@@ -237,7 +792,7 @@ static int process_usb_msg(struct osmo_st2_cardem_inst *ci, uint8_t *buf, int le
 		rc = 0;
 		break;
 	default:
-		printf("unknown simtrace msg type 0x%02x\n", sh->msg_type);
+		LOGCI(ci, LOGL_ERROR, "unknown simtrace msg type 0x%02x\n", sh->msg_type);
 		rc = -1;
 		break;
 	}
@@ -255,6 +810,7 @@ static int process_irq_status(struct osmo_st2_cardem_inst *ci, const uint8_t *bu
 	LOGCI(ci, LOGL_NOTICE, "=> IRQ STATUS: flags=0x%x, fi=%u, di=%u, wi=%u wtime=%u (%s)\n",
 		status->flags, status->fi, status->di, status->wi,
 		status->waiting_time, fbuf);
+	log_status_measured(ci, status, len);
 
 	update_status_flags(ci, status->flags);
 
@@ -267,6 +823,11 @@ static int process_usb_msg_irq(struct osmo_st2_cardem_inst *ci, const uint8_t *b
 	int rc;
 
 	buf += sizeof(*sh);
+	len -= sizeof(*sh);
+
+	/* changes of the modem status, if subscribed */
+	if (sh->msg_class == SIMTRACE_MSGC_MODEM && sh->msg_type == SIMTRACE_MSGT_BD_MODEM_STATUS)
+		return osmo_st2_cardem_rx_modem_status(ci, buf, len);
 
 	switch (sh->msg_type) {
 	case SIMTRACE_MSGT_BD_CEMU_STATUS:
@@ -391,6 +952,29 @@ static void allocate_and_submit_irq(struct osmo_st2_cardem_inst *ci)
 
 
 
+/* call-back of the SITL firmware socket: dispatch IN and IRQ transfers */
+static int sitl_sock_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	struct cardem_slot *cs = ofd->data;
+	struct osmo_st2_cardem_inst *ci = &cs->ci;
+	uint8_t buf[16*256];
+	uint8_t ep;
+	int rc;
+
+	rc = osmo_st2_transport_sock_recv(&cs->transp, &ep, buf, sizeof(buf));
+	if (rc <= 0) {
+		LOGCI(ci, LOGL_FATAL, "SITL firmware disappeared\n");
+		exit(1);
+	}
+
+	if (ep == cs->transp.usb_ep.irq_in)
+		process_usb_msg_irq(ci, buf, rc);
+	else
+		process_usb_msg(ci, buf, rc);
+
+	return 0;
+}
+
 static void print_welcome(void)
 {
 	printf("simtrace2-cardem-pcsc - Using PC/SC reader as SIM\n"
@@ -414,6 +998,19 @@ static void print_help(void)
 		"\t-A\t--usb-address\tADDRESS\n"
 		"\t-H\t--usb-path\tPATH\n"
 		"\t-Z\t--set-sim-presence\t<0/1>\n"
+		"\t-F\t--vsim-image\tFILE\tserve a virtual SIM from FILE instead of PC/SC\n"
+		"\t-W\t--vsim-write-back\twrite UPDATEs back to the virtual SIM image\n"
+		"\t-L\t--vsim-auth-plugin\tSHARED-OBJECT\n"
+		"\t-s\t--slot\t\tSLOT-SPEC\tadd a card emulation instance (may be repeated)\n"
+		"\t-T\t--stats-interval\tSECONDS\tperiodically log per-slot statistics\n"
+		"\t-p\t--prefetch\tspeculatively read the likely next response from the card\n"
+		"\t-U\t--sitl-socket\tPATH\tattach to a SITL firmware build instead of USB\n"
+		"\n"
+		"SLOT-SPEC is a comma-separated list of the following keys, each of which\n"
+		"defaults to the value of the corresponding global option above:\n"
+		"\tname=NAME,usb-path=PATH,usb-address=ADDRESS,usb-interface=INTERFACE_ID,\n"
+		"\tpcsc-reader-num=N,vsim-image=FILE,sitl-socket=PATH\n"
+		"e.g. -s usb-interface=0,pcsc-reader-num=0 -s usb-interface=1,vsim-image=sim.img\n"
 		"\n"
 		);
 }
@@ -433,36 +1030,357 @@ static const struct option opts[] = {
 	{ "usb-address", 1, 0, 'A' },
 	{ "usb-path", 1, 0, 'H' },
 	{ "set-sim-presence", 1, 0, 'Z' },
+	{ "vsim-image", 1, 0, 'F' },
+	{ "vsim-write-back", 0, 0, 'W' },
+	{ "vsim-auth-plugin", 1, 0, 'L' },
+	{ "slot", 1, 0, 's' },
+	{ "stats-interval", 1, 0, 'T' },
+	{ "prefetch", 0, 0, 'p' },
+	{ "sitl-socket", 1, 0, 'U' },
 	{ NULL, 0, 0, 0 }
 };
 
-static void run_mainloop(struct osmo_st2_cardem_inst *ci)
+/* options shared by all card emulation instances */
+static struct {
+	int vendor_id;
+	int product_id;
+	int config_id;
+	int altsetting;
+	bool skip_atr;
+	uint8_t override_atr[OSIM_MAX_ATR_LEN];
+	int override_atr_len;
+	bool vsim_write_back;
+	const char *vsim_auth_plugin;
+	struct cardemu_usb_msg_config cardem_config;
+	unsigned int stats_interval;
+	bool prefetch;
+} g_opts = {
+	.vendor_id = -1,
+	.product_id = -1,
+	.config_id = -1,
+	.cardem_config = { .features = CEMU_FEAT_F_STATUS_IRQ },
+};
+
+/***********************************************************************
+ * Card emulation instances
+ ***********************************************************************/
+
+static struct cardem_slot *slot_alloc(void *ctx, const struct cardem_slot *defaults)
 {
-	printf("Entering main loop\n");
-	while (1) {
-		osmo_select_main(0);
+	struct cardem_slot *cs = talloc_zero(ctx, struct cardem_slot);
+	if (!cs)
+		return NULL;
+
+	cs->cfg = defaults->cfg;
+	snprintf(cs->name, sizeof(cs->name), "slot%u", llist_count(&g_slots));
+	cs->slot.transp = &cs->transp;
+	cs->slot.slot_nr = 0;
+	cs->ci.slot = &cs->slot;
+	cs->ci.card_prof = &osim_uicc_sim_cic_profile;
+	cs->ci.priv = cs;
+	cs->transp.udp_fd = -1;
+	cs->transp.usb_async = true;
+
+	llist_add_tail(&cs->list, &g_slots);
+	return cs;
+}
+
+/* parse a SLOT-SPEC like "usb-interface=1,pcsc-reader-num=2" into cs->cfg */
+static int slot_parse_spec(struct cardem_slot *cs, char *spec)
+{
+	enum { SO_NAME, SO_PATH, SO_ADDR, SO_IF, SO_READER, SO_VSIM, SO_SITL };
+	char *const tokens[] = {
+		[SO_NAME] = "name",
+		[SO_PATH] = "usb-path",
+		[SO_ADDR] = "usb-address",
+		[SO_IF] = "usb-interface",
+		[SO_READER] = "pcsc-reader-num",
+		[SO_VSIM] = "vsim-image",
+		[SO_SITL] = "sitl-socket",
+		NULL
+	};
+	char *value;
+
+	while (*spec) {
+		int tok = getsubopt(&spec, tokens, &value);
+		if (tok >= 0 && !value) {
+			fprintf(stderr, "slot option '%s' requires a value\n", tokens[tok]);
+			return -EINVAL;
+		}
+		switch (tok) {
+		case SO_NAME:
+			osmo_strlcpy(cs->name, value, sizeof(cs->name));
+			break;
+		case SO_PATH:
+			cs->cfg.usb_path = value;
+			break;
+		case SO_ADDR:
+			cs->cfg.usb_addr = atoi(value);
+			break;
+		case SO_IF:
+			cs->cfg.if_num = atoi(value);
+			break;
+		case SO_READER:
+			cs->cfg.reader_num = atoi(value);
+			cs->cfg.vsim_image = NULL;
+			break;
+		case SO_VSIM:
+			cs->cfg.vsim_image = value;
+			break;
+		case SO_SITL:
+			cs->cfg.sitl_socket = value;
+			break;
+		default:
+			fprintf(stderr, "unknown slot option '%s'\n", value);
+			return -EINVAL;
+		}
 	}
+	return 0;
 }
 
-static struct osmo_st2_transport _transp;
+/* open the card backend (PC/SC reader or virtual SIM) of a slot */
+static int slot_open_backend(struct cardem_slot *cs)
+{
+	struct osim_reader_hdl *reader;
+	struct osim_card_hdl *card;
 
-static struct osmo_st2_slot _slot = {
-	.transp = &_transp,
-	.slot_nr = 0,
-};
+	if (cs->cfg.vsim_image) {
+		struct osmo_st2_vsim *vs;
 
-struct osmo_st2_cardem_inst _ci = {
-	.slot = &_slot,
-};
+		vs = osmo_st2_vsim_open_file(cs, cs->cfg.vsim_image, g_opts.vsim_write_back);
+		if (!vs) {
+			fprintf(stderr, "[%s] unable to open virtual SIM image %s\n", cs->name,
+				cs->cfg.vsim_image);
+			return -1;
+		}
+		if (g_opts.vsim_auth_plugin && vsim_load_auth_plugin(vs, g_opts.vsim_auth_plugin) < 0)
+			return -1;
+		cs->be = osmo_st2_vsim_backend(vs);
+		return 0;
+	}
 
-struct osmo_st2_cardem_inst *ci = &_ci;
+	reader = osim_reader_open(OSIM_READER_DRV_PCSC, cs->cfg.reader_num, "", NULL);
+	if (!reader) {
+		fprintf(stderr, "[%s] unable to open PC/SC reader %d: %s\n", cs->name,
+			cs->cfg.reader_num, strerror(errno));
+		return -1;
+	}
+
+	card = osim_card_open(reader, OSIM_PROTO_T0);
+	if (!card) {
+		fprintf(stderr, "[%s] unable to open SIM card: %s\n", cs->name, strerror(errno));
+		return -1;
+	}
+
+	cs->ci.chan = llist_entry(card->channels.next, struct osim_chan_hdl, list);
+	if (!cs->ci.chan) {
+		fprintf(stderr, "[%s] SIM card has no channel?!?\n", cs->name);
+		return -1;
+	}
+
+	cs->be = talloc_zero(cs, struct osmo_st2_card_backend);
+	cs->be->ops = &pcsc_backend_ops;
+	cs->be->priv = card;
+	memcpy(cs->be->atr, card->atr, card->atr_len);
+	cs->be->atr_len = card->atr_len;
+	return 0;
+}
+
+/* open and claim the USB interface of a slot */
+static int slot_open_usb(struct cardem_slot *cs)
+{
+	struct osmo_st2_transport *transp = &cs->transp;
+	struct usb_interface_match _ifm, *ifm = &_ifm;
+	int rc;
+
+	memset(ifm, 0, sizeof(*ifm));
+	ifm->vendor = g_opts.vendor_id;
+	ifm->product = g_opts.product_id;
+	ifm->configuration = g_opts.config_id;
+	ifm->interface = cs->cfg.if_num;
+	ifm->altsetting = g_opts.altsetting;
+	if (cs->cfg.usb_addr > 0 && cs->cfg.usb_addr < 256)
+		ifm->addr = cs->cfg.usb_addr;
+	if (cs->cfg.usb_path)
+		osmo_strlcpy(ifm->path, cs->cfg.usb_path, sizeof(ifm->path));
+	transp->usb_devh = osmo_libusb_open_claim_interface(NULL, NULL, ifm);
+	if (!transp->usb_devh) {
+		fprintf(stderr, "[%s] can't open USB device: %s\n", cs->name, strerror(errno));
+		return -1;
+	}
+
+	rc = libusb_claim_interface(transp->usb_devh, cs->cfg.if_num);
+	if (rc < 0) {
+		fprintf(stderr, "[%s] can't claim interface %d; rc=%d\n", cs->name, cs->cfg.if_num, rc);
+		return -1;
+	}
+
+	rc = osmo_libusb_get_ep_addrs(transp->usb_devh, cs->cfg.if_num, &transp->usb_ep.out,
+				      &transp->usb_ep.in, &transp->usb_ep.irq_in);
+	if (rc < 0) {
+		fprintf(stderr, "[%s] can't obtain EP addrs; rc=%d\n", cs->name, rc);
+		return -1;
+	}
+
+	/* avoid heap allocations for each message sent to the firmware */
+	if (!osmo_st2_tx_pool_alloc(cs, transp, TX_POOL_MSGS, 16)) {
+		fprintf(stderr, "[%s] can't allocate transmit pool\n", cs->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* attach a slot to the USB socket of a SITL firmware build */
+static int slot_open_sitl(struct cardem_slot *cs)
+{
+	struct osmo_st2_transport *transp = &cs->transp;
+	int rc;
+
+	rc = osmo_st2_transport_sock_connect(transp, cs->cfg.sitl_socket);
+	if (rc < 0) {
+		fprintf(stderr, "[%s] can't attach to SITL firmware at %s: %s\n", cs->name,
+			cs->cfg.sitl_socket, strerror(-rc));
+		return -1;
+	}
+	osmo_fd_setup(&cs->sitl_ofd, rc, OSMO_FD_READ, sitl_sock_cb, cs, 0);
+	rc = osmo_fd_register(&cs->sitl_ofd);
+	if (rc < 0)
+		return -1;
+
+	if (!osmo_st2_tx_pool_alloc(cs, transp, 64, 0)) {
+		fprintf(stderr, "[%s] can't allocate transmit pool\n", cs->name);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void slot_close_usb(struct cardem_slot *cs)
+{
+	struct osmo_st2_transport *transp = &cs->transp;
+
+	if (transp->tx_pool)
+		osmo_st2_tx_pool_free(transp->tx_pool);
+	if (transp->udp_fd >= 0) {
+		osmo_fd_unregister(&cs->sitl_ofd);
+		close(transp->udp_fd);
+		transp->udp_fd = -1;
+	}
+	if (transp->usb_devh) {
+		libusb_release_interface(transp->usb_devh, cs->cfg.if_num);
+		libusb_close(transp->usb_devh);
+		transp->usb_devh = NULL;
+	}
+}
+
+/* configure the firmware of a slot and hand the modem over to the emulated card */
+static void slot_start(struct cardem_slot *cs)
+{
+	struct osmo_st2_cardem_inst *ci = &cs->ci;
+
+	LOGCI(ci, LOGL_NOTICE, "starting card emulation on interface %d using %s backend\n",
+	      cs->cfg.if_num, cs->be->ops->name);
+
+	memset(&cs->ac, 0, sizeof(cs->ac));
+	memset(&cs->prev_ac, 0, sizeof(cs->prev_ac));
+	cs->last_status_flags = 0;
+
+	/* the socket of a SITL firmware is read from sitl_sock_cb() */
+	if (cs->transp.usb_devh) {
+		allocate_and_submit_irq(ci);
+		for (int i = 0; i < 4; i++)
+			allocate_and_submit_in(ci);
+	}
+
+	/* learn how large the messages to the firmware may be */
+	osmo_st2_request_board_info(ci->slot);
+
+	/* request firmware to generate STATUS on IRQ endpoint */
+	osmo_st2_cardem_request_config2(ci, &g_opts.cardem_config);
+
+	/* and the changes of the modem status (WWAN LED, card inserted) */
+	osmo_st2_modem_status_subscribe(ci, modem_status_cb, NULL);
+
+	/* simulate card-insert to modem (owhw, not qmod) */
+	osmo_st2_cardem_request_card_insert(ci, true);
+
+	/* select remote (forwarded) SIM */
+	osmo_st2_modem_sim_select_remote(ci->slot);
+
+	if (!g_opts.skip_atr) {
+		/* set the ATR */
+		if (g_opts.override_atr_len) {
+			/* user has specified an override-ATR */
+			osmo_st2_cardem_request_set_atr(ci, g_opts.override_atr, g_opts.override_atr_len);
+		} else {
+			/* use the real ATR of the card */
+			osmo_st2_cardem_request_set_atr(ci, cs->be->atr, cs->be->atr_len);
+		}
+	}
+
+	/* select remote (forwarded) SIM */
+	osmo_st2_modem_reset_pulse(ci->slot, 300);
+}
+
+static void slot_log_stats(struct cardem_slot *cs)
+{
+	LOGCI(&cs->ci, LOGL_NOTICE, "STATS: apdus=%lu resets=%lu errors=%lu stale=%lu "
+	      "transceive avg=%lluus max=%luus\n", cs->stats.apdus, cs->stats.resets,
+	      cs->stats.errors, cs->stats.stale,
+	      cs->stats.apdus ? cs->stats.xceive_us_total / cs->stats.apdus : 0,
+	      cs->stats.xceive_us_max);
+
+	if (cs->transp.tx_pool) {
+		const struct osmo_st2_tx_pool_stats *ts = osmo_st2_tx_pool_get_stats(cs->transp.tx_pool);
+		LOGCI(&cs->ci, LOGL_NOTICE, "TX POOL: msgs=%u/%u (max %u) xfers=%u/%u (max %u) "
+		      "submitted=%lu queued=%lu exhausted=%lu\n", ts->msgs_in_use, ts->num_msgs,
+		      ts->msgs_in_use_max, ts->xfers_in_flight, ts->num_xfers, ts->xfers_in_flight_max,
+		      ts->xfer_submits, ts->xfer_queued, ts->msg_exhausted);
+	}
+
+	if (cs->pf) {
+		const struct osmo_st2_prefetch_stats *ps = osmo_st2_prefetch_get_stats(cs->pf);
+		LOGCI(&cs->ci, LOGL_NOTICE, "PREFETCH: commands=%lu issued=%lu hits=%lu (%lu%%) "
+		      "misses=%lu invalidated=%lu learned=%lu\n", ps->commands, ps->issued, ps->hits,
+		      ps->commands ? ps->hits * 100 / ps->commands : 0, ps->misses, ps->invalidated,
+		      ps->learned);
+	}
+}
+
+static struct osmo_timer_list stats_timer;
+
+static void stats_timer_cb(void *data)
+{
+	struct cardem_slot *cs;
+
+	llist_for_each_entry(cs, &g_slots, list)
+		slot_log_stats(cs);
+
+	osmo_timer_schedule(&stats_timer, g_opts.stats_interval, 0);
+}
+
+static void run_mainloop(void)
+{
+	printf("Entering main loop\n");
+	while (1) {
+		osmo_select_main(0);
+	}
+}
 
 static void signal_handler(int signal)
 {
+	struct cardem_slot *cs;
+
 	switch (signal) {
 	case SIGINT:
-		osmo_st2_cardem_request_card_insert(ci, false);
-		osmo_st2_modem_sim_select_local(ci->slot);
+		llist_for_each_entry(cs, &g_slots, list) {
+			slot_log_stats(cs);
+			if (!slot_attached(cs))
+				continue;
+			osmo_st2_cardem_request_card_insert(&cs->ci, false);
+			osmo_st2_modem_sim_select_local(cs->ci.slot);
+		}
 		exit(0);
 		break;
 	default:
@@ -472,28 +1390,25 @@ static void signal_handler(int signal)
 
 static struct log_info log_info = {};
 
+#define MAX_SLOT_SPECS	16
+
 int main(int argc, char **argv)
 {
-	struct osmo_st2_transport *transp = ci->slot->transp;
 	char *gsmtap_host = "127.0.0.1";
 	int rc;
 	int c, ret = 1;
-	int skip_atr = 0;
 	char *atr = NULL;
-	uint8_t override_atr[OSIM_MAX_ATR_LEN];
-	int override_atr_len = 0;
 	int keep_running = 0;
-	int if_num = 0, vendor_id = -1, product_id = -1;
-	int config_id = -1, altsetting = 0, addr = -1;
-	int reader_num = 0;
-	char *path = NULL;
-	struct osim_reader_hdl *reader;
-	struct osim_card_hdl *card;
-	struct cardemu_usb_msg_config cardem_config = { .features = CEMU_FEAT_F_STATUS_IRQ };
+	struct cardem_slot defaults = {};
+	char *slot_specs[MAX_SLOT_SPECS];
+	unsigned int num_slot_specs = 0;
+	struct cardem_slot *cs;
 
 	print_welcome();
 
 	osmo_init_logging2(NULL, &log_info);
+	/* card backends log from their worker threads */
+	log_enable_multithread();
 
 	rc = osmo_libusb_init(NULL);
 	if (rc < 0) {
@@ -509,10 +1424,12 @@ int main(int argc, char **argv)
 	log_set_category_filter(osmo_stderr_target, DLINP, 1, LOGL_DEBUG);
 	log_set_category_filter(osmo_stderr_target, DLGLOBAL, 1, LOGL_DEBUG);
 
+	defaults.cfg.usb_addr = -1;
+
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "hi:V:P:C:I:S:A:H:akn:t:Z:", opts, &option_index);
+		c = getopt_long(argc, argv, "hi:V:P:C:I:S:A:H:akn:t:Z:F:WL:s:T:pU:", opts, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -524,7 +1441,7 @@ int main(int argc, char **argv)
 			gsmtap_host = optarg;
 			break;
 		case 'a':
-			skip_atr = 1;
+			g_opts.skip_atr = true;
 			break;
 		case 't':
 		        atr = optarg;
@@ -533,51 +1450,88 @@ int main(int argc, char **argv)
 			keep_running = 1;
 			break;
 		case 'n':
-			reader_num = atoi(optarg);
+			defaults.cfg.reader_num = atoi(optarg);
 			break;
 		case 'V':
-			vendor_id = strtol(optarg, NULL, 16);
+			g_opts.vendor_id = strtol(optarg, NULL, 16);
 			break;
 		case 'P':
-			product_id = strtol(optarg, NULL, 16);
+			g_opts.product_id = strtol(optarg, NULL, 16);
 			break;
 		case 'C':
-			config_id = atoi(optarg);
+			g_opts.config_id = atoi(optarg);
 			break;
 		case 'I':
-			if_num = atoi(optarg);
+			defaults.cfg.if_num = atoi(optarg);
 			break;
 		case 'S':
-			altsetting = atoi(optarg);
+			g_opts.altsetting = atoi(optarg);
 			break;
 		case 'A':
-			addr = atoi(optarg);
+			defaults.cfg.usb_addr = atoi(optarg);
 			break;
 		case 'H':
-			path = optarg;
+			defaults.cfg.usb_path = optarg;
 			break;
 		case 'Z':
-			cardem_config.pres_pol = atoi(optarg) ? CEMU_CONFIG_PRES_POL_PRES_H : 0;
-			cardem_config.pres_pol |= CEMU_CONFIG_PRES_POL_VALID;
+			g_opts.cardem_config.pres_pol = atoi(optarg) ? CEMU_CONFIG_PRES_POL_PRES_H : 0;
+			g_opts.cardem_config.pres_pol |= CEMU_CONFIG_PRES_POL_VALID;
+			break;
+		case 'F':
+			defaults.cfg.vsim_image = optarg;
+			break;
+		case 'W':
+			g_opts.vsim_write_back = true;
+			break;
+		case 'L':
+			g_opts.vsim_auth_plugin = optarg;
+			break;
+		case 's':
+			if (num_slot_specs >= ARRAY_SIZE(slot_specs)) {
+				fprintf(stderr, "At most %zu slots are supported\n", ARRAY_SIZE(slot_specs));
+				goto do_exit;
+			}
+			slot_specs[num_slot_specs++] = optarg;
+			break;
+		case 'T':
+			g_opts.stats_interval = atoi(optarg);
+			break;
+		case 'p':
+			g_opts.prefetch = true;
+			break;
+		case 'U':
+			defaults.cfg.sitl_socket = optarg;
 			break;
 		}
 	}
 
 	if (atr) {
-		override_atr_len = osmo_hexparse(atr, override_atr, sizeof(override_atr));
-		if (override_atr_len < 2) {
+		g_opts.override_atr_len = osmo_hexparse(atr, g_opts.override_atr, sizeof(g_opts.override_atr));
+		if (g_opts.override_atr_len < 2) {
 			fprintf(stderr, "Invalid ATR - please omit a leading 0x and only use valid hex "
 				"digits and whitespace. ATRs need to be between 2 and 33 bytes long.\n");
 			goto do_exit;
 		}
+		atr_update_csum(g_opts.override_atr, g_opts.override_atr_len);
 	}
 
-	if (vendor_id < 0 || product_id < 0) {
-		fprintf(stderr, "You have to specify the vendor and product ID\n");
-		goto do_exit;
+	/* without any --slot, the global options describe the one and only slot */
+	if (num_slot_specs == 0) {
+		if (!slot_alloc(NULL, &defaults))
+			goto do_exit;
+	}
+	for (unsigned int i = 0; i < num_slot_specs; i++) {
+		cs = slot_alloc(NULL, &defaults);
+		if (!cs || slot_parse_spec(cs, slot_specs[i]) < 0)
+			goto do_exit;
 	}
 
-	ci->card_prof = &osim_uicc_sim_cic_profile;
+	llist_for_each_entry(cs, &g_slots, list) {
+		if (!cs->cfg.sitl_socket && (g_opts.vendor_id < 0 || g_opts.product_id < 0)) {
+			fprintf(stderr, "You have to specify the vendor and product ID\n");
+			goto do_exit;
+		}
+	}
 
 	rc = osmo_st2_gsmtap_init(gsmtap_host);
 	if (rc < 0) {
@@ -585,104 +1539,50 @@ int main(int argc, char **argv)
 		goto close_exit;
 	}
 
-	reader = osim_reader_open(OSIM_READER_DRV_PCSC, reader_num, "", NULL);
-	if (!reader) {
-		perror("unable to open PC/SC reader");
-		goto close_exit;
+	llist_for_each_entry(cs, &g_slots, list) {
+		if (slot_open_backend(cs) < 0)
+			goto close_exit;
+		if (g_opts.prefetch) {
+			cs->pf = osmo_st2_prefetch_alloc(cs, cs->be, true);
+			if (!cs->pf)
+				goto close_exit;
+			cs->be = osmo_st2_prefetch_backend(cs->pf);
+		}
+		if (slot_worker_start(cs) < 0)
+			goto close_exit;
 	}
 
-	card = osim_card_open(reader, OSIM_PROTO_T0);
-	if (!card) {
-		perror("unable to open SIM card");
-		goto close_exit;
-	}
+	signal(SIGINT, &signal_handler);
 
-	ci->chan = llist_entry(card->channels.next, struct osim_chan_hdl, list);
-	if (!ci->chan) {
-		perror("SIM card has no channel?!?");
-		goto close_exit;
+	if (g_opts.stats_interval) {
+		osmo_timer_setup(&stats_timer, stats_timer_cb, NULL);
+		osmo_timer_schedule(&stats_timer, g_opts.stats_interval, 0);
 	}
 
-	signal(SIGINT, &signal_handler);
-
 	do {
-		struct usb_interface_match _ifm, *ifm = &_ifm;
-		memset(ifm, 0, sizeof(*ifm));
-		ifm->vendor = vendor_id;
-		ifm->product = product_id;
-		ifm->configuration = config_id;
-		ifm->interface = if_num;
-		ifm->altsetting = altsetting;
-		if (addr > 0 && addr < 256)
-			ifm->addr = addr;
-		if (path)
-			osmo_strlcpy(ifm->path, path, sizeof(ifm->path));
-		transp->udp_fd = -1;
-		transp->usb_async = true;
-		transp->usb_devh = osmo_libusb_open_claim_interface(NULL, NULL, ifm);
-		if (!transp->usb_devh) {
-			fprintf(stderr, "can't open USB device: %s\n", strerror(errno));
-			goto close;
-		}
-
-		rc = libusb_claim_interface(transp->usb_devh, if_num);
-		if (rc < 0) {
-			fprintf(stderr, "can't claim interface %d; rc=%d\n", if_num, rc);
-			goto close;
-		}
-
-		rc = osmo_libusb_get_ep_addrs(transp->usb_devh, if_num, &transp->usb_ep.out,
-				      &transp->usb_ep.in, &transp->usb_ep.irq_in);
-		if (rc < 0) {
-			fprintf(stderr, "can't obtain EP addrs; rc=%d\n", rc);
-			goto close;
-		}
-
-		allocate_and_submit_irq(ci);
-		for (int i = 0; i < 4; i++)
-			allocate_and_submit_in(ci);
-
-		/* request firmware to generate STATUS on IRQ endpoint */
-		osmo_st2_cardem_request_config2(ci, &cardem_config);
-
-		/* simulate card-insert to modem (owhw, not qmod) */
-		osmo_st2_cardem_request_card_insert(ci, true);
-
-		/* select remote (forwarded) SIM */
-		osmo_st2_modem_sim_select_remote(ci->slot);
-
-		if (!skip_atr) {
-			/* set the ATR */
-			if (override_atr_len) {
-				/* user has specified an override-ATR */
-				atr_update_csum(override_atr, override_atr_len);
-				osmo_st2_cardem_request_set_atr(ci, override_atr, override_atr_len);
-			} else {
-				/* use the real ATR of the card */
-				osmo_st2_cardem_request_set_atr(ci, card->atr, card->atr_len);
-			}
+		llist_for_each_entry(cs, &g_slots, list) {
+			rc = cs->cfg.sitl_socket ? slot_open_sitl(cs) : slot_open_usb(cs);
+			if (rc < 0)
+				goto close;
 		}
 
-		/* select remote (forwarded) SIM */
-		osmo_st2_modem_reset_pulse(ci->slot, 300);
+		/* all instances are served from the one osmo_select_main() loop */
+		llist_for_each_entry(cs, &g_slots, list)
+			slot_start(cs);
 
-		run_mainloop(ci);
+		run_mainloop();
 		ret = 0;
 
-		libusb_release_interface(transp->usb_devh, 0);
-
 close:
-		if (transp->usb_devh) {
-			libusb_close(transp->usb_devh);
-			transp->usb_devh = NULL;
-		}
+		llist_for_each_entry(cs, &g_slots, list)
+			slot_close_usb(cs);
 		if (keep_running)
 			sleep(1);
 	} while (keep_running);
 
 close_exit:
-	if (transp->usb_devh)
-		libusb_close(transp->usb_devh);
+	llist_for_each_entry(cs, &g_slots, list)
+		slot_close_usb(cs);
 
 	osmo_libusb_exit(NULL);
 do_exit:
@@ -0,0 +1,987 @@
+/* simtrace2-fleet-update - update the firmware of all attached SIMtrace 2
+ * compatible boards at once
+ *
+ * Each board found is switched to its DFU bootloader, gets the image of its
+ * board and application downloaded, and is verified by the CRC the new
+ * application reports in its board information.  All boards proceed in
+ * parallel, each through its own chain of asynchronous USB transfers.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#define _GNU_SOURCE
+#include <getopt.h>
+
+#include <libusb.h>
+
+#include <osmocom/usb/libusb.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+#include <osmocom/simtrace2/simtrace_usb.h>
+#include <osmocom/simtrace2/usb_util.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/bit32gen.h>
+#include <osmocom/core/talloc.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/core/application.h>
+
+/***********************************************************************
+ * DFU protocol (USB Device Firmware Upgrade 1.1)
+ ***********************************************************************/
+
+#define USB_CLASS_DFU			0xfe
+#define USB_SUBCLASS_DFU		0x01
+#define USB_PROTOCOL_DFU_RUNTIME	0x01
+#define USB_PROTOCOL_DFU_MODE		0x02
+#define USB_DT_DFU			0x21
+
+enum dfu_req {
+	DFU_DETACH	= 0,
+	DFU_DNLOAD	= 1,
+	DFU_GETSTATUS	= 3,
+	DFU_CLRSTATUS	= 4,
+};
+
+enum dfu_state {
+	DFU_STATE_appIDLE		= 0,
+	DFU_STATE_appDETACH		= 1,
+	DFU_STATE_dfuIDLE		= 2,
+	DFU_STATE_dfuDNLOAD_SYNC	= 3,
+	DFU_STATE_dfuDNBUSY		= 4,
+	DFU_STATE_dfuDNLOAD_IDLE	= 5,
+	DFU_STATE_dfuMANIFEST_SYNC	= 6,
+	DFU_STATE_dfuMANIFEST		= 7,
+	DFU_STATE_dfuMANIFEST_WAIT_RST	= 8,
+	DFU_STATE_dfuUPLOAD_IDLE	= 9,
+	DFU_STATE_dfuERROR		= 10,
+};
+
+#define DFU_STATUS_OK			0x00
+#define DFU_STATUS_errVERIFY		0x07
+
+/* alternate setting of the bootloader's DFU interface writing the application flash */
+#define DFU_ALT_FLASH			1
+/* wTransferSize of bootloaders not announcing it: one flash page */
+#define DFU_DEFAULT_TRANSFER_SIZE	256
+#define DFU_MAX_TRANSFER_SIZE		4096
+
+/* the image starts with the table of the crc stub: stack, stub, crc, start, length */
+#define IMG_CRC_WORD			2
+#define IMG_START_WORD			3
+#define IMG_CRC_START			(0x00400000 + 0x4000 + 512)
+
+/* time for a board to show up again in the other mode */
+#define ENUM_TIMEOUT_MS			15000
+#define SCAN_INTERVAL_MS		200
+#define CTRL_TIMEOUT_MS			5000
+#define BOARD_INFO_TIMEOUT_MS		1000
+/* messages skipped on the IN endpoint while waiting for the board information */
+#define BOARD_INFO_MAX_SKIP		16
+#define MANIFEST_MAX_POLLS		200
+
+/***********************************************************************
+ * Boards and images
+ ***********************************************************************/
+
+/* the boards, by their USB product string (see firmware/libboard/<name>/product_string.txt) */
+struct fu_board {
+	const char *name;
+	const char *product_string;
+	uint16_t product_id;
+};
+
+static const struct fu_board boards[] = {
+	{ "simtrace",		"SIMtrace 2",			USB_PRODUCT_SIMTRACE2 },
+	{ "qmod",		"sysmoQMOD (Quad Modem)",	USB_PRODUCT_QMOD_SAM3 },
+	{ "owhw",		"OWHW",				USB_PRODUCT_OWHW_SAM3 },
+	{ "octsimtest",		"sysmoOCTSIM-Tester",		USB_PRODUCT_OCTSIMTEST },
+	{ "ngff_cardem",	"ngff-cardem",			USB_PRODUCT_NGFF_CARDEM },
+};
+
+static const struct fu_board *board_by_product(const char *product_string, uint16_t product_id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(boards); i++) {
+		if (!strcmp(boards[i].product_string, product_string))
+			return &boards[i];
+	}
+	/* the string couldn't be read: the product IDs are unique, too */
+	for (i = 0; i < ARRAY_SIZE(boards); i++) {
+		if (boards[i].product_id == product_id)
+			return &boards[i];
+	}
+	return NULL;
+}
+
+/* application of the firmware, by the subclass of its SIMtrace interface */
+static const char *app_by_subclass(uint8_t sub_class)
+{
+	switch (sub_class) {
+	case SIMTRACE_SNIFFER_USB_SUBCLASS:
+		return "trace";
+	case SIMTRACE_CARDEM_USB_SUBCLASS:
+		return "cardem";
+	default:
+		return NULL;
+	}
+}
+
+/* a firmware image <board>-<app>-dfu.bin, as built in firmware/bin */
+struct fu_image {
+	struct llist_head list;
+	char path[PATH_MAX];
+	uint8_t *data;
+	size_t len;
+	/* CRC the crc stub checks at boot, and the application reports */
+	uint32_t crc;
+};
+
+static LLIST_HEAD(images);
+static const char *image_dir = ".";
+
+static struct fu_image *image_get(const struct fu_board *board, const char *app)
+{
+	struct fu_image *img;
+	char path[PATH_MAX];
+	FILE *f;
+	long len;
+
+	snprintf(path, sizeof(path), "%s/%s-%s-dfu.bin", image_dir, board->name, app);
+	llist_for_each_entry(img, &images, list) {
+		if (!strcmp(img->path, path))
+			return img;
+	}
+
+	f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "can't open image %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	fseek(f, 0, SEEK_SET);
+	if (len < 512 || len > 256 * 1024) {
+		fprintf(stderr, "image %s: invalid size %ld\n", path, len);
+		fclose(f);
+		return NULL;
+	}
+
+	img = talloc_zero(NULL, struct fu_image);
+	OSMO_STRLCPY_ARRAY(img->path, path);
+	img->len = len;
+	img->data = talloc_size(img, len);
+	if (fread(img->data, 1, len, f) != len) {
+		fprintf(stderr, "can't read image %s\n", path);
+		fclose(f);
+		talloc_free(img);
+		return NULL;
+	}
+	fclose(f);
+
+	/* only images patched by crctool carry the CRC; the bootloader refuses others */
+	if (osmo_load32le(img->data + IMG_START_WORD * 4) != IMG_CRC_START) {
+		fprintf(stderr, "image %s: no CRC table, not a DFU image?\n", path);
+		talloc_free(img);
+		return NULL;
+	}
+	img->crc = osmo_load32le(img->data + IMG_CRC_WORD * 4);
+
+	llist_add_tail(&img->list, &images);
+	return img;
+}
+
+/***********************************************************************
+ * One board, and its update
+ ***********************************************************************/
+
+enum fu_dev_state {
+	/* reading the board information of the running application */
+	FU_S_INFO,
+	/* asking the application to switch to the bootloader */
+	FU_S_DETACH,
+	/* waiting for the bootloader to enumerate */
+	FU_S_WAIT_DFU,
+	/* downloading the image, block by block */
+	FU_S_DNLOAD,
+	/* the bootloader verifies the image it wrote */
+	FU_S_MANIFEST,
+	/* waiting for the new application to enumerate */
+	FU_S_WAIT_APP,
+	/* reading the board information of the new application */
+	FU_S_VERIFY,
+	FU_S_DONE,
+};
+
+static const struct value_string fu_dev_state_names[] = {
+	{ FU_S_INFO,		"INFO" },
+	{ FU_S_DETACH,		"DETACH" },
+	{ FU_S_WAIT_DFU,	"WAIT_DFU" },
+	{ FU_S_DNLOAD,		"DNLOAD" },
+	{ FU_S_MANIFEST,	"MANIFEST" },
+	{ FU_S_WAIT_APP,	"WAIT_APP" },
+	{ FU_S_VERIFY,		"VERIFY" },
+	{ FU_S_DONE,		"DONE" },
+	{ 0, NULL }
+};
+
+struct fu_dev {
+	struct llist_head list;
+	/* USB path: stays the same while the board enumerates in the other mode */
+	char path[USB_MAX_PATH_LEN];
+	uint16_t product_id;
+	const struct fu_board *board;
+	const char *app;
+	const struct fu_image *img;
+
+	enum fu_dev_state state;
+	libusb_device_handle *devh;
+	struct libusb_transfer *xfer;
+	/* interface the requests go to: SIMtrace or DFU interface */
+	uint8_t if_num;
+	/* DFU runtime interface of the application */
+	int dfu_rt_if;
+	uint8_t ep_out, ep_in;
+	uint8_t buf[LIBUSB_CONTROL_SETUP_SIZE + DFU_MAX_TRANSFER_SIZE];
+
+	/* board information */
+	unsigned int info_skipped;
+	bool old_crc_valid;
+	uint32_t old_crc;
+	bool new_crc_valid;
+	uint32_t new_crc;
+
+	/* download */
+	uint8_t last_req;
+	uint16_t transfer_size;
+	size_t offset;
+	uint16_t block;
+	unsigned int polls;
+	struct osmo_timer_list poll_timer;
+
+	/* time the update started, the current phase started, and the wait ends */
+	struct timespec t_start, t_phase;
+	unsigned int wait_ms;
+	unsigned int ms_detach, ms_dnload, ms_manifest, ms_reboot;
+
+	/* NULL while in progress */
+	const char *result;
+	bool failed;
+};
+
+static LLIST_HEAD(devs);
+static unsigned int num_running;
+static bool force, list_only;
+static const char *app_override;
+static struct osmo_timer_list scan_timer;
+
+static unsigned int ms_since(const struct timespec *t)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - t->tv_sec) * 1000 + (now.tv_nsec - t->tv_nsec) / 1000000;
+}
+
+/* end of a phase: returns its duration, and starts the next one */
+static unsigned int phase_end(struct fu_dev *fd)
+{
+	unsigned int ms = ms_since(&fd->t_phase);
+
+	clock_gettime(CLOCK_MONOTONIC, &fd->t_phase);
+	return ms;
+}
+
+static void fu_close(struct fu_dev *fd)
+{
+	if (!fd->devh)
+		return;
+	libusb_close(fd->devh);
+	fd->devh = NULL;
+}
+
+static void fu_finish(struct fu_dev *fd, bool failed, const char *fmt, ...)
+{
+	char buf[128];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(buf, sizeof(buf), fmt, ap);
+	va_end(ap);
+
+	osmo_timer_del(&fd->poll_timer);
+	fu_close(fd);
+	fd->result = talloc_strdup(fd, buf);
+	fd->failed = failed;
+	if (failed)
+		fprintf(stderr, "%s: %s failed: %s\n", fd->path,
+			get_value_string(fu_dev_state_names, fd->state), buf);
+	fd->state = FU_S_DONE;
+	num_running--;
+}
+
+static void fu_wait(struct fu_dev *fd, enum fu_dev_state state)
+{
+	fu_close(fd);
+	fd->state = state;
+	fd->wait_ms = ENUM_TIMEOUT_MS;
+	if (!osmo_timer_pending(&scan_timer))
+		osmo_timer_schedule(&scan_timer, 0, SCAN_INTERVAL_MS * 1000);
+}
+
+static void xfer_cb(struct libusb_transfer *xfer);
+
+static int fu_submit_ctrl(struct fu_dev *fd, uint8_t req_type, uint8_t req, uint16_t value,
+			  uint16_t index, const uint8_t *data, uint16_t len)
+{
+	libusb_fill_control_setup(fd->buf, req_type, req, value, index, len);
+	if (data && len)
+		memcpy(fd->buf + LIBUSB_CONTROL_SETUP_SIZE, data, len);
+	libusb_fill_control_transfer(fd->xfer, fd->devh, fd->buf, xfer_cb, fd, CTRL_TIMEOUT_MS);
+	fd->last_req = req;
+	return libusb_submit_transfer(fd->xfer);
+}
+
+static int fu_submit_bulk(struct fu_dev *fd, uint8_t ep, unsigned int len, unsigned int timeout_ms)
+{
+	libusb_fill_bulk_transfer(fd->xfer, fd->devh, ep, fd->buf, len, xfer_cb, fd, timeout_ms);
+	return libusb_submit_transfer(fd->xfer);
+}
+
+static int dfu_getstatus(struct fu_dev *fd)
+{
+	return fu_submit_ctrl(fd, LIBUSB_ENDPOINT_IN | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+			      DFU_GETSTATUS, 0, fd->if_num, NULL, 6);
+}
+
+static int dfu_clrstatus(struct fu_dev *fd)
+{
+	return fu_submit_ctrl(fd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+			      DFU_CLRSTATUS, 0, fd->if_num, NULL, 0);
+}
+
+/* next block of the image; the zero-length block after the last one ends the download */
+static int dfu_dnload_next(struct fu_dev *fd)
+{
+	uint16_t len = OSMO_MIN(fd->img->len - fd->offset, fd->transfer_size);
+
+	if (!len) {
+		fd->ms_dnload = phase_end(fd);
+		fd->state = FU_S_MANIFEST;
+		fd->polls = 0;
+	}
+	return fu_submit_ctrl(fd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+			      DFU_DNLOAD, fd->block, fd->if_num, fd->img->data + fd->offset, len);
+}
+
+static int board_info_request(struct fu_dev *fd)
+{
+	struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *) fd->buf;
+
+	memset(sh, 0, sizeof(*sh));
+	sh->msg_class = SIMTRACE_MSGC_GENERIC;
+	sh->msg_type = SIMTRACE_CMD_BD_BOARD_INFO;
+	sh->msg_len = sizeof(*sh);
+	fd->info_skipped = 0;
+	return fu_submit_bulk(fd, fd->ep_out, sizeof(*sh), CTRL_TIMEOUT_MS);
+}
+
+/* the board information has been read, or not (info == NULL) */
+static void board_info_done(struct fu_dev *fd, const struct osmo_st2_board_info *info)
+{
+	int rc;
+
+	if (fd->state == FU_S_VERIFY) {
+		fd->ms_reboot = phase_end(fd);
+		if (!info) {
+			fu_finish(fd, true, "no board information from the new firmware");
+			return;
+		}
+		fd->new_crc = info->info.software.crc;
+		fd->new_crc_valid = true;
+		if (fd->new_crc != fd->img->crc)
+			fu_finish(fd, true, "running CRC %08x, expected %08x", fd->new_crc, fd->img->crc);
+		else
+			fu_finish(fd, false, "updated");
+		return;
+	}
+
+	/* older firmware doesn't answer, or reports no CRC */
+	if (info && info->info.software.crc) {
+		fd->old_crc_valid = true;
+		fd->old_crc = info->info.software.crc;
+	}
+	if (list_only) {
+		fu_finish(fd, false, fd->old_crc_valid && fd->old_crc == fd->img->crc ?
+			  "up to date" : "to be updated");
+		return;
+	}
+	if (!force && fd->old_crc_valid && fd->old_crc == fd->img->crc) {
+		fu_finish(fd, false, "up to date");
+		return;
+	}
+	if (fd->dfu_rt_if < 0) {
+		fu_finish(fd, true, "no DFU runtime interface");
+		return;
+	}
+
+	/* the time to switch to the bootloader starts now */
+	phase_end(fd);
+	fd->state = FU_S_DETACH;
+	rc = libusb_claim_interface(fd->devh, fd->dfu_rt_if);
+	if (rc == 0)
+		rc = fu_submit_ctrl(fd, LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_CLASS | LIBUSB_RECIPIENT_INTERFACE,
+				    DFU_DETACH, 1000, fd->dfu_rt_if, NULL, 0);
+	if (rc < 0)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+static void board_info_rx(struct fu_dev *fd, const uint8_t *buf, unsigned int len)
+{
+	const struct simtrace_msg_hdr *sh = (const struct simtrace_msg_hdr *) buf;
+	struct osmo_st2_board_info info;
+	int rc;
+
+	if (len >= sizeof(*sh) && sh->msg_class == SIMTRACE_MSGC_GENERIC &&
+	    sh->msg_type == SIMTRACE_CMD_BD_BOARD_INFO &&
+	    osmo_st2_board_info_decode(&info, buf + sizeof(*sh), len - sizeof(*sh)) == 0) {
+		board_info_done(fd, &info);
+		return;
+	}
+
+	/* an application in card emulation may have something else to say first */
+	if (++fd->info_skipped > BOARD_INFO_MAX_SKIP) {
+		board_info_done(fd, NULL);
+		return;
+	}
+	rc = fu_submit_bulk(fd, fd->ep_in, sizeof(fd->buf), BOARD_INFO_TIMEOUT_MS);
+	if (rc < 0)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+static void poll_timer_cb(void *data)
+{
+	struct fu_dev *fd = data;
+	int rc;
+
+	rc = dfu_getstatus(fd);
+	if (rc < 0)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+/* answer of DFU_GETSTATUS: bStatus, bwPollTimeout[3], bState, iString */
+static int dfu_status_rx(struct fu_dev *fd, const uint8_t *st)
+{
+	unsigned int poll_ms = st[1] | (st[2] << 8) | (st[3] << 16);
+	uint8_t status = st[0], state = st[4];
+
+	if (state == DFU_STATE_dfuERROR) {
+		if (fd->state == FU_S_MANIFEST) {
+			fd->ms_manifest = phase_end(fd);
+			fu_finish(fd, true, status == DFU_STATUS_errVERIFY ?
+				  "image CRC verification failed" : "DFU status %u", status);
+			return 0;
+		}
+		/* left over from an earlier attempt */
+		if (fd->offset == 0 && fd->last_req == DFU_GETSTATUS && fd->polls++ < 1)
+			return dfu_clrstatus(fd);
+		fu_finish(fd, true, "DFU status %u at offset %zu", status, fd->offset);
+		return 0;
+	}
+	if (status != DFU_STATUS_OK) {
+		fu_finish(fd, true, "DFU status %u in state %u", status, state);
+		return 0;
+	}
+
+	switch (state) {
+	case DFU_STATE_dfuIDLE:
+		if (fd->state == FU_S_MANIFEST) {
+			/* the bootloader wrote and verified the image: a bus reset
+			 * starts the new application */
+			fd->ms_manifest = phase_end(fd);
+			libusb_reset_device(fd->devh);
+			fu_wait(fd, FU_S_WAIT_APP);
+			return 0;
+		}
+		/* fall through */
+	case DFU_STATE_dfuDNLOAD_IDLE:
+		if (fd->state == FU_S_DNLOAD)
+			return dfu_dnload_next(fd);
+		break;
+	case DFU_STATE_dfuDNLOAD_SYNC:
+	case DFU_STATE_dfuDNBUSY:
+	case DFU_STATE_dfuMANIFEST_SYNC:
+	case DFU_STATE_dfuMANIFEST:
+		if (fd->state == FU_S_MANIFEST && fd->polls++ > MANIFEST_MAX_POLLS)
+			break;
+		/* the bootloader is still writing the flash */
+		osmo_timer_schedule(&fd->poll_timer, poll_ms / 1000, (poll_ms % 1000) * 1000);
+		return 0;
+	default:
+		break;
+	}
+
+	fu_finish(fd, true, "unexpected DFU state %u", state);
+	return 0;
+}
+
+static void xfer_cb(struct libusb_transfer *xfer)
+{
+	struct fu_dev *fd = xfer->user_data;
+	const uint8_t *data;
+	int rc = 0;
+
+	if (xfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		switch (fd->state) {
+		case FU_S_DETACH:
+			/* the application may be gone before the status stage */
+			break;
+		case FU_S_INFO:
+		case FU_S_VERIFY:
+			if (xfer->status == LIBUSB_TRANSFER_TIMED_OUT) {
+				board_info_done(fd, NULL);
+				return;
+			}
+			/* fall through */
+		default:
+			fu_finish(fd, true, "USB transfer status %d", xfer->status);
+			return;
+		}
+	}
+
+	switch (fd->state) {
+	case FU_S_INFO:
+	case FU_S_VERIFY:
+		if (xfer->endpoint == fd->ep_out)
+			rc = fu_submit_bulk(fd, fd->ep_in, sizeof(fd->buf), BOARD_INFO_TIMEOUT_MS);
+		else
+			board_info_rx(fd, xfer->buffer, xfer->actual_length);
+		break;
+	case FU_S_DETACH:
+		fu_wait(fd, FU_S_WAIT_DFU);
+		break;
+	case FU_S_DNLOAD:
+	case FU_S_MANIFEST:
+		data = libusb_control_transfer_get_data(xfer);
+		switch (fd->last_req) {
+		case DFU_DNLOAD:
+			fd->offset += xfer->actual_length;
+			fd->block++;
+			/* fall through */
+		case DFU_CLRSTATUS:
+			rc = dfu_getstatus(fd);
+			break;
+		case DFU_GETSTATUS:
+			if (xfer->actual_length < 6) {
+				fu_finish(fd, true, "short DFU status");
+				return;
+			}
+			rc = dfu_status_rx(fd, data);
+			break;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (rc < 0 && fd->state != FU_S_DONE)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+/* wTransferSize of the DFU functional descriptor of the interface */
+static uint16_t dfu_transfer_size(libusb_device *dev, uint8_t if_num, uint8_t altsetting)
+{
+	const struct libusb_interface_descriptor *intf;
+	struct libusb_config_descriptor *cfg;
+	uint16_t size = DFU_DEFAULT_TRANSFER_SIZE;
+	const uint8_t *p;
+	int len;
+
+	if (libusb_get_active_config_descriptor(dev, &cfg) < 0)
+		return size;
+	if (if_num >= cfg->bNumInterfaces || altsetting >= cfg->interface[if_num].num_altsetting)
+		goto out;
+	intf = &cfg->interface[if_num].altsetting[altsetting];
+	for (p = intf->extra, len = intf->extra_length; len >= 2 && p[0] >= 2 && p[0] <= len;
+	     len -= p[0], p += p[0]) {
+		if (p[1] == USB_DT_DFU && p[0] >= 7) {
+			size = p[5] | (p[6] << 8);
+			break;
+		}
+	}
+out:
+	libusb_free_config_descriptor(cfg);
+	return OSMO_MIN(OSMO_MAX(size, 1), DFU_MAX_TRANSFER_SIZE);
+}
+
+/* the bootloader enumerated: open its DFU interface, and start the download */
+static void fu_start_dnload(struct fu_dev *fd, const struct usb_interface_match *m)
+{
+	struct usb_interface_match ifm = *m;
+	int rc;
+
+	fd->ms_detach = phase_end(fd);
+	fd->devh = osmo_libusb_open_claim_interface(NULL, NULL, &ifm);
+	if (!fd->devh) {
+		fu_finish(fd, true, "can't open the bootloader: %s", strerror(errno));
+		return;
+	}
+	rc = libusb_set_interface_alt_setting(fd->devh, m->interface, m->altsetting);
+	if (rc < 0) {
+		fu_finish(fd, true, "can't select the flash partition: %s", libusb_error_name(rc));
+		return;
+	}
+
+	fd->state = FU_S_DNLOAD;
+	fd->if_num = m->interface;
+	fd->transfer_size = dfu_transfer_size(libusb_get_device(fd->devh), m->interface, m->altsetting);
+	fd->offset = 0;
+	fd->block = 0;
+	fd->polls = 0;
+	rc = dfu_getstatus(fd);
+	if (rc < 0)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+/* the application enumerated: open its SIMtrace interface, and ask for the board information */
+static void fu_start_info(struct fu_dev *fd, const struct usb_interface_match *m, enum fu_dev_state state)
+{
+	struct usb_interface_match ifm = *m;
+	uint8_t irq;
+	int rc;
+
+	fd->devh = osmo_libusb_open_claim_interface(NULL, NULL, &ifm);
+	if (!fd->devh) {
+		fu_finish(fd, true, "can't open the application: %s", strerror(errno));
+		return;
+	}
+	rc = osmo_libusb_get_ep_addrs(fd->devh, m->interface, &fd->ep_out, &fd->ep_in, &irq);
+	if (rc < 0) {
+		fu_finish(fd, true, "can't obtain EP addrs; rc=%d", rc);
+		return;
+	}
+
+	fd->state = state;
+	fd->if_num = m->interface;
+	rc = board_info_request(fd);
+	if (rc < 0)
+		fu_finish(fd, true, "%s", libusb_error_name(rc));
+}
+
+/***********************************************************************
+ * Enumeration
+ ***********************************************************************/
+
+static struct usb_interface_match app_ifm[32], dfu_ifm[32], rt_ifm[32];
+static int num_app_ifm, num_dfu_ifm, num_rt_ifm;
+
+static void scan(void)
+{
+	num_app_ifm = osmo_libusb_find_matching_interfaces(NULL, osmo_st2_compatible_dev_ids,
+							   USB_CLASS_PROPRIETARY, -1, -1,
+							   app_ifm, ARRAY_SIZE(app_ifm));
+	num_dfu_ifm = osmo_libusb_find_matching_interfaces(NULL, osmo_st2_compatible_dev_ids,
+							   USB_CLASS_DFU, USB_SUBCLASS_DFU, USB_PROTOCOL_DFU_MODE,
+							   dfu_ifm, ARRAY_SIZE(dfu_ifm));
+	num_rt_ifm = osmo_libusb_find_matching_interfaces(NULL, osmo_st2_compatible_dev_ids,
+							  USB_CLASS_DFU, USB_SUBCLASS_DFU, USB_PROTOCOL_DFU_RUNTIME,
+							  rt_ifm, ARRAY_SIZE(rt_ifm));
+	num_app_ifm = OSMO_MAX(num_app_ifm, 0);
+	num_dfu_ifm = OSMO_MAX(num_dfu_ifm, 0);
+	num_rt_ifm = OSMO_MAX(num_rt_ifm, 0);
+}
+
+/* SIMtrace interface of the application at the path; the first one if there are several */
+static const struct usb_interface_match *find_app(const char *path)
+{
+	int i;
+
+	for (i = 0; i < num_app_ifm; i++) {
+		if (!strcmp(app_ifm[i].path, path) && app_by_subclass(app_ifm[i].sub_class))
+			return &app_ifm[i];
+	}
+	return NULL;
+}
+
+/* DFU interface of the bootloader at the path, with the flash partition selected */
+static const struct usb_interface_match *find_dfu(const char *path)
+{
+	int i;
+
+	for (i = 0; i < num_dfu_ifm; i++) {
+		if (!strcmp(dfu_ifm[i].path, path) && dfu_ifm[i].altsetting == DFU_ALT_FLASH)
+			return &dfu_ifm[i];
+	}
+	return NULL;
+}
+
+static int find_rt_if(const char *path)
+{
+	int i;
+
+	for (i = 0; i < num_rt_ifm; i++) {
+		if (!strcmp(rt_ifm[i].path, path))
+			return rt_ifm[i].interface;
+	}
+	return -1;
+}
+
+static void scan_timer_cb(void *data)
+{
+	const struct usb_interface_match *m;
+	struct fu_dev *fd;
+	bool waiting = false;
+
+	scan();
+	llist_for_each_entry(fd, &devs, list) {
+		switch (fd->state) {
+		case FU_S_WAIT_DFU:
+			m = find_dfu(fd->path);
+			if (m)
+				fu_start_dnload(fd, m);
+			break;
+		case FU_S_WAIT_APP:
+			m = find_app(fd->path);
+			if (m)
+				fu_start_info(fd, m, FU_S_VERIFY);
+			break;
+		default:
+			continue;
+		}
+		if (fd->state != FU_S_WAIT_DFU && fd->state != FU_S_WAIT_APP)
+			continue;
+		if (ms_since(&fd->t_phase) > fd->wait_ms) {
+			fu_finish(fd, true, "board didn't enumerate within %u ms", fd->wait_ms);
+			continue;
+		}
+		waiting = true;
+	}
+
+	if (waiting)
+		osmo_timer_schedule(&scan_timer, 0, SCAN_INTERVAL_MS * 1000);
+}
+
+static struct fu_dev *dev_find(const char *path)
+{
+	struct fu_dev *fd;
+
+	llist_for_each_entry(fd, &devs, list) {
+		if (!strcmp(fd->path, path))
+			return fd;
+	}
+	return NULL;
+}
+
+/* a board found at startup, in either mode */
+static void dev_add(const struct usb_interface_match *m, bool dfu_mode)
+{
+	libusb_device_handle *devh;
+	struct libusb_device_descriptor desc;
+	char product[64] = "";
+	struct fu_dev *fd;
+
+	if (dev_find(m->path))
+		return;
+
+	if (libusb_get_device_descriptor(m->usb_dev, &desc) == 0 && desc.iProduct &&
+	    libusb_open(m->usb_dev, &devh) == 0) {
+		if (libusb_get_string_descriptor_ascii(devh, desc.iProduct, (unsigned char *) product,
+						       sizeof(product)) < 0)
+			product[0] = '\0';
+		libusb_close(devh);
+	}
+
+	fd = talloc_zero(NULL, struct fu_dev);
+	OSMO_STRLCPY_ARRAY(fd->path, m->path);
+	fd->product_id = m->product;
+	fd->dfu_rt_if = find_rt_if(m->path);
+	osmo_timer_setup(&fd->poll_timer, poll_timer_cb, fd);
+	fd->xfer = libusb_alloc_transfer(0);
+	OSMO_ASSERT(fd->xfer);
+	clock_gettime(CLOCK_MONOTONIC, &fd->t_start);
+	fd->t_phase = fd->t_start;
+	llist_add_tail(&fd->list, &devs);
+	num_running++;
+
+	fd->board = board_by_product(product, m->product);
+	if (!fd->board) {
+		fu_finish(fd, true, "unknown board '%s'", product);
+		return;
+	}
+	fd->app = app_override ? app_override : dfu_mode ? NULL : app_by_subclass(m->sub_class);
+	if (!fd->app) {
+		fu_finish(fd, true, "in DFU mode: specify the application with -a");
+		return;
+	}
+	fd->img = image_get(fd->board, fd->app);
+	if (!fd->img) {
+		fu_finish(fd, true, "no image");
+		return;
+	}
+
+	if (dfu_mode) {
+		if (list_only) {
+			fu_finish(fd, false, "in DFU mode");
+			return;
+		}
+		fu_start_dnload(fd, m);
+	} else {
+		fu_start_info(fd, m, FU_S_INFO);
+	}
+}
+
+static void print_summary(void)
+{
+	unsigned int num_failed = 0, num_updated = 0;
+	struct fu_dev *fd;
+	char old_crc[9], new_crc[9];
+
+	printf("\n%-12s %-12s %-7s %-8s %-8s %7s %7s %7s %7s %7s  %s\n",
+	       "path", "board", "app", "old crc", "new crc", "detach", "dnload", "verify",
+	       "reboot", "total", "result");
+	llist_for_each_entry(fd, &devs, list) {
+		if (fd->old_crc_valid)
+			snprintf(old_crc, sizeof(old_crc), "%08x", fd->old_crc);
+		else
+			OSMO_STRLCPY_ARRAY(old_crc, "-");
+		/* as reported by the firmware running after the update */
+		if (fd->new_crc_valid)
+			snprintf(new_crc, sizeof(new_crc), "%08x", fd->new_crc);
+		else
+			OSMO_STRLCPY_ARRAY(new_crc, "-");
+		printf("%-12s %-12s %-7s %-8s %-8s %7u %7u %7u %7u %7u  %s\n",
+		       fd->path, fd->board ? fd->board->name : "?", fd->app ? fd->app : "?",
+		       old_crc, new_crc, fd->ms_detach, fd->ms_dnload,
+		       fd->ms_manifest, fd->ms_reboot, ms_since(&fd->t_start), fd->result);
+		if (fd->failed)
+			num_failed++;
+		else if (!strcmp(fd->result, "updated"))
+			num_updated++;
+	}
+	printf("%u board(s): %u updated, %u failed\n", llist_count(&devs), num_updated, num_failed);
+}
+
+static void print_welcome(void)
+{
+	printf("simtrace2-fleet-update - update the firmware of all attached boards\n");
+}
+
+static void print_help(void)
+{
+	printf( "simtrace2-fleet-update [OPTIONS]\n\n");
+	printf( "Options:\n"
+		"\t-h\t--help\n"
+		"\t-d\t--image-dir\tDIR\tdirectory of the <board>-<app>-dfu.bin images (default: .)\n"
+		"\t-a\t--app\t\tAPP\tapplication to flash (default: the running one)\n"
+		"\t-f\t--force\t\t\tflash boards already running the image\n"
+		"\t-l\t--list\t\t\tonly list the boards, and whether they need an update\n"
+		"\n"
+		);
+}
+
+static const struct option opts[] = {
+	{ "help", 0, 0, 'h' },
+	{ "image-dir", 1, 0, 'd' },
+	{ "app", 1, 0, 'a' },
+	{ "force", 0, 0, 'f' },
+	{ "list", 0, 0, 'l' },
+	{ NULL, 0, 0, 0 }
+};
+
+static struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	struct fu_dev *fd;
+	int i, rc;
+
+	while (1) {
+		int option_index = 0;
+
+		int c = getopt_long(argc, argv, "hd:a:fl", opts, &option_index);
+		if (c == -1)
+			break;
+		switch (c) {
+		case 'h':
+			print_help();
+			exit(0);
+			break;
+		case 'd':
+			image_dir = optarg;
+			break;
+		case 'a':
+			app_override = optarg;
+			break;
+		case 'f':
+			force = true;
+			break;
+		case 'l':
+			list_only = true;
+			break;
+		default:
+			print_help();
+			exit(2);
+		}
+	}
+
+	print_welcome();
+
+	osmo_init_logging2(NULL, &log_info);
+	rc = osmo_libusb_init(NULL);
+	if (rc < 0) {
+		fprintf(stderr, "libusb initialization failed\n");
+		exit(1);
+	}
+	osmo_timer_setup(&scan_timer, scan_timer_cb, NULL);
+
+	scan();
+	for (i = 0; i < num_app_ifm; i++) {
+		if (app_by_subclass(app_ifm[i].sub_class))
+			dev_add(&app_ifm[i], false);
+	}
+	for (i = 0; i < num_dfu_ifm; i++) {
+		if (dfu_ifm[i].altsetting == DFU_ALT_FLASH)
+			dev_add(&dfu_ifm[i], true);
+	}
+	if (llist_empty(&devs)) {
+		fprintf(stderr, "No compatible USB devices found\n");
+		osmo_libusb_exit(NULL);
+		exit(1);
+	}
+	printf("%u board(s) found\n", llist_count(&devs));
+
+	while (num_running)
+		osmo_select_main(0);
+
+	print_summary();
+
+	rc = 0;
+	llist_for_each_entry(fd, &devs, list) {
+		libusb_free_transfer(fd->xfer);
+		if (fd->failed)
+			rc = 1;
+	}
+	osmo_libusb_exit(NULL);
+	return rc;
+}
@@ -36,8 +36,10 @@
 #include <osmocom/usb/libusb.h>
 #include <osmocom/simtrace2/simtrace_usb.h>
 #include <osmocom/simtrace2/simtrace_prot.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
 
 #include <osmocom/simtrace2/gsmtap.h>
+#include <osmocom/simtrace2/apdu_dispatch.h>
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/socket.h>
@@ -110,6 +112,10 @@ static const uint16_t fi_table[] = { 372, 372, 558, 744, 1116, 1488, 1860, 0, 0,
 /* Table 8 from ISO 7816-3:2006 */
 static const uint8_t di_table[] = { 0, 1, 2, 4, 8, 16, 32, 64, 12, 20, 2, 4, 8, 16, 32, 64, };
 
+/* current F/D, to print the etu along with the clock */
+static uint16_t cur_fi = 372;
+static uint8_t cur_di = 1;
+
 static int process_fidi(const uint8_t *buf, int len)
 {
 	/* check if there is enough data for the structure */
@@ -119,9 +125,135 @@ static int process_fidi(const uint8_t *buf, int len)
 	struct sniff_fidi *fidi = (struct sniff_fidi *)buf;
 
 	printf("Fi/Di switched to %u/%u\n", fi_table[fidi->fidi>>4], di_table[fidi->fidi&0x0f]);
+	if (fi_table[fidi->fidi>>4] && di_table[fidi->fidi&0x0f]) {
+		cur_fi = fi_table[fidi->fidi>>4];
+		cur_di = di_table[fidi->fidi&0x0f];
+	}
+	return 0;
+}
+
+static int process_clk(const uint8_t *buf, int len)
+{
+	const struct sniff_clk *clk = (const struct sniff_clk *) buf;
+
+	if (len < sizeof(*clk))
+		return -1;
+
+	if (!clk->hz) {
+		printf("CLK stopped (%u times)\n", clk->stops);
+		return 0;
+	}
+	printf("CLK %u Hz (stopped %u times), etu %.2f us\n", clk->hz, clk->stops,
+	       1e6 * cur_fi / cur_di / clk->hz);
 	return 0;
 }
 
+/* T=1: APDU reassembled from the information fields of (chained) I-blocks.  The
+ * direction of a block can't be told from the line, but the command of the reader
+ * and the response of the card alternate, both ending with a block without M-bit. */
+static struct {
+	/* the command is complete, the blocks are the ones of the response */
+	bool rsp;
+	/* N(S) of the last I-block of the reader and of the card, or -1 */
+	int ns[2];
+	uint8_t capdu[4 + 3 + OSMO_APDU_MAX_DATA_LEN + 2];
+	unsigned int capdu_len;
+	uint8_t rapdu[OSMO_APDU_MAX_DATA_LEN + 2];
+	unsigned int rapdu_len;
+} g_t1 = {
+	.ns = { -1, -1 },
+};
+
+static void t1_reset(void)
+{
+	g_t1.rsp = false;
+	g_t1.ns[0] = g_t1.ns[1] = -1;
+	g_t1.capdu_len = g_t1.rapdu_len = 0;
+}
+
+/* send the reassembled APDU as GSMTAP, in the TPDU format of T=0 also used for SIMTRACE_MSGT_SNIFF_TPDU:
+ * header, command data, response data and status word.  An APDU with extended Lc/Le fields has no
+ * such format, it is sent as a whole, followed by the response */
+static void t1_send_apdu(void)
+{
+	/* static, as the extended length APDUs make them large */
+	static struct osmo_apdu_context ac;
+	static uint8_t buf[sizeof(g_t1.capdu) + sizeof(g_t1.rapdu)];
+	unsigned int len = 0;
+
+	if (g_t1.rapdu_len < 2)
+		return;
+	if (osmo_apdu_parse_capdu(&ac, g_t1.capdu, g_t1.capdu_len) < 0) {
+		printf("T=1 APDU of unsupported format: %s\n", osmo_hexdump(g_t1.capdu, g_t1.capdu_len));
+		return;
+	}
+	if (ac.extended) {
+		memcpy(buf, g_t1.capdu, g_t1.capdu_len);
+		len += g_t1.capdu_len;
+	} else {
+		memcpy(buf, &ac.hdr, sizeof(ac.hdr));
+		len += sizeof(ac.hdr);
+		memcpy(buf + len, ac.dc, ac.lc.tot);
+		len += ac.lc.tot;
+	}
+	memcpy(buf + len, g_t1.rapdu, g_t1.rapdu_len);
+	len += g_t1.rapdu_len;
+
+	printf("APDU: %s\n", osmo_hexdump(buf, len));
+	osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, buf, len);
+}
+
+static void t1_process_block(const uint8_t *blk, unsigned int len)
+{
+	uint8_t pcb;
+	int ns;
+	unsigned int dir;
+	uint8_t *apdu;
+	unsigned int *apdu_len, apdu_size;
+
+	if (len < 3 || len < 3 + blk[2])
+		return;
+	pcb = blk[1];
+	/* R- and S-blocks carry no APDU data */
+	if (pcb & 0x80)
+		return;
+
+	dir = g_t1.rsp ? 1 : 0;
+	ns = (pcb >> 6) & 1;
+	if (g_t1.ns[dir] == ns) {
+		printf("T=1 I-block repeated\n");
+		return;
+	}
+	g_t1.ns[dir] = ns;
+
+	if (g_t1.rsp) {
+		apdu = g_t1.rapdu;
+		apdu_len = &g_t1.rapdu_len;
+		apdu_size = sizeof(g_t1.rapdu);
+	} else {
+		apdu = g_t1.capdu;
+		apdu_len = &g_t1.capdu_len;
+		apdu_size = sizeof(g_t1.capdu);
+	}
+	if (*apdu_len + blk[2] > apdu_size) {
+		printf("T=1 APDU too long\n");
+		t1_reset();
+		return;
+	}
+	memcpy(apdu + *apdu_len, blk + 3, blk[2]);
+	*apdu_len += blk[2];
+
+	/* more blocks of the chain are following */
+	if (pcb & 0x20)
+		return;
+
+	if (g_t1.rsp) {
+		t1_send_apdu();
+		g_t1.capdu_len = g_t1.rapdu_len = 0;
+	}
+	g_t1.rsp = !g_t1.rsp;
+}
+
 static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, int len)
 {
 	/* check if there is enough data for the structure */
@@ -136,7 +268,8 @@ static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, i
 	}
 
 	/* check type */
-	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS && type != SIMTRACE_MSGT_SNIFF_TPDU) {
+	if (type != SIMTRACE_MSGT_SNIFF_ATR && type != SIMTRACE_MSGT_SNIFF_PPS &&
+	    type != SIMTRACE_MSGT_SNIFF_TPDU && type != SIMTRACE_MSGT_SNIFF_BLOCK) {
 		return -3;
 	}
 
@@ -151,6 +284,9 @@ static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, i
 	case SIMTRACE_MSGT_SNIFF_TPDU:
 		printf("TPDU");
 		break;
+	case SIMTRACE_MSGT_SNIFF_BLOCK:
+		printf("BLOCK");
+		break;
 	default:
 		printf("???");
 		break;
@@ -171,11 +307,18 @@ static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, i
 	switch (type) {
 	case SIMTRACE_MSGT_SNIFF_ATR:
 		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_ATR, data->data, data->length);
+		t1_reset();
 		break;
 	case SIMTRACE_MSGT_SNIFF_TPDU:
 		/* TPDU is now considered as APDU since SIMtrace sends complete TPDU */
 		osmo_st2_gsmtap_send_apdu(GSMTAP_SIM_APDU, data->data, data->length);
 		break;
+	case SIMTRACE_MSGT_SNIFF_BLOCK:
+		/* APDUs are formed by the information fields of one or more blocks.  Erroneous
+		 * blocks are skipped, the reader or card will ask for their retransmission */
+		if (!data->flags)
+			t1_process_block(data->data, data->length);
+		break;
 	default:
 		break;
 	}
@@ -183,6 +326,21 @@ static int process_data(enum simtrace_msg_type_sniff type, const uint8_t *buf, i
 	return 0;
 }
 
+/*! \brief Print the board information of the SIMtrace2 */
+static void process_board_info(const uint8_t *buf, int len)
+{
+	struct osmo_st2_board_info bi;
+
+	if (osmo_st2_board_info_decode(&bi, buf, len) < 0) {
+		printf("truncated board information\n");
+		return;
+	}
+	printf("Firmware: %s %s %s, capabilities 0x%08x\n", bi.info.hardware.model,
+	       bi.info.software.name, bi.info.software.version, bi.cap_generic);
+	if (bi.cap_generic & (1 << SIMTRACE_CAP_BOOT_TIME))
+		printf("Ready %u ms after reset (target %u ms)\n", bi.boot.ready, bi.boot.ready_target);
+}
+
 /*! \brief Process an incoming message from the SIMtrace2 */
 static int process_usb_msg(const uint8_t *buf, int len)
 {
@@ -198,6 +356,12 @@ static int process_usb_msg(const uint8_t *buf, int len)
 	}
 	//printf("msg: %s\n", osmo_hexdump(buf, msg_hdr->msg_len));
 
+	if (msg_hdr->msg_class == SIMTRACE_MSGC_GENERIC &&
+	    msg_hdr->msg_type == SIMTRACE_CMD_BD_BOARD_INFO) {
+		process_board_info(buf + sizeof(*msg_hdr), msg_hdr->msg_len - sizeof(*msg_hdr));
+		return msg_hdr->msg_len;
+	}
+
 	/* check for message class */
 	if (SIMTRACE_MSGC_SNIFF != msg_hdr->msg_class) { /* we only care about sniffing messages */
 		return msg_hdr->msg_len; /* discard non-sniffing messaged */
@@ -213,9 +377,13 @@ static int process_usb_msg(const uint8_t *buf, int len)
 	case SIMTRACE_MSGT_SNIFF_FIDI:
 		process_fidi(buf, len);
 		break;
+	case SIMTRACE_MSGT_SNIFF_CLK:
+		process_clk(buf, len);
+		break;
 	case SIMTRACE_MSGT_SNIFF_ATR:
 	case SIMTRACE_MSGT_SNIFF_PPS:
 	case SIMTRACE_MSGT_SNIFF_TPDU:
+	case SIMTRACE_MSGT_SNIFF_BLOCK:
 		process_data(msg_hdr->msg_type, buf, len);
 		break;
 	default:
@@ -235,6 +403,15 @@ static void run_mainloop()
 	uint8_t buf[16*256];
 	unsigned int i, buf_i = 0;
 	int xfer_len;
+	struct simtrace_msg_hdr req = {
+		.msg_class = SIMTRACE_MSGC_GENERIC,
+		.msg_type = SIMTRACE_CMD_BD_BOARD_INFO,
+		.msg_len = sizeof(req),
+	};
+
+	/* ask for the firmware version; older firmware doesn't read the OUT endpoint */
+	libusb_bulk_transfer(_transp.usb_devh, _transp.usb_ep.out, (uint8_t *) &req,
+			     sizeof(req), &xfer_len, 100);
 
 	printf("Entering main loop\n");
 
@@ -270,6 +447,39 @@ static void run_mainloop()
 	}
 }
 
+/* sniff from the USB socket of a SITL (host) build of the firmware */
+static int run_mainloop_sitl(const char *path)
+{
+	struct osmo_st2_transport transp = { .udp_fd = -1 };
+	struct osmo_st2_slot slot = { .transp = &transp };
+	uint8_t buf[16*256];
+	uint8_t ep;
+	int i, len, processed;
+
+	len = osmo_st2_transport_sock_connect(&transp, path);
+	if (len < 0) {
+		fprintf(stderr, "can't attach to SITL firmware at %s: %s\n", path, strerror(-len));
+		return len;
+	}
+	osmo_st2_request_board_info(&slot);
+
+	printf("Entering main loop\n");
+
+	while ((len = osmo_st2_transport_sock_recv(&transp, &ep, buf, sizeof(buf))) > 0) {
+		if (ep != transp.usb_ep.in)
+			continue;
+		/* each transfer contains complete messages */
+		for (i = 0; i < len; i += processed) {
+			processed = process_usb_msg(&buf[i], len - i);
+			if (processed <= 0)
+				break;
+		}
+	}
+
+	close(transp.udp_fd);
+	return len;
+}
+
 static void print_welcome(void)
 {
 	printf("simtrace2-sniff - Phone-SIM card communication sniffer \n"
@@ -291,6 +501,7 @@ static void print_help(void)
 		"\t-I\t--usb-interface\tINTERFACE_ID\n"
 		"\t-S\t--usb-altsetting ALTSETTING_ID\n"
 		"\t-A\t--usb-address\tADDRESS\n"
+		"\t-U\t--sitl-socket\tPATH\tattach to a SITL firmware build instead of USB\n"
 		"\n"
 		);
 }
@@ -305,6 +516,7 @@ static const struct option opts[] = {
 	{ "usb-interface", 1, 0, 'I' },
 	{ "usb-altsetting", 1, 0, 'S' },
 	{ "usb-address", 1, 0, 'A' },
+	{ "sitl-socket", 1, 0, 'U' },
 	{ NULL, 0, 0, 0 }
 };
 
@@ -335,11 +547,12 @@ int main(int argc, char **argv)
 	char *gsmtap_host = "127.0.0.1";
 	int keep_running = 0;
 	int vendor_id = -1, product_id = -1, addr = -1, config_id = -1, if_num = -1, altsetting = -1;
+	const char *sitl_socket = NULL;
 
 	while (1) {
 		int option_index = 0;
 
-		int c = getopt_long(argc, argv, "hi:kV:P:C:I:S:A:", opts, &option_index);
+		int c = getopt_long(argc, argv, "hi:kV:P:C:I:S:A:U:", opts, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -371,7 +584,25 @@ int main(int argc, char **argv)
 		case 'A':
 			addr = atoi(optarg);
 			break;
+		case 'U':
+			sitl_socket = optarg;
+			break;
+		}
+	}
+
+	if (sitl_socket) {
+		rc = osmo_st2_gsmtap_init(gsmtap_host);
+		if (rc < 0) {
+			perror("unable to open GSMTAP");
+			goto do_exit;
 		}
+		signal(SIGINT, &signal_handler);
+		do {
+			ret = run_mainloop_sitl(sitl_socket) < 0 ? 1 : 0;
+			if (keep_running)
+				sleep(1);
+		} while (keep_running);
+		goto do_exit;
 	}
 
 	/* Scan for available SIMtrace USB devices supporting sniffing */
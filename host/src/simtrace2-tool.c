@@ -21,10 +21,13 @@
 #include <string.h>
 #include <stdint.h>
 #include <signal.h>
+#include <time.h>
 #define _GNU_SOURCE
 #include <getopt.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include <libusb.h>
 
@@ -35,9 +38,16 @@
 
 #include <osmocom/core/utils.h>
 #include <osmocom/core/msgb.h>
+#include <osmocom/core/linuxlist.h>
+#include <osmocom/core/select.h>
+#include <osmocom/core/timer.h>
+#include <osmocom/core/talloc.h>
 #include <osmocom/core/logging.h>
 #include <osmocom/core/application.h>
 
+/* commands of a script in flight, by default */
+#define SCRIPT_WINDOW_DEFAULT	8
+
 /***********************************************************************
  * Incoming Messages
  ***********************************************************************/
@@ -50,7 +60,8 @@ static void print_welcome(void)
 
 static void print_help(void)
 {
-	printf( "simtrace2-tool [OPTIONS] COMMAND\n\n");
+	printf( "simtrace2-tool [OPTIONS] COMMAND\n");
+	printf( "simtrace2-tool [OPTIONS] --script FILE\n\n");
 	printf( "Options:\n"
 		"\t-h\t--help\n"
 		"\t-V\t--usb-vendor\tVENDOR_ID\n"
@@ -60,12 +71,21 @@ static void print_help(void)
 		"\t-S\t--usb-altsetting ALTSETTING_ID\n"
 		"\t-A\t--usb-address\tADDRESS\n"
 		"\t-H\t--usb-path\tPATH\n"
-		"\n"
+		"\t-s\t--script\tFILE\trun the commands of FILE, one per line ('-' for stdin)\n"
+		"\t-w\t--window\tNUM\tcommands of the script in flight (default %u)\n"
+		"\n", SCRIPT_WINDOW_DEFAULT
 		);
 	printf( "Commands:\n"
 		"\tmodem reset (enable|disable|cycle)\n"
 		"\tmodem sim-switch (local|remote)\n"
 		"\tmodem sim-card (insert|remove)\n"
+		"\tcardem slot-sched SLOT [MASK]\n"
+		"\tcardem stats [SLOT...]\n"
+		"\tusb stress [COUNT]\n"
+		"\n");
+	printf( "Script commands, in addition to the modem and cardem slot-sched ones:\n"
+		"\tsync\t\twait until the previous commands are done\n"
+		"\twait MS\t\tsync, then wait for MS milliseconds\n"
 		"\n");
 }
 
@@ -78,6 +98,8 @@ static const struct option opts[] = {
 	{ "usb-altsetting", 1, 0, 'S' },
 	{ "usb-address", 1, 0, 'A' },
 	{ "usb-path", 1, 0, 'H' },
+	{ "script", 1, 0, 's' },
+	{ "window", 1, 0, 'w' },
 	{ NULL, 0, 0, 0 }
 };
 
@@ -216,6 +238,183 @@ static int do_subsys_modem(int argc, char **argv)
 	return rc;
 }
 
+/* slots behind the mux of an octsimtest */
+#define NUM_MUX_SLOTS	8
+
+/* connect the card emulation to SLOT, and cycle through the slots of MASK */
+static int do_cardem_slot_sched(int argc, char **argv)
+{
+	unsigned long slot_nr, mask = 0;
+
+	if (argc < 1)
+		return -EINVAL;
+	slot_nr = strtoul(argv[0], NULL, 0);
+	if (argc >= 2)
+		mask = strtoul(argv[1], NULL, 0);
+	if (slot_nr >= NUM_MUX_SLOTS || mask >= (1 << NUM_MUX_SLOTS))
+		return -EINVAL;
+
+	printf("Connecting slot %lu, scheduling slots 0x%02lx\n", slot_nr, mask);
+	return osmo_st2_cardem_request_slot_sched(ci, slot_nr, mask);
+}
+
+/* request the statistics of the given slots, and print them as they arrive.
+ * Without a schedule, the firmware answers for the connected slot: the slot a
+ * response is for is the one of its header */
+static int do_cardem_stats(int argc, char **argv)
+{
+	struct osmo_st2_transport *transp = ci->slot->transp;
+	struct osmo_st2_slot slots[NUM_MUX_SLOTS];
+	struct osmo_st2_cardem_inst cis[NUM_MUX_SLOTS];
+	struct osmo_st2_cardem_stats st;
+	unsigned int num_req = 0, num_rx = 0;
+	uint8_t buf[16*265];
+	int i, len, rc;
+
+	memset(cis, 0, sizeof(cis));
+	for (i = 0; i < NUM_MUX_SLOTS; i++) {
+		slots[i].transp = transp;
+		slots[i].slot_nr = i;
+		cis[i].slot = &slots[i];
+	}
+
+	for (i = 0; i < (argc ? argc : 1); i++) {
+		unsigned long slot_nr = argc ? strtoul(argv[i], NULL, 0) : ci->slot->slot_nr;
+
+		if (slot_nr >= NUM_MUX_SLOTS)
+			return -EINVAL;
+		rc = osmo_st2_cardem_request_stats(&cis[slot_nr]);
+		if (rc < 0)
+			return rc;
+		num_req++;
+	}
+
+	while (num_rx < num_req) {
+		uint8_t *cur = buf;
+
+		rc = libusb_bulk_transfer(transp->usb_devh, transp->usb_ep.in, buf, sizeof(buf), &len, 1000);
+		if (rc == LIBUSB_ERROR_TIMEOUT) {
+			fprintf(stderr, "%u of %u statistics received\n", num_rx, num_req);
+			return -ETIMEDOUT;
+		}
+		if (rc < 0)
+			return rc;
+
+		/* a transfer may carry several messages */
+		while (len >= sizeof(struct simtrace_msg_hdr)) {
+			struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *) cur;
+
+			if (sh->msg_len < sizeof(*sh) || sh->msg_len > len)
+				break;
+			if (sh->msg_class == SIMTRACE_MSGC_CARDEM && sh->msg_type == SIMTRACE_MSGT_BD_CEMU_STATS &&
+			    osmo_st2_cardem_stats_decode(&st, cur + sizeof(*sh), sh->msg_len - sizeof(*sh)) == 0) {
+				printf("slot %u: rx %u tx %u bytes, %u commands, %u PPS, "
+				       "connected %u ms in %u connections\n", sh->slot_nr,
+				       st.rx_bytes, st.tx_bytes, st.commands, st.pps,
+				       st.connected_ms, st.connections);
+				num_rx++;
+			}
+			cur += sh->msg_len;
+			len -= sh->msg_len;
+		}
+	}
+
+	return 0;
+}
+
+static int do_subsys_cardem(int argc, char **argv)
+{
+	char *command;
+
+	if (argc < 1)
+		return -EINVAL;
+	command = argv[0];
+	argc--;
+	argv++;
+
+	if (!strcmp(command, "slot-sched"))
+		return do_cardem_slot_sched(argc, argv);
+	if (!strcmp(command, "stats"))
+		return do_cardem_stats(argc, argv);
+
+	fprintf(stderr, "Unsupported command for subsystem cardem: '%s'\n", command);
+	return -EINVAL;
+}
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* an (empty) generic error message: the firmware only answers BOARD_INFO in
+ * that class and silently drops anything else */
+static int usb_stress_send(void)
+{
+	struct msgb *msg = osmo_st2_transport_msgb_alloc(ci->slot->transp);
+
+	if (!msg)
+		return -ENOMEM;
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_GENERIC, SIMTRACE_CMD_DO_ERROR);
+}
+
+/* send a burst of commands which the firmware consumes without responding.
+ * Each bulk OUT transfer only completes once the device has accepted it, so
+ * the slowest one tells for how long the host was NAKed at worst. */
+static int do_usb_stress(int argc, char **argv)
+{
+	unsigned long count = 10000, i;
+	uint64_t start, t, dur, dur_max = 0;
+	int rc;
+
+	if (argc >= 1)
+		count = strtoul(argv[0], NULL, 0);
+	if (!count)
+		return -EINVAL;
+
+	printf("Sending %lu commands to the device\n", count);
+
+	start = now_us();
+	for (i = 0; i < count; i++) {
+		t = now_us();
+		rc = usb_stress_send();
+		if (rc < 0) {
+			fprintf(stderr, "command %lu failed: %d\n", i, rc);
+			return rc;
+		}
+		dur = now_us() - t;
+		if (dur > dur_max)
+			dur_max = dur;
+	}
+	dur = now_us() - start;
+	if (!dur)
+		dur = 1;
+
+	printf("%lu commands in %llu us: %llu commands/s, average %llu us, worst case %llu us\n",
+		count, (unsigned long long) dur, (unsigned long long) count * 1000000 / dur,
+		(unsigned long long) dur / count, (unsigned long long) dur_max);
+	return 0;
+}
+
+static int do_subsys_usb(int argc, char **argv)
+{
+	char *command;
+
+	if (argc < 1)
+		return -EINVAL;
+	command = argv[0];
+	argc--;
+	argv++;
+
+	if (!strcmp(command, "stress"))
+		return do_usb_stress(argc, argv);
+
+	fprintf(stderr, "Unsupported command for subsystem usb: '%s'\n", command);
+	return -EINVAL;
+}
+
 static int do_command(int argc, char **argv)
 {
 	char *subsys;
@@ -229,6 +428,10 @@ static int do_command(int argc, char **argv)
 
 	if (!strcmp(subsys, "modem"))
 		rc = do_subsys_modem(argc, argv);
+	else if (!strcmp(subsys, "cardem"))
+		rc = do_subsys_cardem(argc, argv);
+	else if (!strcmp(subsys, "usb"))
+		rc = do_subsys_usb(argc, argv);
 	else {
 		fprintf(stderr, "Unsupported subsystem '%s'\n", subsys);
 		rc = -EINVAL;
@@ -237,6 +440,370 @@ static int do_command(int argc, char **argv)
 	return rc;
 }
 
+/***********************************************************************
+ * Scripts
+ ***********************************************************************/
+
+/* Each command of a script is followed by a status request.  The firmware
+ * processes the commands in order, and doesn't respond to most of them, so
+ * the status arriving back tells when the command before it was done. */
+
+#define SCRIPT_TIMEOUT_MS	2000
+#define SCRIPT_MAX_ARGS		16
+
+/* command sent to the firmware, waiting for its status to arrive */
+struct script_cmd {
+	struct llist_head list;
+	unsigned int line;
+	uint64_t start_us;
+};
+
+static struct {
+	struct osmo_fd ofd;
+	char buf[256];
+	size_t buf_len;
+	bool eof;
+	unsigned int line;
+
+	/* commands in flight, oldest first */
+	struct llist_head in_flight;
+	unsigned int num_in_flight;
+	unsigned int window;
+
+	/* wait for the commands in flight before reading on, then for wait_ms */
+	bool sync;
+	unsigned int wait_ms;
+	bool waiting;
+	struct osmo_timer_list wait_timer;
+	struct osmo_timer_list timeout;
+
+	struct libusb_transfer *in_xfer;
+	bool done;
+	int rc;
+
+	/* statistics */
+	unsigned int num_cmds;
+	uint64_t start_us;
+	uint64_t lat_sum_us;
+	uint64_t lat_max_us;
+} script;
+
+static void script_continue(void);
+
+static void script_fail(int rc)
+{
+	script.rc = rc;
+	script.done = true;
+}
+
+static int script_send_status_req(void)
+{
+	struct msgb *msg = osmo_st2_transport_msgb_alloc(ci->slot->transp);
+
+	if (!msg)
+		return -ENOMEM;
+	return osmo_st2_slot_tx_msg(ci->slot, msg, SIMTRACE_MSGC_CARDEM, SIMTRACE_MSGT_BD_CEMU_STATUS);
+}
+
+static void script_cmd_done(void)
+{
+	struct script_cmd *cmd;
+	uint64_t lat;
+
+	cmd = llist_first_entry_or_null(&script.in_flight, struct script_cmd, list);
+	if (!cmd) {
+		/* status requested by somebody else */
+		return;
+	}
+	llist_del(&cmd->list);
+	script.num_in_flight--;
+
+	lat = now_us() - cmd->start_us;
+	printf("line %u: done in %llu us\n", cmd->line, (unsigned long long) lat);
+	script.lat_sum_us += lat;
+	if (lat > script.lat_max_us)
+		script.lat_max_us = lat;
+	talloc_free(cmd);
+
+	if (script.num_in_flight)
+		osmo_timer_schedule(&script.timeout, SCRIPT_TIMEOUT_MS / 1000, (SCRIPT_TIMEOUT_MS % 1000) * 1000);
+	else
+		osmo_timer_del(&script.timeout);
+
+	script_continue();
+}
+
+static void script_timeout_cb(void *data)
+{
+	struct script_cmd *cmd = llist_first_entry(&script.in_flight, struct script_cmd, list);
+
+	fprintf(stderr, "line %u: no response from the firmware\n", cmd->line);
+	script_fail(-ETIMEDOUT);
+}
+
+static void script_wait_cb(void *data)
+{
+	script.waiting = false;
+	script_continue();
+}
+
+static int script_run_line(char *line)
+{
+	char *argv[SCRIPT_MAX_ARGS];
+	struct script_cmd *cmd;
+	char *tok, *saveptr;
+	int argc = 0;
+	int rc;
+
+	/* comments and empty lines */
+	tok = strchr(line, '#');
+	if (tok)
+		*tok = '\0';
+	for (tok = strtok_r(line, " \t\r", &saveptr); tok; tok = strtok_r(NULL, " \t\r", &saveptr)) {
+		if (argc >= ARRAY_SIZE(argv))
+			return -EINVAL;
+		argv[argc++] = tok;
+	}
+	if (!argc)
+		return 0;
+
+	if (!strcmp(argv[0], "sync")) {
+		script.sync = true;
+		return 0;
+	} else if (!strcmp(argv[0], "wait")) {
+		if (argc < 2)
+			return -EINVAL;
+		script.sync = true;
+		script.wait_ms = atoi(argv[1]);
+		return 0;
+	} else if (!strcmp(argv[0], "usb")) {
+		/* waits for the device itself */
+		fprintf(stderr, "usb commands can't be run from a script\n");
+		return -EINVAL;
+	} else if (!strcmp(argv[0], "cardem") && argc >= 2 && !strcmp(argv[1], "stats")) {
+		/* reads the responses itself */
+		fprintf(stderr, "cardem stats can't be run from a script\n");
+		return -EINVAL;
+	}
+
+	cmd = talloc_zero(NULL, struct script_cmd);
+	OSMO_ASSERT(cmd);
+	cmd->line = script.line;
+	cmd->start_us = now_us();
+	if (!script.start_us)
+		script.start_us = cmd->start_us;
+
+	rc = do_command(argc, argv);
+	if (rc >= 0)
+		rc = script_send_status_req();
+	if (rc < 0) {
+		talloc_free(cmd);
+		return rc;
+	}
+
+	llist_add_tail(&cmd->list, &script.in_flight);
+	if (script.num_in_flight++ == 0)
+		osmo_timer_schedule(&script.timeout, SCRIPT_TIMEOUT_MS / 1000, (SCRIPT_TIMEOUT_MS % 1000) * 1000);
+	script.num_cmds++;
+
+	return 0;
+}
+
+static bool script_blocked(void)
+{
+	if (script.sync && script.num_in_flight == 0) {
+		script.sync = false;
+		if (script.wait_ms) {
+			osmo_timer_schedule(&script.wait_timer, script.wait_ms / 1000, (script.wait_ms % 1000) * 1000);
+			script.waiting = true;
+			script.wait_ms = 0;
+		}
+	}
+	return script.sync || script.waiting || script.num_in_flight >= script.window;
+}
+
+/* run the lines read so far, as long as the window allows */
+static void script_continue(void)
+{
+	char *nl;
+	int rc;
+
+	while (!script.done && !script_blocked()) {
+		nl = memchr(script.buf, '\n', script.buf_len);
+		if (!nl) {
+			if (!script.eof || !script.buf_len)
+				break;
+			/* last line without a newline */
+			nl = script.buf + script.buf_len;
+			script.buf_len++;
+		}
+		*nl = '\0';
+		script.line++;
+
+		rc = script_run_line(script.buf);
+		if (rc < 0) {
+			if (rc == -EINVAL)
+				fprintf(stderr, "line %u: invalid command/syntax\n", script.line);
+			else
+				fprintf(stderr, "line %u: error executing command: %d\n", script.line, rc);
+			script_fail(rc);
+			break;
+		}
+
+		script.buf_len -= nl + 1 - script.buf;
+		memmove(script.buf, nl + 1, script.buf_len);
+	}
+
+	if (script.done)
+		return;
+	if (script.eof && !script.buf_len && !script.num_in_flight && !script.waiting) {
+		script.done = true;
+		return;
+	}
+
+	/* read on only once the lines read so far can be run */
+	if (script.eof || script_blocked() || memchr(script.buf, '\n', script.buf_len))
+		osmo_fd_read_disable(&script.ofd);
+	else
+		osmo_fd_read_enable(&script.ofd);
+}
+
+static int script_read_cb(struct osmo_fd *ofd, unsigned int what)
+{
+	ssize_t rc;
+
+	if (script.buf_len >= sizeof(script.buf) - 1) {
+		fprintf(stderr, "line %u: too long\n", script.line + 1);
+		script_fail(-EINVAL);
+		return 0;
+	}
+
+	rc = read(ofd->fd, script.buf + script.buf_len, sizeof(script.buf) - 1 - script.buf_len);
+	if (rc < 0) {
+		fprintf(stderr, "can't read the script: %s\n", strerror(errno));
+		script_fail(-errno);
+		return 0;
+	}
+	if (rc == 0)
+		script.eof = true;
+	script.buf_len += rc;
+
+	script_continue();
+	return 0;
+}
+
+static void script_in_xfer_cb(struct libusb_transfer *xfer)
+{
+	uint8_t *buf = xfer->buffer;
+	int len = xfer->actual_length;
+	int rc;
+
+	switch (xfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		/* a transfer may carry several messages */
+		while (len >= sizeof(struct simtrace_msg_hdr)) {
+			struct simtrace_msg_hdr *sh = (struct simtrace_msg_hdr *) buf;
+
+			if (sh->msg_len < sizeof(*sh) || sh->msg_len > len)
+				break;
+			if (sh->msg_class == SIMTRACE_MSGC_CARDEM && sh->msg_type == SIMTRACE_MSGT_BD_CEMU_STATUS)
+				script_cmd_done();
+			buf += sh->msg_len;
+			len -= sh->msg_len;
+		}
+		break;
+	case LIBUSB_TRANSFER_ERROR:
+		fprintf(stderr, "USB IN transfer error, trying resubmit\n");
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		libusb_dev_mem_free(xfer->dev_handle, xfer->buffer, xfer->length);
+		libusb_free_transfer(xfer);
+		script.in_xfer = NULL;
+		return;
+	default:
+		fprintf(stderr, "USB IN transfer failed, status=%u\n", xfer->status);
+		script_fail(-EIO);
+		script.in_xfer = NULL;
+		return;
+	}
+
+	rc = libusb_submit_transfer(xfer);
+	OSMO_ASSERT(rc == 0);
+}
+
+static int run_script(const char *path, unsigned int window)
+{
+	struct osmo_st2_transport *transp = ci->slot->transp;
+	struct libusb_transfer *xfer;
+	uint64_t dur;
+	int fd, rc;
+
+	if (!strcmp(path, "-"))
+		fd = STDIN_FILENO;
+	else {
+		fd = open(path, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "can't open %s: %s\n", path, strerror(errno));
+			return -errno;
+		}
+	}
+
+	memset(&script, 0, sizeof(script));
+	INIT_LLIST_HEAD(&script.in_flight);
+	script.window = window;
+	osmo_timer_setup(&script.wait_timer, script_wait_cb, NULL);
+	osmo_timer_setup(&script.timeout, script_timeout_cb, NULL);
+	osmo_fd_setup(&script.ofd, fd, OSMO_FD_READ, script_read_cb, NULL, 0);
+	rc = osmo_fd_register(&script.ofd);
+	OSMO_ASSERT(rc == 0);
+
+	/* the responses are received while the next commands are sent */
+	xfer = libusb_alloc_transfer(0);
+	OSMO_ASSERT(xfer);
+	xfer->dev_handle = transp->usb_devh;
+	xfer->flags = 0;
+	xfer->type = LIBUSB_TRANSFER_TYPE_BULK;
+	xfer->endpoint = transp->usb_ep.in;
+	xfer->timeout = 0;
+	xfer->length = 16*256;
+	xfer->buffer = libusb_dev_mem_alloc(xfer->dev_handle, xfer->length);
+	OSMO_ASSERT(xfer->buffer);
+	xfer->callback = script_in_xfer_cb;
+	rc = libusb_submit_transfer(xfer);
+	OSMO_ASSERT(rc == 0);
+	script.in_xfer = xfer;
+
+	while (!script.done)
+		osmo_select_main(0);
+
+	osmo_timer_del(&script.timeout);
+	osmo_timer_del(&script.wait_timer);
+	osmo_fd_unregister(&script.ofd);
+	if (fd != STDIN_FILENO)
+		close(fd);
+
+	if (script.in_xfer) {
+		libusb_cancel_transfer(script.in_xfer);
+		while (script.in_xfer)
+			osmo_select_main(0);
+	}
+
+	if (script.rc < 0)
+		return script.rc;
+
+	if (script.num_cmds) {
+		dur = now_us() - script.start_us;
+		if (!dur)
+			dur = 1;
+		printf("%u commands in %llu us: %llu commands/s, average latency %llu us, worst case %llu us\n",
+			script.num_cmds, (unsigned long long) dur,
+			(unsigned long long) script.num_cmds * 1000000 / dur,
+			(unsigned long long) script.lat_sum_us / script.num_cmds,
+			(unsigned long long) script.lat_max_us);
+	}
+	return 0;
+}
+
 static struct log_info log_info = {};
 
 int main(int argc, char **argv)
@@ -247,11 +814,13 @@ int main(int argc, char **argv)
 	int if_num = 0, vendor_id = -1, product_id = -1;
 	int config_id = -1, altsetting = 0, addr = -1;
 	char *path = NULL;
+	char *script_path = NULL;
+	int window = SCRIPT_WINDOW_DEFAULT;
 
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "hV:P:C:I:S:A:H:", opts, &option_index);
+		c = getopt_long(argc, argv, "hV:P:C:I:S:A:H:s:w:", opts, &option_index);
 		if (c == -1)
 			break;
 		switch (c) {
@@ -280,6 +849,16 @@ int main(int argc, char **argv)
 		case 'H':
 			path = optarg;
 			break;
+		case 's':
+			script_path = optarg;
+			break;
+		case 'w':
+			window = atoi(optarg);
+			if (window < 1) {
+				fprintf(stderr, "The window must be at least 1\n");
+				exit(1);
+			}
+			break;
 		}
 	}
 
@@ -289,6 +868,8 @@ int main(int argc, char **argv)
 	}
 
 	transp->udp_fd = -1;
+	/* a script is pipelined: the responses arrive while commands are sent */
+	transp->usb_async = !!script_path;
 
 	print_welcome();
 
@@ -327,6 +908,13 @@ int main(int argc, char **argv)
 			}
 		}
 
+		if (script_path) {
+			rc = run_script(script_path, window);
+			ret = rc < 0 ? 1 : 0;
+			libusb_release_interface(transp->usb_devh, 0);
+			goto close_exit;
+		}
+
 		if (argc - optind <= 0) {
 			fprintf(stderr, "You have to specify a command to execute\n");
 			exit(1);
@@ -73,10 +73,68 @@ void test_apdu_dispatch_context(void)
 	OSMO_ASSERT(ac.apdu_case == 2)
 }
 
+/* complete command APDUs, as received by T=1 */
+const uint8_t select_mf_c1[] = { 0x00, 0xA4, 0x00, 0x04 };
+const uint8_t select_mf_c3[] = { 0x00, 0xA4, 0x00, 0x04, 0x02, 0x3F, 0x00 };
+const uint8_t select_mf_c4[] = { 0x00, 0xA4, 0x00, 0x04, 0x02, 0x3F, 0x00, 0x10 };
+/* extended Lc/Le */
+const uint8_t read_binary_ext_c2[] = { 0x00, 0xB0, 0x00, 0x00, 0x00, 0x04, 0x00 };
+const uint8_t select_mf_ext[] = { 0x00, 0xA4, 0x00, 0x04, 0x00, 0x00, 0x02, 0x3F, 0x00 };
+const uint8_t select_mf_ext_c4[] = { 0x00, 0xA4, 0x00, 0x04, 0x00, 0x00, 0x02, 0x3F, 0x00, 0x00, 0x00 };
+/* extended Lc announcing more data than present */
+const uint8_t select_mf_ext_short[] = { 0x00, 0xA4, 0x00, 0x04, 0x00, 0x00, 0x03, 0x3F, 0x00 };
+
+#define APDU_PARSE_CAPDU(apdu, exp_rc, exp_case)			\
+	do {								\
+		printf("Testing " #apdu "\n");				\
+		int rc = osmo_apdu_parse_capdu(&ac, apdu, ARRAY_SIZE(apdu)); \
+		if (rc != exp_rc)					\
+			printf("%d (actual) != %d (expected)\n", rc, exp_rc);\
+		OSMO_ASSERT(rc == exp_rc);				\
+		OSMO_ASSERT(rc < 0 || ac.apdu_case == exp_case);	\
+	} while (0)
+
+void test_apdu_parse_capdu(void)
+{
+	struct osmo_apdu_context ac;
+
+	APDU_PARSE_CAPDU(select_mf_c1, APDU_ACT_TX_CAPDU_TO_CARD, 1);
+	OSMO_ASSERT(ac.hdr.p3 == 0 && ac.lc.tot == 0);
+
+	APDU_PARSE_CAPDU(get_data_c2_ca, APDU_ACT_TX_CAPDU_TO_CARD, 2);
+	OSMO_ASSERT(ac.hdr.p3 == 0 && ac.lc.tot == 0 && ac.le.tot == 0);
+	APDU_PARSE_CAPDU(get_data_c2_ca_le_23, APDU_ACT_TX_CAPDU_TO_CARD, 2);
+	OSMO_ASSERT(ac.hdr.p3 == 0x23 && ac.le.tot == 0x23);
+
+	APDU_PARSE_CAPDU(select_mf_c3, APDU_ACT_TX_CAPDU_TO_CARD, 3);
+	OSMO_ASSERT(ac.hdr.p3 == 2 && ac.lc.tot == 2 && ac.lc.cur == 2);
+	OSMO_ASSERT(ac.dc[0] == 0x3F && ac.dc[1] == 0x00);
+
+	APDU_PARSE_CAPDU(select_mf_c4, APDU_ACT_TX_CAPDU_TO_CARD, 4);
+	OSMO_ASSERT(ac.hdr.p3 == 2 && ac.lc.tot == 2 && ac.le.tot == 0x10);
+
+	APDU_PARSE_CAPDU(read_binary_ext_c2, APDU_ACT_TX_CAPDU_TO_CARD, 2);
+	OSMO_ASSERT(ac.extended && ac.hdr.p3 == 0 && ac.le.tot == 0x400);
+
+	APDU_PARSE_CAPDU(select_mf_ext, APDU_ACT_TX_CAPDU_TO_CARD, 3);
+	OSMO_ASSERT(ac.extended && ac.hdr.p3 == 0 && ac.lc.tot == 2 && ac.lc.cur == 2);
+	OSMO_ASSERT(ac.ext_dc == select_mf_ext + 7);
+
+	APDU_PARSE_CAPDU(select_mf_ext_c4, APDU_ACT_TX_CAPDU_TO_CARD, 4);
+	OSMO_ASSERT(ac.extended && ac.lc.tot == 2 && ac.le.tot == 0);
+
+	APDU_PARSE_CAPDU(select_mf_ext_short, -1, 0);
+
+	/* short APDUs again, after the extended ones */
+	APDU_PARSE_CAPDU(select_mf_c4, APDU_ACT_TX_CAPDU_TO_CARD, 4);
+	OSMO_ASSERT(!ac.extended && ac.hdr.p3 == 2);
+}
+
 int main(int argc, char **argv)
 {
 	test_apdu_dispatch_simple();
 	test_apdu_dispatch_context();
+	test_apdu_parse_capdu();
 
 	printf("All tests passed.\n");
 	return 0;
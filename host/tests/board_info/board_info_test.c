@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+#include "st2_loopback.h"
+
+static struct st2_loopback lb;
+
+/* build the board information like the firmware does */
+static unsigned int build_board_info_boot(uint8_t *buf, uint8_t cap_bytes, const uint8_t *caps,
+					  const struct simtrace_board_perf *perf,
+					  const struct simtrace_board_boot_time *boot)
+{
+	struct simtrace_board_info *info = (struct simtrace_board_info *) buf;
+	unsigned int len = sizeof(*info);
+
+	memset(info, 0, sizeof(*info));
+	osmo_strlcpy(info->hardware.model, "simtrace", sizeof(info->hardware.model));
+	osmo_strlcpy(info->software.name, "cardem", sizeof(info->software.name));
+	info->cap_generic_bytes = cap_bytes;
+	memcpy(buf + len, caps, cap_bytes);
+	len += cap_bytes;
+	if (perf) {
+		memcpy(buf + len, perf, sizeof(*perf));
+		len += sizeof(*perf);
+	}
+	if (boot) {
+		memcpy(buf + len, boot, sizeof(*boot));
+		len += sizeof(*boot);
+	}
+	return len;
+}
+
+static unsigned int build_board_info(uint8_t *buf, uint8_t cap_bytes, const uint8_t *caps,
+				     const struct simtrace_board_perf *perf)
+{
+	return build_board_info_boot(buf, cap_bytes, caps, perf, NULL);
+}
+
+static void dump_board_info(const struct osmo_st2_board_info *bi)
+{
+	printf("  %s %s caps=0x%08x perf: out=%u in=%u bufs=%u large=%u\n",
+	       bi->info.hardware.model, bi->info.software.name, bi->cap_generic,
+	       bi->perf.max_out_msg_len, bi->perf.max_in_msg_len, bi->perf.num_out_bufs,
+	       bi->perf.num_large_bufs);
+	printf("  boot: main=%u board=%u usb_init=%u usb_configured=%u ready=%u deferred=%u target=%u\n",
+	       bi->boot.main, bi->boot.board, bi->boot.usb_init, bi->boot.usb_configured,
+	       bi->boot.ready, bi->boot.deferred, bi->boot.ready_target);
+}
+
+static void test_decode(void)
+{
+	const uint8_t caps[] = { 0x00, 0xc0 };
+	const uint8_t caps_boot[] = { 0x00, 0xc0, 0x01 };
+	const struct simtrace_board_perf perf = {
+		.max_out_msg_len = 1024,
+		.max_in_msg_len = 280,
+		.num_out_bufs = 2,
+		.num_large_bufs = 4,
+	};
+	const struct simtrace_board_boot_time boot = {
+		.main = 12,
+		.board = 15,
+		.usb_init = 17,
+		.usb_configured = 240,
+		.ready = 243,
+		.deferred = 0xffff,
+		.ready_target = 300,
+	};
+	struct osmo_st2_board_info bi;
+	uint8_t buf[512];
+	unsigned int len;
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	len = build_board_info(buf, sizeof(caps), caps, &perf);
+	rc = osmo_st2_board_info_decode(&bi, buf, len);
+	printf("  complete: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_board_info(&bi);
+
+	rc = osmo_st2_board_info_decode(&bi, buf, len - 1);
+	printf("  perf truncated: rc=%d\n", rc);
+	OSMO_ASSERT(rc == -EINVAL);
+
+	rc = osmo_st2_board_info_decode(&bi, buf, sizeof(struct simtrace_board_info) + 1);
+	printf("  caps truncated: rc=%d\n", rc);
+	OSMO_ASSERT(rc == -EINVAL);
+
+	len = build_board_info_boot(buf, sizeof(caps_boot), caps_boot, &perf, &boot);
+	rc = osmo_st2_board_info_decode(&bi, buf, len);
+	printf("  with boot time: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_board_info(&bi);
+
+	rc = osmo_st2_board_info_decode(&bi, buf, len - 1);
+	printf("  boot time truncated: rc=%d\n", rc);
+	OSMO_ASSERT(rc == -EINVAL);
+
+	/* firmware without any capabilities */
+	len = build_board_info(buf, 0, caps, NULL);
+	rc = osmo_st2_board_info_decode(&bi, buf, len);
+	printf("  old firmware: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_board_info(&bi);
+}
+
+/* length of each message sent for a T=1 response of the given length */
+static void t1_tx(unsigned int data_len)
+{
+	static uint8_t data[2048];
+	uint8_t buf[2048];
+	int rc;
+
+	printf("  %u bytes:", data_len);
+	rc = osmo_st2_cardem_request_t1_tx(&lb.ci, data, data_len);
+	OSMO_ASSERT(rc > 0);
+	while ((rc = recv(lb.peer_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0)
+		printf(" %d", rc);
+	printf("\n");
+}
+
+static void test_t1_chunks(void)
+{
+	const uint8_t caps[] = { 0x00, 0xc0 };
+	const uint8_t caps_no_reassembly[] = { 0x00, 0x40 };
+	const struct simtrace_board_perf perf = { .max_out_msg_len = 1024 };
+	struct osmo_st2_board_info bi;
+	uint8_t buf[512];
+
+	printf("==> %s\n", __func__);
+
+	printf(" unknown firmware\n");
+	t1_tx(600);
+
+	osmo_st2_board_info_decode(&bi, buf, build_board_info(buf, sizeof(caps_no_reassembly),
+								 caps_no_reassembly, &perf));
+	osmo_st2_transport_apply_board_info(&lb.transp, &bi);
+	printf(" without reassembly: max_out_msg_len=%u\n", lb.transp.max_out_msg_len);
+	t1_tx(600);
+
+	osmo_st2_board_info_decode(&bi, buf, build_board_info(buf, sizeof(caps), caps, &perf));
+	osmo_st2_transport_apply_board_info(&lb.transp, &bi);
+	printf(" with reassembly: max_out_msg_len=%u\n", lb.transp.max_out_msg_len);
+	t1_tx(600);
+	t1_tx(1010);
+	t1_tx(1011);
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	log_init(&log_info, NULL);
+
+	st2_loopback_init(&lb);
+
+	test_decode();
+	test_t1_chunks();
+
+	printf("All tests passed.\n");
+	return 0;
+}
@@ -0,0 +1,36 @@
+/* loopback stand-in for a SIMtrace2, shared by the tests
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#include <string.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+
+#include "st2_loopback.h"
+
+/*! set up a transport, slot 0 and its card emulation instance, connected to
+ *  lb->peer_fd instead of a device */
+void st2_loopback_init(struct st2_loopback *lb)
+{
+	int sv[2];
+	int rc;
+
+	memset(lb, 0, sizeof(*lb));
+	lb->slot.transp = &lb->transp;
+	lb->slot.slot_nr = 0;
+	lb->ci.slot = &lb->slot;
+
+	rc = socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv);
+	OSMO_ASSERT(rc == 0);
+	lb->transp.udp_fd = sv[0];
+	lb->peer_fd = sv[1];
+}
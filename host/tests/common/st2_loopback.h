@@ -0,0 +1,27 @@
+/* loopback stand-in for a SIMtrace2, shared by the tests
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ */
+#pragma once
+
+#include <osmocom/simtrace2/simtrace2_api.h>
+
+/* the transport writes into one end of a socketpair, and the test reads what
+ * would have been sent to the device from the other */
+struct st2_loopback {
+	struct osmo_st2_transport transp;
+	struct osmo_st2_slot slot;
+	struct osmo_st2_cardem_inst ci;
+	/* the device end of the socketpair */
+	int peer_fd;
+};
+
+void st2_loopback_init(struct st2_loopback *lb);
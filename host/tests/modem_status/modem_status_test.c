@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+#include "st2_loopback.h"
+
+static struct st2_loopback lb;
+
+static unsigned int num_cb;
+
+static void dump_status(const struct osmo_st2_modem_status *sts)
+{
+	printf("  supported=0x%02x status=0x%02x changed=0x%02x at %u: led edge %u (%u edges), card edge %u\n",
+	       sts->supported_mask, sts->status_mask, sts->changed_mask, sts->timestamp_ms,
+	       sts->wwan_led_edge_ms, sts->wwan_led_edges, sts->card_inserted_edge_ms);
+}
+
+/* the messages sent to the firmware */
+static void dump_sent(void)
+{
+	uint8_t buf[512];
+	int rc;
+
+	while ((rc = recv(lb.peer_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		const struct simtrace_msg_hdr *sh = (const struct simtrace_msg_hdr *) buf;
+
+		printf("  sent class=%u type=%u len=%u", sh->msg_class, sh->msg_type, sh->msg_len);
+		if (sh->msg_class == SIMTRACE_MSGC_CARDEM && sh->msg_type == SIMTRACE_MSGT_BD_CEMU_CONFIG)
+			printf(" features=0x%08x", osmo_load32le(buf + sizeof(*sh)));
+		printf("\n");
+	}
+}
+
+/* build the modem status like the firmware does */
+static unsigned int build_status(uint8_t *buf)
+{
+	struct st_modem_status *ms = (struct st_modem_status *) buf;
+
+	memset(ms, 0, sizeof(*ms));
+	ms->supported_mask = ST_MDM_STS_BIT_WWAN_LED | ST_MDM_STS_BIT_CARD_INSERTED;
+	ms->status_mask = ST_MDM_STS_BIT_CARD_INSERTED;
+	ms->changed_mask = ST_MDM_STS_BIT_WWAN_LED;
+	osmo_store32le(5000, &ms->timestamp_ms);
+	osmo_store32le(4980, &ms->wwan_led_edge_ms);
+	osmo_store32le(1200, &ms->card_inserted_edge_ms);
+	osmo_store32le(42, &ms->wwan_led_edges);
+	return sizeof(*ms);
+}
+
+static void test_decode(void)
+{
+	struct osmo_st2_modem_status sts;
+	uint8_t buf[64];
+	unsigned int len;
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	len = build_status(buf);
+	rc = osmo_st2_modem_status_decode(&sts, buf, len);
+	printf("  complete: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_status(&sts);
+
+	/* firmware only sending the masks */
+	rc = osmo_st2_modem_status_decode(&sts, buf, 3);
+	printf("  old firmware: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_status(&sts);
+
+	rc = osmo_st2_modem_status_decode(&sts, buf, 2);
+	printf("  truncated: rc=%d\n", rc);
+	OSMO_ASSERT(rc == -EINVAL);
+}
+
+static void status_cb(struct osmo_st2_cardem_inst *_ci, const struct osmo_st2_modem_status *sts, void *data)
+{
+	OSMO_ASSERT(_ci == &lb.ci);
+	OSMO_ASSERT(data == &num_cb);
+	num_cb++;
+	printf("  callback\n");
+	dump_status(sts);
+}
+
+static void test_subscribe(void)
+{
+	uint8_t buf[64];
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	printf(" not subscribed\n");
+	rc = osmo_st2_cardem_rx_modem_status(&lb.ci, buf, build_status(buf));
+	OSMO_ASSERT(rc == 0);
+	OSMO_ASSERT(num_cb == 0);
+
+	printf(" config\n");
+	osmo_st2_cardem_request_config(&lb.ci, CEMU_FEAT_F_STATUS_IRQ);
+	dump_sent();
+
+	printf(" subscribe\n");
+	rc = osmo_st2_modem_status_subscribe(&lb.ci, status_cb, &num_cb);
+	OSMO_ASSERT(rc >= 0);
+	dump_sent();
+	rc = osmo_st2_cardem_rx_modem_status(&lb.ci, buf, build_status(buf));
+	OSMO_ASSERT(rc == 0);
+	OSMO_ASSERT(num_cb == 1);
+
+	printf(" truncated\n");
+	rc = osmo_st2_cardem_rx_modem_status(&lb.ci, buf, 1);
+	OSMO_ASSERT(rc == -EINVAL);
+	OSMO_ASSERT(num_cb == 1);
+
+	/* the subscription is kept over a new configuration */
+	printf(" config\n");
+	osmo_st2_cardem_request_config(&lb.ci, CEMU_FEAT_F_STATUS_IRQ);
+	dump_sent();
+
+	printf(" unsubscribe\n");
+	rc = osmo_st2_modem_status_subscribe(&lb.ci, NULL, NULL);
+	OSMO_ASSERT(rc >= 0);
+	dump_sent();
+	osmo_st2_cardem_rx_modem_status(&lb.ci, buf, build_status(buf));
+	OSMO_ASSERT(num_cb == 1);
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	log_init(&log_info, NULL);
+	st2_loopback_init(&lb);
+
+	test_decode();
+	test_subscribe();
+
+	printf("All tests passed.\n");
+	return 0;
+}
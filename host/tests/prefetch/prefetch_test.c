@@ -0,0 +1,205 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/vsim.h>
+#include <osmocom/simtrace2/prefetch.h>
+
+static uint8_t img[4096];
+static unsigned int img_len;
+
+static struct osmo_st2_vsim *vs;
+static struct osmo_st2_prefetch *pf;
+
+/* append a file to the image under construction */
+static void img_add_file(uint16_t fid, uint16_t parent, uint8_t type, uint8_t rec_len,
+			 const uint8_t *body, unsigned int size)
+{
+	struct osmo_st2_vsim_img_hdr *hdr = (struct osmo_st2_vsim_img_hdr *) img;
+	struct osmo_st2_vsim_img_file *f;
+	uint16_t idx = le16toh(hdr->num_files);
+
+	f = (struct osmo_st2_vsim_img_file *) (img + sizeof(*hdr)) + idx;
+	memset(f, 0, sizeof(*f));
+	f->fid = htole16(fid);
+	f->parent = htole16(parent);
+	f->type = type;
+	f->rec_len = rec_len;
+	f->offset = htole32(img_len);
+	f->size = htole32(size);
+	if (size) {
+		memcpy(img + img_len, body, size);
+		img_len += size;
+	}
+
+	hdr->num_files = htole16(idx + 1);
+}
+
+static struct osmo_st2_vsim *build_vsim(void)
+{
+	struct osmo_st2_vsim_img_hdr *hdr = (struct osmo_st2_vsim_img_hdr *) img;
+	uint8_t transp[32], recs[4*4];
+	unsigned int i;
+
+	memset(img, 0, sizeof(img));
+	memcpy(hdr->magic, OSMO_ST2_VSIM_MAGIC, sizeof(hdr->magic));
+	hdr->atr_len = osmo_hexparse("3b9f96801fc78031a073be21136743200718000001a5", hdr->atr, sizeof(hdr->atr));
+	img_len = sizeof(*hdr) + 4 * sizeof(struct osmo_st2_vsim_img_file);
+
+	for (i = 0; i < sizeof(transp); i++)
+		transp[i] = i;
+	for (i = 0; i < sizeof(recs); i++)
+		recs[i] = 0x10 * (i / 4 + 1) + i % 4;
+
+	/* 0 */ img_add_file(0x3f00, OSMO_ST2_VSIM_NO_PARENT, OSMO_ST2_VSIM_FT_DF, 0, NULL, 0);
+	/* 1 */ img_add_file(0x7f20, 0, OSMO_ST2_VSIM_FT_DF, 0, NULL, 0);
+	/* 2 */ img_add_file(0x6f07, 1, OSMO_ST2_VSIM_FT_EF_TRANSP, 0, transp, sizeof(transp));
+	/* 3 */ img_add_file(0x6f3c, 1, OSMO_ST2_VSIM_FT_EF_LINFIX, 4, recs, sizeof(recs));
+
+	return osmo_st2_vsim_open_mem(NULL, img, img_len);
+}
+
+/* send a command to the prefetcher; tell whether the card had to be asked */
+static uint16_t xceive(const char *cmd_hex)
+{
+	struct osmo_st2_card_backend *be = osmo_st2_prefetch_backend(pf);
+	unsigned long card_cmds = osmo_st2_vsim_get_stats(vs)->commands;
+	struct msgb *msg = msgb_alloc(1024, "TPDU");
+	int len, rc;
+	uint16_t sw;
+
+	len = osmo_hexparse(cmd_hex, msgb_data(msg), msgb_tailroom(msg));
+	msgb_put(msg, len);
+	msg->l3h = msg->tail;
+
+	rc = osmo_st2_card_backend_transceive(be, msg);
+	OSMO_ASSERT(rc == 0);
+	sw = msgb_get_u16(msg);
+	printf("%s -> %s SW=%04x (%s)\n", cmd_hex,
+	       msgb_l3len(msg) ? osmo_hexdump_nospc(msg->l3h, msgb_l3len(msg)) : "", sw,
+	       osmo_st2_vsim_get_stats(vs)->commands == card_cmds ? "prefetched" : "card");
+	msgb_free(msg);
+
+	return sw;
+}
+
+/* let the prefetcher use the idle time, as the worker thread of cardem-pcsc does */
+static void idle(void)
+{
+	int rc = osmo_st2_prefetch_run(pf);
+	OSMO_ASSERT(rc >= 0);
+	printf("  idle: %s\n", rc ? "prefetched" : "nothing to do");
+}
+
+static void select_and_get_response(const char *select_hex)
+{
+	char gr[16];
+	uint16_t sw;
+
+	sw = xceive(select_hex);
+	OSMO_ASSERT((sw >> 8) == 0x9f);
+	idle();
+	snprintf(gr, sizeof(gr), "a0c00000%02x", sw & 0xff);
+	xceive(gr);
+}
+
+static void test_prefetch_transparent(void)
+{
+	printf("==> %s\n", __func__);
+	select_and_get_response("a0a40000027f20");
+	idle();
+	select_and_get_response("a0a40000026f07");
+	idle();
+	/* nothing learned yet: the card is asked, the next chunk is predicted */
+	xceive("a0b0000008");
+	idle();
+	/* sub-ranges of the prefetched chunk */
+	xceive("a0b0000804");
+	xceive("a0b0000c04");
+	/* outside of the prefetched chunk */
+	xceive("a0b0001008");
+	idle();
+	xceive("a0b0001808");
+}
+
+static void test_prefetch_records(void)
+{
+	printf("==> %s\n", __func__);
+	select_and_get_response("a0a40000026f3c");
+	idle();
+	xceive("a0b2010404");
+	idle();
+	xceive("a0b2020404");
+	idle();
+	/* UPDATE invalidates the prefetched record 3 */
+	xceive("a0dc030404aabbccdd");
+	idle();
+	xceive("a0b2030404");
+}
+
+static void test_prefetch_learned(void)
+{
+	printf("==> %s\n", __func__);
+	/* READ BINARY at offset 0 has been learned to follow selection of 6F07 */
+	select_and_get_response("a0a40000026f07");
+	idle();
+	xceive("a0b0000008");
+}
+
+static void test_prefetch_get_response_le(void)
+{
+	printf("==> %s\n", __func__);
+	xceive("a0a40000026f07");
+	idle();
+	/* the card has handed out its response already: all from the prefetch */
+	xceive("a0c0000020");
+	xceive("a0c0000004");
+	idle();
+	xceive("a0c000000b");
+}
+
+static void test_prefetch_reset(void)
+{
+	printf("==> %s\n", __func__);
+	select_and_get_response("a0a40000026f07");
+	idle();
+	osmo_st2_card_backend_reset(osmo_st2_prefetch_backend(pf), false);
+	idle();
+	xceive("a0b0000008");
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	const struct osmo_st2_prefetch_stats *st;
+
+	log_init(&log_info, NULL);
+
+	vs = build_vsim();
+	OSMO_ASSERT(vs);
+	pf = osmo_st2_prefetch_alloc(NULL, osmo_st2_vsim_backend(vs), true);
+	OSMO_ASSERT(pf);
+	osmo_st2_card_backend_reset(osmo_st2_prefetch_backend(pf), true);
+
+	test_prefetch_transparent();
+	test_prefetch_records();
+	test_prefetch_learned();
+	test_prefetch_get_response_le();
+	test_prefetch_reset();
+
+	st = osmo_st2_prefetch_get_stats(pf);
+	printf("commands=%lu issued=%lu hits=%lu misses=%lu invalidated=%lu learned=%lu\n",
+	       st->commands, st->issued, st->hits, st->misses, st->invalidated, st->learned);
+
+	osmo_st2_prefetch_free(pf);
+	osmo_st2_vsim_close(vs);
+
+	printf("All tests passed.\n");
+	return 0;
+}
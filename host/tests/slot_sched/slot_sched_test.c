@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <errno.h>
+#include <sys/socket.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+#include "st2_loopback.h"
+
+static struct st2_loopback lb;
+
+/* the messages sent to the firmware */
+static void dump_sent(void)
+{
+	uint8_t buf[512];
+	int rc;
+
+	while ((rc = recv(lb.peer_fd, buf, sizeof(buf), MSG_DONTWAIT)) > 0) {
+		const struct simtrace_msg_hdr *sh = (const struct simtrace_msg_hdr *) buf;
+
+		printf("  sent class=%u type=%u slot=%u len=%u", sh->msg_class, sh->msg_type,
+		       sh->slot_nr, sh->msg_len);
+		if (sh->msg_class == SIMTRACE_MSGC_CARDEM && sh->msg_type == SIMTRACE_MSGT_BD_CEMU_CONFIG) {
+			const struct cardemu_usb_msg_config *cfg =
+				(const struct cardemu_usb_msg_config *) (buf + sizeof(*sh));
+			unsigned int len = rc - sizeof(*sh);
+
+			printf(" features=0x%08x", osmo_load32le(&cfg->features));
+			if (len > offsetof(struct cardemu_usb_msg_config, slot_mux_nr))
+				printf(" mux=%u", cfg->slot_mux_nr);
+			if (len > offsetof(struct cardemu_usb_msg_config, pres_pol))
+				printf(" pres_pol=0x%02x", cfg->pres_pol);
+			if (len > offsetof(struct cardemu_usb_msg_config, slot_sched_mask))
+				printf(" mask=0x%02x", cfg->slot_sched_mask);
+		}
+		printf("\n");
+	}
+}
+
+static void dump_stats(const struct osmo_st2_cardem_stats *st)
+{
+	printf("  rx=%u tx=%u commands=%u pps=%u connected=%u ms (%u times)\n",
+	       st->rx_bytes, st->tx_bytes, st->commands, st->pps, st->connected_ms, st->connections);
+}
+
+/* build the statistics like the firmware does */
+static unsigned int build_stats(uint8_t *buf)
+{
+	struct cardemu_usb_msg_stats *ms = (struct cardemu_usb_msg_stats *) buf;
+
+	osmo_store32le(1234, &ms->rx_bytes);
+	osmo_store32le(5678, &ms->tx_bytes);
+	osmo_store32le(42, &ms->commands);
+	osmo_store32le(1, &ms->pps);
+	osmo_store32le(60000, &ms->connected_ms);
+	osmo_store32le(250, &ms->connections);
+	return sizeof(*ms);
+}
+
+static void test_decode(void)
+{
+	struct osmo_st2_cardem_stats st;
+	uint8_t buf[64];
+	unsigned int len;
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	len = build_stats(buf);
+	rc = osmo_st2_cardem_stats_decode(&st, buf, len);
+	printf("  complete: rc=%d\n", rc);
+	OSMO_ASSERT(rc == 0);
+	dump_stats(&st);
+
+	rc = osmo_st2_cardem_stats_decode(&st, buf, len - 1);
+	printf("  truncated: rc=%d\n", rc);
+	OSMO_ASSERT(rc == -EINVAL);
+}
+
+static void test_request(void)
+{
+	struct osmo_st2_slot slot3 = { .transp = &lb.transp, .slot_nr = 3 };
+	struct osmo_st2_cardem_inst ci3 = { .slot = &slot3 };
+	struct cardemu_usb_msg_config cfg = {};
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	printf(" config\n");
+	osmo_st2_cardem_request_config(&lb.ci, CEMU_FEAT_F_STATUS_IRQ);
+	dump_sent();
+
+	/* the features are kept, the presence polarity is not touched */
+	printf(" schedule slots 0, 3 and 5\n");
+	rc = osmo_st2_cardem_request_slot_sched(&lb.ci, 0, 0x29);
+	OSMO_ASSERT(rc >= 0);
+	dump_sent();
+
+	/* each slot is addressed by the slot number of the header */
+	printf(" stats\n");
+	rc = osmo_st2_cardem_request_stats(&lb.ci);
+	OSMO_ASSERT(rc >= 0);
+	rc = osmo_st2_cardem_request_stats(&ci3);
+	OSMO_ASSERT(rc >= 0);
+	dump_sent();
+
+	/* neither changes the schedule, nor the slot unless the polarity is set */
+	printf(" config while scheduling\n");
+	osmo_st2_cardem_request_config(&lb.ci, CEMU_FEAT_F_STATUS_IRQ);
+	cfg.features = CEMU_FEAT_F_STATUS_IRQ;
+	cfg.slot_mux_nr = 2;
+	cfg.slot_sched_mask = 0xff;
+	osmo_st2_cardem_request_config2(&lb.ci, &cfg);
+	cfg.pres_pol = CEMU_CONFIG_PRES_POL_VALID | CEMU_CONFIG_PRES_POL_PRES_H;
+	osmo_st2_cardem_request_config2(&lb.ci, &cfg);
+	dump_sent();
+
+	printf(" stop scheduling\n");
+	rc = osmo_st2_cardem_request_slot_sched(&ci3, 3, 0);
+	OSMO_ASSERT(rc >= 0);
+	dump_sent();
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	log_init(&log_info, NULL);
+	st2_loopback_init(&lb);
+
+	test_decode();
+	test_request();
+
+	printf("All tests passed.\n");
+	return 0;
+}
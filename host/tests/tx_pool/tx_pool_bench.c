@@ -0,0 +1,61 @@
+/* benchmark of sending TX_DATA messages with and without a transmit pool.
+ * Not part of the testsuite, as the results depend on the machine; run manually:
+ *	tx_pool_bench [NUM_MESSAGES] */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+
+#include "st2_loopback.h"
+
+static struct st2_loopback lb;
+
+static double run(unsigned long num_msgs)
+{
+	uint8_t data[256], buf[2048];
+	struct timespec t_start, t_end;
+	unsigned long i;
+
+	memset(data, 0x55, sizeof(data));
+
+	clock_gettime(CLOCK_MONOTONIC, &t_start);
+	for (i = 0; i < num_msgs; i++) {
+		OSMO_ASSERT(osmo_st2_cardem_request_pb_and_tx(&lb.ci, 0xb0, data, sizeof(data)) > 0);
+		OSMO_ASSERT(read(lb.peer_fd, buf, sizeof(buf)) > 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t_end);
+
+	return (t_end.tv_sec - t_start.tv_sec) + (t_end.tv_nsec - t_start.tv_nsec) / 1e9;
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	unsigned long num_msgs = 1000000;
+	double t_heap, t_pool;
+
+	if (argc > 1)
+		num_msgs = strtoul(argv[1], NULL, 0);
+
+	log_init(&log_info, NULL);
+
+	st2_loopback_init(&lb);
+
+	t_heap = run(num_msgs);
+	printf("heap: %lu messages in %.3fs (%.0f msg/s)\n", num_msgs, t_heap, num_msgs / t_heap);
+
+	OSMO_ASSERT(osmo_st2_tx_pool_alloc(NULL, &lb.transp, 64, 0));
+	t_pool = run(num_msgs);
+	printf("pool: %lu messages in %.3fs (%.0f msg/s)\n", num_msgs, t_pool, num_msgs / t_pool);
+
+	osmo_st2_tx_pool_free(lb.transp.tx_pool);
+	return 0;
+}
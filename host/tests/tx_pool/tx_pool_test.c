@@ -0,0 +1,124 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/simtrace2_api.h>
+#include <osmocom/simtrace2/simtrace_prot.h>
+
+#include "st2_loopback.h"
+
+static struct st2_loopback lb;
+
+static void dump_sent(void)
+{
+	uint8_t buf[2048];
+	int rc;
+
+	rc = read(lb.peer_fd, buf, sizeof(buf));
+	OSMO_ASSERT(rc > 0);
+	printf("  sent: %s\n", osmo_hexdump_nospc(buf, rc));
+}
+
+static void dump_stats(void)
+{
+	const struct osmo_st2_tx_pool_stats *st = osmo_st2_tx_pool_get_stats(lb.transp.tx_pool);
+
+	printf("  pool: msgs=%u/%u max=%u allocs=%lu exhausted=%lu xfers=%u\n",
+	       st->msgs_in_use, st->num_msgs, st->msgs_in_use_max, st->msg_allocs,
+	       st->msg_exhausted, st->num_xfers);
+}
+
+static void test_tx_pool_basic(void)
+{
+	const uint8_t sw[2] = { 0x90, 0x00 };
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	rc = osmo_st2_cardem_request_sw_tx(&lb.ci, sw);
+	OSMO_ASSERT(rc > 0);
+	dump_sent();
+	rc = osmo_st2_cardem_request_pb_and_tx(&lb.ci, 0xb0, (const uint8_t *) "\x01\x02\x03", 3);
+	OSMO_ASSERT(rc > 0);
+	dump_sent();
+	dump_stats();
+}
+
+static void test_tx_pool_exhaustion(void)
+{
+	const uint8_t sw[2] = { 0x6a, 0x82 };
+	struct msgb *held[4];
+	struct msgb *msg;
+	unsigned int i;
+	int rc;
+
+	printf("==> %s\n", __func__);
+
+	/* take all buffers out of the pool */
+	for (i = 0; i < ARRAY_SIZE(held); i++) {
+		held[i] = osmo_st2_transport_msgb_alloc(&lb.transp);
+		OSMO_ASSERT(held[i]);
+	}
+	OSMO_ASSERT(osmo_st2_transport_msgb_alloc(&lb.transp) == NULL);
+	dump_stats();
+
+	/* requests are refused while the pool is empty */
+	rc = osmo_st2_cardem_request_sw_tx(&lb.ci, sw);
+	printf("  request with empty pool: %s\n", rc == -ENOBUFS ? "-ENOBUFS" : "unexpected");
+	OSMO_ASSERT(rc == -ENOBUFS);
+
+	/* sending a message returns its buffer to the pool */
+	msgb_put_u8(held[0], 0x42);
+	rc = osmo_st2_slot_tx_msg(&lb.slot, held[0], SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
+	OSMO_ASSERT(rc > 0);
+	dump_sent();
+	rc = osmo_st2_cardem_request_sw_tx(&lb.ci, sw);
+	OSMO_ASSERT(rc > 0);
+	dump_sent();
+
+	for (i = 1; i < ARRAY_SIZE(held); i++) {
+		osmo_st2_slot_tx_msg(&lb.slot, held[i], SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
+		dump_sent();
+	}
+	dump_stats();
+
+	/* a message not taken from the pool is freed, not added to the pool */
+	msg = msgb_alloc_headroom(1024+32, 32, "test");
+	osmo_st2_slot_tx_msg(&lb.slot, msg, SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
+	dump_sent();
+	for (i = 0; i < ARRAY_SIZE(held); i++)
+		held[i] = osmo_st2_transport_msgb_alloc(&lb.transp);
+	OSMO_ASSERT(osmo_st2_transport_msgb_alloc(&lb.transp) == NULL);
+	for (i = 0; i < ARRAY_SIZE(held); i++) {
+		osmo_st2_slot_tx_msg(&lb.slot, held[i], SIMTRACE_MSGC_MODEM, SIMTRACE_MSGT_BD_MODEM_STATUS);
+		dump_sent();
+	}
+	dump_stats();
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	log_init(&log_info, NULL);
+
+	st2_loopback_init(&lb);
+
+	/* without a USB device, no OUT transfers are pre-allocated */
+	OSMO_ASSERT(osmo_st2_tx_pool_alloc(NULL, &lb.transp, 4, 4));
+
+	test_tx_pool_basic();
+	test_tx_pool_exhaustion();
+
+	osmo_st2_tx_pool_free(lb.transp.tx_pool);
+	OSMO_ASSERT(lb.transp.tx_pool == NULL);
+
+	printf("All tests passed.\n");
+	return 0;
+}
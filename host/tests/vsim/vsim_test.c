@@ -0,0 +1,235 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <endian.h>
+
+#include <osmocom/core/utils.h>
+#include <osmocom/core/msgb.h>
+#include <osmocom/core/logging.h>
+#include <osmocom/simtrace2/vsim.h>
+
+static uint8_t img[4096];
+static unsigned int img_len;
+
+/* append a file to the image under construction */
+static void img_add_file(uint16_t fid, uint16_t parent, uint8_t type, uint8_t sfi, uint8_t rec_len,
+			 const char *aid_hex, const uint8_t *body, unsigned int size)
+{
+	struct osmo_st2_vsim_img_hdr *hdr = (struct osmo_st2_vsim_img_hdr *) img;
+	struct osmo_st2_vsim_img_file *f;
+	uint16_t idx = le16toh(hdr->num_files);
+
+	f = (struct osmo_st2_vsim_img_file *) (img + sizeof(*hdr)) + idx;
+	memset(f, 0, sizeof(*f));
+	f->fid = htole16(fid);
+	f->parent = htole16(parent);
+	f->type = type;
+	f->sfi = sfi;
+	f->rec_len = rec_len;
+	if (aid_hex)
+		f->aid_len = osmo_hexparse(aid_hex, f->aid, sizeof(f->aid));
+	f->offset = htole32(img_len);
+	f->size = htole32(size);
+	if (size) {
+		memcpy(img + img_len, body, size);
+		img_len += size;
+	}
+
+	hdr->num_files = htole16(idx + 1);
+}
+
+static struct osmo_st2_vsim *build_vsim(void)
+{
+	struct osmo_st2_vsim_img_hdr *hdr = (struct osmo_st2_vsim_img_hdr *) img;
+	const uint8_t imsi[] = { 0x08, 0x29, 0x26, 0x02, 0x00, 0x00, 0x00, 0x00, 0x10 };
+	const uint8_t ad[] = { 0x00, 0x00, 0x00, 0x02 };
+	uint8_t dir[2*8], sms[3*4], cyc[3*2];
+	unsigned int i;
+
+	memset(img, 0, sizeof(img));
+	memcpy(hdr->magic, OSMO_ST2_VSIM_MAGIC, sizeof(hdr->magic));
+	hdr->atr_len = osmo_hexparse("3b9f96801fc78031a073be21136743200718000001a5", hdr->atr, sizeof(hdr->atr));
+	/* leave room for 8 file table entries */
+	img_len = sizeof(*hdr) + 8 * sizeof(struct osmo_st2_vsim_img_file);
+
+	memset(dir, 0xff, sizeof(dir));
+	for (i = 0; i < sizeof(sms); i++)
+		sms[i] = i;
+	for (i = 0; i < sizeof(cyc); i++)
+		cyc[i] = i / 3 + 1;
+
+	/* 0 */ img_add_file(0x3f00, OSMO_ST2_VSIM_NO_PARENT, OSMO_ST2_VSIM_FT_DF, 0, 0, NULL, NULL, 0);
+	/* 1 */ img_add_file(0x2f00, 0, OSMO_ST2_VSIM_FT_EF_LINFIX, 30, 8, NULL, dir, sizeof(dir));
+	/* 2 */ img_add_file(0x7f20, 0, OSMO_ST2_VSIM_FT_DF, 0, 0, NULL, NULL, 0);
+	/* 3 */ img_add_file(0x6f07, 2, OSMO_ST2_VSIM_FT_EF_TRANSP, 0, 0, NULL, imsi, sizeof(imsi));
+	/* 4 */ img_add_file(0x7fff, 0, OSMO_ST2_VSIM_FT_ADF, 0, 0, "a0000000871002ffffffff8907090000", NULL, 0);
+	/* 5 */ img_add_file(0x6fad, 4, OSMO_ST2_VSIM_FT_EF_TRANSP, 3, 0, NULL, ad, sizeof(ad));
+	/* 6 */ img_add_file(0x6f3c, 4, OSMO_ST2_VSIM_FT_EF_LINFIX, 0, 3, NULL, sms, sizeof(sms));
+	/* 7 */ img_add_file(0x6f13, 4, OSMO_ST2_VSIM_FT_EF_CYCLIC, 0, 3, NULL, cyc, sizeof(cyc));
+
+	return osmo_st2_vsim_open_mem(NULL, img, img_len);
+}
+
+static void xceive(struct osmo_st2_card_backend *be, const char *cmd_hex)
+{
+	struct msgb *msg = msgb_alloc(1024, "TPDU");
+	int len, rc;
+	uint16_t sw;
+
+	len = osmo_hexparse(cmd_hex, msgb_data(msg), msgb_tailroom(msg));
+	msgb_put(msg, len);
+	msg->l3h = msg->tail;
+
+	rc = osmo_st2_card_backend_transceive(be, msg);
+	OSMO_ASSERT(rc == 0);
+	sw = msgb_get_u16(msg);
+	printf("%s -> %s SW=%04x\n", cmd_hex, msgb_l3len(msg) ? osmo_hexdump_nospc(msg->l3h, msgb_l3len(msg)) : "",
+	       sw);
+	msgb_free(msg);
+}
+
+static uint16_t test_auth_cb(struct osmo_st2_vsim *vs, const struct osim_apdu_cmd_hdr *hdr,
+			     const uint8_t *data, unsigned int data_len,
+			     uint8_t *resp, unsigned int *resp_len, void *priv)
+{
+	unsigned int i;
+
+	/* return SRES/Kc derived trivially from RAND */
+	for (i = 0; i < 12; i++)
+		resp[i] = data[i] ^ 0xff;
+	*resp_len = 12;
+	return 0x9000;
+}
+
+static void test_vsim_select(struct osmo_st2_card_backend *be)
+{
+	printf("==> %s\n", __func__);
+	osmo_st2_card_backend_reset(be, true);
+	/* UICC select MF, EF.DIR and read records */
+	xceive(be, "00a40004023f00");
+	xceive(be, "00c000001c");
+	xceive(be, "00a40004022f00");
+	xceive(be, "00c0000019");
+	xceive(be, "00b2010408");
+	xceive(be, "00b2020410");
+	xceive(be, "00b2030408");
+	/* select ADF by partial AID, then EF by path */
+	xceive(be, "00a4040c07a0000000871002");
+	xceive(be, "00a4080c047fff6fad");
+	xceive(be, "00b0000004");
+	xceive(be, "00b0000008");
+	/* non-existent file */
+	xceive(be, "00a4000c026f99");
+	/* STATUS returns the ADF AID */
+	xceive(be, "80f2000110");
+	xceive(be, "80f2000012");
+	/* read via SFI 3 = EF.AD */
+	xceive(be, "00b0830002");
+	/* extended Le, as passed from T=1, is not supported */
+	xceive(be, "00b00000000004");
+}
+
+static void test_vsim_update(struct osmo_st2_card_backend *be)
+{
+	printf("==> %s\n", __func__);
+	osmo_st2_card_backend_reset(be, true);
+	/* 7FFF refers to the current ADF, which is unknown after reset */
+	xceive(be, "00a4080c047fff6fad");
+	xceive(be, "00a4040c10a0000000871002ffffffff8907090000");
+	xceive(be, "00a4080c047fff6fad");
+	xceive(be, "00d6000102aabb");
+	xceive(be, "00b0000004");
+	/* linear fixed: next / previous / absolute */
+	xceive(be, "00a4000c026f3c");
+	xceive(be, "00b2000203");
+	xceive(be, "00b2000203");
+	xceive(be, "00b2000303");
+	xceive(be, "00dc040403112233");
+	xceive(be, "00b2040403");
+	xceive(be, "00b2050403");
+	/* cyclic: update previous turns the oldest record into record 1 */
+	xceive(be, "00a4000c026f13");
+	xceive(be, "00dc000303cccccc");
+	xceive(be, "00b2010403");
+	xceive(be, "00b2020403");
+	xceive(be, "00dc010403dddddd");
+}
+
+static void test_vsim_gsm(struct osmo_st2_card_backend *be)
+{
+	printf("==> %s\n", __func__);
+	osmo_st2_card_backend_reset(be, true);
+	xceive(be, "a0a40000027f20");
+	xceive(be, "a0c0000016");
+	xceive(be, "a0a40000026f07");
+	xceive(be, "a0c000000f");
+	xceive(be, "a0b0000009");
+	xceive(be, "a0b000000a");
+	xceive(be, "a0f2000016");
+	/* GET RESPONSE without pending data */
+	xceive(be, "a0c000000f");
+}
+
+static void test_vsim_auth(struct osmo_st2_vsim *vs, struct osmo_st2_card_backend *be)
+{
+	printf("==> %s\n", __func__);
+	osmo_st2_card_backend_reset(be, true);
+	xceive(be, "a088000010000102030405060708090a0b0c0d0e0f");
+	osmo_st2_vsim_set_auth_cb(vs, test_auth_cb, NULL);
+	xceive(be, "a088000010000102030405060708090a0b0c0d0e0f");
+	xceive(be, "a0c000000c");
+	/* unsupported instruction and class */
+	xceive(be, "00e2000000");
+	xceive(be, "40a4000c023f00");
+}
+
+static const struct log_info log_info = {};
+
+int main(int argc, char **argv)
+{
+	const struct osmo_st2_vsim_stats *st;
+	struct osmo_st2_vsim_img_file *files;
+	struct osmo_st2_card_backend *be;
+	struct osmo_st2_vsim *vs;
+
+	log_init(&log_info, NULL);
+
+	vs = build_vsim();
+	OSMO_ASSERT(vs);
+	be = osmo_st2_vsim_backend(vs);
+	printf("ATR: %s\n", osmo_hexdump_nospc(be->atr, be->atr_len));
+
+	test_vsim_select(be);
+	test_vsim_update(be);
+	test_vsim_gsm(be);
+	test_vsim_auth(vs, be);
+
+	st = osmo_st2_vsim_get_stats(vs);
+	printf("commands=%lu updates=%lu auth=%lu errors=%lu\n",
+	       st->commands, st->updates, st->auth, st->errors);
+	osmo_st2_vsim_close(vs);
+
+	/* a corrupt image must be rejected */
+	img[0] = 'X';
+	OSMO_ASSERT(osmo_st2_vsim_open_mem(NULL, img, img_len) == NULL);
+
+	/* a DF being its own parent */
+	osmo_st2_vsim_close(build_vsim());
+	files = (struct osmo_st2_vsim_img_file *) (img + sizeof(struct osmo_st2_vsim_img_hdr));
+	files[2].parent = htole16(2);
+	OSMO_ASSERT(osmo_st2_vsim_open_mem(NULL, img, img_len) == NULL);
+
+	/* a parent listed after its child */
+	osmo_st2_vsim_close(build_vsim());
+	files[3].parent = htole16(4);
+	OSMO_ASSERT(osmo_st2_vsim_open_mem(NULL, img, img_len) == NULL);
+
+	/* a body overlapping the file table */
+	osmo_st2_vsim_close(build_vsim());
+	files[1].offset = htole32(sizeof(struct osmo_st2_vsim_img_hdr));
+	OSMO_ASSERT(osmo_st2_vsim_open_mem(NULL, img, img_len) == NULL);
+
+	printf("All tests passed.\n");
+	return 0;
+}